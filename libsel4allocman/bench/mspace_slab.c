@@ -0,0 +1,227 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Replay the book keeping allocations allocman makes under an object allocation workload
+ * against a K&R fixed pool, and against mspace_slab on top of the same kind of pool */
+
+#include <autoconf.h>
+#include <allocman/allocman.h>
+#include <allocman/mspace/fixed_pool.h>
+#include <allocman/mspace/slab.h>
+#include <sel4bench/sel4bench.h>
+#include <sel4test/test.h>
+#include <vka/object.h>
+#include <stdlib.h>
+
+#define SLAB_BENCH_TRACE_RECORDS 8192
+#define SLAB_BENCH_WORKLOAD_OPS 2000
+#define SLAB_BENCH_LIVE_OBJECTS 256
+#define SLAB_BENCH_POOL_SIZE (512 * 1024)
+
+typedef struct slab_bench_record {
+    bool free;
+    size_t bytes;
+    /* the memory allocated or freed, or NULL if an allocation failed */
+    void *ptr;
+} slab_bench_record_t;
+
+/* An mspace that passes everything on to another, recording each call */
+typedef struct slab_bench_recorder {
+    struct mspace_interface backing;
+    slab_bench_record_t *records;
+    size_t max_records;
+    size_t num_records;
+    size_t dropped;
+} slab_bench_recorder_t;
+
+static void record(slab_bench_recorder_t *recorder, bool free, size_t bytes, void *ptr)
+{
+    if (recorder->num_records == recorder->max_records) {
+        recorder->dropped++;
+        return;
+    }
+    recorder->records[recorder->num_records++] = (slab_bench_record_t) {
+        .free = free, .bytes = bytes, .ptr = ptr
+    };
+}
+
+static void *recorder_alloc(struct allocman *alloc, void *cookie, size_t bytes, int *error)
+{
+    slab_bench_recorder_t *recorder = cookie;
+    void *ptr = recorder->backing.alloc(alloc, recorder->backing.mspace, bytes, error);
+    record(recorder, false, bytes, *error ? NULL : ptr);
+    return ptr;
+}
+
+static void recorder_free(struct allocman *alloc, void *cookie, void *ptr, size_t bytes)
+{
+    slab_bench_recorder_t *recorder = cookie;
+    record(recorder, true, bytes, ptr);
+    recorder->backing.free(alloc, recorder->backing.mspace, ptr, bytes);
+}
+
+/* Allocate and free a mix of objects to drive allocman's book keeping */
+static void run_workload(vka_t *vka)
+{
+    vka_object_t objects[SLAB_BENCH_LIVE_OBJECTS] = {{0}};
+    int error;
+
+    for (int i = 0; i < SLAB_BENCH_WORKLOAD_OPS; i++) {
+        int n = (i * 7919) % SLAB_BENCH_LIVE_OBJECTS;
+        if (objects[n].cptr) {
+            vka_free_object(vka, &objects[n]);
+            objects[n].cptr = 0;
+            continue;
+        }
+        switch (i % 4) {
+        case 0:
+            error = vka_alloc_frame(vka, seL4_PageBits, &objects[n]);
+            break;
+        case 1:
+            error = vka_alloc_endpoint(vka, &objects[n]);
+            break;
+        case 2:
+            error = vka_alloc_notification(vka, &objects[n]);
+            break;
+        default:
+            error = vka_alloc_cnode_object(vka, 4, &objects[n]);
+            break;
+        }
+        if (error) {
+            objects[n].cptr = 0;
+        }
+    }
+    for (int i = 0; i < SLAB_BENCH_LIVE_OBJECTS; i++) {
+        if (objects[i].cptr) {
+            vka_free_object(vka, &objects[i]);
+        }
+    }
+}
+
+/* For every free record the index of the allocation it frees, or -1 if the memory was
+ * allocated before the recording started */
+static void pair_records(slab_bench_record_t *records, size_t num, long *pairs)
+{
+    for (size_t i = 0; i < num; i++) {
+        pairs[i] = -1;
+        if (!records[i].free) {
+            continue;
+        }
+        for (long j = i - 1; j >= 0; j--) {
+            if (!records[j].free && records[j].ptr == records[i].ptr) {
+                pairs[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+static ccnt_t replay(struct mspace_interface mspace, slab_bench_record_t *records, size_t num, long *pairs,
+                     void **ptrs, size_t *failed)
+{
+    ccnt_t start, total = 0;
+    int error;
+
+    *failed = 0;
+    for (size_t i = 0; i < num; i++) {
+        ptrs[i] = NULL;
+        if (!records[i].free && records[i].ptr != NULL) {
+            start = sel4bench_get_cycle_count();
+            ptrs[i] = mspace.alloc(NULL, mspace.mspace, records[i].bytes, &error);
+            total += sel4bench_get_cycle_count() - start;
+            if (error) {
+                ptrs[i] = NULL;
+                (*failed)++;
+            }
+        } else if (records[i].free && pairs[i] != -1 && ptrs[pairs[i]]) {
+            start = sel4bench_get_cycle_count();
+            mspace.free(NULL, mspace.mspace, ptrs[pairs[i]], records[i].bytes);
+            total += sel4bench_get_cycle_count() - start;
+            ptrs[pairs[i]] = NULL;
+        }
+    }
+    return total;
+}
+
+static int bench_mspace_slab(env_t env)
+{
+    /* sel4test makes its vka from an allocman with allocman_make_vka */
+    allocman_t *alloc = env->vka.data;
+    struct mspace_interface original = alloc->mspace;
+    mspace_fixed_pool_t k_r_pool, slab_pool;
+    mspace_slab_t slab;
+    size_t allocs = 0, k_r_failed, slab_failed;
+
+    slab_bench_record_t *records = calloc(SLAB_BENCH_TRACE_RECORDS, sizeof(*records));
+    long *pairs = calloc(SLAB_BENCH_TRACE_RECORDS, sizeof(*pairs));
+    void **ptrs = calloc(SLAB_BENCH_TRACE_RECORDS, sizeof(*ptrs));
+    void *k_r_memory = malloc(SLAB_BENCH_POOL_SIZE);
+    void *slab_memory = malloc(SLAB_BENCH_POOL_SIZE);
+    test_assert(records && pairs && ptrs && k_r_memory && slab_memory);
+
+    /* Record allocman's book keeping whilst the workload runs. Memory allocated before or
+     * after is still freed to the original mspace, as the recorder passes everything on */
+    slab_bench_recorder_t recorder = {
+        .backing = original,
+        .records = records,
+        .max_records = SLAB_BENCH_TRACE_RECORDS,
+    };
+    alloc->mspace = (struct mspace_interface) {
+        .alloc = recorder_alloc,
+        .free = recorder_free,
+        .properties = original.properties,
+        .mspace = &recorder
+    };
+    run_workload(&env->vka);
+    alloc->mspace = original;
+
+    for (size_t i = 0; i < recorder.num_records; i++) {
+        allocs += !records[i].free;
+    }
+    test_assert(allocs > 0);
+    pair_records(records, recorder.num_records, pairs);
+
+    mspace_fixed_pool_create(&k_r_pool, (struct mspace_fixed_pool_config) {
+        .pool = k_r_memory, .size = SLAB_BENCH_POOL_SIZE
+    });
+    mspace_fixed_pool_create(&slab_pool, (struct mspace_fixed_pool_config) {
+        .pool = slab_memory, .size = SLAB_BENCH_POOL_SIZE
+    });
+    mspace_slab_create(&slab, (struct mspace_slab_config) {
+        .backing = mspace_fixed_pool_make_interface(&slab_pool)
+    });
+
+    sel4bench_init();
+    ccnt_t k_r = replay(mspace_fixed_pool_make_interface(&k_r_pool), records, recorder.num_records, pairs, ptrs,
+                        &k_r_failed);
+    ccnt_t slab_cycles = replay(mspace_slab_make_interface(&slab), records, recorder.num_records, pairs, ptrs,
+                                &slab_failed);
+    sel4bench_destroy();
+    test_eq(k_r_failed, (size_t)0);
+    test_eq(slab_failed, (size_t)0);
+
+    printf("allocman book keeping trace: %zu records, %zu allocations, %zu dropped\n", recorder.num_records, allocs,
+           recorder.dropped);
+    printf("  k_r fixed pool  %" PRIu64 " cycles, %zu bytes of pool used\n", (uint64_t)k_r,
+           SLAB_BENCH_POOL_SIZE - k_r_pool.remaining);
+    printf("  slab            %" PRIu64 " cycles, %zu bytes of pool used\n", (uint64_t)slab_cycles,
+           SLAB_BENCH_POOL_SIZE - slab_pool.remaining);
+
+    free(records);
+    free(pairs);
+    free(ptrs);
+    free(k_r_memory);
+    free(slab_memory);
+    return sel4test_get_result();
+}
+DEFINE_TEST(ALLOCMAN_BENCH0002, "Replay allocman book keeping against K&R and slab mspaces", bench_mspace_slab,
+            true)
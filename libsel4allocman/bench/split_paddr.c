@@ -0,0 +1,127 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Cost of allocating at a physical address from a utspace_split holding many small
+ * untypeds, with the paddr index, compared with walking the free lists as
+ * allocations at an address used to */
+
+#include <autoconf.h>
+#include <allocman/allocman.h>
+#include <allocman/utspace/split.h>
+#include <sel4bench/sel4bench.h>
+#include <sel4test/test.h>
+#include <vka/capops.h>
+#include <vka/object.h>
+#include <stdlib.h>
+
+/* Untypeds in the synthetic layout, fewer if the cspace runs out of slots first */
+#define SPLIT_BENCH_UNTYPEDS 10000
+#define SPLIT_BENCH_PARENT_BITS 18
+#define SPLIT_BENCH_ITERATIONS 1000
+
+/* The list walk find_head_for_paddr did before the index: every free list of the pool */
+static struct utspace_split_node *linear_find(struct utspace_split_node **heads, uintptr_t paddr, size_t size_bits)
+{
+    for (size_t i = 0; i < CONFIG_WORD_SIZE; i++) {
+        for (struct utspace_split_node *node = heads[i]; node; node = node->next) {
+            if (node->paddr <= paddr && paddr + BIT(size_bits) <= node->paddr + BIT(node->size_bits)) {
+                return node;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int bench_split_paddr(env_t env)
+{
+    /* sel4test makes its vka from an allocman with allocman_make_vka */
+    allocman_t *alloc = env->vka.data;
+    utspace_split_t split;
+    vka_object_t parent;
+    size_t size_bits = seL4_MinUntypedBits;
+    size_t num = 0;
+    ccnt_t start, linear = 0, indexed = 0, unindexed = 0;
+    int error;
+
+    cspacepath_t *uts = calloc(SPLIT_BENCH_UNTYPEDS, sizeof(*uts));
+    size_t *sizes = calloc(SPLIT_BENCH_UNTYPEDS, sizeof(*sizes));
+    uintptr_t *paddrs = calloc(SPLIT_BENCH_UNTYPEDS, sizeof(*paddrs));
+    test_assert(uts && sizes && paddrs);
+
+    error = vka_alloc_untyped(&env->vka, SPLIT_BENCH_PARENT_BITS, &parent);
+    test_eq(error, 0);
+    uintptr_t base = vka_object_paddr(&env->vka, &parent);
+    test_assert(base != VKA_NO_PADDR);
+
+    /* Split the parent into the smallest untypeds possible, keeping back a slot for the
+     * objects allocated whilst measuring */
+    cspacepath_t dest;
+    error = vka_cspace_alloc_path(&env->vka, &dest);
+    test_eq(error, 0);
+    while (num < SPLIT_BENCH_UNTYPEDS && num < BIT(SPLIT_BENCH_PARENT_BITS - size_bits)) {
+        if (vka_cspace_alloc_path(&env->vka, &uts[num])) {
+            break;
+        }
+        error = seL4_Untyped_Retype(parent.cptr, seL4_UntypedObject, size_bits, uts[num].root, uts[num].dest,
+                                    uts[num].destDepth, uts[num].offset, 1);
+        test_eq(error, seL4_NoError);
+        sizes[num] = size_bits;
+        paddrs[num] = base + num * BIT(size_bits);
+        num++;
+    }
+    test_assert(num > 0);
+
+    utspace_split_create(&split);
+    error = _utspace_split_add_uts(alloc, &split, num, uts, sizes, paddrs, ALLOCMAN_UT_KERNEL);
+    test_eq(error, 0);
+
+    sel4bench_init();
+    for (size_t i = 0; i < SPLIT_BENCH_ITERATIONS; i++) {
+        uintptr_t paddr = paddrs[(i * 7919) % num];
+        seL4_Word cookie;
+
+        start = sel4bench_get_cycle_count();
+        struct utspace_split_node *node = linear_find(split.heads, paddr, size_bits);
+        linear += sel4bench_get_cycle_count() - start;
+        test_assert(node && node->paddr == paddr);
+
+        start = sel4bench_get_cycle_count();
+        cookie = _utspace_split_alloc(alloc, &split, size_bits, seL4_UntypedObject, &dest, paddr, false, &error);
+        indexed += sel4bench_get_cycle_count() - start;
+        test_eq(error, 0);
+        test_eq(_utspace_split_paddr(&split, cookie, size_bits), paddr);
+        vka_cnode_delete(&dest);
+        _utspace_split_free(alloc, &split, cookie, size_bits);
+
+        /* the same allocation without an address, which needs no lookup at all */
+        start = sel4bench_get_cycle_count();
+        cookie = _utspace_split_alloc(alloc, &split, size_bits, seL4_UntypedObject, &dest, ALLOCMAN_NO_PADDR, false,
+                                      &error);
+        unindexed += sel4bench_get_cycle_count() - start;
+        test_eq(error, 0);
+        vka_cnode_delete(&dest);
+        _utspace_split_free(alloc, &split, cookie, size_bits);
+    }
+    sel4bench_destroy();
+
+    printf("utspace_split paddr allocation over %zu untypeds, mean cycles of %d:\n", num, SPLIT_BENCH_ITERATIONS);
+    printf("  free list walk       %" PRIu64 "\n", (uint64_t)(linear / SPLIT_BENCH_ITERATIONS));
+    printf("  alloc at paddr       %" PRIu64 "\n", (uint64_t)(indexed / SPLIT_BENCH_ITERATIONS));
+    printf("  alloc without paddr  %" PRIu64 "\n", (uint64_t)(unindexed / SPLIT_BENCH_ITERATIONS));
+
+    /* The split's nodes and the untypeds are left behind with the test process */
+    free(uts);
+    free(sizes);
+    free(paddrs);
+    return sel4test_get_result();
+}
+DEFINE_TEST(ALLOCMAN_BENCH0001, "Allocate at physical addresses among many split untypeds", bench_split_paddr, true)
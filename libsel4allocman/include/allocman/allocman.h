@@ -53,8 +53,13 @@
 
 #include <assert.h>
 #include <autoconf.h>
+#include <allocman/gen_config.h>
 #include <sel4/types.h>
 #include <allocman/util.h>
+#ifdef CONFIG_ALLOCMAN_STATS
+#include <allocman/stats.h>
+#include <sel4utils/profile.h>
+#endif
 #include <allocman/cspace/cspace.h>
 #include <allocman/mspace/mspace.h>
 #include <allocman/utspace/utspace.h>
@@ -68,6 +73,9 @@
 struct allocman_mspace_chunk {
     size_t size;
     size_t count;
+    /* When refilling asynchronously, the refill thread is signalled once fewer than
+     * this many chunks remain. 0 signals as soon as any chunk has been used */
+    size_t low_water;
 };
 
 /**
@@ -78,6 +86,9 @@ struct allocman_utspace_chunk {
     size_t size_bits;
     seL4_Word type;
     size_t count;
+    /* When refilling asynchronously, the refill thread is signalled once fewer than
+     * this many chunks remain. 0 signals as soon as any chunk has been used */
+    size_t low_water;
 };
 
 /**
@@ -130,6 +141,15 @@ typedef struct allocman {
     /* Has a watermark resource been used. This is just an optimization */
     int used_watermark;
 
+    /* If set the watermark is refilled by a separate thread that waits on refill_notification,
+     * rather than at the end of every operation */
+    int have_async_refill;
+    seL4_CPtr refill_notification;
+    /* Whether the refill thread has been signalled and not yet run */
+    int refill_signalled;
+    /* Whether we are currently being called by the refill thread */
+    int in_async_refill;
+
     /* track resources that we have not yet been able to free due to circular dependencies */
     size_t desired_freed_slots;
     size_t num_freed_slots;
@@ -146,6 +166,7 @@ typedef struct allocman {
     /* cspace watermark resources */
     size_t desired_cspace_slots;
     size_t num_cspace_slots;
+    size_t cspace_low_water;
     cspacepath_t *cspace_slots;
 
     /* mspace watermark resources */
@@ -159,6 +180,10 @@ typedef struct allocman {
     struct allocman_utspace_chunk *utspace_chunk;
     size_t *utspace_chunk_count;
     struct allocman_utspace_allocation **utspace_chunks;
+
+#ifdef CONFIG_ALLOCMAN_STATS
+    allocman_stats_t stats;
+#endif
 } allocman_t;
 
 /**
@@ -192,7 +217,21 @@ void allocman_mspace_free(allocman_t *alloc, void *ptr, size_t bytes);
 int allocman_cspace_alloc(allocman_t *alloc, cspacepath_t *slot);
 
 /**
- * Frees a cslot from the allocator, as previously allocated by {@link #allocman_cspace_alloc}.
+ * Allocates a range of contiguous cslots in a single CNode from the allocator, suitable for
+ * use as the destination of {@link #allocman_utspace_alloc_batch}. Ranges are not held in
+ * the watermark, so this can fail where {@link #allocman_cspace_alloc} would succeed.
+ *
+ * @param alloc Allocman to allocate from
+ * @param num Number of slots to allocate
+ * @param slot Stores details of the first allocated slot. The remaining slots can be found with cspacepath_offset
+ *
+ * @return returns 0 on sucess
+ */
+int allocman_cspace_alloc_range(allocman_t *alloc, size_t num, cspacepath_t *slot);
+
+/**
+ * Frees a cslot from the allocator, as previously allocated by {@link #allocman_cspace_alloc}
+ * or as part of a range from {@link #allocman_cspace_alloc_range}.
  * To avoid the need to keep cspacepath_t's laying around, it is guaruanteed that
  * (*slot) == allocman_cspace_make_path(alloc, slot->capPtr). So if needed you can simply store
  * the capPtr and reconstruct the path before calling free.
@@ -256,6 +295,26 @@ seL4_Word allocman_utspace_alloc(allocman_t *alloc, size_t size_bits, seL4_Word
     return allocman_utspace_alloc_at(alloc, size_bits, type, path, ALLOCMAN_NO_PADDR, canBeDev, _error);
 }
 
+/**
+ * Allocates a number of objects of the same type and size, placing them in a contiguous range
+ * of slots. If the untyped allocator supports it the objects are created with as few calls to
+ * seL4_Untyped_Retype as possible, otherwise they are allocated one at a time.
+ *
+ * @param alloc Allocman to allocate from
+ * @param size_bits The size in bits of the memory that will be required to store each object.
+    This is different to seL4_Untyped_Retype for allocating seL4_CapTableObjects
+ * @param type The seL4 type of the objects being allocated
+ * @param path A path to the first of num contiguous empty slots in a single CNode
+ * @param num Number of objects to allocate
+ * @param canBeDev Whether this allocation can be satisified from a device region, provided that
+ *  region is known to be actual RAM. Objects from device regions are not initialized (i.e. not zeroed)
+ * @param cookies Array of num locations to store the cookie of each object. Objects are freed
+ *  individually by passing their cookie to {@link allocman_utspace_free}
+ *
+ * @return returns 0 on success. On failure no objects are allocated
+ */
+int allocman_utspace_alloc_batch(allocman_t *alloc, size_t size_bits, seL4_Word type, const cspacepath_t *path, size_t num, bool canBeDev, seL4_Word *cookies);
+
 /**
  * Returns a portion of untyped memory back to the allocator. It is assumed that this
  * memory is now unused, and every capability to this memory has been deleted (including
@@ -338,6 +397,50 @@ int allocman_configure_utspace_reserve(allocman_t *alloc, struct allocman_utspac
  */
 int allocman_configure_cspace_reserve(allocman_t *alloc, size_t num);
 
+/**
+ * Configure when the refill thread is signalled to refill the cspace reserve. See
+ * {@link #allocman_configure_async_refill}
+ *
+ * @param alloc The allocman to configure
+ * @param low_water Signal once fewer than this many cslots remain in reserve. 0 signals as
+ *                  soon as any slot has been used
+ *
+ * @return returns 0 on success
+ */
+int allocman_configure_cspace_low_water(allocman_t *alloc, size_t low_water);
+
+/**
+ * Move refilling of the reserves out of the allocation path and into a separate thread.
+ * Normally the reserves are refilled at the end of whichever operation used them, which
+ * means an unlucky caller pays for a burst of retypes and slot allocations. Once this is
+ * configured an operation that leaves a reserve below its low water mark instead signals
+ * the given notification. A helper thread, ideally at a low priority, should then be
+ * running {@link #allocman_async_refill_loop} to perform the refill.
+ *
+ * To avoid running dry, an operation that completely empties a reserve, or fills one of
+ * the queues of frees that could not yet be performed, still refills synchronously.
+ *
+ * @param alloc The allocman to configure
+ * @param notification Notification to signal when a refill is required
+ *
+ * @return returns 0 on success
+ */
+int allocman_configure_async_refill(allocman_t *alloc, seL4_CPtr notification);
+
+/**
+ * Body of a reserve refill thread, see {@link #allocman_configure_async_refill}. Waits on
+ * the refill notification and refills the reserves every time it is signalled. Does not
+ * return. As an allocman is not thread safe, the same lock that other threads use around
+ * the allocman must be provided.
+ *
+ * @param alloc The allocman to refill
+ * @param lock (Optional) Function to take the lock protecting the allocman
+ * @param unlock (Optional) Function to release the lock protecting the allocman
+ * @param cookie Passed to lock and unlock
+ */
+void allocman_async_refill_loop(allocman_t *alloc, void (*lock)(void *cookie), void (*unlock)(void *cookie),
+                                void *cookie) NORETURN;
+
 /**
  * Configure the maximul number of freed cptrs we can store. This is required for
  * scenarios where an allocator cannot handle a recursive call, but we would like to not
@@ -422,3 +525,26 @@ static inline uintptr_t allocman_utspace_paddr(allocman_t *alloc, seL4_Word cook
  */
 int allocman_add_untypeds_from_timer_objects(allocman_t *alloc, timer_objects_t *to);
 
+#ifdef CONFIG_ALLOCMAN_STATS
+/**
+ * Takes a snapshot of the statistics collected by an allocman
+ *
+ * @param alloc The allocman to query
+ * @param stats Structure to copy the statistics into
+ *
+ * @return 0 on success
+ */
+int allocman_get_stats(allocman_t *alloc, allocman_stats_t *stats);
+
+/**
+ * Reports every statistic collected by an allocman through the same callbacks as
+ * profile_scrape, so the output can be consumed by existing profile tooling
+ *
+ * @param alloc The allocman to query
+ * @param callback32 Unused, all statistics are reported as 64bit values
+ * @param callback64 Called once for every statistic
+ * @param cookie Passed through to the callback
+ */
+void allocman_stats_scrape(allocman_t *alloc, profile_callback32 callback32, profile_callback64 callback64,
+                           void *cookie);
+#endif /* CONFIG_ALLOCMAN_STATS */
@@ -20,6 +20,9 @@ struct allocman;
 
 typedef struct cspace_interface {
     int (*alloc)(struct allocman *alloc, void *cookie, cspacepath_t *path);
+    /* Optional. Allocates num contiguous slots in the same cnode, returning the path of the first.
+       Each slot in the range is later freed individually with free */
+    int (*alloc_range)(struct allocman *alloc, void *cookie, size_t num, cspacepath_t *path);
     void (*free)(struct allocman *alloc, void *cookie, const cspacepath_t *path);
     cspacepath_t (*make_path)(void *cookie, seL4_CPtr slot);
     struct allocman_properties properties;
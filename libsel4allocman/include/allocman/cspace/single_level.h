@@ -32,9 +32,16 @@ struct cspace_single_level_config {
 
 typedef struct cspace_single_level {
     struct cspace_single_level_config config;
+    /* One bit per slot, set if the slot is free */
     size_t *bitmap;
     size_t bitmap_length;
+    /* One bit per bitmap word, set if that word has any free slots. This allows finding
+     * a free slot without scanning past full words of the bitmap */
+    size_t *summary;
+    size_t summary_length;
     size_t last_entry;
+    /* Bitmap word that the next search for a range of slots starts from */
+    size_t range_hint;
 } cspace_single_level_t;
 
 int cspace_single_level_create(struct allocman *alloc, cspace_single_level_t *cspace, struct cspace_single_level_config config);
@@ -44,6 +51,7 @@ void cspace_single_level_destroy(struct allocman *alloc, cspace_single_level_t *
 
 int _cspace_single_level_alloc(struct allocman *alloc, void *_cspace, cspacepath_t *slot);
 int _cspace_single_level_alloc_at(struct allocman *alloc, void *_cspace, seL4_CPtr slot);
+int _cspace_single_level_alloc_range(struct allocman *alloc, void *_cspace, size_t num, cspacepath_t *slot);
 void _cspace_single_level_free(struct allocman *alloc, void *_cspace, const cspacepath_t *slot);
 
 static inline cspacepath_t _cspace_single_level_make_path(void *_cspace, seL4_CPtr slot)
@@ -63,6 +71,7 @@ static inline cspacepath_t _cspace_single_level_make_path(void *_cspace, seL4_CP
 static inline cspace_interface_t cspace_single_level_make_interface(cspace_single_level_t *cspace) {
     return (cspace_interface_t) {
         .alloc = _cspace_single_level_alloc,
+        .alloc_range = _cspace_single_level_alloc_range,
         .free = _cspace_single_level_free,
         .make_path = _cspace_single_level_make_path,
         /* We do not want to handle recursion, as it shouldn't happen */
@@ -17,6 +17,11 @@
 #include <allocman/cspace/cspace.h>
 #include <allocman/cspace/single_level.h>
 
+/* Number of second level cnodes that are allowed to become empty before we start
+ * destroying them. Keeping a few around stops a workload that frees and allocates
+ * at a cnode boundary from repeatedly retyping and deleting a whole cnode */
+#define CSPACE_TWO_LEVEL_MAX_EMPTY 2
+
 struct cspace_two_level_config {
     /* A cptr to the first level cnode that we are managing slots in */
     seL4_CPtr cnode;
@@ -65,6 +70,12 @@ typedef struct cspace_two_level {
     struct cspace_two_level_node **second_levels;
     /* Remember which second level we last tried to allocate a slot from */
     size_t last_second_level;
+    /* Bitmap with a bit set for every second level that exists and still has a
+       free slot */
+    size_t *free_levels;
+    size_t free_levels_length;
+    /* How many second levels currently exist with nothing allocated in them */
+    size_t num_empty;
 } cspace_two_level_t;
 
 int cspace_two_level_create(struct allocman *alloc, cspace_two_level_t *cspace, struct cspace_two_level_config config);
@@ -74,12 +85,14 @@ seL4_CPtr _cspace_two_level_boot_alloc(struct allocman *alloc, void *_cspace, in
 int _cspace_two_level_alloc(struct allocman *alloc, void *_cspace, cspacepath_t *slot);
 void _cspace_two_level_free(struct allocman *alloc, void *_cspace, const cspacepath_t *slot);
 int _cspace_two_level_alloc_at(struct allocman *alloc, void *_cspace, seL4_CPtr slot);
+int _cspace_two_level_alloc_range(struct allocman *alloc, void *_cspace, size_t num, cspacepath_t *slot);
 
 cspacepath_t _cspace_two_level_make_path(void *_cspace, seL4_CPtr slot);
 
 static inline cspace_interface_t cspace_two_level_make_interface(cspace_two_level_t *cspace) {
     return (cspace_interface_t) {
         .alloc = _cspace_two_level_alloc,
+        .alloc_range = _cspace_two_level_alloc_range,
         .free = _cspace_two_level_free,
         .make_path = _cspace_two_level_make_path,
         /* We do not want to handle recursion, as it shouldn't happen */
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stdlib.h>
+#include <sel4/types.h>
+#include <vka/vka.h>
+#include <vka/cspacepath_t.h>
+#include <allocman/allocman.h>
+
+/* A magazine is a small per thread cache that sits in front of a shared allocman. An allocman
+ * is not thread safe, so multiple threads must serialise on a lock around every operation.
+ * Instead each thread can create a magazine and use the vka it provides. The magazine keeps a
+ * handful of free slots and pre-created objects of commonly used types (such as 4K frames, TCBs,
+ * endpoints and notifications) and only takes the lock to refill or drain these in batches.
+ *
+ * Objects are handed out by moving the cap of a pre-created object from the magazine into the
+ * destination slot, so an allocation that hits in the magazine costs a single CNode_Move and
+ * no lock. Frees of cached object types are deferred and given back to the allocman in a batch.
+ *
+ * Everything else (slot paths, allocations at a physical address, uncached types) is forwarded
+ * to the allocman under the lock. Making a path takes the lock too, as a cspace may read state
+ * that is changed by other threads refilling from it (such as the second levels of a
+ * cspace_two_level), so free slots are cached as bare cptrs and only turned back into paths
+ * when they are given back to the allocman.
+ *
+ * A magazine must only ever be used by one thread at a time. */
+
+/* Number of free slots that can be cached */
+#define ALLOCMAN_MAGAZINE_SLOTS 32
+/* Maximum number of object types that can be cached */
+#define ALLOCMAN_MAGAZINE_MAX_TYPES 4
+/* Number of objects of each type that can be cached */
+#define ALLOCMAN_MAGAZINE_OBJECTS 16
+
+struct allocman_magazine_type {
+    /* seL4 object type and size_bits, as they would be passed to vka_utspace_alloc */
+    seL4_Word type;
+    seL4_Word size_bits;
+};
+
+struct allocman_magazine_config {
+    /* shared allocator to refill from and drain to */
+    allocman_t *alloc;
+    /* lock that serialises access to alloc. May be NULL if there is no sharing */
+    void (*lock)(void *cookie);
+    void (*unlock)(void *cookie);
+    void *lock_cookie;
+    /* object types to keep a cache of */
+    size_t num_types;
+    struct allocman_magazine_type types[ALLOCMAN_MAGAZINE_MAX_TYPES];
+};
+
+struct allocman_magazine_objects {
+    struct allocman_magazine_type type;
+    /* size of the object in memory, as used by allocman */
+    size_t alloc_size_bits;
+    /* slots owned by this cache. slots [0, count) hold objects, the rest are empty */
+    cspacepath_t slots[ALLOCMAN_MAGAZINE_OBJECTS];
+    seL4_Word cookies[ALLOCMAN_MAGAZINE_OBJECTS];
+    size_t count;
+    /* whether the slots form a single contiguous range and can be refilled in one batch */
+    int contiguous;
+    /* cookies of objects that have been freed but not yet given back to the allocman */
+    seL4_Word freed[ALLOCMAN_MAGAZINE_OBJECTS];
+    size_t num_freed;
+};
+
+typedef struct allocman_magazine {
+    struct allocman_magazine_config config;
+    seL4_CPtr slots[ALLOCMAN_MAGAZINE_SLOTS];
+    size_t num_slots;
+    struct allocman_magazine_objects objects[ALLOCMAN_MAGAZINE_MAX_TYPES];
+} allocman_magazine_t;
+
+/**
+ * Create a magazine in front of a shared allocman. This allocates the slots used to hold
+ * cached objects, but does not fill them until they are first used.
+ *
+ * @param magazine Magazine to initialise
+ * @param config Description of the allocman to use and the object types to cache
+ * @return 0 on success
+ */
+int allocman_magazine_create(allocman_magazine_t *magazine, struct allocman_magazine_config config);
+
+/**
+ * Give all cached slots and objects back to the allocman and release any deferred frees.
+ *
+ * @param magazine Magazine to flush
+ */
+void allocman_magazine_flush(allocman_magazine_t *magazine);
+
+/**
+ * Flush a magazine and release the slots it holds for caching objects. The magazine cannot
+ * be used after this.
+ *
+ * @param magazine Magazine to destroy
+ */
+void allocman_magazine_destroy(allocman_magazine_t *magazine);
+
+/**
+ * Make a VKA object that allocates through this magazine. This vka must only be used by
+ * the thread that owns the magazine.
+ *
+ * @param vka structure for the vka interface object
+ * @param magazine Magazine to be used with this vka
+ */
+void allocman_magazine_make_vka(vka_t *vka, allocman_magazine_t *magazine);
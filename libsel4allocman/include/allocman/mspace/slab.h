@@ -0,0 +1,71 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stdlib.h>
+#include <sel4/types.h>
+#include <allocman/mspace/mspace.h>
+#include <allocman/mspace/k_r_malloc.h>
+
+/* Segregated size class allocator that sits on top of another memory manager. Small
+ * requests are rounded up to a multiple of the granule and served from a free list for
+ * that size class. Free lists are refilled by carving up a chunk obtained from the
+ * backing memory manager. Since allocman always tells us the size of the block being
+ * freed no per object header is needed. Requests larger than the largest size class
+ * go straight to the backing memory manager.
+ *
+ * Chunks are never returned to the backing memory manager. */
+
+/* Size classes are multiples of this. It matches the alignment provided by the
+ * K&R based pools that this is expected to sit on top of */
+#define MSPACE_SLAB_GRANULE sizeof(k_r_malloc_header_t)
+#define MSPACE_SLAB_NUM_CLASSES 16
+#define MSPACE_SLAB_MAX_SIZE (MSPACE_SLAB_GRANULE * MSPACE_SLAB_NUM_CLASSES)
+/* Default size of the chunks used to refill a size class */
+#define MSPACE_SLAB_DEFAULT_CHUNK_SIZE 1024
+
+struct mspace_slab_config {
+    /* Memory manager to get chunks and large allocations from */
+    struct mspace_interface backing;
+    /* Size of the chunks to request from the backing memory manager. If 0
+     * MSPACE_SLAB_DEFAULT_CHUNK_SIZE is used */
+    size_t chunk_size;
+};
+
+struct mspace_slab_object {
+    struct mspace_slab_object *next;
+};
+
+typedef struct mspace_slab {
+    struct mspace_interface backing;
+    size_t chunk_size;
+    /* Free list for every size class */
+    struct mspace_slab_object *free_lists[MSPACE_SLAB_NUM_CLASSES];
+} mspace_slab_t;
+
+void mspace_slab_create(mspace_slab_t *slab, struct mspace_slab_config config);
+
+void *_mspace_slab_alloc(struct allocman *alloc, void *_slab, size_t bytes, int *error);
+void _mspace_slab_free(struct allocman *alloc, void *_slab, void *ptr, size_t bytes);
+
+static inline struct mspace_interface mspace_slab_make_interface(mspace_slab_t *slab) {
+    return (struct mspace_interface){
+        .alloc = _mspace_slab_alloc,
+        .free = _mspace_slab_free,
+        /* we only ever call down into the backing memory manager */
+        .properties = slab->backing.properties,
+        .mspace = slab
+    };
+}
+
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stdlib.h>
+#include <sel4/types.h>
+#include <vka/trace-vka.h>
+#include <allocman/mspace/mspace.h>
+
+/* This memory allocator records every allocation and free into a vka trace before passing
+ * it on to another memory allocator. Book keeping allocations never go through a vka, so
+ * wrapping the interface given to allocman_create with this puts them in the same trace
+ * as the vka calls that caused them. */
+
+typedef struct mspace_trace {
+    struct mspace_interface underlying;
+    vka_trace_t *trace;
+} mspace_trace_t;
+
+void mspace_trace_create(mspace_trace_t *mspace, struct mspace_interface underlying, vka_trace_t *trace);
+
+void *_mspace_trace_alloc(struct allocman *alloc, void *_mspace, size_t bytes, int *error);
+void _mspace_trace_free(struct allocman *alloc, void *_mspace, void *ptr, size_t bytes);
+
+static inline struct mspace_interface mspace_trace_make_interface(mspace_trace_t *mspace) {
+    return (struct mspace_interface){
+        .alloc = _mspace_trace_alloc,
+        .free = _mspace_trace_free,
+        .properties = mspace->underlying.properties,
+        .mspace = mspace
+    };
+}
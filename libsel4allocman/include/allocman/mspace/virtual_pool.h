@@ -20,10 +20,18 @@
 
 /* Performs allocation from a pool of virtual memory */
 
+/* Suggested amount to grow a virtual pool by at a time */
+#define MSPACE_VIRTUAL_POOL_BULK_GROW_SIZE BIT(16)
+
 struct mspace_virtual_pool_config {
     void *vstart;
     size_t size;
     seL4_CPtr pd;
+    /* Minimum amount of memory to map in whenever the pool needs to grow. Frames
+     * are allocated and mapped as a batch. If this is at least a large page, and the
+     * pool is suitably aligned, a large page will be used. 0 grows a single 4K page
+     * at a time */
+    size_t grow_size;
 };
 
 typedef struct mspace_virtual_pool {
@@ -31,6 +39,7 @@ typedef struct mspace_virtual_pool {
     void *pool_top;
     void *pool_limit;
     seL4_CPtr pd;
+    size_t grow_size;
     mspace_k_r_malloc_t k_r_malloc;
     struct allocman *morecore_alloc;
 } mspace_virtual_pool_t;
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <allocman/gen_config.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sel4/types.h>
+
+/* Statistics collected by an allocman when CONFIG_ALLOCMAN_STATS is enabled. These are
+ * gathered where allocman calls into the underlying allocators, so resources held in the
+ * watermark reserves count as being in use, and frees that had to be queued are only
+ * counted once they are actually performed. */
+
+/* Latency histograms have a bucket for every power of two number of cycles. The first
+ * bucket collects everything below BIT(ALLOCMAN_STATS_HIST_SHIFT + 1) cycles and the last
+ * everything from BIT(ALLOCMAN_STATS_HIST_SHIFT + ALLOCMAN_STATS_HIST_BUCKETS - 1) up */
+#define ALLOCMAN_STATS_HIST_BUCKETS 16
+#define ALLOCMAN_STATS_HIST_SHIFT 4
+
+struct allocman_op_stats {
+    /* number of calls into the underlying allocator */
+    uint64_t count;
+    /* how many of those calls failed */
+    uint64_t failed;
+    /* total cycles spent in the underlying allocator, including any nested operations */
+    uint64_t cycles;
+    uint64_t histogram[ALLOCMAN_STATS_HIST_BUCKETS];
+};
+
+typedef struct allocman_stats {
+    struct allocman_op_stats cspace_alloc;
+    struct allocman_op_stats cspace_free;
+    struct allocman_op_stats utspace_alloc;
+    struct allocman_op_stats utspace_free;
+    struct allocman_op_stats mspace_alloc;
+    struct allocman_op_stats mspace_free;
+
+    /* slots currently allocated and the most that have ever been allocated at once */
+    uint64_t slots_in_use;
+    uint64_t slots_high_water;
+
+    /* Untyped memory in use. Per size class counts are in objects, indexed by size_bits */
+    uint64_t utspace_bytes_in_use;
+    uint64_t utspace_bytes_high_water;
+    uint64_t utspace_in_use[CONFIG_WORD_SIZE];
+    uint64_t utspace_high_water[CONFIG_WORD_SIZE];
+
+    /* Book keeping memory in use. Per size class counts are in allocations, indexed by the
+     * log2 of the allocation size rounded down */
+    uint64_t mspace_bytes_in_use;
+    uint64_t mspace_bytes_high_water;
+    uint64_t mspace_in_use[CONFIG_WORD_SIZE];
+    uint64_t mspace_high_water[CONFIG_WORD_SIZE];
+
+    /* Deepest nesting of allocations seen, across all three allocators. An allocator
+     * refilling itself shows up here as the allocations it makes on the allocman */
+    uint64_t max_alloc_depth;
+
+    /* Number of allocations served from the watermark reserves, and how many times the
+     * reserves had to be refilled */
+    uint64_t watermark_cspace_uses;
+    uint64_t watermark_utspace_uses;
+    uint64_t watermark_mspace_uses;
+    uint64_t watermark_refills;
+} allocman_stats_t;
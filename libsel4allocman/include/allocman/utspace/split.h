@@ -21,6 +21,17 @@
 /* This is an untyped manager that works by splitting each untyped in half to
  * create smaller untypeds. */
 
+struct utspace_split_node;
+
+/* Book keeping for an object that was created as part of a batch. All objects in a batch are
+ * retyped directly out of a single node, which is only returned to the free lists once every
+ * object in the batch has been freed */
+struct utspace_split_batch_object {
+    struct utspace_split_node *parent;
+    /* position of this object in the batch */
+    size_t index;
+};
+
 struct utspace_split_node {
     cspacepath_t ut;
     /* if this is a child node, represents our parent. Our parent must by
@@ -34,8 +45,20 @@ struct utspace_split_node {
     struct utspace_split_node **origin_head;
     /* physical address of the node */
     uintptr_t paddr;
+    /* size in bits of the untyped this node represents */
+    size_t size_bits;
     /* if this node is not allocated then these are the next/previous pointers in the free list */
     struct utspace_split_node *next, *prev;
+    /* physical address index this node is placed in whilst it is free. Only nodes with a
+     * known physical address are ever placed in an index */
+    struct utspace_split_node **paddr_tree;
+    /* children and height of this node in the paddr index */
+    struct utspace_split_node *tree_left, *tree_right;
+    int tree_height;
+    /* if this node was retyped into a batch of objects, the book keeping for those objects and
+     * how many of them are yet to be freed */
+    struct utspace_split_batch_object *batch;
+    size_t batch_live;
 };
 
 typedef struct utspace_split {
@@ -45,12 +68,19 @@ typedef struct utspace_split {
     struct utspace_split_node *dev_heads[CONFIG_WORD_SIZE];
     /* untypeds that are known to be RAM from the device region */
     struct utspace_split_node *dev_mem_heads[CONFIG_WORD_SIZE];
+    /* Free nodes of each of the above pools, of all sizes, indexed by physical address.
+     * As free nodes never overlap the untyped covering any address can be found by
+     * searching for its predecessor, avoiding a walk of every free list */
+    struct utspace_split_node *paddr_tree;
+    struct utspace_split_node *dev_paddr_tree;
+    struct utspace_split_node *dev_mem_paddr_tree;
 } utspace_split_t;
 
 void utspace_split_create(utspace_split_t *split);
 int _utspace_split_add_uts(struct allocman *alloc, void *_split, size_t num, const cspacepath_t *uts, size_t *size_bits, uintptr_t *paddr, int utType);
 
 seL4_Word _utspace_split_alloc(struct allocman *alloc, void *_split, size_t size_bits, seL4_Word type, const cspacepath_t *slot, uintptr_t paddr, bool canBeDev, int *error);
+int _utspace_split_alloc_batch(struct allocman *alloc, void *_split, size_t size_bits, seL4_Word type, const cspacepath_t *slots, size_t num, bool canBeDev, seL4_Word *cookies);
 void _utspace_split_free(struct allocman *alloc, void *_split, seL4_Word cookie, size_t size_bits);
 
 uintptr_t _utspace_split_paddr(void *_split, seL4_Word cookie, size_t size_bits);
@@ -59,6 +89,7 @@ static inline struct utspace_interface utspace_split_make_interface(utspace_spli
     return (struct utspace_interface) {
         .alloc = _utspace_split_alloc,
         .free = _utspace_split_free,
+        .alloc_batch = _utspace_split_alloc_batch,
         .add_uts = _utspace_split_add_uts,
         .paddr = _utspace_split_paddr,
         .properties = ALLOCMAN_DEFAULT_PROPERTIES,
@@ -61,6 +61,9 @@ typedef struct utspace_interface {
        semantics of size_bits when cnodes are involved */
     seL4_Word (*alloc)(struct allocman *alloc, void *utspace, size_t size_bits, seL4_Word object_type, const cspacepath_t *slot, uintptr_t paddr, bool canBeDevice, int *error);
     void (*free)(struct allocman *alloc, void *utspace, seL4_Word cookie, size_t size_bits);
+    /* Optional. Allocates num objects of the same type into a contiguous range of slots starting at
+       slots, using as few retypes as possible. Each cookie is later freed individually with free */
+    int (*alloc_batch)(struct allocman *alloc, void *utspace, size_t size_bits, seL4_Word object_type, const cspacepath_t *slots, size_t num, bool canBeDevice, seL4_Word *cookies);
     int (*add_uts)(struct allocman *alloc, void *utspace, size_t num, const cspacepath_t *uts, size_t *size_bits, uintptr_t *paddr, int utType);
     uintptr_t (*paddr)(void *utspace, seL4_Word cookie, size_t size_bits);
     struct allocman_properties properties;
@@ -18,9 +18,91 @@
 #include <sel4/sel4.h>
 #include <vka/capops.h>
 #include <sel4utils/util.h>
+#ifdef CONFIG_ALLOCMAN_STATS
+#include <sel4bench/sel4bench.h>
+#endif
 
 static int _refill_watermark(allocman_t *alloc);
 
+#ifdef CONFIG_ALLOCMAN_STATS
+
+static inline size_t _stats_class(size_t bytes)
+{
+    return bytes == 0 ? 0 : CONFIG_WORD_SIZE - 1 - CLZL(bytes);
+}
+
+static void _stats_op(struct allocman_op_stats *op, ccnt_t start, int error)
+{
+    uint64_t cycles = (uint64_t)(sel4bench_get_cycle_count() - start);
+    size_t bucket = _stats_class(cycles);
+    bucket = bucket > ALLOCMAN_STATS_HIST_SHIFT ? bucket - ALLOCMAN_STATS_HIST_SHIFT : 0;
+    op->count++;
+    op->cycles += cycles;
+    op->histogram[MIN(bucket, ALLOCMAN_STATS_HIST_BUCKETS - 1)]++;
+    if (error) {
+        op->failed++;
+    }
+}
+
+static inline void _stats_add(uint64_t *in_use, uint64_t *high_water, uint64_t amount)
+{
+    *in_use += amount;
+    *high_water = MAX(*high_water, *in_use);
+}
+
+static void _stats_depth(allocman_t *alloc)
+{
+    uint64_t depth = alloc->cspace_alloc_depth + alloc->utspace_alloc_depth + alloc->mspace_alloc_depth;
+    alloc->stats.max_alloc_depth = MAX(alloc->stats.max_alloc_depth, depth);
+}
+
+#define STATS_START() ccnt_t _stats_start = sel4bench_get_cycle_count()
+#define STATS_OP(alloc, op, error) do { \
+    _stats_op(&(alloc)->stats.op, _stats_start, error); \
+    _stats_depth(alloc); \
+} while(0)
+#define STATS_INC(alloc, counter) do { (alloc)->stats.counter++; } while(0)
+#define STATS_CSPACE(alloc, num, error) do { \
+    if (!(error)) { \
+        _stats_add(&(alloc)->stats.slots_in_use, &(alloc)->stats.slots_high_water, num); \
+    } \
+} while(0)
+#define STATS_UTSPACE(alloc, size_bits, num, error) do { \
+    if (!(error)) { \
+        _stats_add(&(alloc)->stats.utspace_bytes_in_use, &(alloc)->stats.utspace_bytes_high_water, (num) * BIT(size_bits)); \
+        _stats_add(&(alloc)->stats.utspace_in_use[size_bits], &(alloc)->stats.utspace_high_water[size_bits], num); \
+    } \
+} while(0)
+#define STATS_MSPACE(alloc, bytes, error) do { \
+    if (!(error)) { \
+        _stats_add(&(alloc)->stats.mspace_bytes_in_use, &(alloc)->stats.mspace_bytes_high_water, bytes); \
+        _stats_add(&(alloc)->stats.mspace_in_use[_stats_class(bytes)], &(alloc)->stats.mspace_high_water[_stats_class(bytes)], 1); \
+    } \
+} while(0)
+#define STATS_FREE_cspace(alloc, slot) do { (alloc)->stats.slots_in_use--; } while(0)
+#define STATS_FREE_utspace(alloc, cookie, size_bits) do { \
+    (alloc)->stats.utspace_bytes_in_use -= BIT(size_bits); \
+    (alloc)->stats.utspace_in_use[size_bits]--; \
+} while(0)
+#define STATS_FREE_mspace(alloc, ptr, bytes) do { \
+    (alloc)->stats.mspace_bytes_in_use -= (bytes); \
+    (alloc)->stats.mspace_in_use[_stats_class(bytes)]--; \
+} while(0)
+
+#else
+
+#define STATS_START() do { } while(0)
+#define STATS_OP(alloc, op, error) do { } while(0)
+#define STATS_INC(alloc, counter) do { } while(0)
+#define STATS_CSPACE(alloc, num, error) do { } while(0)
+#define STATS_UTSPACE(alloc, size_bits, num, error) do { } while(0)
+#define STATS_MSPACE(alloc, bytes, error) do { } while(0)
+#define STATS_FREE_cspace(alloc, slot) do { } while(0)
+#define STATS_FREE_utspace(alloc, cookie, size_bits) do { } while(0)
+#define STATS_FREE_mspace(alloc, ptr, bytes) do { } while(0)
+
+#endif
+
 static inline int _can_alloc(struct allocman_properties properties, size_t alloc_depth, size_t free_depth)
 {
     int in_alloc = alloc_depth > 0;
@@ -44,13 +126,92 @@ static int _start_operation(allocman_t *alloc)
     return ret;
 }
 
+static inline int _below_low_water(size_t count, size_t desired, size_t low_water)
+{
+    return low_water == 0 ? count < desired : count < low_water;
+}
+
+/* Work out how urgently the watermark needs refilling. Returns 0 if it does not,
+   1 if the refill thread should be signalled and 2 if we cannot wait for it */
+static int _watermark_urgency(allocman_t *alloc)
+{
+    size_t i;
+    int urgency = 0;
+    if (alloc->num_freed_slots == alloc->desired_freed_slots && alloc->num_freed_slots > 0) {
+        return 2;
+    }
+    if (alloc->num_freed_mspace_chunks == alloc->desired_freed_mspace_chunks && alloc->num_freed_mspace_chunks > 0) {
+        return 2;
+    }
+    if (alloc->num_freed_utspace_chunks == alloc->desired_freed_utspace_chunks && alloc->num_freed_utspace_chunks > 0) {
+        return 2;
+    }
+    if (alloc->num_freed_slots > 0 || alloc->num_freed_mspace_chunks > 0 || alloc->num_freed_utspace_chunks > 0) {
+        urgency = 1;
+    }
+    if (alloc->desired_cspace_slots > 0) {
+        if (alloc->num_cspace_slots == 0) {
+            return 2;
+        }
+        if (_below_low_water(alloc->num_cspace_slots, alloc->desired_cspace_slots, alloc->cspace_low_water)) {
+            urgency = 1;
+        }
+    }
+    for (i = 0; i < alloc->num_utspace_chunks; i++) {
+        if (alloc->utspace_chunk[i].count > 0) {
+            if (alloc->utspace_chunk_count[i] == 0) {
+                return 2;
+            }
+            if (_below_low_water(alloc->utspace_chunk_count[i], alloc->utspace_chunk[i].count, alloc->utspace_chunk[i].low_water)) {
+                urgency = 1;
+            }
+        }
+    }
+    for (i = 0; i < alloc->num_mspace_chunks; i++) {
+        if (alloc->mspace_chunk[i].count > 0) {
+            if (alloc->mspace_chunk_count[i] == 0) {
+                return 2;
+            }
+            if (_below_low_water(alloc->mspace_chunk_count[i], alloc->mspace_chunk[i].count, alloc->mspace_chunk[i].low_water)) {
+                urgency = 1;
+            }
+        }
+    }
+    return urgency;
+}
+
+static void _async_refill_watermark(allocman_t *alloc)
+{
+    if (alloc->in_async_refill || !alloc->used_watermark) {
+        /* the refill thread will refill everything it can before it returns */
+        return;
+    }
+    switch (_watermark_urgency(alloc)) {
+    case 2:
+        _refill_watermark(alloc);
+        break;
+    case 1:
+        if (!alloc->refill_signalled) {
+            alloc->refill_signalled = 1;
+            seL4_Signal(alloc->refill_notification);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 static inline void _end_operation(allocman_t *alloc, int root)
 {
     alloc->in_operation = !root;
     /* Anytime we end an operation we need to make sure we have watermark
        resources */
     if (root) {
-        _refill_watermark(alloc);
+        if (alloc->have_async_refill) {
+            _async_refill_watermark(alloc);
+        } else {
+            _refill_watermark(alloc);
+        }
     }
 }
 
@@ -93,9 +254,12 @@ static void allocman_utspace_queue_for_free(allocman_t *alloc, seL4_Word cookie,
         return; \
     } \
     root = _start_operation(alloc); \
+    STATS_START(); \
     alloc->space##_free_depth++; \
     alloc->space.free(alloc, alloc->space.space, __VA_ARGS__); \
     alloc->space##_free_depth--; \
+    STATS_OP(alloc, space##_free, 0); \
+    STATS_FREE_##space(alloc, __VA_ARGS__); \
     _end_operation(alloc, root); \
 } while(0)
 
@@ -123,6 +287,7 @@ static void *_try_watermark_mspace(allocman_t *alloc, size_t size, int *_error)
                 void *ret = alloc->mspace_chunks[i][--alloc->mspace_chunk_count[i]];
                 SET_ERROR(_error, 0);
                 alloc->used_watermark = 1;
+                STATS_INC(alloc, watermark_mspace_uses);
                 return ret;
             }
         }
@@ -137,6 +302,7 @@ static int _try_watermark_cspace(allocman_t *alloc, cspacepath_t *slot)
         return 1;
     }
     alloc->used_watermark = 1;
+    STATS_INC(alloc, watermark_cspace_uses);
     *slot = alloc->cspace_slots[--alloc->num_cspace_slots];
     return 0;
 }
@@ -157,6 +323,7 @@ static seL4_Word _try_watermark_utspace(allocman_t *alloc, size_t size_bits, seL
                     return 0;
                 }
                 alloc->used_watermark = 1;
+                STATS_INC(alloc, watermark_utspace_uses);
                 alloc->utspace_chunk_count[i]--;
                 allocman_cspace_free(alloc, &result.slot);
                 SET_ERROR(_error, 0);
@@ -193,9 +360,12 @@ static void *_allocman_mspace_alloc(allocman_t *alloc, size_t size, int *_error,
     }
     root_op = _start_operation(alloc);
     /* Attempt the allocation */
+    STATS_START();
     alloc->mspace_alloc_depth++;
     ret = alloc->mspace.alloc(alloc, alloc->mspace.mspace, size, &error);
     alloc->mspace_alloc_depth--;
+    STATS_OP(alloc, mspace_alloc, error);
+    STATS_MSPACE(alloc, size, error);
     if (!error) {
         _end_operation(alloc, root_op);
         SET_ERROR(_error, 0);
@@ -239,9 +409,12 @@ static int _allocman_cspace_alloc(allocman_t *alloc, cspacepath_t *slot, int use
     }
     root_op = _start_operation(alloc);
     /* Attempt the allocation */
+    STATS_START();
     alloc->cspace_alloc_depth++;
     error = alloc->cspace.alloc(alloc, alloc->cspace.cspace, slot);
     alloc->cspace_alloc_depth--;
+    STATS_OP(alloc, cspace_alloc, error);
+    STATS_CSPACE(alloc, 1, error);
     if (!error) {
         _end_operation(alloc, root_op);
         return 0;
@@ -286,9 +459,12 @@ static seL4_Word _allocman_utspace_alloc(allocman_t *alloc, size_t size_bits, se
     }
     root_op = _start_operation(alloc);
     /* Attempt the allocation */
+    STATS_START();
     alloc->utspace_alloc_depth++;
     ret = alloc->utspace.alloc(alloc, alloc->utspace.utspace, size_bits, type, path, paddr, canBeDev, &error);
     alloc->utspace_alloc_depth--;
+    STATS_OP(alloc, utspace_alloc, error);
+    STATS_UTSPACE(alloc, size_bits, 1, error);
     if (!error) {
         _end_operation(alloc, root_op);
         SET_ERROR(_error, error);
@@ -320,11 +496,77 @@ int allocman_cspace_alloc(allocman_t *alloc, cspacepath_t *slot)
     return _allocman_cspace_alloc(alloc, slot, 1);
 }
 
+int allocman_cspace_alloc_range(allocman_t *alloc, size_t num, cspacepath_t *slot)
+{
+    int root_op;
+    int error;
+    /* see if we have an allocator installed yet that can allocate ranges */
+    if (!alloc->have_cspace || !alloc->cspace.alloc_range) {
+        return 1;
+    }
+    /* The watermark only holds individual slots, so there is nothing to fall back to if we
+       are not permitted to allocate */
+    if (!_can_alloc(alloc->cspace.properties, alloc->cspace_alloc_depth, alloc->cspace_free_depth)) {
+        return 1;
+    }
+    root_op = _start_operation(alloc);
+    STATS_START();
+    alloc->cspace_alloc_depth++;
+    error = alloc->cspace.alloc_range(alloc, alloc->cspace.cspace, num, slot);
+    alloc->cspace_alloc_depth--;
+    STATS_OP(alloc, cspace_alloc, error);
+    STATS_CSPACE(alloc, num, error);
+    _end_operation(alloc, root_op);
+    return error;
+}
+
 seL4_Word allocman_utspace_alloc_at(allocman_t *alloc, size_t size_bits, seL4_Word type, const cspacepath_t *path, uintptr_t paddr, bool canBeDev, int *_error)
 {
     return _allocman_utspace_alloc(alloc, size_bits, type, path, paddr, canBeDev, _error, 1);
 }
 
+int allocman_utspace_alloc_batch(allocman_t *alloc, size_t size_bits, seL4_Word type, const cspacepath_t *path, size_t num, bool canBeDev, seL4_Word *cookies)
+{
+    int root_op;
+    int error;
+    size_t i;
+    /* see if we have an allocator installed yet*/
+    if (!alloc->have_utspace) {
+        return 1;
+    }
+    /* try and do the whole batch at once if we are permitted to */
+    if (alloc->utspace.alloc_batch && _can_alloc(alloc->utspace.properties, alloc->utspace_alloc_depth, alloc->utspace_free_depth)) {
+        root_op = _start_operation(alloc);
+        STATS_START();
+        alloc->utspace_alloc_depth++;
+        error = alloc->utspace.alloc_batch(alloc, alloc->utspace.utspace, size_bits, type, path, num, canBeDev, cookies);
+        alloc->utspace_alloc_depth--;
+        STATS_OP(alloc, utspace_alloc, error);
+        STATS_UTSPACE(alloc, size_bits, num, error);
+        _end_operation(alloc, root_op);
+        if (!error) {
+            return 0;
+        }
+        ZF_LOGV("Batch allocation of %zu objects failed, falling back to individual allocations", num);
+    }
+    /* Allocate each object individually. This gives us the benefit of the watermark */
+    for (i = 0; i < num; i++) {
+        cspacepath_t slot = cspacepath_offset(path, i);
+        cookies[i] = allocman_utspace_alloc(alloc, size_bits, type, &slot, canBeDev, &error);
+        if (error) {
+            /* release everything we have allocated so far */
+            while (i > 0) {
+                i--;
+                slot = cspacepath_offset(path, i);
+                vka_cnode_delete(&slot);
+                allocman_utspace_free(alloc, cookies[i], size_bits);
+            }
+            return error;
+        }
+    }
+    return 0;
+}
+
 static int _refill_watermark(allocman_t *alloc)
 {
     int found_empty_pool;
@@ -334,6 +576,7 @@ static int _refill_watermark(allocman_t *alloc)
         return 0;
     }
     alloc->refilling_watermark = 1;
+    STATS_INC(alloc, watermark_refills);
 
     /* Run in a loop refilling our resources. We need a loop as refilling
        one resource may require another watermark resource to be used. It is up
@@ -504,6 +747,36 @@ int allocman_configure_cspace_reserve(allocman_t *alloc, size_t num) {
     return resize_slots_array(alloc, num, &alloc->cspace_slots, &alloc->desired_cspace_slots, &alloc->num_cspace_slots);
 }
 
+int allocman_configure_cspace_low_water(allocman_t *alloc, size_t low_water) {
+    alloc->cspace_low_water = low_water;
+    return 0;
+}
+
+int allocman_configure_async_refill(allocman_t *alloc, seL4_CPtr notification) {
+    alloc->refill_notification = notification;
+    alloc->refill_signalled = 0;
+    alloc->have_async_refill = 1;
+    return 0;
+}
+
+void allocman_async_refill_loop(allocman_t *alloc, void (*lock)(void *cookie), void (*unlock)(void *cookie),
+                                void *cookie) {
+    assert(alloc->have_async_refill);
+    while (1) {
+        seL4_Wait(alloc->refill_notification, NULL);
+        if (lock) {
+            lock(cookie);
+        }
+        alloc->refill_signalled = 0;
+        alloc->in_async_refill = 1;
+        allocman_fill_reserves(alloc);
+        alloc->in_async_refill = 0;
+        if (unlock) {
+            unlock(cookie);
+        }
+    }
+}
+
 int allocman_configure_max_freed_slots(allocman_t *alloc, size_t num) {
     return resize_slots_array(alloc, num, &alloc->freed_slots, &alloc->desired_freed_slots, &alloc->num_freed_slots);
 }
@@ -647,3 +920,80 @@ int allocman_add_untypeds_from_timer_objects(allocman_t *alloc, timer_objects_t
     }
     return 0;
 }
+
+#ifdef CONFIG_ALLOCMAN_STATS
+int allocman_get_stats(allocman_t *alloc, allocman_stats_t *stats)
+{
+    *stats = alloc->stats;
+    return 0;
+}
+
+static const char *_hist_descriptions[ALLOCMAN_STATS_HIST_BUCKETS] = {
+    "latency < 2^5 cycles",
+    "latency 2^5 to 2^6 cycles",
+    "latency 2^6 to 2^7 cycles",
+    "latency 2^7 to 2^8 cycles",
+    "latency 2^8 to 2^9 cycles",
+    "latency 2^9 to 2^10 cycles",
+    "latency 2^10 to 2^11 cycles",
+    "latency 2^11 to 2^12 cycles",
+    "latency 2^12 to 2^13 cycles",
+    "latency 2^13 to 2^14 cycles",
+    "latency 2^14 to 2^15 cycles",
+    "latency 2^15 to 2^16 cycles",
+    "latency 2^16 to 2^17 cycles",
+    "latency 2^17 to 2^18 cycles",
+    "latency 2^18 to 2^19 cycles",
+    "latency >= 2^19 cycles",
+};
+compile_time_assert(allocman_hist_descriptions, ALLOCMAN_STATS_HIST_SHIFT == 4 && ALLOCMAN_STATS_HIST_BUCKETS == 16);
+
+static void _scrape_op(struct allocman_op_stats *op, const char *name, profile_callback64 callback64, void *cookie)
+{
+    size_t i;
+    callback64(op->count, name, "calls", cookie);
+    callback64(op->failed, name, "failed calls", cookie);
+    callback64(op->cycles, name, "total cycles", cookie);
+    for (i = 0; i < ALLOCMAN_STATS_HIST_BUCKETS; i++) {
+        callback64(op->histogram[i], name, _hist_descriptions[i], cookie);
+    }
+}
+
+void allocman_stats_scrape(allocman_t *alloc, profile_callback32 callback32, profile_callback64 callback64,
+                           void *cookie)
+{
+    size_t i;
+    allocman_stats_t *stats = &alloc->stats;
+    _scrape_op(&stats->cspace_alloc, "allocman_cspace_alloc", callback64, cookie);
+    _scrape_op(&stats->cspace_free, "allocman_cspace_free", callback64, cookie);
+    _scrape_op(&stats->utspace_alloc, "allocman_utspace_alloc", callback64, cookie);
+    _scrape_op(&stats->utspace_free, "allocman_utspace_free", callback64, cookie);
+    _scrape_op(&stats->mspace_alloc, "allocman_mspace_alloc", callback64, cookie);
+    _scrape_op(&stats->mspace_free, "allocman_mspace_free", callback64, cookie);
+    callback64(stats->slots_in_use, "allocman_slots", "slots in use", cookie);
+    callback64(stats->slots_high_water, "allocman_slots", "slots high water mark", cookie);
+    callback64(stats->utspace_bytes_in_use, "allocman_utspace", "bytes in use", cookie);
+    callback64(stats->utspace_bytes_high_water, "allocman_utspace", "bytes high water mark", cookie);
+    callback64(stats->mspace_bytes_in_use, "allocman_mspace", "bytes in use", cookie);
+    callback64(stats->mspace_bytes_high_water, "allocman_mspace", "bytes high water mark", cookie);
+    for (i = 0; i < CONFIG_WORD_SIZE; i++) {
+        if (stats->utspace_high_water[i] != 0) {
+            callback64(i, "allocman_utspace_class", "size_bits", cookie);
+            callback64(stats->utspace_in_use[i], "allocman_utspace_class", "objects in use", cookie);
+            callback64(stats->utspace_high_water[i], "allocman_utspace_class", "objects high water mark", cookie);
+        }
+    }
+    for (i = 0; i < CONFIG_WORD_SIZE; i++) {
+        if (stats->mspace_high_water[i] != 0) {
+            callback64(i, "allocman_mspace_class", "log2 size", cookie);
+            callback64(stats->mspace_in_use[i], "allocman_mspace_class", "allocations in use", cookie);
+            callback64(stats->mspace_high_water[i], "allocman_mspace_class", "allocations high water mark", cookie);
+        }
+    }
+    callback64(stats->max_alloc_depth, "allocman_max_alloc_depth", "deepest nested allocation", cookie);
+    callback64(stats->watermark_cspace_uses, "allocman_watermark", "slots taken from reserve", cookie);
+    callback64(stats->watermark_utspace_uses, "allocman_watermark", "untypeds taken from reserve", cookie);
+    callback64(stats->watermark_mspace_uses, "allocman_watermark", "memory chunks taken from reserve", cookie);
+    callback64(stats->watermark_refills, "allocman_watermark", "reserve refills", cookie);
+}
+#endif /* CONFIG_ALLOCMAN_STATS */
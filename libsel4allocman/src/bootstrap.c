@@ -1276,7 +1276,8 @@ void bootstrap_configure_virtual_pool(allocman_t *alloc, void *vstart, size_t vs
             (struct mspace_virtual_pool_config){
                 .vstart = vstart,
                 .size = vsize,
-                .pd = pd
+                .pd = pd,
+                .grow_size = MSPACE_VIRTUAL_POOL_BULK_GROW_SIZE
             }
     );
 }
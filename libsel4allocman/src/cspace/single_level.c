@@ -18,65 +18,182 @@
 
 #define BITS_PER_WORD (sizeof(size_t) * 8)
 
+static inline void _mark_allocated(cspace_single_level_t *cspace, size_t index)
+{
+    size_t word = index / BITS_PER_WORD;
+    cspace->bitmap[word] &= ~BIT(index % BITS_PER_WORD);
+    if (cspace->bitmap[word] == 0) {
+        cspace->summary[word / BITS_PER_WORD] &= ~BIT(word % BITS_PER_WORD);
+    }
+}
+
+static inline void _mark_free(cspace_single_level_t *cspace, size_t index)
+{
+    size_t word = index / BITS_PER_WORD;
+    cspace->bitmap[word] |= BIT(index % BITS_PER_WORD);
+    cspace->summary[word / BITS_PER_WORD] |= BIT(word % BITS_PER_WORD);
+}
+
 int cspace_single_level_create(struct allocman *alloc, cspace_single_level_t *cspace, struct cspace_single_level_config config)
 {
     size_t num_slots;
     size_t num_entries;
+    size_t num_summaries;
+    size_t i;
     int error;
     cspace->config = config;
     /* Allocate bitmap */
     num_slots = cspace->config.end_slot - cspace->config.first_slot;
     num_entries = num_slots / BITS_PER_WORD;
-    cspace->bitmap_length = num_entries;
     if (num_slots % BITS_PER_WORD != 0) {
         num_entries++;
     }
+    cspace->bitmap_length = num_entries;
     cspace->bitmap = (size_t*)allocman_mspace_alloc(alloc, num_entries * sizeof(size_t), &error);
     if (error) {
         return error;
     }
+    /* Allocate the summary of the bitmap */
+    num_summaries = num_entries / BITS_PER_WORD;
+    if (num_entries % BITS_PER_WORD != 0) {
+        num_summaries++;
+    }
+    cspace->summary_length = num_summaries;
+    cspace->summary = (size_t*)allocman_mspace_alloc(alloc, num_summaries * sizeof(size_t), &error);
+    if (error) {
+        allocman_mspace_free(alloc, cspace->bitmap, num_entries * sizeof(size_t));
+        return error;
+    }
     /* Make everything 1's */
     memset(cspace->bitmap, -1, num_entries * sizeof(size_t));
     if (num_slots % BITS_PER_WORD != 0) {
         /* Mark the padding slots as allocated */
         size_t excess = num_slots % BITS_PER_WORD;
-        size_t i;
         for (i = excess; i < BITS_PER_WORD; i++) {
             cspace->bitmap[num_entries - 1] ^= BIT(i);
         }
     }
+    memset(cspace->summary, 0, num_summaries * sizeof(size_t));
+    for (i = 0; i < num_entries; i++) {
+        if (cspace->bitmap[i] != 0) {
+            cspace->summary[i / BITS_PER_WORD] |= BIT(i % BITS_PER_WORD);
+        }
+    }
     cspace->last_entry = 0;
+    cspace->range_hint = 0;
     return 0;
 }
 
 void cspace_single_level_destroy(struct allocman *alloc, cspace_single_level_t *cspace)
 {
+    allocman_mspace_free(alloc, cspace->summary, cspace->summary_length * sizeof(size_t));
     allocman_mspace_free(alloc, cspace->bitmap, cspace->bitmap_length * sizeof(size_t));
 }
 
 int _cspace_single_level_alloc(allocman_t *alloc, void *_cspace, cspacepath_t *slot)
 {
     size_t i;
+    size_t s;
     size_t index;
     cspace_single_level_t *cspace = (cspace_single_level_t*)_cspace;
     i = cspace->last_entry;
     if (cspace->bitmap[i] == 0) {
         assert(cspace->bitmap_length != 0);
         assert(cspace->last_entry < cspace->bitmap_length);
-        do {
-            i = (i + 1) % cspace->bitmap_length;
-        } while (cspace->bitmap[i] == 0 && i != cspace->last_entry);
-        if (i == cspace->last_entry) {
+        /* use the summary to find the next bitmap word with a free slot */
+        s = i / BITS_PER_WORD;
+        for (index = 0; index < cspace->summary_length && cspace->summary[s] == 0; index++) {
+            s = (s + 1) % cspace->summary_length;
+        }
+        if (cspace->summary[s] == 0) {
             return 1;
         }
+        i = s * BITS_PER_WORD + (BITS_PER_WORD - 1 - CLZL(cspace->summary[s]));
         cspace->last_entry = i;
     }
     index = BITS_PER_WORD - 1 - CLZL(cspace->bitmap[i]);
-    cspace->bitmap[i] &= ~BIT(index);
+    _mark_allocated(cspace, i * BITS_PER_WORD + index);
     *slot = _cspace_single_level_make_path(cspace, cspace->config.first_slot + (i * BITS_PER_WORD + index));
     return 0;
 }
 
+/* Bits of word that start a run of num free slots lying entirely within the word, found by
+ * doubling the length of run checked at each step rather than looking at every bit */
+static inline size_t _runs_within_word(size_t word, size_t num)
+{
+    size_t runs = word;
+    size_t len = 1;
+    while (len < num && runs != 0) {
+        size_t step = MIN(len, num - len);
+        runs &= runs >> step;
+        len += step;
+    }
+    return runs;
+}
+
+int _cspace_single_level_alloc_range(allocman_t *alloc, void *_cspace, size_t num, cspacepath_t *slot)
+{
+    size_t n;
+    size_t run = 0;
+    size_t run_start = 0;
+    cspace_single_level_t *cspace = (cspace_single_level_t*)_cspace;
+    if (num == 0) {
+        return 1;
+    }
+    /* Look for a run of num free slots, starting from where the last one was found so that
+     * the full words before it are not looked at again. The first word is looked at again at
+     * the end, for runs that start in the word before it */
+    for (n = 0; n <= cspace->bitmap_length && run < num; n++) {
+        size_t i = (cspace->range_hint + n) % cspace->bitmap_length;
+        size_t word = cspace->bitmap[i];
+        if (i == 0) {
+            /* runs do not wrap around the end of the cnode */
+            run = 0;
+        }
+        if (word == 0) {
+            run = 0;
+            if (cspace->summary[i / BITS_PER_WORD] == 0) {
+                /* skip the rest of the words covered by this summary, they are all full */
+                n += BITS_PER_WORD - 1 - i % BITS_PER_WORD;
+            }
+            continue;
+        }
+        /* a run carried over from the previous words continues into the bottom of this one */
+        size_t low = word == (size_t)-1 ? BITS_PER_WORD : CTZL(~word);
+        if (run > 0 && run + low >= num) {
+            run = num;
+            break;
+        }
+        if (num <= BITS_PER_WORD) {
+            size_t runs = _runs_within_word(word, num);
+            if (runs != 0) {
+                run_start = i * BITS_PER_WORD + CTZL(runs);
+                run = num;
+                break;
+            }
+        }
+        if (word == (size_t)-1) {
+            if (run == 0) {
+                run_start = i * BITS_PER_WORD;
+            }
+            run += BITS_PER_WORD;
+            continue;
+        }
+        /* only the free slots at the top of the word can start a run into the next one */
+        run = CLZL(~word);
+        run_start = (i + 1) * BITS_PER_WORD - run;
+    }
+    if (run < num) {
+        return 1;
+    }
+    for (n = 0; n < num; n++) {
+        _mark_allocated(cspace, run_start + n);
+    }
+    cspace->range_hint = ((run_start + num) / BITS_PER_WORD) % cspace->bitmap_length;
+    *slot = _cspace_single_level_make_path(cspace, cspace->config.first_slot + run_start);
+    return 0;
+}
+
 int _cspace_single_level_alloc_at(allocman_t *alloc, void *_cspace, seL4_CPtr slot) {
     cspace_single_level_t *cspace = (cspace_single_level_t*)_cspace;
     size_t index = slot - cspace->config.first_slot;
@@ -89,7 +206,7 @@ int _cspace_single_level_alloc_at(allocman_t *alloc, void *_cspace, seL4_CPtr sl
         return 1;
     }
     /* mark it as allocated */
-    cspace->bitmap[index / BITS_PER_WORD] &= ~BIT(index % BITS_PER_WORD);
+    _mark_allocated(cspace, index);
     return 0;
 }
 
@@ -98,5 +215,5 @@ void _cspace_single_level_free(allocman_t *alloc, void *_cspace, const cspacepat
     cspace_single_level_t *cspace = (cspace_single_level_t*)_cspace;
     size_t index = slot->capPtr - cspace->config.first_slot;
     assert((cspace->bitmap[index / BITS_PER_WORD] & BIT(index % BITS_PER_WORD)) == 0);
-    cspace->bitmap[index / BITS_PER_WORD] |= BIT(index % BITS_PER_WORD);
+    _mark_free(cspace, index);
 }
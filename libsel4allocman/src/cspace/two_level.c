@@ -17,6 +17,41 @@
 #include <string.h>
 #include <utils/attribute.h>
 
+#define BITS_PER_WORD (sizeof(size_t) * 8)
+
+static inline void _update_free_level(cspace_two_level_t *cspace, size_t index)
+{
+    struct cspace_two_level_node *node = cspace->second_levels[index];
+    if (node && node->count < MASK(cspace->config.level_two_bits)) {
+        cspace->free_levels[index / BITS_PER_WORD] |= BIT(index % BITS_PER_WORD);
+    } else {
+        cspace->free_levels[index / BITS_PER_WORD] &= ~BIT(index % BITS_PER_WORD);
+    }
+}
+
+static inline void _add_count(cspace_two_level_t *cspace, size_t index, size_t num)
+{
+    if (cspace->second_levels[index]->count == 0) {
+        cspace->num_empty--;
+    }
+    cspace->second_levels[index]->count += num;
+    _update_free_level(cspace, index);
+}
+
+static int _find_free_level(cspace_two_level_t *cspace, size_t *index)
+{
+    size_t i;
+    size_t word = cspace->last_second_level / BITS_PER_WORD;
+    for (i = 0; i < cspace->free_levels_length; i++) {
+        if (cspace->free_levels[word] != 0) {
+            *index = word * BITS_PER_WORD + CTZL(cspace->free_levels[word]);
+            return 1;
+        }
+        word = (word + 1) % cspace->free_levels_length;
+    }
+    return 0;
+}
+
 cspacepath_t _cspace_two_level_make_path(void *_cspace, seL4_CPtr slot)
 {
     cspacepath_t l1_path, l2_path;
@@ -86,6 +121,8 @@ static int _create_second_level(allocman_t *alloc, cspace_two_level_t *cspace, s
         return error;
     }
     cspace->second_levels[index]->count = 0;
+    cspace->num_empty++;
+    _update_free_level(cspace, index);
     return 0;
 }
 
@@ -105,15 +142,27 @@ int cspace_two_level_create(allocman_t *alloc, cspace_two_level_t *cspace, struc
     if (error) {
         return error;
     }
+    cspace->free_levels_length = BIT(config.cnode_size_bits) / BITS_PER_WORD;
+    if (BIT(config.cnode_size_bits) % BITS_PER_WORD != 0) {
+        cspace->free_levels_length++;
+    }
+    cspace->free_levels = (size_t*)allocman_mspace_alloc(alloc, sizeof(size_t) * cspace->free_levels_length, &error);
+    if (error) {
+        allocman_mspace_free(alloc, cspace->second_levels, sizeof(struct cspace_two_level_node*) * BIT(config.cnode_size_bits));
+        return error;
+    }
     error = cspace_single_level_create(alloc, &cspace->first_level, single_config);
     if (error) {
+        allocman_mspace_free(alloc, cspace->free_levels, sizeof(size_t) * cspace->free_levels_length);
         allocman_mspace_free(alloc, cspace->second_levels, sizeof(struct cspace_two_level_node*) * BIT(config.cnode_size_bits));
         return error;
     }
     for (i = 0; i < BIT(config.cnode_size_bits); i++) {
         cspace->second_levels[i] = NULL;
     }
+    memset(cspace->free_levels, 0, sizeof(size_t) * cspace->free_levels_length);
     cspace->last_second_level = 0;
+    cspace->num_empty = 0;
     for (i = config.start_existing_index; i < config.end_existing_index; i++) {
         error = _cspace_single_level_alloc_at(alloc, &cspace->first_level, (seL4_CPtr) i);
         if (error) {
@@ -152,6 +201,8 @@ int _cspace_two_level_alloc_at(allocman_t *alloc, void *_cspace, seL4_CPtr slot)
         }
         error = _create_second_level(alloc, cspace, l1slot, 1);
         if (error) {
+            cspacepath_t path = _cspace_single_level_make_path(&cspace->first_level, l1slot);
+            _cspace_single_level_free(alloc, &cspace->first_level, &path);
             return error;
         }
     }
@@ -160,7 +211,7 @@ int _cspace_two_level_alloc_at(allocman_t *alloc, void *_cspace, seL4_CPtr slot)
     if (error) {
         return error;
     }
-    cspace->second_levels[l1slot]->count++;
+    _add_count(cspace, l1slot, 1);
     return 0;
 }
 
@@ -168,23 +219,10 @@ int _cspace_two_level_alloc(allocman_t *alloc, void *_cspace, cspacepath_t *slot
 {
     cspace_two_level_t *cspace = (cspace_two_level_t*)_cspace;
     size_t i;
-    int found;
-    int first;
     int error;
     cspacepath_t level2_slot;
-    /* Hunt for a slot */
-    i = cspace->last_second_level;
-    found = 0;
-    first = 1;
-    while (!found && (first || i != cspace->last_second_level)) {
-        first = 0;
-        if (cspace->second_levels[i] && cspace->second_levels[i]->count < MASK(cspace->config.level_two_bits)) {
-            found = 1;
-        } else {
-            i = (i + 1) % BIT(cspace->config.cnode_size_bits);
-        }
-    }
-    if (!found) {
+    /* Find a second level that still has space */
+    if (!_find_free_level(cspace, &i)) {
         /* ask the first level node for an empty slot */
         cspacepath_t l1slot;
         error = _cspace_single_level_alloc(alloc, &cspace->first_level, &l1slot);
@@ -193,8 +231,10 @@ int _cspace_two_level_alloc(allocman_t *alloc, void *_cspace, cspacepath_t *slot
             return error;
         }
         /* use this index */
-        error = _create_second_level(alloc, cspace, l1slot.offset, 1);
+        i = l1slot.offset;
+        error = _create_second_level(alloc, cspace, i, 1);
         if (error) {
+            _cspace_single_level_free(alloc, &cspace->first_level, &l1slot);
             return error;
         }
     }
@@ -205,7 +245,58 @@ int _cspace_two_level_alloc(allocman_t *alloc, void *_cspace, cspacepath_t *slot
         assert(!"cspace_single_level not behaving as expected");
         return error;
     }
-    cspace->second_levels[i]->count++;
+    _add_count(cspace, i, 1);
+    *slot = _cspace_two_level_make_path(cspace, (i << cspace->config.level_two_bits) | level2_slot.capPtr);
+    return 0;
+}
+
+int _cspace_two_level_alloc_range(allocman_t *alloc, void *_cspace, size_t num, cspacepath_t *slot)
+{
+    cspace_two_level_t *cspace = (cspace_two_level_t*)_cspace;
+    size_t i;
+    size_t n;
+    size_t bits;
+    int found = 0;
+    int error;
+    cspacepath_t level2_slot;
+    /* a range can never span multiple second level nodes */
+    if (num == 0 || num > MASK(cspace->config.level_two_bits)) {
+        return 1;
+    }
+    /* Hunt for a second level with a large enough run of free slots, starting from the one last
+     * allocated from as it is the most likely to have one */
+    for (n = 0; n < cspace->free_levels_length && !found; n++) {
+        size_t word = (cspace->last_second_level / BITS_PER_WORD + n) % cspace->free_levels_length;
+        for (bits = cspace->free_levels[word]; bits != 0 && !found; bits &= bits - 1) {
+            i = word * BITS_PER_WORD + CTZL(bits);
+            if (cspace->second_levels[i]->count + num <= MASK(cspace->config.level_two_bits)) {
+                error = _cspace_single_level_alloc_range(alloc, &cspace->second_levels[i]->second_level, num, &level2_slot);
+                found = !error;
+            }
+        }
+    }
+    if (!found) {
+        /* ask the first level node for an empty slot and create a new second level there */
+        cspacepath_t l1slot;
+        error = _cspace_single_level_alloc(alloc, &cspace->first_level, &l1slot);
+        if (error) {
+            return error;
+        }
+        i = l1slot.offset;
+        error = _create_second_level(alloc, cspace, i, 1);
+        if (error) {
+            _cspace_single_level_free(alloc, &cspace->first_level, &l1slot);
+            return error;
+        }
+        error = _cspace_single_level_alloc_range(alloc, &cspace->second_levels[i]->second_level, num, &level2_slot);
+        if (error) {
+            /* This just shouldn't be possible */
+            assert(!"cspace_single_level not behaving as expected");
+            return error;
+        }
+    }
+    _add_count(cspace, i, num);
+    cspace->last_second_level = i;
     *slot = _cspace_two_level_make_path(cspace, (i << cspace->config.level_two_bits) | level2_slot.capPtr);
     return 0;
 }
@@ -220,7 +311,12 @@ static void _destroy_second_level(allocman_t *alloc, cspace_two_level_t *cspace,
         assert(error == seL4_NoError);
         allocman_utspace_free(alloc, cspace->second_levels[index]->cookie, cspace->config.level_two_bits + seL4_SlotBits);
     }
+    if (cspace->second_levels[index]->count == 0) {
+        cspace->num_empty--;
+    }
     allocman_mspace_free(alloc, cspace->second_levels[index], sizeof(struct cspace_two_level_node));
+    cspace->second_levels[index] = NULL;
+    _update_free_level(cspace, index);
     path = _cspace_single_level_make_path(&cspace->first_level, index);
     _cspace_single_level_free(alloc, &cspace->first_level, &path);
 }
@@ -237,9 +333,13 @@ void _cspace_two_level_free(struct allocman *alloc, void *_cspace, const cspacep
     path = _cspace_single_level_make_path(&cspace->second_levels[l1slot]->second_level, l2slot);
     _cspace_single_level_free(alloc, &cspace->second_levels[l1slot]->second_level, &path);
     cspace->second_levels[l1slot]->count--;
+    _update_free_level(cspace, l1slot);
     if (cspace->second_levels[l1slot]->count == 0) {
-        _destroy_second_level(alloc, cspace, l1slot);
-        cspace->second_levels[l1slot] = NULL;
+        cspace->num_empty++;
+        /* Only tear down the cnode once we are holding on to too many empty ones */
+        if (cspace->num_empty > CSPACE_TWO_LEVEL_MAX_EMPTY) {
+            _destroy_second_level(alloc, cspace, l1slot);
+        }
     }
 }
 
@@ -251,6 +351,7 @@ void cspace_two_level_destroy(struct allocman *alloc, cspace_two_level_t *cspace
             _destroy_second_level(alloc, cspace, i);
         }
     }
+    allocman_mspace_free(alloc, cspace->free_levels, sizeof(size_t) * cspace->free_levels_length);
     allocman_mspace_free(alloc, cspace->second_levels, sizeof(struct cspace_two_level_node*) * BIT(cspace->config.cnode_size_bits));
     cspace_single_level_destroy(alloc, &cspace->first_level);
 }
@@ -0,0 +1,379 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <allocman/magazine.h>
+#include <allocman/allocman.h>
+#include <allocman/util.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sel4/sel4.h>
+#include <vka/object.h>
+#include <vka/capops.h>
+
+static inline void _lock(allocman_magazine_t *magazine)
+{
+    if (magazine->config.lock) {
+        magazine->config.lock(magazine->config.lock_cookie);
+    }
+}
+
+static inline void _unlock(allocman_magazine_t *magazine)
+{
+    if (magazine->config.unlock) {
+        magazine->config.unlock(magazine->config.lock_cookie);
+    }
+}
+
+static struct allocman_magazine_objects *_find_objects(allocman_magazine_t *magazine, seL4_Word type,
+                                                       seL4_Word size_bits)
+{
+    size_t i;
+    for (i = 0; i < magazine->config.num_types; i++) {
+        struct allocman_magazine_objects *objects = &magazine->objects[i];
+        if (objects->type.type == type && objects->type.size_bits == size_bits) {
+            return objects;
+        }
+    }
+    return NULL;
+}
+
+/* The following all expect the lock to already be held */
+
+static void _refill_slots(allocman_magazine_t *magazine)
+{
+    int error;
+    cspacepath_t path;
+    while (magazine->num_slots < ALLOCMAN_MAGAZINE_SLOTS / 2) {
+        error = allocman_cspace_alloc(magazine->config.alloc, &path);
+        if (error) {
+            return;
+        }
+        magazine->slots[magazine->num_slots] = path.capPtr;
+        magazine->num_slots++;
+    }
+}
+
+static void _drain_slots(allocman_magazine_t *magazine, size_t keep)
+{
+    cspacepath_t path;
+    while (magazine->num_slots > keep) {
+        magazine->num_slots--;
+        path = allocman_cspace_make_path(magazine->config.alloc, magazine->slots[magazine->num_slots]);
+        allocman_cspace_free(magazine->config.alloc, &path);
+    }
+}
+
+static void _refill_objects(allocman_magazine_t *magazine, struct allocman_magazine_objects *objects)
+{
+    int error;
+    allocman_t *alloc = magazine->config.alloc;
+    size_t num = ALLOCMAN_MAGAZINE_OBJECTS - objects->count;
+    if (num == 0) {
+        return;
+    }
+    if (objects->contiguous) {
+        error = allocman_utspace_alloc_batch(alloc, objects->alloc_size_bits, objects->type.type,
+                                             &objects->slots[objects->count], num, false,
+                                             &objects->cookies[objects->count]);
+        if (!error) {
+            objects->count += num;
+            return;
+        }
+    }
+    while (objects->count < ALLOCMAN_MAGAZINE_OBJECTS) {
+        objects->cookies[objects->count] = allocman_utspace_alloc(alloc, objects->alloc_size_bits, objects->type.type,
+                                                                  &objects->slots[objects->count], false, &error);
+        if (error) {
+            return;
+        }
+        objects->count++;
+    }
+}
+
+static void _drain_freed(allocman_magazine_t *magazine, struct allocman_magazine_objects *objects)
+{
+    while (objects->num_freed > 0) {
+        objects->num_freed--;
+        allocman_utspace_free(magazine->config.alloc, objects->freed[objects->num_freed], objects->alloc_size_bits);
+    }
+}
+
+static void _drain_objects(allocman_magazine_t *magazine, struct allocman_magazine_objects *objects)
+{
+    while (objects->count > 0) {
+        objects->count--;
+        vka_cnode_delete(&objects->slots[objects->count]);
+        allocman_utspace_free(magazine->config.alloc, objects->cookies[objects->count], objects->alloc_size_bits);
+    }
+}
+
+int allocman_magazine_create(allocman_magazine_t *magazine, struct allocman_magazine_config config)
+{
+    size_t i;
+    size_t j;
+    int error = 0;
+    cspacepath_t range;
+    if (config.num_types > ALLOCMAN_MAGAZINE_MAX_TYPES) {
+        ZF_LOGE("Too many object types for magazine");
+        return 1;
+    }
+    memset(magazine, 0, sizeof(*magazine));
+    magazine->config = config;
+    _lock(magazine);
+    for (i = 0; i < config.num_types && !error; i++) {
+        struct allocman_magazine_objects *objects = &magazine->objects[i];
+        objects->type = config.types[i];
+        objects->alloc_size_bits = vka_get_object_size(objects->type.type, objects->type.size_bits);
+        /* Prefer a contiguous range so we can refill with a single batch */
+        if (allocman_cspace_alloc_range(config.alloc, ALLOCMAN_MAGAZINE_OBJECTS, &range) == 0) {
+            for (j = 0; j < ALLOCMAN_MAGAZINE_OBJECTS; j++) {
+                objects->slots[j] = cspacepath_offset(&range, j);
+            }
+            objects->contiguous = 1;
+            continue;
+        }
+        for (j = 0; j < ALLOCMAN_MAGAZINE_OBJECTS; j++) {
+            error = allocman_cspace_alloc(config.alloc, &objects->slots[j]);
+            if (error) {
+                break;
+            }
+        }
+        if (error) {
+            /* release the slots we did get for this type */
+            while (j > 0) {
+                j--;
+                allocman_cspace_free(config.alloc, &objects->slots[j]);
+            }
+        }
+    }
+    if (error) {
+        /* i - 1 is the type that failed, and has already been cleaned up */
+        i--;
+        while (i > 0) {
+            i--;
+            for (j = 0; j < ALLOCMAN_MAGAZINE_OBJECTS; j++) {
+                allocman_cspace_free(config.alloc, &magazine->objects[i].slots[j]);
+            }
+        }
+    }
+    _unlock(magazine);
+    return error;
+}
+
+void allocman_magazine_flush(allocman_magazine_t *magazine)
+{
+    size_t i;
+    _lock(magazine);
+    _drain_slots(magazine, 0);
+    for (i = 0; i < magazine->config.num_types; i++) {
+        _drain_objects(magazine, &magazine->objects[i]);
+        _drain_freed(magazine, &magazine->objects[i]);
+    }
+    _unlock(magazine);
+}
+
+void allocman_magazine_destroy(allocman_magazine_t *magazine)
+{
+    size_t i;
+    size_t j;
+    allocman_magazine_flush(magazine);
+    _lock(magazine);
+    for (i = 0; i < magazine->config.num_types; i++) {
+        for (j = 0; j < ALLOCMAN_MAGAZINE_OBJECTS; j++) {
+            allocman_cspace_free(magazine->config.alloc, &magazine->objects[i].slots[j]);
+        }
+    }
+    _unlock(magazine);
+}
+
+static int mag_vka_cspace_alloc(void *data, seL4_CPtr *res)
+{
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    assert(data);
+    assert(res);
+    if (magazine->num_slots == 0) {
+        _lock(magazine);
+        _refill_slots(magazine);
+        _unlock(magazine);
+        if (magazine->num_slots == 0) {
+            return 1;
+        }
+    }
+    magazine->num_slots--;
+    *res = magazine->slots[magazine->num_slots];
+    return 0;
+}
+
+static int mag_vka_cspace_alloc_range(void *data, size_t num, seL4_CPtr *res)
+{
+    int error;
+    cspacepath_t path;
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    assert(data);
+    assert(res);
+    /* cached slots are not contiguous, so ranges always come from the allocman */
+    _lock(magazine);
+    error = allocman_cspace_alloc_range(magazine->config.alloc, num, &path);
+    _unlock(magazine);
+    if (!error) {
+        *res = path.capPtr;
+    }
+    return error;
+}
+
+static void mag_vka_cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res)
+{
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    assert(data);
+    assert(res);
+    /* the cspace may read state that other threads change whilst refilling, such as the
+     * second levels of a two level cspace */
+    _lock(magazine);
+    *res = allocman_cspace_make_path(magazine->config.alloc, slot);
+    _unlock(magazine);
+}
+
+static void mag_vka_cspace_free(void *data, seL4_CPtr slot)
+{
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    assert(data);
+    if (magazine->num_slots == ALLOCMAN_MAGAZINE_SLOTS) {
+        _lock(magazine);
+        _drain_slots(magazine, ALLOCMAN_MAGAZINE_SLOTS / 2);
+        _unlock(magazine);
+    }
+    /* the path is only made when the slot is given back, under the lock */
+    magazine->slots[magazine->num_slots] = slot;
+    magazine->num_slots++;
+}
+
+static int mag_vka_utspace_alloc_maybe_device(void *data, const cspacepath_t *dest, seL4_Word type,
+                                              seL4_Word size_bits, bool can_use_dev, seL4_Word *res)
+{
+    int error;
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    struct allocman_magazine_objects *objects;
+    assert(data);
+    assert(res);
+    assert(dest);
+    objects = _find_objects(magazine, type, size_bits);
+    if (objects) {
+        if (objects->count == 0) {
+            _lock(magazine);
+            _refill_objects(magazine, objects);
+            _unlock(magazine);
+        }
+        if (objects->count > 0) {
+            error = vka_cnode_move(dest, &objects->slots[objects->count - 1]);
+            if (error != seL4_NoError) {
+                ZF_LOGE("Failed to move object out of magazine");
+                return error;
+            }
+            objects->count--;
+            *res = objects->cookies[objects->count];
+            return 0;
+        }
+    }
+    /* not cached, or we could not refill, try the allocman directly */
+    _lock(magazine);
+    *res = allocman_utspace_alloc(magazine->config.alloc, vka_get_object_size(type, size_bits), type, dest,
+                                  can_use_dev, &error);
+    _unlock(magazine);
+    return error;
+}
+
+static int mag_vka_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                 seL4_Word *res)
+{
+    return mag_vka_utspace_alloc_maybe_device(data, dest, type, size_bits, false, res);
+}
+
+static int mag_vka_utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                    uintptr_t paddr, seL4_Word *res)
+{
+    int error;
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    assert(data);
+    assert(res);
+    assert(dest);
+    _lock(magazine);
+    *res = allocman_utspace_alloc_at(magazine->config.alloc, vka_get_object_size(type, size_bits), type, dest, paddr,
+                                     true, &error);
+    _unlock(magazine);
+    return error;
+}
+
+static int mag_vka_utspace_alloc_batch(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                       size_t num, bool can_use_dev, seL4_Word *res)
+{
+    int error;
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    assert(data);
+    assert(res);
+    assert(dest);
+    _lock(magazine);
+    error = allocman_utspace_alloc_batch(magazine->config.alloc, vka_get_object_size(type, size_bits), type, dest,
+                                         num, can_use_dev, res);
+    _unlock(magazine);
+    return error;
+}
+
+static void mag_vka_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
+{
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    struct allocman_magazine_objects *objects;
+    assert(data);
+    objects = _find_objects(magazine, type, size_bits);
+    if (objects) {
+        if (objects->num_freed == ALLOCMAN_MAGAZINE_OBJECTS) {
+            _lock(magazine);
+            _drain_freed(magazine, objects);
+            _unlock(magazine);
+        }
+        objects->freed[objects->num_freed] = target;
+        objects->num_freed++;
+        return;
+    }
+    _lock(magazine);
+    allocman_utspace_free(magazine->config.alloc, target, vka_get_object_size(type, size_bits));
+    _unlock(magazine);
+}
+
+static uintptr_t mag_vka_utspace_paddr(void *data, seL4_Word target, seL4_Word type, seL4_Word size_bits)
+{
+    uintptr_t paddr;
+    allocman_magazine_t *magazine = (allocman_magazine_t*)data;
+    assert(data);
+    _lock(magazine);
+    paddr = allocman_utspace_paddr(magazine->config.alloc, target, vka_get_object_size(type, size_bits));
+    _unlock(magazine);
+    return paddr;
+}
+
+void allocman_magazine_make_vka(vka_t *vka, allocman_magazine_t *magazine)
+{
+    assert(vka);
+    assert(magazine);
+
+    vka->data = magazine;
+    vka->cspace_alloc = &mag_vka_cspace_alloc;
+    vka->cspace_make_path = &mag_vka_cspace_make_path;
+    vka->utspace_alloc = &mag_vka_utspace_alloc;
+    vka->utspace_alloc_maybe_device = &mag_vka_utspace_alloc_maybe_device;
+    vka->utspace_alloc_at = &mag_vka_utspace_alloc_at;
+    vka->cspace_free = &mag_vka_cspace_free;
+    vka->utspace_free = &mag_vka_utspace_free;
+    vka->utspace_paddr = &mag_vka_utspace_paddr;
+    vka->utspace_alloc_batch = &mag_vka_utspace_alloc_batch;
+    vka->cspace_alloc_range = &mag_vka_cspace_alloc_range;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <allocman/mspace/slab.h>
+#include <allocman/allocman.h>
+#include <allocman/util.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static inline size_t _size_class(size_t bytes)
+{
+    if (bytes == 0) {
+        return 0;
+    }
+    return (bytes - 1) / MSPACE_SLAB_GRANULE;
+}
+
+static inline size_t _class_size(size_t size_class)
+{
+    return (size_class + 1) * MSPACE_SLAB_GRANULE;
+}
+
+static int _refill_class(struct allocman *alloc, mspace_slab_t *slab, size_t size_class)
+{
+    int error;
+    size_t i;
+    size_t object_size = _class_size(size_class);
+    size_t chunk_size = MAX(slab->chunk_size, object_size);
+    uintptr_t chunk = (uintptr_t)slab->backing.alloc(alloc, slab->backing.mspace, chunk_size, &error);
+    if (error) {
+        ZF_LOGV("Failed to allocate chunk of size %zu", chunk_size);
+        return error;
+    }
+    for (i = 0; i + object_size <= chunk_size; i += object_size) {
+        struct mspace_slab_object *object = (struct mspace_slab_object*)(chunk + i);
+        object->next = slab->free_lists[size_class];
+        slab->free_lists[size_class] = object;
+    }
+    return 0;
+}
+
+void mspace_slab_create(mspace_slab_t *slab, struct mspace_slab_config config)
+{
+    size_t i;
+    slab->backing = config.backing;
+    slab->chunk_size = config.chunk_size ? config.chunk_size : MSPACE_SLAB_DEFAULT_CHUNK_SIZE;
+    for (i = 0; i < MSPACE_SLAB_NUM_CLASSES; i++) {
+        slab->free_lists[i] = NULL;
+    }
+}
+
+void *_mspace_slab_alloc(struct allocman *alloc, void *_slab, size_t bytes, int *error)
+{
+    struct mspace_slab_object *object;
+    size_t size_class;
+    mspace_slab_t *slab = (mspace_slab_t*)_slab;
+    if (bytes > MSPACE_SLAB_MAX_SIZE) {
+        return slab->backing.alloc(alloc, slab->backing.mspace, bytes, error);
+    }
+    size_class = _size_class(bytes);
+    if (!slab->free_lists[size_class]) {
+        int _error = _refill_class(alloc, slab, size_class);
+        if (_error) {
+            SET_ERROR(error, _error);
+            return NULL;
+        }
+    }
+    object = slab->free_lists[size_class];
+    slab->free_lists[size_class] = object->next;
+    SET_ERROR(error, 0);
+    return object;
+}
+
+void _mspace_slab_free(struct allocman *alloc, void *_slab, void *ptr, size_t bytes)
+{
+    struct mspace_slab_object *object = (struct mspace_slab_object*)ptr;
+    size_t size_class;
+    mspace_slab_t *slab = (mspace_slab_t*)_slab;
+    if (bytes > MSPACE_SLAB_MAX_SIZE) {
+        slab->backing.free(alloc, slab->backing.mspace, ptr, bytes);
+        return;
+    }
+    size_class = _size_class(bytes);
+    object->next = slab->free_lists[size_class];
+    slab->free_lists[size_class] = object;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <allocman/mspace/trace.h>
+#include <allocman/allocman.h>
+#include <allocman/util.h>
+#include <stdlib.h>
+
+void mspace_trace_create(mspace_trace_t *mspace, struct mspace_interface underlying, vka_trace_t *trace)
+{
+    *mspace = (mspace_trace_t) {
+        .underlying = underlying,
+        .trace = trace
+    };
+}
+
+void *_mspace_trace_alloc(allocman_t *alloc, void *_mspace, size_t bytes, int *error)
+{
+    mspace_trace_t *mspace = (mspace_trace_t*)_mspace;
+    int _error;
+    void *ret = mspace->underlying.alloc(alloc, mspace->underlying.mspace, bytes, &_error);
+    vka_trace_add(mspace->trace, (vka_trace_record_t) {
+        .op = VKA_TRACE_MSPACE_ALLOC,
+        .result = _error,
+        .cookie = (seL4_Word)ret,
+        .bytes = bytes
+    });
+    SET_ERROR(error, _error);
+    return ret;
+}
+
+void _mspace_trace_free(allocman_t *alloc, void *_mspace, void *ptr, size_t bytes)
+{
+    mspace_trace_t *mspace = (mspace_trace_t*)_mspace;
+    vka_trace_add(mspace->trace, (vka_trace_record_t) {
+        .op = VKA_TRACE_MSPACE_FREE,
+        .cookie = (seL4_Word)ptr,
+        .bytes = bytes
+    });
+    mspace->underlying.free(alloc, mspace->underlying.mspace, ptr, bytes);
+}
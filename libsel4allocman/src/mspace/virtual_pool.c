@@ -17,29 +17,20 @@
 #include <sel4/sel4.h>
 #include <sel4utils/mapping.h>
 #include <vka/kobject_t.h>
+#include <vka/capops.h>
 #include <vspace/mapping.h>
 #include <string.h>
 
 /* This allocator deliberately does not use the vspace library to manage mappings to prevent
  * circular dependencies between the vspace library and the allocator */
 
-static int _add_page(allocman_t *alloc, seL4_CPtr pd, void *vaddr)
+/* Maximum number of frames to allocate and map in a single batch */
+#define MAX_FRAME_BATCH 16
+
+static int _map_frame(allocman_t *alloc, seL4_CPtr pd, seL4_CPtr frame, void *vaddr)
 {
-    cspacepath_t frame_path;
-    seL4_Word frame_cookie;
     int error;
-    error = allocman_cspace_alloc(alloc, &frame_path);
-    if (error) {
-        ZF_LOGV("Failed to allocate slot");
-        return error;
-    }
-    frame_cookie = allocman_utspace_alloc(alloc, seL4_PageBits, seL4_ARCH_4KPage, &frame_path, true, &error);
-    if (error) {
-        allocman_cspace_free(alloc, &frame_path);
-        ZF_LOGV("Failed to allocate frame");
-        return error;
-    }
-    while ((error = seL4_ARCH_Page_Map(frame_path.capPtr, pd, (seL4_Word) vaddr, seL4_AllRights,
+    while ((error = seL4_ARCH_Page_Map(frame, pd, (seL4_Word) vaddr, seL4_AllRights,
                     seL4_ARCH_Default_VMAttributes)) == seL4_FailedLookup) {
         cspacepath_t path;
         error = allocman_cspace_alloc(alloc, &path);
@@ -65,19 +56,107 @@ static int _add_page(allocman_t *alloc, seL4_CPtr pd, void *vaddr)
             break;
         }
     }
-    if (error != seL4_NoError) {
-        allocman_cspace_free(alloc, &frame_path);
-        allocman_utspace_free(alloc, frame_cookie, seL4_PageBits);
-        return error;
+    return error;
+}
+
+/* Allocates num frames of size_bits as a single batch and maps them contiguously from vaddr.
+ * Returns how many frames were mapped, which may be less than num if we ran out of resources
+ * part way through */
+static size_t _add_frames(allocman_t *alloc, seL4_CPtr pd, void *vaddr, size_t size_bits, seL4_Word type,
+                          size_t num)
+{
+    cspacepath_t slots;
+    cspacepath_t frame;
+    seL4_Word cookies[MAX_FRAME_BATCH];
+    int need_zero = 0;
+    size_t mapped;
+    size_t i;
+    int error;
+    assert(num > 0 && num <= MAX_FRAME_BATCH);
+    if (num == 1) {
+        error = allocman_cspace_alloc(alloc, &slots);
+    } else {
+        error = allocman_cspace_alloc_range(alloc, num, &slots);
+    }
+    if (error) {
+        ZF_LOGV("Failed to allocate %zu slots", num);
+        return 0;
+    }
+    /* Prefer kernel memory as the kernel zeroes it for us on retype */
+    error = allocman_utspace_alloc_batch(alloc, size_bits, type, &slots, num, false, cookies);
+    if (error) {
+        error = allocman_utspace_alloc_batch(alloc, size_bits, type, &slots, num, true, cookies);
+        /* we may have been allocated from a device range */
+        need_zero = 1;
+    }
+    if (error) {
+        for (i = 0; i < num; i++) {
+            frame = cspacepath_offset(&slots, i);
+            allocman_cspace_free(alloc, &frame);
+        }
+        ZF_LOGV("Failed to allocate %zu frames", num);
+        return 0;
+    }
+    for (mapped = 0; mapped < num; mapped++) {
+        frame = cspacepath_offset(&slots, mapped);
+        error = _map_frame(alloc, pd, frame.capPtr, vaddr + mapped * BIT(size_bits));
+        if (error != seL4_NoError) {
+            break;
+        }
+    }
+    /* give back anything we could not map */
+    for (i = mapped; i < num; i++) {
+        frame = cspacepath_offset(&slots, i);
+        vka_cnode_delete(&frame);
+        allocman_utspace_free(alloc, cookies[i], size_bits);
+        allocman_cspace_free(alloc, &frame);
+    }
+    if (need_zero) {
+        memset(vaddr, 0, mapped * BIT(size_bits));
+    }
+    return mapped;
+}
+
+/* Grows the pool by at least needed bytes, returns how many bytes were actually added */
+static size_t _grow(mspace_virtual_pool_t *virtual_pool, size_t needed)
+{
+    allocman_t *alloc = virtual_pool->morecore_alloc;
+    uintptr_t top = (uintptr_t)virtual_pool->pool_top;
+    size_t limit = ROUND_UP((uintptr_t)virtual_pool->pool_limit - top, PAGE_SIZE_4K);
+    size_t size = MIN(ROUND_UP(MAX(needed, virtual_pool->grow_size), PAGE_SIZE_4K), limit);
+    size_t added = 0;
+    size_t pages;
+    /* try and use a single large page if it would fit */
+    if (size >= BIT(seL4_LargePageBits) && IS_ALIGNED(top, seL4_LargePageBits)) {
+        if (_add_frames(alloc, virtual_pool->pd, (void*)top, seL4_LargePageBits, seL4_ARCH_LargePageObject, 1) == 1) {
+            return BIT(seL4_LargePageBits);
+        }
+    }
+    while (added < size) {
+        pages = MIN((size - added) / PAGE_SIZE_4K, MAX_FRAME_BATCH);
+        if (pages == 0) {
+            break;
+        }
+        pages = _add_frames(alloc, virtual_pool->pd, (void*)(top + added), seL4_PageBits, seL4_ARCH_4KPage, pages);
+        if (pages == 0) {
+            break;
+        }
+        added += pages * PAGE_SIZE_4K;
+    }
+    /* if bulk growth could not get everything we needed fall back to a page at a time */
+    while (added < needed) {
+        if (_add_frames(alloc, virtual_pool->pd, (void*)(top + added), seL4_PageBits, seL4_ARCH_4KPage, 1) == 0) {
+            break;
+        }
+        added += PAGE_SIZE_4K;
     }
-    /* zero the memory in case we were allocated from a device range */
-    memset(vaddr, 0, PAGE_SIZE_4K);
-    return 0;
+    return added;
 }
 
 static k_r_malloc_header_t *_morecore(size_t cookie, mspace_k_r_malloc_t *k_r_malloc, size_t new_units)
 {
     size_t new_size;
+    size_t added;
     k_r_malloc_header_t *new_header;
     mspace_virtual_pool_t *virtual_pool = (mspace_virtual_pool_t*)cookie;
     new_size = new_units * sizeof(k_r_malloc_header_t);
@@ -86,14 +165,13 @@ static k_r_malloc_header_t *_morecore(size_t cookie, mspace_k_r_malloc_t *k_r_ma
         ZF_LOGV("morecore out of virtual pool");
         return NULL;
     }
-    while (virtual_pool->pool_ptr + new_size > virtual_pool->pool_top) {
-        int error;
-        error = _add_page(virtual_pool->morecore_alloc, virtual_pool->pd, virtual_pool->pool_top);
-        if (error) {
+    if (virtual_pool->pool_ptr + new_size > virtual_pool->pool_top) {
+        added = _grow(virtual_pool, virtual_pool->pool_ptr + new_size - virtual_pool->pool_top);
+        virtual_pool->pool_top += added;
+        if (virtual_pool->pool_ptr + new_size > virtual_pool->pool_top) {
             ZF_LOGV("morecore failed to add page");
             return NULL;
         }
-        virtual_pool->pool_top += PAGE_SIZE_4K;
     }
     new_header = (k_r_malloc_header_t*)virtual_pool->pool_ptr;
     virtual_pool->pool_ptr += new_size;
@@ -107,6 +185,7 @@ void mspace_virtual_pool_create(mspace_virtual_pool_t *virtual_pool, struct mspa
     virtual_pool->pool_limit = config.vstart + config.size;
     virtual_pool->morecore_alloc = NULL;
     virtual_pool->pd = config.pd;
+    virtual_pool->grow_size = config.grow_size;
     mspace_k_r_malloc_init(&virtual_pool->k_r_malloc, (size_t)virtual_pool, _morecore);
 }
 
@@ -19,6 +19,134 @@
 #include <vka/capops.h>
 #include <string.h>
 
+/* Cookies for objects allocated as part of a batch point to a utspace_split_batch_object
+ * instead of a node, and are distinguished by having their bottom bit set */
+#define SPLIT_BATCH_COOKIE_TAG 1ul
+
+/* Largest batch, in bits, that will be created with a single retype. This bounds the size
+ * of the batch book keeping we need to allocate in one go */
+#define SPLIT_MAX_BATCH_BITS 8
+
+static inline int _tree_height(struct utspace_split_node *node)
+{
+    return node ? node->tree_height : 0;
+}
+
+static inline void _tree_update_height(struct utspace_split_node *node)
+{
+    node->tree_height = MAX(_tree_height(node->tree_left), _tree_height(node->tree_right)) + 1;
+}
+
+static struct utspace_split_node *_tree_rotate_right(struct utspace_split_node *node)
+{
+    struct utspace_split_node *left = node->tree_left;
+    node->tree_left = left->tree_right;
+    left->tree_right = node;
+    _tree_update_height(node);
+    _tree_update_height(left);
+    return left;
+}
+
+static struct utspace_split_node *_tree_rotate_left(struct utspace_split_node *node)
+{
+    struct utspace_split_node *right = node->tree_right;
+    node->tree_right = right->tree_left;
+    right->tree_left = node;
+    _tree_update_height(node);
+    _tree_update_height(right);
+    return right;
+}
+
+/* Restores the AVL invariant for a subtree whose children are already balanced */
+static struct utspace_split_node *_tree_balance(struct utspace_split_node *node)
+{
+    int balance;
+    _tree_update_height(node);
+    balance = _tree_height(node->tree_left) - _tree_height(node->tree_right);
+    if (balance > 1) {
+        if (_tree_height(node->tree_left->tree_left) < _tree_height(node->tree_left->tree_right)) {
+            node->tree_left = _tree_rotate_left(node->tree_left);
+        }
+        return _tree_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (_tree_height(node->tree_right->tree_right) < _tree_height(node->tree_right->tree_left)) {
+            node->tree_right = _tree_rotate_right(node->tree_right);
+        }
+        return _tree_rotate_left(node);
+    }
+    return node;
+}
+
+static struct utspace_split_node *_tree_insert(struct utspace_split_node *root, struct utspace_split_node *node)
+{
+    if (!root) {
+        node->tree_left = node->tree_right = NULL;
+        node->tree_height = 1;
+        return node;
+    }
+    /* free nodes never overlap, so no two nodes in a tree can have the same address */
+    assert(node->paddr != root->paddr);
+    if (node->paddr < root->paddr) {
+        root->tree_left = _tree_insert(root->tree_left, node);
+    } else {
+        root->tree_right = _tree_insert(root->tree_right, node);
+    }
+    return _tree_balance(root);
+}
+
+static struct utspace_split_node *_tree_remove_min(struct utspace_split_node *root, struct utspace_split_node **min)
+{
+    if (!root->tree_left) {
+        *min = root;
+        return root->tree_right;
+    }
+    root->tree_left = _tree_remove_min(root->tree_left, min);
+    return _tree_balance(root);
+}
+
+static struct utspace_split_node *_tree_remove(struct utspace_split_node *root, struct utspace_split_node *node)
+{
+    struct utspace_split_node *min;
+    /* node must be in the tree */
+    assert(root);
+    if (node->paddr < root->paddr) {
+        root->tree_left = _tree_remove(root->tree_left, node);
+        return _tree_balance(root);
+    }
+    if (node->paddr > root->paddr) {
+        root->tree_right = _tree_remove(root->tree_right, node);
+        return _tree_balance(root);
+    }
+    assert(root == node);
+    if (!node->tree_right) {
+        return node->tree_left;
+    }
+    node->tree_right = _tree_remove_min(node->tree_right, &min);
+    min->tree_left = node->tree_left;
+    min->tree_right = node->tree_right;
+    return _tree_balance(min);
+}
+
+/* Find the free node that contains the range [paddr, paddr + BIT(size_bits)) */
+static struct utspace_split_node *_tree_find(struct utspace_split_node *root, uintptr_t paddr, size_t size_bits)
+{
+    struct utspace_split_node *best = NULL;
+    /* find the node with the greatest address that is not above paddr */
+    while (root) {
+        if (root->paddr <= paddr) {
+            best = root;
+            root = root->tree_right;
+        } else {
+            root = root->tree_left;
+        }
+    }
+    if (best && paddr + BIT(size_bits) <= best->paddr + BIT(best->size_bits)) {
+        return best;
+    }
+    return NULL;
+}
+
 static void _remove_node(struct utspace_split_node **head, struct utspace_split_node *node)
 {
     if (node->prev) {
@@ -30,6 +158,9 @@ static void _remove_node(struct utspace_split_node **head, struct utspace_split_
     if (node->next) {
         node->next->prev = node->prev;
     }
+    if (node->paddr != ALLOCMAN_NO_PADDR) {
+        *node->paddr_tree = _tree_remove(*node->paddr_tree, node);
+    }
     node->head = head;
 }
 
@@ -41,6 +172,9 @@ static void _insert_node(struct utspace_split_node **head, struct utspace_split_
         (*head)->prev = node;
     }
     *head = node;
+    if (node->paddr != ALLOCMAN_NO_PADDR) {
+        *node->paddr_tree = _tree_insert(*node->paddr_tree, node);
+    }
     /* mark node as not allocated */
     node->head = NULL;
 }
@@ -63,6 +197,53 @@ static struct utspace_split_node *_new_node(allocman_t *alloc)
     return node;
 }
 
+/* Allocate a pair of nodes to split a parent into. Where possible their slots are adjacent so
+ * that both children can be created with a single retype */
+static int _new_node_pair(allocman_t *alloc, struct utspace_split_node **left, struct utspace_split_node **right)
+{
+    int error;
+    cspacepath_t range;
+    if (allocman_cspace_alloc_range(alloc, 2, &range) != 0) {
+        /* no ranges available, fall back to individual slots */
+        *left = _new_node(alloc);
+        if (!*left) {
+            return 1;
+        }
+        *right = _new_node(alloc);
+        if (!*right) {
+            allocman_cspace_free(alloc, &(*left)->ut);
+            allocman_mspace_free(alloc, *left, sizeof(**left));
+            return 1;
+        }
+        return 0;
+    }
+    *left = (struct utspace_split_node *) allocman_mspace_alloc(alloc, sizeof(**left), &error);
+    if (error) {
+        ZF_LOGV("Failed to allocate node of size %zu", sizeof(**left));
+        goto free_range;
+    }
+    *right = (struct utspace_split_node *) allocman_mspace_alloc(alloc, sizeof(**right), &error);
+    if (error) {
+        ZF_LOGV("Failed to allocate node of size %zu", sizeof(**right));
+        allocman_mspace_free(alloc, *left, sizeof(**left));
+        goto free_range;
+    }
+    (*left)->ut = cspacepath_offset(&range, 0);
+    (*right)->ut = cspacepath_offset(&range, 1);
+    return 0;
+free_range:
+    allocman_cspace_free(alloc, &range);
+    range = cspacepath_offset(&range, 1);
+    allocman_cspace_free(alloc, &range);
+    return 1;
+}
+
+static inline int _nodes_adjacent(struct utspace_split_node *left, struct utspace_split_node *right)
+{
+    return left->ut.root == right->ut.root && left->ut.dest == right->ut.dest &&
+           left->ut.destDepth == right->ut.destDepth && left->ut.offset + 1 == right->ut.offset;
+}
+
 static void _delete_node(allocman_t *alloc, struct utspace_split_node *node)
 {
     vka_cnode_delete(&node->ut);
@@ -70,7 +251,8 @@ static void _delete_node(allocman_t *alloc, struct utspace_split_node *node)
     allocman_mspace_free(alloc, node, sizeof(*node));
 }
 
-static int _insert_new_node(allocman_t *alloc, struct utspace_split_node **head, cspacepath_t ut, uintptr_t paddr)
+static int _insert_new_node(allocman_t *alloc, struct utspace_split_node **head, struct utspace_split_node **tree,
+                            cspacepath_t ut, size_t size_bits, uintptr_t paddr)
 {
     int error;
     struct utspace_split_node *node;
@@ -82,6 +264,8 @@ static int _insert_new_node(allocman_t *alloc, struct utspace_split_node **head,
     node->parent = NULL;
     node->ut = ut;
     node->paddr = paddr;
+    node->size_bits = size_bits;
+    node->paddr_tree = tree;
     node->origin_head = head;
     _insert_node(head, node);
     return 0;
@@ -95,6 +279,21 @@ void utspace_split_create(utspace_split_t *split)
         split->dev_heads[i] = NULL;
         split->dev_mem_heads[i] = NULL;
     }
+    split->paddr_tree = NULL;
+    split->dev_paddr_tree = NULL;
+    split->dev_mem_paddr_tree = NULL;
+}
+
+static struct utspace_split_node **_paddr_tree_for_heads(utspace_split_t *split, struct utspace_split_node **heads)
+{
+    if (heads == split->dev_heads) {
+        return &split->dev_paddr_tree;
+    }
+    if (heads == split->dev_mem_heads) {
+        return &split->dev_mem_paddr_tree;
+    }
+    assert(heads == split->heads);
+    return &split->paddr_tree;
 }
 
 int _utspace_split_add_uts(allocman_t *alloc, void *_split, size_t num, const cspacepath_t *uts, size_t *size_bits,
@@ -104,6 +303,7 @@ int _utspace_split_add_uts(allocman_t *alloc, void *_split, size_t num, const cs
     int error;
     size_t i;
     struct utspace_split_node **list;
+    struct utspace_split_node **tree;
     switch (utType) {
     case ALLOCMAN_UT_KERNEL:
         list = split->heads;
@@ -117,8 +317,10 @@ int _utspace_split_add_uts(allocman_t *alloc, void *_split, size_t num, const cs
     default:
         return -1;
     }
+    tree = _paddr_tree_for_heads(split, list);
     for (i = 0; i < num; i++) {
-        error = _insert_new_node(alloc, &list[size_bits[i]], uts[i], paddr ? paddr[i] : ALLOCMAN_NO_PADDR);
+        error = _insert_new_node(alloc, &list[size_bits[i]], tree, uts[i], size_bits[i],
+                                 paddr ? paddr[i] : ALLOCMAN_NO_PADDR);
         if (error) {
             return error;
         }
@@ -139,13 +341,9 @@ static int _refill_pool(allocman_t *alloc, utspace_split_t *split, struct utspac
         }
     } else {
         /* see if the pool has the paddr we want */
-        for (node = heads[size_bits]; node; node = node->next) {
-            if (node->paddr == ALLOCMAN_NO_PADDR) {
-                continue;
-            }
-            if (node->paddr <= paddr && paddr < node->paddr + BIT(size_bits)) {
-                return 0;
-            }
+        node = _tree_find(*_paddr_tree_for_heads(split, heads), paddr, 0);
+        if (node && node->size_bits == size_bits) {
+            return 0;
         }
     }
     /* ensure we are not the highest pool */
@@ -164,43 +362,48 @@ static int _refill_pool(allocman_t *alloc, utspace_split_t *split, struct utspac
         /* use the first node for lack of a better one */
         node = heads[size_bits + 1];
     } else {
-        for (node = heads[size_bits + 1]; node && (node->paddr == ALLOCMAN_NO_PADDR || !(node->paddr <= paddr
-                                                                                         && paddr < node->paddr + BIT(size_bits + 1))); node = node->next);
+        node = _tree_find(*_paddr_tree_for_heads(split, heads), paddr, 0);
         /* _refill_pool should not have returned if this wasn't possible */
-        assert(node);
+        assert(node && node->size_bits == size_bits + 1);
     }
     /* allocate two new nodes */
-    left = _new_node(alloc);
-    if (!left) {
-        ZF_LOGV("Failed to allocate left node");
-        return 1;
-    }
-    right = _new_node(alloc);
-    if (!right) {
-        ZF_LOGV("Failed to allocate right node");
-        _delete_node(alloc, left);
-        return 1;
-    }
-    /* perform the first retype */
-    sel4_error = seL4_Untyped_Retype(node->ut.capPtr, seL4_UntypedObject, size_bits, left->ut.root, left->ut.dest,
-                                     left->ut.destDepth, left->ut.offset, 1);
-    if (sel4_error != seL4_NoError) {
-        _delete_node(alloc, left);
-        _delete_node(alloc, right);
-        /* Well this shouldn't happen */
-        ZF_LOGE("Failed to retype untyped, error %d\n", sel4_error);
+    if (_new_node_pair(alloc, &left, &right)) {
+        ZF_LOGV("Failed to allocate nodes");
         return 1;
     }
-    /* perform the second retype */
-    sel4_error = seL4_Untyped_Retype(node->ut.capPtr, seL4_UntypedObject, size_bits, right->ut.root, right->ut.dest,
-                                     right->ut.destDepth, right->ut.offset, 1);
-    if (sel4_error != seL4_NoError) {
-        vka_cnode_delete(&left->ut);
-        _delete_node(alloc, left);
-        _delete_node(alloc, right);
-        /* Well this shouldn't happen */
-        ZF_LOGE("Failed to retype untyped, error %d\n", sel4_error);
-        return 1;
+    if (_nodes_adjacent(left, right)) {
+        /* create both children in one go */
+        sel4_error = seL4_Untyped_Retype(node->ut.capPtr, seL4_UntypedObject, size_bits, left->ut.root, left->ut.dest,
+                                         left->ut.destDepth, left->ut.offset, 2);
+        if (sel4_error != seL4_NoError) {
+            _delete_node(alloc, left);
+            _delete_node(alloc, right);
+            /* Well this shouldn't happen */
+            ZF_LOGE("Failed to retype untyped, error %d\n", sel4_error);
+            return 1;
+        }
+    } else {
+        /* perform the first retype */
+        sel4_error = seL4_Untyped_Retype(node->ut.capPtr, seL4_UntypedObject, size_bits, left->ut.root, left->ut.dest,
+                                         left->ut.destDepth, left->ut.offset, 1);
+        if (sel4_error != seL4_NoError) {
+            _delete_node(alloc, left);
+            _delete_node(alloc, right);
+            /* Well this shouldn't happen */
+            ZF_LOGE("Failed to retype untyped, error %d\n", sel4_error);
+            return 1;
+        }
+        /* perform the second retype */
+        sel4_error = seL4_Untyped_Retype(node->ut.capPtr, seL4_UntypedObject, size_bits, right->ut.root, right->ut.dest,
+                                         right->ut.destDepth, right->ut.offset, 1);
+        if (sel4_error != seL4_NoError) {
+            vka_cnode_delete(&left->ut);
+            _delete_node(alloc, left);
+            _delete_node(alloc, right);
+            /* Well this shouldn't happen */
+            ZF_LOGE("Failed to retype untyped, error %d\n", sel4_error);
+            return 1;
+        }
     }
     /* all is done. remove the parent and insert the children */
     _remove_node(&heads[size_bits + 1], node);
@@ -208,6 +411,8 @@ static int _refill_pool(allocman_t *alloc, utspace_split_t *split, struct utspac
     left->sibling = right;
     left->origin_head = &heads[size_bits];
     right->origin_head = &heads[size_bits];
+    left->size_bits = right->size_bits = size_bits;
+    left->paddr_tree = right->paddr_tree = node->paddr_tree;
     right->sibling = left;
     if (node->paddr != ALLOCMAN_NO_PADDR) {
         left->paddr = node->paddr;
@@ -222,25 +427,38 @@ static int _refill_pool(allocman_t *alloc, utspace_split_t *split, struct utspac
     return 0;
 }
 
-static struct utspace_split_node **find_head_for_paddr(struct utspace_split_node **head, uintptr_t paddr,
+static struct utspace_split_node **find_head_for_paddr(struct utspace_split_node **head,
+                                                       struct utspace_split_node *tree, uintptr_t paddr,
                                                        size_t size_bits)
 {
-    int i;
-    for (i = 0; i < CONFIG_WORD_SIZE; i++) {
-        struct utspace_split_node *node;
-        for (node = head[i]; node; node = node->next) {
-            if (node->paddr == ALLOCMAN_NO_PADDR) {
-                /* skip nodes with no physical address */
-                continue;
-            }
-            if (node->paddr <= paddr && paddr + BIT(size_bits) <= node->paddr + BIT(i)) {
-                return head;
-            }
-        }
+    if (_tree_find(tree, paddr, size_bits)) {
+        return head;
     }
     return NULL;
 }
 
+/* Ensure there is a node of size_bits available in one of the pools that can be used when
+ * no particular physical address is wanted, and return that pool */
+static struct utspace_split_node **_refill_any_pool(allocman_t *alloc, utspace_split_t *split, size_t size_bits,
+                                                    bool canBeDev)
+{
+    /* if we can use device memory then preference allocating from there */
+    if (canBeDev) {
+        if (_refill_pool(alloc, split, split->dev_mem_heads, size_bits, ALLOCMAN_NO_PADDR)) {
+            /* out of memory? Try fall through */
+            ZF_LOGV("Failed to refill device memory pool to allocate object of size %zu", size_bits);
+            ZF_LOGV("Trying regular untyped pool");
+        } else {
+            return split->dev_mem_heads;
+        }
+    }
+    if (_refill_pool(alloc, split, split->heads, size_bits, ALLOCMAN_NO_PADDR)) {
+        ZF_LOGV("Failed to refill pool to allocate object of size %zu", size_bits);
+        return NULL;
+    }
+    return split->heads;
+}
+
 seL4_Word _utspace_split_alloc(allocman_t *alloc, void *_split, size_t size_bits, seL4_Word type,
                                const cspacepath_t *slot, uintptr_t paddr, bool canBeDev, int *error)
 {
@@ -255,17 +473,17 @@ seL4_Word _utspace_split_alloc(allocman_t *alloc, void *_split, size_t size_bits
         return 0;
     }
     struct utspace_split_node **head = NULL;
-    /* if we're allocating at a particular paddr then we will just trawl through every pool
-     * and see if we can find out which one has what we want */
+    /* if we're allocating at a particular paddr then look up which pool has a free
+     * untyped covering what we want */
     if (paddr != ALLOCMAN_NO_PADDR) {
         if (canBeDev) {
-            head = find_head_for_paddr(split->dev_heads, paddr, size_bits);
+            head = find_head_for_paddr(split->dev_heads, split->dev_paddr_tree, paddr, size_bits);
             if (!head) {
-                head = find_head_for_paddr(split->dev_mem_heads, paddr, size_bits);
+                head = find_head_for_paddr(split->dev_mem_heads, split->dev_mem_paddr_tree, paddr, size_bits);
             }
         }
         if (!head) {
-            head = find_head_for_paddr(split->heads, paddr, size_bits);
+            head = find_head_for_paddr(split->heads, split->paddr_tree, paddr, size_bits);
         }
         if (!head) {
             SET_ERROR(error, 1);
@@ -278,32 +496,18 @@ seL4_Word _utspace_split_alloc(allocman_t *alloc, void *_split, size_t size_bits
             ZF_LOGV("Failed to refill pool to allocate object of size %zu", size_bits);
             return 0;
         }
-        /* search for the node we want to use. We have the advantage of knowing that
+        /* find the node we want to use. We have the advantage of knowing that
          * due to objects being size aligned that the base paddr of the untyped will
          * be exactly the paddr we want */
-        for (node = head[size_bits]; node && (node->paddr == ALLOCMAN_NO_PADDR || node->paddr != paddr); node = node->next);
+        node = _tree_find(*_paddr_tree_for_heads(split, head), paddr, size_bits);
         /* _refill_pool should not have returned if this wasn't possible */
-        assert(node);
+        assert(node && node->paddr == paddr && node->size_bits == size_bits);
     } else {
-        /* if we can use device memory then preference allocating from there */
-        if (canBeDev) {
-            if (_refill_pool(alloc, split, split->dev_mem_heads, size_bits, ALLOCMAN_NO_PADDR)) {
-                /* out of memory? Try fall through */
-                ZF_LOGV("Failed to refill device memory pool to allocate object of size %zu", size_bits);
-                ZF_LOGV("Trying regular untyped pool");
-            } else {
-                head = split->dev_mem_heads;
-            }
-
-        }
+        head = _refill_any_pool(alloc, split, size_bits, canBeDev);
         if (!head) {
-            head = split->heads;
-            if (_refill_pool(alloc, split, head, size_bits, ALLOCMAN_NO_PADDR)) {
-                /* out of memory? */
-                SET_ERROR(error, 1);
-                ZF_LOGV("Failed to refill pool to allocate object of size %zu", size_bits);
-                return 0;
-            }
+            /* out of memory? */
+            SET_ERROR(error, 1);
+            return 0;
         }
         /* use the first node for lack of a better one */
         node = head[size_bits];
@@ -324,11 +528,120 @@ seL4_Word _utspace_split_alloc(allocman_t *alloc, void *_split, size_t size_bits
     return (seL4_Word)node;
 }
 
+/* Retype an entire node of size size_bits + batch_bits into BIT(batch_bits) objects with a single
+ * retype. The node stays allocated until every object in the batch has been freed */
+static int _alloc_batch_node(allocman_t *alloc, utspace_split_t *split, size_t size_bits, size_t batch_bits,
+                             seL4_Word type, const cspacepath_t *slots, bool canBeDev, seL4_Word *cookies)
+{
+    struct utspace_split_node **head;
+    struct utspace_split_node *node;
+    struct utspace_split_batch_object *batch;
+    size_t num = BIT(batch_bits);
+    size_t i;
+    int error;
+    int sel4_error;
+    head = _refill_any_pool(alloc, split, size_bits + batch_bits, canBeDev);
+    if (!head) {
+        return 1;
+    }
+    node = head[size_bits + batch_bits];
+    batch = (struct utspace_split_batch_object *) allocman_mspace_alloc(alloc, sizeof(*batch) * num, &error);
+    if (error) {
+        ZF_LOGV("Failed to allocate batch of size %zu", sizeof(*batch) * num);
+        return 1;
+    }
+    /* cookies for batch objects are tagged, so they must be at least word aligned */
+    assert(((uintptr_t)batch & SPLIT_BATCH_COOKIE_TAG) == 0);
+    sel4_error = seL4_Untyped_Retype(node->ut.capPtr, type, get_sel4_object_size(type, size_bits), slots->root,
+                                     slots->dest, slots->destDepth, slots->offset, num);
+    if (sel4_error != seL4_NoError) {
+        allocman_mspace_free(alloc, batch, sizeof(*batch) * num);
+        ZF_LOGE("Failed to retype untyped, error %d\n", sel4_error);
+        return 1;
+    }
+    _remove_node(&head[size_bits + batch_bits], node);
+    node->batch = batch;
+    node->batch_live = num;
+    for (i = 0; i < num; i++) {
+        batch[i].parent = node;
+        batch[i].index = i;
+        cookies[i] = (seL4_Word)&batch[i] | SPLIT_BATCH_COOKIE_TAG;
+    }
+    return 0;
+}
+
+int _utspace_split_alloc_batch(allocman_t *alloc, void *_split, size_t size_bits, seL4_Word type,
+                               const cspacepath_t *slots, size_t num, bool canBeDev, seL4_Word *cookies)
+{
+    utspace_split_t *split = (utspace_split_t *)_split;
+    size_t sel4_size_bits;
+    size_t done = 0;
+    int error;
+    sel4_size_bits = get_sel4_object_size(type, size_bits);
+    if (size_bits != vka_get_object_size(type, sel4_size_bits) || size_bits == 0) {
+        return 1;
+    }
+    /* Break the batch up into power of two sized pieces, largest first, so that each
+     * piece exactly consumes a single node and no memory is wasted */
+    while (done < num) {
+        size_t batch_bits = MIN(LOG_BASE_2(num - done), SPLIT_MAX_BATCH_BITS);
+        cspacepath_t slots_start = cspacepath_offset(slots, done);
+        while (batch_bits > 0 && size_bits + batch_bits >= sizeof(seL4_Word) * 8 - 2) {
+            batch_bits--;
+        }
+        /* If there is no untyped large enough for this piece, try smaller pieces */
+        error = 1;
+        while (batch_bits > 0 && error) {
+            error = _alloc_batch_node(alloc, split, size_bits, batch_bits, type, &slots_start, canBeDev, cookies + done);
+            if (error) {
+                batch_bits--;
+            }
+        }
+        if (error) {
+            cookies[done] = _utspace_split_alloc(alloc, split, size_bits, type, &slots_start, ALLOCMAN_NO_PADDR,
+                                                 canBeDev, &error);
+        }
+        if (error) {
+            /* release everything we have allocated so far */
+            while (done > 0) {
+                done--;
+                slots_start = cspacepath_offset(slots, done);
+                vka_cnode_delete(&slots_start);
+                _utspace_split_free(alloc, split, cookies[done], size_bits);
+            }
+            return 1;
+        }
+        done += BIT(batch_bits);
+    }
+    return 0;
+}
+
+static void _free_batch_object(allocman_t *alloc, utspace_split_t *split, struct utspace_split_batch_object *object,
+                               size_t size_bits)
+{
+    struct utspace_split_node *node = object->parent;
+    assert(node->batch_live > 0);
+    node->batch_live--;
+    if (node->batch_live == 0) {
+        /* every object has been deleted so the whole node can be used again */
+        allocman_mspace_free(alloc, node->batch, sizeof(*node->batch) * BIT(node->size_bits - size_bits));
+        node->batch = NULL;
+        _utspace_split_free(alloc, split, (seL4_Word)node, node->size_bits);
+    }
+}
+
 void _utspace_split_free(allocman_t *alloc, void *_split, seL4_Word cookie, size_t size_bits)
 {
     utspace_split_t *split = (utspace_split_t *)_split;
-    struct utspace_split_node *node = (struct utspace_split_node *)cookie;
-    struct utspace_split_node *parent = node->parent;
+    struct utspace_split_node *node;
+    struct utspace_split_node *parent;
+    if (cookie & SPLIT_BATCH_COOKIE_TAG) {
+        _free_batch_object(alloc, split, (struct utspace_split_batch_object *)(cookie & ~SPLIT_BATCH_COOKIE_TAG),
+                           size_bits);
+        return;
+    }
+    node = (struct utspace_split_node *)cookie;
+    parent = node->parent;
     /* see if our sibling is also free */
     if (parent && !node->sibling->head) {
         /* remove sibling from free list */
@@ -346,6 +659,16 @@ void _utspace_split_free(allocman_t *alloc, void *_split, seL4_Word cookie, size
 
 uintptr_t _utspace_split_paddr(void *_split, seL4_Word cookie, size_t size_bits)
 {
-    struct utspace_split_node *node = (struct utspace_split_node *)cookie;
+    struct utspace_split_node *node;
+    if (cookie & SPLIT_BATCH_COOKIE_TAG) {
+        struct utspace_split_batch_object *object;
+        object = (struct utspace_split_batch_object *)(cookie & ~SPLIT_BATCH_COOKIE_TAG);
+        node = object->parent;
+        if (node->paddr == ALLOCMAN_NO_PADDR) {
+            return ALLOCMAN_NO_PADDR;
+        }
+        return node->paddr + object->index * BIT(size_bits);
+    }
+    node = (struct utspace_split_node *)cookie;
     return node->paddr;
 }
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+/* Configuration of the host build of allocman. The replay tool behaves like an x86_64
+ * kernel without MCS or any of the optional object types */
+#define CONFIG_WORD_SIZE 64
+#define CONFIG_ARCH_X86 1
+#define CONFIG_ARCH_X86_64 1
+#define CONFIG_X86_64 1
+#define CONFIG_MAX_NUM_NODES 1
+#define CONFIG_LIB_SEL4_VKA 1
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+#pragma once
+
+#include <sel4/types.h>
+
+/* Kernel operations that allocman uses, implemented by the mock kernel of the replay tool.
+ * Only a single CNode exists, which is also the root of the cspace, and every CNode cap
+ * refers to it */
+
+seL4_Error seL4_Untyped_Retype(seL4_Untyped service, seL4_Word type, seL4_Word size_bits, seL4_CNode root,
+                               seL4_Word node_index, seL4_Word node_depth, seL4_Word node_offset,
+                               seL4_Word num_objects);
+
+seL4_Error seL4_CNode_Copy(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                           seL4_Word src_index, seL4_Uint8 src_depth, seL4_CapRights_t rights);
+seL4_Error seL4_CNode_Mint(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                           seL4_Word src_index, seL4_Uint8 src_depth, seL4_CapRights_t rights, seL4_Word badge);
+seL4_Error seL4_CNode_Move(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                           seL4_Word src_index, seL4_Uint8 src_depth);
+seL4_Error seL4_CNode_Mutate(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                             seL4_Word src_index, seL4_Uint8 src_depth, seL4_Word badge);
+seL4_Error seL4_CNode_Rotate(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_Word dest_badge,
+                             seL4_CNode pivot_root, seL4_Word pivot_index, seL4_Uint8 pivot_depth,
+                             seL4_Word pivot_badge, seL4_CNode src_root, seL4_Word src_index, seL4_Uint8 src_depth);
+seL4_Error seL4_CNode_Delete(seL4_CNode service, seL4_Word index, seL4_Uint8 depth);
+seL4_Error seL4_CNode_Revoke(seL4_CNode service, seL4_Word index, seL4_Uint8 depth);
+seL4_Error seL4_CNode_SaveCaller(seL4_CNode service, seL4_Word index, seL4_Uint8 depth);
+seL4_Error seL4_CNode_CancelBadgedSends(seL4_CNode service, seL4_Word index, seL4_Uint8 depth);
+
+/* Asynchronous refill is never configured by the replay tool */
+void seL4_Signal(seL4_CPtr dest);
+void seL4_Wait(seL4_CPtr src, seL4_Word *sender);
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* The parts of the x86_64 libsel4 types that allocman and vka use */
+
+typedef unsigned long seL4_Word;
+typedef uint8_t seL4_Uint8;
+typedef uint32_t seL4_Uint32;
+typedef uint64_t seL4_Uint64;
+typedef seL4_Word seL4_CPtr;
+typedef seL4_CPtr seL4_CNode;
+typedef seL4_CPtr seL4_Untyped;
+typedef seL4_CPtr seL4_TCB;
+
+typedef enum {
+    seL4_NoError = 0,
+    seL4_InvalidArgument,
+    seL4_InvalidCapability,
+    seL4_IllegalOperation,
+    seL4_RangeError,
+    seL4_AlignmentError,
+    seL4_FailedLookup,
+    seL4_TruncatedMessage,
+    seL4_DeleteFirst,
+    seL4_RevokeFirst,
+    seL4_NotEnoughMemory,
+    seL4_NumErrors
+} seL4_Error;
+
+typedef enum {
+    seL4_UntypedObject,
+    seL4_TCBObject,
+    seL4_EndpointObject,
+    seL4_NotificationObject,
+    seL4_CapTableObject,
+    seL4_NonArchObjectTypeCount,
+    seL4_X86_PDPTObject = seL4_NonArchObjectTypeCount,
+    seL4_X64_PML4Object,
+    seL4_X64_HugePageObject,
+    seL4_X86_4K,
+    seL4_X86_LargePageObject,
+    seL4_X86_PageTableObject,
+    seL4_X86_PageDirectoryObject,
+    seL4_X86_IOPageTableObject,
+    seL4_ObjectTypeCount
+} seL4_ObjectType;
+
+#define seL4_WordBits 64
+#define seL4_WordSizeBits 3
+#define seL4_SlotBits 5
+#define seL4_TCBBits 11
+#define seL4_EndpointBits 4
+#define seL4_NotificationBits 5
+#define seL4_PageBits 12
+#define seL4_LargePageBits 21
+#define seL4_HugePageBits 30
+#define seL4_PageTableBits 12
+#define seL4_PageDirBits 12
+#define seL4_PDPTBits 12
+#define seL4_PML4Bits 12
+#define seL4_IOPageTableBits 12
+#define seL4_MinUntypedBits 4
+#define seL4_MaxUntypedBits 47
+
+#define seL4_CapNull 0
+#define seL4_CapInitThreadTCB 1
+#define seL4_CapInitThreadCNode 2
+
+typedef struct seL4_CapRights {
+    seL4_Word words[1];
+} seL4_CapRights_t;
+
+static inline seL4_CapRights_t seL4_CapRights_new(seL4_Word capAllowGrantReply, seL4_Word capAllowGrant,
+                                                  seL4_Word capAllowRead, seL4_Word capAllowWrite)
+{
+    return (seL4_CapRights_t) {
+        {(capAllowGrantReply << 3) | (capAllowGrant << 2) | (capAllowRead << 1) | capAllowWrite}
+    };
+}
+
+#define seL4_AllRights seL4_CapRights_new(1, 1, 1, 1)
+#define seL4_NoRights seL4_CapRights_new(0, 0, 0, 0)
+
+typedef struct seL4_SlotRegion {
+    seL4_Word start;
+    seL4_Word end;
+} seL4_SlotRegion;
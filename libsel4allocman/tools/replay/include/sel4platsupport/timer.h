@@ -0,0 +1,33 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sel4/types.h>
+
+/* Just enough of a timer for allocman_add_untypeds_from_timer_objects to build */
+typedef struct timer_obj {
+    struct {
+        seL4_CPtr cptr;
+        size_t size_bits;
+    } obj;
+    struct {
+        uintptr_t base_addr;
+    } region;
+} timer_obj_t;
+
+typedef struct timer_objects {
+    size_t nobjs;
+    timer_obj_t *objs;
+} timer_objects_t;
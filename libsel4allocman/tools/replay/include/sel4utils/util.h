@@ -0,0 +1,19 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+/* allocman only uses the generic helpers and logging from here, which come from libutils.
+ * The rest of sel4utils needs a real kernel */
+#include <assert.h>
+#include <stdint.h>
+#include <utils/util.h>
@@ -0,0 +1,16 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#define CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_SLOTS_SZ 0
+#define CONFIG_LIB_SEL4_VKA_DEBUG_LIVE_OBJS_SZ 0
@@ -0,0 +1,500 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utils/util.h>
+#include "mock_kernel.h"
+
+#define NO_OBJECT SIZE_MAX
+
+typedef struct mock_object {
+    uint64_t id;
+    seL4_Word type;
+    uintptr_t paddr;
+    size_t size_bits;
+    bool device;
+    /* untyped this was retyped from, or NO_OBJECT */
+    size_t parent;
+    /* caps to this object, and objects retyped from it that still exist */
+    size_t refs;
+    size_t children;
+    /* offset of the first free byte, untypeds only */
+    size_t watermark;
+    /* next free record when this one is not in use */
+    size_t next_free;
+} mock_object_t;
+
+static struct {
+    size_t size_bits;
+    /* object referred to by each slot of the CNode */
+    size_t *slots;
+    mock_object_t *objects;
+    size_t num_objects;
+    size_t max_objects;
+    size_t free_objects;
+    uint64_t next_id;
+    size_t total_bytes;
+    size_t used_bytes;
+    size_t used_high_water;
+    size_t retypes;
+} mock;
+
+static size_t new_object(seL4_Word type, uintptr_t paddr, size_t size_bits, bool device, size_t parent)
+{
+    size_t index = mock.free_objects;
+    if (index != NO_OBJECT) {
+        mock.free_objects = mock.objects[index].next_free;
+    } else {
+        if (mock.num_objects == mock.max_objects) {
+            size_t max = mock.max_objects ? mock.max_objects * 2 : 1024;
+            mock_object_t *objects = realloc(mock.objects, max * sizeof(*objects));
+            if (objects == NULL) {
+                return NO_OBJECT;
+            }
+            mock.objects = objects;
+            mock.max_objects = max;
+        }
+        index = mock.num_objects++;
+    }
+    mock.objects[index] = (mock_object_t) {
+        .id = ++mock.next_id,
+        .type = type,
+        .paddr = paddr,
+        .size_bits = size_bits,
+        .device = device,
+        .parent = parent,
+    };
+    if (parent != NO_OBJECT) {
+        mock.objects[parent].children++;
+    }
+    if (type != seL4_UntypedObject) {
+        mock.used_bytes += BIT(size_bits);
+        mock.used_high_water = MAX(mock.used_high_water, mock.used_bytes);
+    }
+    return index;
+}
+
+/* Release the record of an object once nothing refers to it, and then its parent */
+static void put_object(size_t index)
+{
+    while (index != NO_OBJECT) {
+        mock_object_t *object = &mock.objects[index];
+        if (object->refs > 0 || object->children > 0) {
+            return;
+        }
+        if (object->type != seL4_UntypedObject) {
+            mock.used_bytes -= BIT(object->size_bits);
+        }
+        size_t parent = object->parent;
+        if (parent != NO_OBJECT) {
+            mock.objects[parent].children--;
+        }
+        object->id = 0;
+        object->next_free = mock.free_objects;
+        mock.free_objects = index;
+        index = parent;
+    }
+}
+
+static seL4_Error lookup(seL4_Word index, size_t *slot)
+{
+    if (index >= BIT(mock.size_bits)) {
+        return seL4_FailedLookup;
+    }
+    *slot = index;
+    return seL4_NoError;
+}
+
+static seL4_Error lookup_cnode(seL4_CNode cnode)
+{
+    size_t slot;
+    if (lookup(cnode, &slot) != seL4_NoError || mock.slots[slot] == NO_OBJECT
+        || mock.objects[mock.slots[slot]].type != seL4_CapTableObject) {
+        return seL4_InvalidCapability;
+    }
+    return seL4_NoError;
+}
+
+static seL4_Error lookup_empty(seL4_CNode cnode, seL4_Word index, size_t *slot)
+{
+    seL4_Error error = lookup_cnode(cnode);
+    if (error == seL4_NoError) {
+        error = lookup(index, slot);
+    }
+    if (error == seL4_NoError && mock.slots[*slot] != NO_OBJECT) {
+        error = seL4_DeleteFirst;
+    }
+    return error;
+}
+
+static seL4_Error lookup_full(seL4_CNode cnode, seL4_Word index, size_t *slot)
+{
+    seL4_Error error = lookup_cnode(cnode);
+    if (error == seL4_NoError) {
+        error = lookup(index, slot);
+    }
+    if (error == seL4_NoError && mock.slots[*slot] == NO_OBJECT) {
+        error = seL4_FailedLookup;
+    }
+    return error;
+}
+
+static void delete_slot(size_t slot)
+{
+    size_t index = mock.slots[slot];
+    if (index != NO_OBJECT) {
+        mock.slots[slot] = NO_OBJECT;
+        mock.objects[index].refs--;
+        put_object(index);
+    }
+}
+
+/* Size in memory of an object, or 0 for types that cannot be created */
+static size_t object_size_bits(seL4_Word type, seL4_Word size_bits)
+{
+    switch (type) {
+    case seL4_UntypedObject:
+        return size_bits >= seL4_MinUntypedBits && size_bits <= seL4_MaxUntypedBits ? size_bits : 0;
+    case seL4_TCBObject:
+        return seL4_TCBBits;
+    case seL4_EndpointObject:
+        return seL4_EndpointBits;
+    case seL4_NotificationObject:
+        return seL4_NotificationBits;
+    case seL4_CapTableObject:
+        return size_bits + seL4_SlotBits;
+    case seL4_X86_4K:
+        return seL4_PageBits;
+    case seL4_X86_LargePageObject:
+        return seL4_LargePageBits;
+    case seL4_X64_HugePageObject:
+        return seL4_HugePageBits;
+    case seL4_X86_PageTableObject:
+        return seL4_PageTableBits;
+    case seL4_X86_PageDirectoryObject:
+        return seL4_PageDirBits;
+    case seL4_X86_PDPTObject:
+        return seL4_PDPTBits;
+    case seL4_X64_PML4Object:
+        return seL4_PML4Bits;
+    case seL4_X86_IOPageTableObject:
+        return seL4_IOPageTableBits;
+    default:
+        return 0;
+    }
+}
+
+static bool is_frame(seL4_Word type)
+{
+    return type == seL4_X86_4K || type == seL4_X86_LargePageObject || type == seL4_X64_HugePageObject;
+}
+
+int mock_kernel_init(size_t size_bits)
+{
+    free(mock.slots);
+    free(mock.objects);
+    memset(&mock, 0, sizeof(mock));
+    mock.free_objects = NO_OBJECT;
+    mock.size_bits = size_bits;
+    mock.slots = malloc(BIT(size_bits) * sizeof(*mock.slots));
+    if (mock.slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < BIT(size_bits); i++) {
+        mock.slots[i] = NO_OBJECT;
+    }
+
+    /* the CNode itself is not part of any untyped, so is not counted as used memory */
+    size_t cnode = new_object(seL4_UntypedObject, 0, 0, false, NO_OBJECT);
+    if (cnode == NO_OBJECT) {
+        return -1;
+    }
+    mock.objects[cnode].type = seL4_CapTableObject;
+    mock.objects[cnode].size_bits = size_bits + seL4_SlotBits;
+    mock.objects[cnode].refs = 1;
+    mock.slots[seL4_CapInitThreadCNode] = cnode;
+    return 0;
+}
+
+int mock_kernel_add_untyped(seL4_CPtr slot, uintptr_t paddr, size_t size_bits, bool device)
+{
+    size_t index;
+    if (lookup(slot, &index) != seL4_NoError || mock.slots[index] != NO_OBJECT) {
+        return -1;
+    }
+    size_t object = new_object(seL4_UntypedObject, paddr, size_bits, device, NO_OBJECT);
+    if (object == NO_OBJECT) {
+        return -1;
+    }
+    mock.objects[object].refs = 1;
+    mock.slots[index] = object;
+    mock.total_bytes += BIT(size_bits);
+    return 0;
+}
+
+uint64_t mock_kernel_object_id(seL4_CPtr slot)
+{
+    size_t index;
+    if (lookup(slot, &index) != seL4_NoError || mock.slots[index] == NO_OBJECT) {
+        return 0;
+    }
+    return mock.objects[mock.slots[index]].id;
+}
+
+typedef struct range {
+    uintptr_t start;
+    uintptr_t end;
+} range_t;
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const range_t *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Largest naturally aligned block in [start, end) */
+static size_t largest_block(uintptr_t start, uintptr_t end)
+{
+    for (int bits = seL4_MaxUntypedBits; bits >= seL4_MinUntypedBits; bits--) {
+        uintptr_t aligned = ROUND_UP(start, BIT(bits));
+        if (aligned >= start && aligned + BIT(bits) <= end) {
+            return BIT(bits);
+        }
+    }
+    return 0;
+}
+
+void mock_kernel_usage(mock_kernel_usage_t *usage)
+{
+    *usage = (mock_kernel_usage_t) {
+        .total_bytes = mock.total_bytes,
+        .used_bytes = mock.used_bytes,
+        .used_high_water = mock.used_high_water,
+        .retypes = mock.retypes,
+    };
+
+    /* every untyped given to the mock and every object in them, ordered by address. Objects
+     * never overlap, and every untyped covers all the objects within it */
+    size_t num_used = 0, num_roots = 0;
+    range_t *used = malloc(mock.num_objects * sizeof(*used));
+    range_t *roots = malloc(mock.num_objects * sizeof(*roots));
+    if (used == NULL || roots == NULL) {
+        free(used);
+        free(roots);
+        return;
+    }
+    for (size_t i = 0; i < mock.num_objects; i++) {
+        mock_object_t *object = &mock.objects[i];
+        if (object->id == 0 || (object->type == seL4_CapTableObject && object->parent == NO_OBJECT)) {
+            continue;
+        }
+        range_t range = { object->paddr, object->paddr + BIT(object->size_bits) };
+        if (object->type != seL4_UntypedObject) {
+            used[num_used++] = range;
+        } else if (object->parent == NO_OBJECT) {
+            roots[num_roots++] = range;
+        }
+    }
+    qsort(used, num_used, sizeof(*used), compare_ranges);
+    qsort(roots, num_roots, sizeof(*roots), compare_ranges);
+
+    size_t u = 0;
+    for (size_t r = 0; r < num_roots; r++) {
+        uintptr_t free_start = roots[r].start;
+        for (; u < num_used && used[u].start < roots[r].end; u++) {
+            usage->largest_free = MAX(usage->largest_free, largest_block(free_start, used[u].start));
+            free_start = used[u].end;
+        }
+        usage->largest_free = MAX(usage->largest_free, largest_block(free_start, roots[r].end));
+    }
+    free(used);
+    free(roots);
+}
+
+seL4_Error seL4_Untyped_Retype(seL4_Untyped service, seL4_Word type, seL4_Word size_bits, seL4_CNode root,
+                               seL4_Word node_index, seL4_Word node_depth, seL4_Word node_offset,
+                               seL4_Word num_objects)
+{
+    size_t ut_slot;
+    seL4_Error error = lookup_full(seL4_CapInitThreadCNode, service, &ut_slot);
+    if (error != seL4_NoError) {
+        return error;
+    }
+    size_t ut = mock.slots[ut_slot];
+    if (mock.objects[ut].type != seL4_UntypedObject) {
+        return seL4_InvalidCapability;
+    }
+    size_t bits = object_size_bits(type, size_bits);
+    if (bits == 0 || num_objects == 0) {
+        return seL4_InvalidArgument;
+    }
+    if (mock.objects[ut].device && type != seL4_UntypedObject && !is_frame(type)) {
+        return seL4_InvalidArgument;
+    }
+    /* every CNode cap refers to the one CNode, so the destination is always root */
+    error = lookup_cnode(node_depth == 0 ? root : node_index);
+    if (error != seL4_NoError) {
+        return error;
+    }
+    if (node_offset + num_objects > BIT(mock.size_bits)) {
+        return seL4_RangeError;
+    }
+    for (size_t i = 0; i < num_objects; i++) {
+        if (mock.slots[node_offset + i] != NO_OBJECT) {
+            return seL4_DeleteFirst;
+        }
+    }
+
+    /* an untyped without children is reset, as the kernel does */
+    mock_object_t *untyped = &mock.objects[ut];
+    if (untyped->children == 0) {
+        untyped->watermark = 0;
+    }
+    uintptr_t start = ROUND_UP(untyped->paddr + untyped->watermark, BIT(bits));
+    if (bits > untyped->size_bits
+        || start + num_objects * BIT(bits) > untyped->paddr + BIT(untyped->size_bits)) {
+        return seL4_NotEnoughMemory;
+    }
+    bool device = untyped->device;
+    for (size_t i = 0; i < num_objects; i++) {
+        size_t object = new_object(type, start + i * BIT(bits), bits, device, ut);
+        if (object == NO_OBJECT) {
+            return seL4_NotEnoughMemory;
+        }
+        mock.objects[object].refs = 1;
+        mock.slots[node_offset + i] = object;
+    }
+    /* new_object may have moved the objects */
+    mock.objects[ut].watermark = start + num_objects * BIT(bits) - mock.objects[ut].paddr;
+    mock.retypes++;
+    return seL4_NoError;
+}
+
+seL4_Error seL4_CNode_Copy(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                           seL4_Word src_index, seL4_Uint8 src_depth, seL4_CapRights_t rights)
+{
+    return seL4_CNode_Mint(service, dest_index, dest_depth, src_root, src_index, src_depth, rights, 0);
+}
+
+seL4_Error seL4_CNode_Mint(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                           seL4_Word src_index, seL4_Uint8 src_depth, seL4_CapRights_t rights, seL4_Word badge)
+{
+    size_t dest, src;
+    seL4_Error error = lookup_empty(service, dest_index, &dest);
+    if (error == seL4_NoError) {
+        error = lookup_full(src_root, src_index, &src);
+    }
+    if (error != seL4_NoError) {
+        return error;
+    }
+    mock.slots[dest] = mock.slots[src];
+    mock.objects[mock.slots[src]].refs++;
+    return seL4_NoError;
+}
+
+seL4_Error seL4_CNode_Move(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                           seL4_Word src_index, seL4_Uint8 src_depth)
+{
+    size_t dest, src;
+    seL4_Error error = lookup_empty(service, dest_index, &dest);
+    if (error == seL4_NoError) {
+        error = lookup_full(src_root, src_index, &src);
+    }
+    if (error != seL4_NoError) {
+        return error;
+    }
+    mock.slots[dest] = mock.slots[src];
+    mock.slots[src] = NO_OBJECT;
+    return seL4_NoError;
+}
+
+seL4_Error seL4_CNode_Mutate(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_CNode src_root,
+                             seL4_Word src_index, seL4_Uint8 src_depth, seL4_Word badge)
+{
+    return seL4_CNode_Move(service, dest_index, dest_depth, src_root, src_index, src_depth);
+}
+
+seL4_Error seL4_CNode_Delete(seL4_CNode service, seL4_Word index, seL4_Uint8 depth)
+{
+    size_t slot;
+    seL4_Error error = lookup_cnode(service);
+    if (error == seL4_NoError) {
+        error = lookup(index, &slot);
+    }
+    if (error != seL4_NoError) {
+        return error;
+    }
+    delete_slot(slot);
+    return seL4_NoError;
+}
+
+static bool is_descendant(size_t index, size_t ancestor)
+{
+    for (index = mock.objects[index].parent; index != NO_OBJECT; index = mock.objects[index].parent) {
+        if (index == ancestor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+seL4_Error seL4_CNode_Revoke(seL4_CNode service, seL4_Word index, seL4_Uint8 depth)
+{
+    size_t slot;
+    seL4_Error error = lookup_full(service, index, &slot);
+    if (error != seL4_NoError) {
+        return error;
+    }
+    size_t ancestor = mock.slots[slot];
+    for (size_t i = 0; i < BIT(mock.size_bits); i++) {
+        if (mock.slots[i] != NO_OBJECT && is_descendant(mock.slots[i], ancestor)) {
+            delete_slot(i);
+        }
+    }
+    return seL4_NoError;
+}
+
+/* Operations on capabilities allocman never creates */
+
+seL4_Error seL4_CNode_Rotate(seL4_CNode service, seL4_Word dest_index, seL4_Uint8 dest_depth, seL4_Word dest_badge,
+                             seL4_CNode pivot_root, seL4_Word pivot_index, seL4_Uint8 pivot_depth,
+                             seL4_Word pivot_badge, seL4_CNode src_root, seL4_Word src_index, seL4_Uint8 src_depth)
+{
+    ZF_LOGE("seL4_CNode_Rotate is not supported by the mock kernel");
+    return seL4_IllegalOperation;
+}
+
+seL4_Error seL4_CNode_SaveCaller(seL4_CNode service, seL4_Word index, seL4_Uint8 depth)
+{
+    ZF_LOGE("seL4_CNode_SaveCaller is not supported by the mock kernel");
+    return seL4_IllegalOperation;
+}
+
+seL4_Error seL4_CNode_CancelBadgedSends(seL4_CNode service, seL4_Word index, seL4_Uint8 depth)
+{
+    ZF_LOGE("seL4_CNode_CancelBadgedSends is not supported by the mock kernel");
+    return seL4_IllegalOperation;
+}
+
+void seL4_Signal(seL4_CPtr dest)
+{
+    ZF_LOGF("seL4_Signal is not supported by the mock kernel");
+    abort();
+}
+
+void seL4_Wait(seL4_CPtr src, seL4_Word *sender)
+{
+    ZF_LOGF("seL4_Wait is not supported by the mock kernel");
+    abort();
+}
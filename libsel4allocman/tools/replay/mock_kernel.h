@@ -0,0 +1,57 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sel4/sel4.h>
+
+/* A mock of the parts of the kernel that allocman uses: untyped memory and a single CNode,
+ * which is also the root of the cspace and sits in slot seL4_CapInitThreadCNode of itself.
+ * Retype follows the kernel's rules for placing objects, so the memory allocman leaves
+ * unusable is the same as it would be on hardware. */
+
+typedef struct mock_kernel_usage {
+    /* memory in all untypeds given to the mock */
+    size_t total_bytes;
+    /* memory covered by objects other than untypeds that still exist */
+    size_t used_bytes;
+    size_t used_high_water;
+    /* largest naturally aligned block that is not used by any object */
+    size_t largest_free;
+    /* number of successful retypes */
+    size_t retypes;
+} mock_kernel_usage_t;
+
+/* Create the CNode with BIT(size_bits) slots. Returns 0 on success */
+int mock_kernel_init(size_t size_bits);
+
+/* Place an untyped of BIT(size_bits) bytes at paddr into an empty slot */
+int mock_kernel_add_untyped(seL4_CPtr slot, uintptr_t paddr, size_t size_bits, bool device);
+
+/* Identifier of the object referred to by the cap in slot, unique over the life of the mock,
+ * or 0 if the slot is empty */
+uint64_t mock_kernel_object_id(seL4_CPtr slot);
+
+/* Collect the current memory usage. Finding the largest free block walks every object */
+void mock_kernel_usage(mock_kernel_usage_t *usage);
+
+/* Fraction of the free memory that is outside the largest free block */
+static inline double mock_kernel_fragmentation(const mock_kernel_usage_t *usage)
+{
+    size_t free_bytes = usage->total_bytes - usage->used_bytes;
+    if (free_bytes == 0) {
+        return 0;
+    }
+    return 1.0 - (double) usage->largest_free / free_bytes;
+}
@@ -0,0 +1,647 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Replays a trace recorded with vka_init_tracevka (and optionally mspace_trace_make_interface)
+ * against allocman running on the host over a mock kernel, and reports how fast and how well
+ * it served the trace. See README.md */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <utils/util.h>
+#include <vka/vka.h>
+#include <vka/capops.h>
+#include <vka/trace-vka.h>
+#include <allocman/allocman.h>
+#include <allocman/vka.h>
+#include <allocman/cspace/single_level.h>
+#include <allocman/mspace/malloc.h>
+#include <allocman/utspace/split.h>
+#include <allocman/utspace/twinkle.h>
+#include "mock_kernel.h"
+
+#define MAX_UNTYPEDS 64
+#define FIRST_UNTYPED_SLOT (seL4_CapInitThreadCNode + 1)
+#define DEFAULT_CNODE_BITS 16
+#define DEFAULT_UNTYPED_BITS 28
+#define DEFAULT_SAMPLE 1000
+
+/* Maps values from the trace, such as slots and cookies, to their replayed values */
+typedef struct entry {
+    seL4_Word key;
+    seL4_Word value;
+    /* for objects, the replayed slot the object was created in and its mock kernel id */
+    seL4_CPtr slot;
+    uint64_t id;
+} entry_t;
+
+typedef struct map {
+    entry_t *entries;
+    bool *used;
+    size_t size;
+    size_t count;
+} map_t;
+
+static size_t map_hash(const map_t *map, seL4_Word key)
+{
+    return ((key * 0x9e3779b97f4a7c15ull) >> 32) & (map->size - 1);
+}
+
+static int map_grow(map_t *map);
+
+static entry_t *map_get(const map_t *map, seL4_Word key)
+{
+    if (map->size == 0) {
+        return NULL;
+    }
+    for (size_t i = map_hash(map, key); map->used[i]; i = (i + 1) & (map->size - 1)) {
+        if (map->entries[i].key == key) {
+            return &map->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the entry for key, adding a new one if there is none */
+static entry_t *map_put(map_t *map, seL4_Word key)
+{
+    entry_t *entry = map_get(map, key);
+    if (entry != NULL) {
+        return entry;
+    }
+    if ((map->count + 1) * 2 > map->size && map_grow(map)) {
+        return NULL;
+    }
+    size_t i = map_hash(map, key);
+    while (map->used[i]) {
+        i = (i + 1) & (map->size - 1);
+    }
+    map->used[i] = true;
+    map->entries[i] = (entry_t) {
+        .key = key
+    };
+    map->count++;
+    return &map->entries[i];
+}
+
+static int map_grow(map_t *map)
+{
+    map_t bigger = {
+        .size = map->size ? map->size * 2 : 1024,
+    };
+    bigger.entries = calloc(bigger.size, sizeof(*bigger.entries));
+    bigger.used = calloc(bigger.size, sizeof(*bigger.used));
+    if (bigger.entries == NULL || bigger.used == NULL) {
+        free(bigger.entries);
+        free(bigger.used);
+        return -1;
+    }
+    for (size_t i = 0; i < map->size; i++) {
+        if (map->used[i]) {
+            size_t j = map_hash(&bigger, map->entries[i].key);
+            while (bigger.used[j]) {
+                j = (j + 1) & (bigger.size - 1);
+            }
+            bigger.used[j] = true;
+            bigger.entries[j] = map->entries[i];
+        }
+    }
+    bigger.count = map->count;
+    free(map->entries);
+    free(map->used);
+    *map = bigger;
+    return 0;
+}
+
+/* Remove an entry, shifting back any entries that probed past it */
+static void map_remove(map_t *map, entry_t *entry)
+{
+    size_t mask = map->size - 1;
+    size_t i = entry - map->entries;
+    map->used[i] = false;
+    map->count--;
+    for (size_t j = (i + 1) & mask; map->used[j]; j = (j + 1) & mask) {
+        size_t home = map_hash(map, map->entries[j].key);
+        /* the entry at j can move to i if i lies cyclically between its home and j */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            map->entries[i] = map->entries[j];
+            map->used[i] = true;
+            map->used[j] = false;
+            i = j;
+        }
+    }
+}
+
+typedef struct op_stats {
+    const char *name;
+    size_t count;
+    /* calls that succeeded in the trace but failed when replayed */
+    size_t failed;
+    uint64_t ns;
+} op_stats_t;
+
+enum {
+    STATS_CSPACE_ALLOC,
+    STATS_CSPACE_FREE,
+    STATS_UTSPACE_ALLOC,
+    STATS_UTSPACE_ALLOC_BATCH,
+    STATS_UTSPACE_FREE,
+    STATS_NUM
+};
+
+typedef struct replay {
+    vka_t vka;
+    map_t slots;
+    map_t objects;
+    op_stats_t stats[STATS_NUM];
+    /* records that were not replayed, as they failed in the trace or refer to something the
+     * trace never allocated */
+    size_t skipped;
+    size_t unmatched;
+    size_t replayed;
+    /* objects of a batch that are yet to be read from the trace */
+    vka_trace_record_t *batch;
+    size_t batch_len;
+    /* book keeping memory used by the trace and by the replay */
+    size_t recorded_metadata;
+    size_t recorded_metadata_high_water;
+    size_t metadata;
+    size_t metadata_high_water;
+    size_t metadata_allocs;
+    /* memory usage sampling */
+    size_t sample;
+    double worst_fragmentation;
+} replay_t;
+
+static replay_t replay;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Book keeping memory of the replayed allocman, from malloc and counted */
+static void *counting_alloc(allocman_t *alloc, void *cookie, size_t bytes, int *error)
+{
+    void *ret = _mspace_malloc_alloc(alloc, cookie, bytes, error);
+    if (ret != NULL) {
+        replay.metadata += bytes;
+        replay.metadata_high_water = MAX(replay.metadata_high_water, replay.metadata);
+        replay.metadata_allocs++;
+    }
+    return ret;
+}
+
+static void counting_free(allocman_t *alloc, void *cookie, void *ptr, size_t bytes)
+{
+    replay.metadata -= bytes;
+    _mspace_malloc_free(alloc, cookie, ptr, bytes);
+}
+
+static void timed(op_stats_t *stats, uint64_t start, int error)
+{
+    stats->ns += now_ns() - start;
+    stats->count++;
+    if (error) {
+        stats->failed++;
+    }
+}
+
+/* Empty a slot before it is freed or reused, as the application would have done */
+static void delete_cap(seL4_CPtr slot)
+{
+    cspacepath_t path;
+    vka_cspace_make_path(&replay.vka, slot, &path);
+    vka_cnode_delete(&path);
+}
+
+/* Replayed slot for a slot in the trace. Slots that the trace did not allocate through the
+ * vka, such as ones from a cspace allocated separately, are allocated now */
+static int replay_slot(seL4_CPtr traced, seL4_CPtr *slot)
+{
+    entry_t *entry = map_get(&replay.slots, traced);
+    if (entry == NULL) {
+        entry = map_put(&replay.slots, traced);
+        if (entry == NULL || vka_cspace_alloc(&replay.vka, &entry->value)) {
+            ZF_LOGE("Failed to allocate slot for traced slot %lx", (long) traced);
+            if (entry != NULL) {
+                map_remove(&replay.slots, entry);
+            }
+            return -1;
+        }
+    }
+    *slot = entry->value;
+    return 0;
+}
+
+static void record_object(seL4_Word traced_cookie, seL4_Word cookie, seL4_CPtr slot)
+{
+    entry_t *entry = map_put(&replay.objects, traced_cookie);
+    if (entry == NULL) {
+        ZF_LOGE("Out of memory recording object");
+        return;
+    }
+    entry->value = cookie;
+    entry->slot = slot;
+    entry->id = mock_kernel_object_id(slot);
+}
+
+static void replay_batch(void)
+{
+    vka_trace_record_t *first = &replay.batch[0];
+    size_t num = replay.batch_len;
+
+    /* the objects of a batch need consecutive slots, which the slots the trace allocated for
+     * them may not be when replayed */
+    bool consecutive = true;
+    seL4_CPtr base = 0;
+    for (size_t i = 0; i < num && consecutive; i++) {
+        entry_t *entry = map_get(&replay.slots, replay.batch[i].slot);
+        if (entry == NULL || (i > 0 && entry->value != base + i)) {
+            consecutive = false;
+        } else if (i == 0) {
+            base = entry->value;
+        }
+    }
+    if (!consecutive) {
+        if (vka_cspace_alloc_range(&replay.vka, num, &base)) {
+            replay.stats[STATS_UTSPACE_ALLOC_BATCH].count++;
+            replay.stats[STATS_UTSPACE_ALLOC_BATCH].failed++;
+            return;
+        }
+        for (size_t i = 0; i < num; i++) {
+            entry_t *entry = map_get(&replay.slots, replay.batch[i].slot);
+            if (entry != NULL) {
+                vka_cspace_free(&replay.vka, entry->value);
+            } else {
+                entry = map_put(&replay.slots, replay.batch[i].slot);
+            }
+            if (entry != NULL) {
+                entry->value = base + i;
+            }
+        }
+    }
+
+    cspacepath_t path;
+    vka_cspace_make_path(&replay.vka, base, &path);
+    seL4_Word cookies[num];
+    uint64_t start = now_ns();
+    int error = vka_utspace_alloc_batch(&replay.vka, &path, first->type, first->size_bits, num, first->can_use_dev,
+                                        cookies);
+    timed(&replay.stats[STATS_UTSPACE_ALLOC_BATCH], start, error);
+    if (!error) {
+        for (size_t i = 0; i < num; i++) {
+            record_object(replay.batch[i].cookie, cookies[i], base + i);
+        }
+    }
+}
+
+static void replay_record(const vka_trace_record_t *r)
+{
+    seL4_CPtr slot;
+    cspacepath_t path;
+    seL4_Word cookie;
+    entry_t *entry;
+    uint64_t start;
+    int error;
+
+    /* failed allocations left nothing behind to replay */
+    if (r->result != 0) {
+        replay.skipped++;
+        return;
+    }
+
+    switch (r->op) {
+    case VKA_TRACE_CSPACE_ALLOC:
+        start = now_ns();
+        error = vka_cspace_alloc(&replay.vka, &slot);
+        timed(&replay.stats[STATS_CSPACE_ALLOC], start, error);
+        if (!error) {
+            entry = map_put(&replay.slots, r->slot);
+            if (entry != NULL) {
+                entry->value = slot;
+            }
+        }
+        break;
+    case VKA_TRACE_CSPACE_FREE:
+        entry = map_get(&replay.slots, r->slot);
+        if (entry == NULL) {
+            replay.unmatched++;
+            return;
+        }
+        delete_cap(entry->value);
+        start = now_ns();
+        vka_cspace_free(&replay.vka, entry->value);
+        timed(&replay.stats[STATS_CSPACE_FREE], start, 0);
+        map_remove(&replay.slots, entry);
+        break;
+    case VKA_TRACE_UTSPACE_ALLOC:
+    case VKA_TRACE_UTSPACE_ALLOC_AT:
+        if (replay_slot(r->slot, &slot)) {
+            replay.stats[STATS_UTSPACE_ALLOC].failed++;
+            return;
+        }
+        vka_cspace_make_path(&replay.vka, slot, &path);
+        start = now_ns();
+        if (r->op == VKA_TRACE_UTSPACE_ALLOC_AT) {
+            error = vka_utspace_alloc_at(&replay.vka, &path, r->type, r->size_bits, r->paddr, &cookie);
+        } else {
+            error = vka_utspace_alloc_maybe_device(&replay.vka, &path, r->type, r->size_bits, r->can_use_dev, &cookie);
+        }
+        timed(&replay.stats[STATS_UTSPACE_ALLOC], start, error);
+        if (!error) {
+            record_object(r->cookie, cookie, slot);
+        }
+        break;
+    case VKA_TRACE_UTSPACE_ALLOC_BATCH:
+        if (replay.batch_len == 0) {
+            replay.batch = malloc(r->count * sizeof(*replay.batch));
+            if (replay.batch == NULL) {
+                ZF_LOGE("Out of memory reading batch of %zu", r->count);
+                replay.skipped++;
+                return;
+            }
+        }
+        replay.batch[replay.batch_len++] = *r;
+        if (replay.batch_len == r->count) {
+            replay_batch();
+            free(replay.batch);
+            replay.batch = NULL;
+            replay.batch_len = 0;
+        }
+        break;
+    case VKA_TRACE_UTSPACE_FREE:
+        entry = map_get(&replay.objects, r->cookie);
+        if (entry == NULL) {
+            replay.unmatched++;
+            return;
+        }
+        /* the untyped can only be reused once the cap to the object is gone */
+        if (mock_kernel_object_id(entry->slot) == entry->id) {
+            delete_cap(entry->slot);
+        }
+        start = now_ns();
+        vka_utspace_free(&replay.vka, r->type, r->size_bits, entry->value);
+        timed(&replay.stats[STATS_UTSPACE_FREE], start, 0);
+        map_remove(&replay.objects, entry);
+        break;
+    case VKA_TRACE_MSPACE_ALLOC:
+        /* book keeping is done again by the replayed allocman, so is only measured */
+        replay.recorded_metadata += r->bytes;
+        replay.recorded_metadata_high_water = MAX(replay.recorded_metadata_high_water, replay.recorded_metadata);
+        return;
+    case VKA_TRACE_MSPACE_FREE:
+        replay.recorded_metadata -= r->bytes;
+        return;
+    default:
+        ZF_LOGE("Unknown trace operation %d", (int) r->op);
+        replay.skipped++;
+        return;
+    }
+
+    replay.replayed++;
+    if (replay.sample != 0 && replay.replayed % replay.sample == 0) {
+        mock_kernel_usage_t usage;
+        mock_kernel_usage(&usage);
+        replay.worst_fragmentation = MAX(replay.worst_fragmentation, mock_kernel_fragmentation(&usage));
+    }
+}
+
+/* Parse a line printed by vka_trace_print, ignoring anything before it on the line */
+static bool parse_record(const char *line, vka_trace_record_t *r)
+{
+    const char *start = strstr(line, "vka_trace ");
+    if (start == NULL) {
+        return false;
+    }
+    unsigned int op, result, can_use_dev;
+    unsigned long type, size_bits, slot, cookie, paddr;
+    size_t count, bytes = 0;
+    /* traces from before mspace tracing have no size */
+    int fields = sscanf(start, "vka_trace %x %x %lx %lx %lx %lx %lx %zx %x %zx", &op, &result, &type, &size_bits,
+                        &slot, &cookie, &paddr, &count, &can_use_dev, &bytes);
+    if (fields < 9) {
+        return false;
+    }
+    *r = (vka_trace_record_t) {
+        .op = op,
+        .result = (int) result,
+        .type = type,
+        .size_bits = size_bits,
+        .slot = slot,
+        .cookie = cookie,
+        .paddr = paddr,
+        .count = count,
+        .can_use_dev = can_use_dev,
+        .bytes = bytes
+    };
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-u split|twinkle] [-c cnode_bits] [-m size_bits[@paddr]]... [-d size_bits@paddr]...\n"
+            "          [-s sample] trace\n"
+            "  -u  untyped allocator to replay with (default split)\n"
+            "  -c  log2 of the number of slots in the cspace (default %d)\n"
+            "  -m  add an untyped of RAM, may be repeated (default one of 2^%d bytes)\n"
+            "  -d  add an untyped of device memory, may be repeated\n"
+            "  -s  measure fragmentation every this many operations, 0 for only at the end (default %d)\n",
+            name, DEFAULT_CNODE_BITS, DEFAULT_UNTYPED_BITS, DEFAULT_SAMPLE);
+}
+
+typedef struct untyped {
+    size_t size_bits;
+    uintptr_t paddr;
+    bool device;
+} untyped_t;
+
+static int parse_untyped(const char *arg, bool device, untyped_t *ut, uintptr_t *next_paddr)
+{
+    char *end;
+    ut->size_bits = strtoul(arg, &end, 0);
+    ut->device = device;
+    if (ut->size_bits < seL4_MinUntypedBits || ut->size_bits > seL4_MaxUntypedBits) {
+        return -1;
+    }
+    if (*end == '@') {
+        ut->paddr = strtoull(end + 1, &end, 0);
+    } else if (device) {
+        return -1;
+    } else {
+        ut->paddr = ROUND_UP(*next_paddr, BIT(ut->size_bits));
+    }
+    if (*end != '\0' || !IS_ALIGNED(ut->paddr, ut->size_bits)) {
+        return -1;
+    }
+    *next_paddr = MAX(*next_paddr, ut->paddr + BIT(ut->size_bits));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *utspace_name = "split";
+    size_t cnode_bits = DEFAULT_CNODE_BITS;
+    untyped_t uts[MAX_UNTYPEDS];
+    size_t num_uts = 0;
+    uintptr_t next_paddr = BIT(DEFAULT_UNTYPED_BITS);
+    replay.sample = DEFAULT_SAMPLE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:c:m:d:s:")) != -1) {
+        switch (opt) {
+        case 'u':
+            utspace_name = optarg;
+            break;
+        case 'c':
+            cnode_bits = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+        case 'd':
+            if (num_uts == MAX_UNTYPEDS || parse_untyped(optarg, opt == 'd', &uts[num_uts], &next_paddr)) {
+                fprintf(stderr, "Invalid or too many untypeds: %s\n", optarg);
+                return 1;
+            }
+            num_uts++;
+            break;
+        case 's':
+            replay.sample = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || (strcmp(utspace_name, "split") && strcmp(utspace_name, "twinkle"))
+        || cnode_bits < 4 || cnode_bits >= seL4_WordBits || BIT(cnode_bits) <= FIRST_UNTYPED_SLOT + MAX_UNTYPEDS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (num_uts == 0) {
+        uts[num_uts++] = (untyped_t) {
+            .size_bits = DEFAULT_UNTYPED_BITS,
+            .paddr = BIT(DEFAULT_UNTYPED_BITS)
+        };
+    }
+
+    FILE *trace = fopen(argv[optind], "r");
+    if (trace == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    /* allocman over the mock kernel, with the untypeds placed just after the CNode and the
+     * rest of the CNode given to the cspace allocator */
+    static allocman_t allocman;
+    static cspace_single_level_t cspace;
+    static utspace_split_t split;
+    static utspace_twinkle_t twinkle;
+    struct mspace_interface mspace = mspace_malloc_interface;
+    mspace.alloc = counting_alloc;
+    mspace.free = counting_free;
+
+    if (mock_kernel_init(cnode_bits) || allocman_create(&allocman, mspace)) {
+        ZF_LOGE("Failed to create allocman");
+        return 1;
+    }
+    int error = cspace_single_level_create(&allocman, &cspace, (struct cspace_single_level_config) {
+        .cnode = seL4_CapInitThreadCNode,
+        .cnode_size_bits = cnode_bits,
+        .cnode_guard_bits = seL4_WordBits - cnode_bits,
+        .first_slot = FIRST_UNTYPED_SLOT + num_uts,
+        .end_slot = BIT(cnode_bits)
+    });
+    if (!error) {
+        error = allocman_attach_cspace(&allocman, cspace_single_level_make_interface(&cspace));
+    }
+    if (!error && !strcmp(utspace_name, "split")) {
+        utspace_split_create(&split);
+        error = allocman_attach_utspace(&allocman, utspace_split_make_interface(&split));
+    } else if (!error) {
+        utspace_twinkle_create(&twinkle);
+        error = allocman_attach_utspace(&allocman, utspace_twinkle_make_interface(&twinkle));
+    }
+    for (size_t i = 0; i < num_uts && !error; i++) {
+        seL4_CPtr slot = FIRST_UNTYPED_SLOT + i;
+        cspacepath_t path = allocman_cspace_make_path(&allocman, slot);
+        error = mock_kernel_add_untyped(slot, uts[i].paddr, uts[i].size_bits, uts[i].device);
+        if (!error) {
+            error = allocman_utspace_add_uts(&allocman, 1, &path, &uts[i].size_bits, &uts[i].paddr,
+                                             uts[i].device ? ALLOCMAN_UT_DEV : ALLOCMAN_UT_KERNEL);
+        }
+    }
+    if (error) {
+        ZF_LOGE("Failed to configure allocman");
+        return 1;
+    }
+    allocman_make_vka(&replay.vka, &allocman);
+
+    replay.stats[STATS_CSPACE_ALLOC].name = "cspace_alloc";
+    replay.stats[STATS_CSPACE_FREE].name = "cspace_free";
+    replay.stats[STATS_UTSPACE_ALLOC].name = "utspace_alloc";
+    replay.stats[STATS_UTSPACE_ALLOC_BATCH].name = "utspace_alloc_batch";
+    replay.stats[STATS_UTSPACE_FREE].name = "utspace_free";
+    /* book keeping of setting up allocman is not part of the trace */
+    size_t setup_metadata = replay.metadata;
+
+    char line[512];
+    size_t records = 0;
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        vka_trace_record_t r;
+        if (parse_record(line, &r)) {
+            records++;
+            replay_record(&r);
+        }
+    }
+    fclose(trace);
+    if (replay.batch_len != 0) {
+        ZF_LOGW("Trace ends part way through a batch, %zu objects not replayed", replay.batch_len);
+        replay.skipped += replay.batch_len;
+    }
+
+    mock_kernel_usage_t usage;
+    mock_kernel_usage(&usage);
+    double fragmentation = mock_kernel_fragmentation(&usage);
+    replay.worst_fragmentation = MAX(replay.worst_fragmentation, fragmentation);
+
+    uint64_t total_ns = 0;
+    size_t total_ops = 0;
+    printf("utspace allocator: %s\n", utspace_name);
+    printf("records: %zu, replayed %zu, skipped %zu, unmatched %zu\n", records, replay.replayed, replay.skipped,
+           replay.unmatched);
+    printf("%-20s %10s %10s %12s\n", "operation", "count", "failed", "mean ns");
+    for (int i = 0; i < STATS_NUM; i++) {
+        op_stats_t *stats = &replay.stats[i];
+        printf("%-20s %10zu %10zu %12.1f\n", stats->name, stats->count, stats->failed,
+               stats->count ? (double) stats->ns / stats->count : 0.0);
+        total_ns += stats->ns;
+        total_ops += stats->count;
+    }
+    printf("throughput: %.0f operations/s\n", total_ns ? total_ops * 1e9 / total_ns : 0.0);
+    printf("untyped memory: %zu bytes, %zu in use at the end, %zu at most\n", usage.total_bytes, usage.used_bytes,
+           usage.used_high_water);
+    printf("fragmentation: %.3f at the end (largest free block %zu of %zu free), %.3f at worst\n", fragmentation,
+           usage.largest_free, usage.total_bytes - usage.used_bytes, replay.worst_fragmentation);
+    printf("book keeping: %zu bytes at most in %zu allocations, plus %zu to set up\n",
+           replay.metadata_high_water - setup_metadata, replay.metadata_allocs, setup_metadata);
+    if (replay.recorded_metadata_high_water != 0) {
+        printf("recorded book keeping: %zu bytes at most\n", replay.recorded_metadata_high_water);
+    }
+    printf("kernel retypes: %zu\n", usage.retypes);
+    return 0;
+}
@@ -26,6 +26,7 @@
 
 #include <sel4utils/util.h>
 #include <sel4utils/mapping.h>
+#include <sel4utils/vspace.h>
 
 /* If we have a nonzero static morecore then we are just doing dodgy hacky morecore */
 #if CONFIG_LIB_SEL4_MUSLC_SYS_MORECORE_BYTES > 0
@@ -96,6 +97,10 @@ long sys_mremap(va_list ap)
     muslc_this_vspace = &vspace;
     muslc_brk_reservation.res = &muslc_brk_reservation_memory;
 
+    If the reservation is made lazy with sel4utils_set_lazy_reservation, the heap is grown without
+    mapping anything and its pages are backed as they are touched, which needs a fault handler
+    such as sel4utils_start_paging_fault_handler serving the faults of all threads using malloc.
+
     In the case that you need dynamic morecore for some apps and static for others, just
     define more_core area in your app itself and set the global morecore_area before calling malloc.
 
@@ -158,6 +163,14 @@ static long sys_brk_dynamic(va_list ap)
     if (newbrk == 0) {
         brk_start = (uintptr_t)muslc_brk_reservation_start;
         ret = brk_start;
+    } else if (((sel4utils_res_t *) muslc_brk_reservation.res)->lazy) {
+        /* pages are backed when first touched, so we only need to check the heap still fits */
+        if (newbrk > ((sel4utils_res_t *) muslc_brk_reservation.res)->end) {
+            ZF_LOGE("Extending brk region past the end of its reservation\n");
+            return 0;
+        }
+        brk_start = MAX(brk_start, ROUND_UP(newbrk, PAGE_SIZE_4K));
+        ret = brk_start;
     } else {
         /* try and map pages until this point */
         while (brk_start < newbrk) {
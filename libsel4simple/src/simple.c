@@ -78,6 +78,8 @@ void simple_make_vka(simple_t *simple, vka_t *vka)
     vka->utspace_alloc_maybe_device = NULL;
     vka->cspace_free = NULL;
     vka->utspace_free = NULL;
+    vka->utspace_alloc_batch = NULL;
+    vka->cspace_alloc_range = NULL;
 }
 
 seL4_CPtr simple_last_valid_cap(simple_t *simple)
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Book keeping memory and lookup speed of the default and compact shadow page table layouts.
+ *
+ * Only the book keeping is of interest, so the vspaces are given a map function that does not
+ * touch the kernel and are filled with made up caps. As the caps are not real the vspaces cannot
+ * be torn down, and are left to be cleaned up with the test process. */
+
+#include <autoconf.h>
+#include <sel4bench/sel4bench.h>
+#include <sel4test/test.h>
+#include <sel4utils/vspace.h>
+#include <sel4utils/vspace_internal.h>
+#include <stdlib.h>
+
+/* pages mapped without cookies, as with vspace_map_pages, then pages with cookies, as with
+ * vspace_new_pages */
+#define COMPACT_BENCH_PLAIN_PAGES BIT(14)
+#define COMPACT_BENCH_COOKIE_PAGES BIT(12)
+
+static sel4utils_alloc_data_t default_data, compact_data;
+
+static int map_nothing(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_CapRights_t rights, int cacheable,
+                       size_t size_bits)
+{
+    return 0;
+}
+
+static size_t shadow_bytes(sel4utils_alloc_data_t *data, vspace_mid_level_t *level, int level_num)
+{
+    size_t bytes = sizeof(*level);
+    for (int i = 0; i < VSPACE_LEVEL_SIZE; i++) {
+        uintptr_t next = level->table[i];
+        if (next == EMPTY || next == RESERVED) {
+            continue;
+        }
+        bytes += level_num == 1 ? bottom_level_size(data) : shadow_bytes(data, (vspace_mid_level_t *) next, level_num - 1);
+    }
+    return bytes;
+}
+
+/* Levels of the cookie table are all the size of a mid level, including the arrays of cookies */
+static size_t cookie_bytes(vspace_mid_level_t *level, int level_num)
+{
+    size_t bytes = sizeof(*level);
+    for (int i = 0; level_num > 0 && i < VSPACE_LEVEL_SIZE; i++) {
+        if (level->table[i] != EMPTY) {
+            bytes += cookie_bytes((vspace_mid_level_t *) level->table[i], level_num - 1);
+        }
+    }
+    return bytes;
+}
+
+static size_t book_keeping_bytes(sel4utils_alloc_data_t *data)
+{
+    size_t bytes = shadow_bytes(data, data->top_level, VSPACE_NUM_LEVELS - 1);
+    if (data->cookie_top_level) {
+        bytes += cookie_bytes(data->cookie_top_level, VSPACE_NUM_LEVELS - 1);
+    }
+    return bytes;
+}
+
+/* Look up the cap and cookie of every page, returning the mean cycles per page. Pages were given
+ * consecutive caps, and consecutive cookies unless first_cookie is 0 */
+static ccnt_t time_lookups(vspace_t *vspace, void *vaddr, size_t num_pages, seL4_CPtr first_cap,
+                           uintptr_t first_cookie, int *errors)
+{
+    ccnt_t start = sel4bench_get_cycle_count();
+    for (size_t i = 0; i < num_pages; i++) {
+        void *page = (void *)((uintptr_t) vaddr + i * PAGE_SIZE_4K);
+        uintptr_t cookie = first_cookie == 0 ? 0 : first_cookie + i;
+        if (vspace_get_cap(vspace, page) != first_cap + i || vspace_get_cookie(vspace, page) != cookie) {
+            (*errors)++;
+        }
+    }
+    return (sel4bench_get_cycle_count() - start) / num_pages;
+}
+
+static int fill_vspace(env_t env, vspace_t *vspace, sel4utils_alloc_data_t *data, bool compact, seL4_CPtr *caps,
+                       uintptr_t *cookies, void **plain, void **with_cookies)
+{
+    int error = sel4utils_get_vspace_with_map(&env->vspace, vspace, data, &env->vka, 0, NULL, NULL, map_nothing);
+    if (error) {
+        return error;
+    }
+    if (compact) {
+        error = sel4utils_set_compact_book_keeping(vspace);
+        if (error) {
+            return error;
+        }
+    }
+    *plain = vspace_map_pages(vspace, caps, NULL, seL4_AllRights, COMPACT_BENCH_PLAIN_PAGES, seL4_PageBits, 1);
+    *with_cookies = vspace_map_pages(vspace, caps + COMPACT_BENCH_PLAIN_PAGES, cookies, seL4_AllRights,
+                                     COMPACT_BENCH_COOKIE_PAGES, seL4_PageBits, 1);
+    return *plain == NULL || *with_cookies == NULL;
+}
+
+static int bench_compact(env_t env)
+{
+    vspace_t vspaces[2];
+    sel4utils_alloc_data_t *data[2] = {&default_data, &compact_data};
+    const char *names[2] = {"default", "compact"};
+    int errors = 0;
+
+    seL4_CPtr *caps = malloc((COMPACT_BENCH_PLAIN_PAGES + COMPACT_BENCH_COOKIE_PAGES) * sizeof(*caps));
+    uintptr_t *cookies = malloc(COMPACT_BENCH_COOKIE_PAGES * sizeof(*cookies));
+    test_assert(caps && cookies);
+    /* any values that are neither EMPTY nor RESERVED will do */
+    for (size_t i = 0; i < COMPACT_BENCH_PLAIN_PAGES + COMPACT_BENCH_COOKIE_PAGES; i++) {
+        caps[i] = i + 1;
+    }
+    for (size_t i = 0; i < COMPACT_BENCH_COOKIE_PAGES; i++) {
+        cookies[i] = i + 1;
+    }
+
+    sel4bench_init();
+    printf("shadow page table with %lu plain pages and %lu pages with cookies:\n", COMPACT_BENCH_PLAIN_PAGES,
+           COMPACT_BENCH_COOKIE_PAGES);
+    printf("  %8s %16s %20s %20s\n", "layout", "book keeping", "lookup cycles plain", "lookup cycles cookie");
+    for (int i = 0; i < 2; i++) {
+        void *plain, *with_cookies;
+        int error = fill_vspace(env, &vspaces[i], data[i], i == 1, caps, cookies, &plain, &with_cookies);
+        test_assert(error == 0);
+        ccnt_t plain_cycles = time_lookups(&vspaces[i], plain, COMPACT_BENCH_PLAIN_PAGES, 1, 0, &errors);
+        ccnt_t cookie_cycles = time_lookups(&vspaces[i], with_cookies, COMPACT_BENCH_COOKIE_PAGES,
+                                            COMPACT_BENCH_PLAIN_PAGES + 1, 1, &errors);
+        printf("  %8s %16zu %20" PRIu64 " %20" PRIu64 "\n", names[i], book_keeping_bytes(data[i]),
+               (uint64_t) plain_cycles, (uint64_t) cookie_cycles);
+    }
+    sel4bench_destroy();
+    test_eq(errors, 0);
+
+    free(caps);
+    free(cookies);
+    return sel4test_get_result();
+}
+DEFINE_TEST(SEL4UTILS_BENCH0003, "Book keeping size and lookup speed of the compact vspace layout", bench_compact,
+            true)
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Cycles taken by sel4utils_elf_load to load an in memory image with one large segment, with the
+ * last bottom level cache and with the cache emptied before every cap lookup the loader makes in
+ * the loadee, which makes every lookup a full walk of the shadow page table as it used to be.
+ *
+ * The difference is the cost of the lookups; the rest of the load, allocating and mapping frames
+ * and copying the segment, is the same either way. */
+
+#include <autoconf.h>
+#include <string.h>
+#include <sel4bench/sel4bench.h>
+#include <sel4test/test.h>
+#include <sel4utils/elf.h>
+#include <sel4utils/vspace.h>
+#include <sel4utils/vspace_internal.h>
+#include <vka/object.h>
+#include <vspace/arch/page.h>
+
+#if CONFIG_WORD_SIZE == 64
+#define LOOKUP_BENCH_ELFCLASS ELFCLASS64
+typedef Elf64_Ehdr lookup_bench_ehdr_t;
+#else
+#define LOOKUP_BENCH_ELFCLASS ELFCLASS32
+typedef Elf32_Ehdr lookup_bench_ehdr_t;
+#endif
+
+/* a 4MiB segment, which follows the headers in the first page of the image */
+#define LOOKUP_BENCH_PAGES BIT(10)
+#define LOOKUP_BENCH_VADDR 0x10000000ul
+#define LOOKUP_BENCH_ROUNDS 10
+
+static sel4utils_alloc_data_t lookup_data;
+
+static seL4_CPtr get_cap_uncached(vspace_t *vspace, void *vaddr)
+{
+    get_alloc_data(vspace)->lookup_level = NULL;
+    return sel4utils_get_cap(vspace, vaddr);
+}
+
+/* An image with a header, one writable loadable segment, and nothing else */
+static void make_image(void *image)
+{
+    lookup_bench_ehdr_t *ehdr = image;
+    Elf_Phdr *phdr = (Elf_Phdr *)(ehdr + 1);
+
+    memset(image, 0, PAGE_SIZE_4K);
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = LOOKUP_BENCH_ELFCLASS;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_EXEC;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_entry = LOOKUP_BENCH_VADDR;
+    ehdr->e_phoff = sizeof(*ehdr);
+    ehdr->e_ehsize = sizeof(*ehdr);
+    ehdr->e_phentsize = sizeof(*phdr);
+    ehdr->e_phnum = 1;
+
+    phdr->p_type = PT_LOAD;
+    phdr->p_flags = PF_R | PF_W;
+    phdr->p_offset = PAGE_SIZE_4K;
+    phdr->p_vaddr = LOOKUP_BENCH_VADDR;
+    phdr->p_paddr = LOOKUP_BENCH_VADDR;
+    phdr->p_filesz = LOOKUP_BENCH_PAGES * PAGE_SIZE_4K;
+    phdr->p_memsz = LOOKUP_BENCH_PAGES * PAGE_SIZE_4K;
+    phdr->p_align = PAGE_SIZE_4K;
+}
+
+/* Returns the cycles taken to load the image into a new vspace, or 0 if it could not be loaded */
+static ccnt_t time_load(env_t env, elf_t *elf, bool cached)
+{
+    vspace_t loadee;
+    vka_object_t root;
+    ccnt_t cycles = 0;
+
+    if (vka_alloc_vspace_root(&env->vka, &root) != 0) {
+        return 0;
+    }
+    /* the vspace is never run, but it needs an ASID for frames to be mapped into it */
+    if (seL4_ARCH_ASIDPool_Assign(env->asid_pool, root.cptr) == seL4_NoError &&
+        sel4utils_get_vspace(&env->vspace, &loadee, &lookup_data, &env->vka, root.cptr, NULL, NULL) == 0) {
+        if (!cached) {
+            loadee.get_cap = get_cap_uncached;
+        }
+        ccnt_t start = sel4bench_get_cycle_count();
+        void *entry = sel4utils_elf_load(&loadee, &env->vspace, &env->vka, &env->vka, elf);
+        cycles = sel4bench_get_cycle_count() - start;
+        if (entry == NULL) {
+            cycles = 0;
+        }
+        vspace_tear_down(&loadee, VSPACE_FREE);
+    }
+    vka_free_object(&env->vka, &root);
+    return cycles;
+}
+
+static int bench_lookup_cache(env_t env)
+{
+    elf_t elf;
+    ccnt_t cycles, cached = 0, uncached = 0;
+
+    size_t image_pages = LOOKUP_BENCH_PAGES + 1;
+    void *image = vspace_new_pages(&env->vspace, seL4_AllRights, image_pages, seL4_PageBits);
+    test_assert(image != NULL);
+    make_image(image);
+    test_eq(elf_newFile(image, image_pages * PAGE_SIZE_4K, &elf), 0);
+
+    sel4bench_init();
+    for (int i = 0; i < LOOKUP_BENCH_ROUNDS; i++) {
+        cycles = time_load(env, &elf, true);
+        test_neq(cycles, 0);
+        cached += cycles;
+        cycles = time_load(env, &elf, false);
+        test_neq(cycles, 0);
+        uncached += cycles;
+    }
+    sel4bench_destroy();
+
+    printf("sel4utils_elf_load of a %lu page segment, mean cycles:\n", LOOKUP_BENCH_PAGES);
+    printf("  with the bottom level cache          %" PRIu64 "\n", (uint64_t)(cached / LOOKUP_BENCH_ROUNDS));
+    printf("  cache emptied before every lookup    %" PRIu64 "\n", (uint64_t)(uncached / LOOKUP_BENCH_ROUNDS));
+
+    vspace_unmap_pages(&env->vspace, image, image_pages, seL4_PageBits, VSPACE_FREE);
+    return sel4test_get_result();
+}
+DEFINE_TEST(SEL4UTILS_BENCH0004, "Load an elf with and without the bottom level cache", bench_lookup_cache, true)
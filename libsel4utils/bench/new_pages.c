@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Cycles taken by vspace_new_pages to allocate and map regions of 1MiB to 256MiB of base pages,
+ * in batches, and a page at a time as it did before batching. A vka without the optional range
+ * and batch operations makes new_pages_at_vaddr take the page at a time path */
+
+#include <autoconf.h>
+#include <sel4bench/sel4bench.h>
+#include <sel4test/test.h>
+#include <sel4utils/vspace.h>
+#include <vka/object.h>
+#include <vspace/arch/page.h>
+
+#define NEW_PAGES_BENCH_MIN_BITS 20
+#define NEW_PAGES_BENCH_MAX_BITS 28
+
+static sel4utils_alloc_data_t batched_data, per_page_data;
+
+static int new_pages_vspace(env_t env, vspace_t *vspace, sel4utils_alloc_data_t *data, vka_t *vka,
+                            vka_object_t *root)
+{
+    int error = vka_alloc_vspace_root(&env->vka, root);
+    if (error) {
+        return error;
+    }
+    /* the vspace is never run, but it needs an ASID for frames to be mapped into it */
+    error = seL4_ARCH_ASIDPool_Assign(env->asid_pool, root->cptr);
+    if (error) {
+        return error;
+    }
+    return sel4utils_get_vspace(&env->vspace, vspace, data, vka, root->cptr, NULL, NULL);
+}
+
+/* Returns the cycles taken to map num_pages new pages, or 0 if they could not be mapped */
+static ccnt_t time_new_pages(vspace_t *vspace, size_t num_pages)
+{
+    ccnt_t start = sel4bench_get_cycle_count();
+    void *vaddr = vspace_new_pages(vspace, seL4_AllRights, num_pages, seL4_PageBits);
+    ccnt_t cycles = sel4bench_get_cycle_count() - start;
+    if (vaddr == NULL) {
+        return 0;
+    }
+    vspace_unmap_pages(vspace, vaddr, num_pages, seL4_PageBits, VSPACE_FREE);
+    return cycles;
+}
+
+static int bench_new_pages(env_t env)
+{
+    vspace_t batched, per_page;
+    vka_object_t batched_root, per_page_root;
+    int error;
+
+    vka_t per_page_vka = env->vka;
+    per_page_vka.utspace_alloc_batch = NULL;
+    per_page_vka.cspace_alloc_range = NULL;
+
+    error = new_pages_vspace(env, &batched, &batched_data, &env->vka, &batched_root);
+    test_eq(error, 0);
+    error = new_pages_vspace(env, &per_page, &per_page_data, &per_page_vka, &per_page_root);
+    test_eq(error, 0);
+
+    sel4bench_init();
+    printf("vspace_new_pages of 4K pages, cycles:\n");
+    printf("  %8s %16s %16s\n", "MiB", "batched", "page at a time");
+    for (size_t bits = NEW_PAGES_BENCH_MIN_BITS; bits <= NEW_PAGES_BENCH_MAX_BITS; bits += 2) {
+        size_t num_pages = BIT(bits - seL4_PageBits);
+        ccnt_t batched_cycles = time_new_pages(&batched, num_pages);
+        ccnt_t per_page_cycles = time_new_pages(&per_page, num_pages);
+        if (batched_cycles == 0 || per_page_cycles == 0) {
+            /* not a failure, the test environment may just not have this much memory */
+            printf("  %8zu out of memory\n", BIT(bits - 20));
+            break;
+        }
+        printf("  %8zu %16" PRIu64 " %16" PRIu64 "\n", BIT(bits - 20), (uint64_t)batched_cycles,
+               (uint64_t)per_page_cycles);
+    }
+    sel4bench_destroy();
+
+    vspace_tear_down(&batched, VSPACE_FREE);
+    vspace_tear_down(&per_page, VSPACE_FREE);
+    vka_free_object(&env->vka, &batched_root);
+    vka_free_object(&env->vka, &per_page_root);
+    return sel4test_get_result();
+}
+DEFINE_TEST(SEL4UTILS_BENCH0002, "Allocate and map new pages in batches and a page at a time", bench_new_pages,
+            true)
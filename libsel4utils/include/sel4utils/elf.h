@@ -72,6 +72,43 @@ void *
 sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka,
                                   vka_t *loader_vka, elf_t *elf, sel4utils_elf_region_t *regions, int mapanywhere);
 
+/**
+ * As sel4utils_elf_load_record_regions, but the pages of read only segments that hold nothing but
+ * file contents are mapped straight from the frames the loader holds the elf file in, rather than
+ * being allocated and copied. Writable segments, segments that are not laid out in the elf file at
+ * the same offset within a page as they are loaded at, and the partial pages at either end of a
+ * segment are still copied, as are pages of the file the loader vspace has no 4K frame cap for.
+ *
+ * The loadee gets copies of the frame caps, with the rights of the segment, allocated from
+ * loadee_vka, which must be the vka of the loadee vspace. They are mapped without a cookie, so
+ * tearing down the loadee neither frees the frames nor deletes the copies: call
+ * sel4utils_elf_release_shared before tearing it down. The frames must outlive the loadee, and
+ * must not be written to by the loader while the loadee is using them. Pages are only shared
+ * when the elf is loaded a window at a time (CONFIG_SEL4UTILS_ELF_LOAD_WINDOW is not 0).
+ * Processes configured with process_config_share_elf are loaded this way, and release the
+ * shared pages when they are destroyed.
+ *
+ * @param regions Array for list of regions to be placed, which is needed to release the
+ *                shared pages so is not optional.
+ */
+void *
+sel4utils_elf_load_record_regions_shared(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka,
+                                         vka_t *loader_vka, elf_t *elf, sel4utils_elf_region_t *regions,
+                                         int mapanywhere);
+
+/**
+ * Unmap the read only regions of an elf loaded by sel4utils_elf_load_record_regions_shared, or
+ * mapped from shared frames in some other way, deleting the loadee's caps to their frames and
+ * freeing the cslots. Frames the loadee allocated itself are freed as well, but shared frames
+ * are left for their owner.
+ *
+ * @param loadee the vspace the elf was loaded into
+ * @param num_regions number of regions, as reported by sel4utils_elf_num_regions
+ * @param regions regions recorded when the elf was loaded
+ */
+void
+sel4utils_elf_release_shared(vspace_t *loadee, int num_regions, sel4utils_elf_region_t *regions);
+
 /**
  * Wrapper for sel4utils_elf_load_record_regions. Does not record/perform reservations and
  * maps into the correct virtual addresses
@@ -102,6 +139,21 @@ sel4utils_elf_load(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka,
 void *
 sel4utils_elf_reserve(vspace_t *loadee, elf_t *elf, sel4utils_elf_region_t *regions);
 
+/**
+ * Parses an elf file and lays out the reservations its regions would need, without reserving
+ * anything. The reservation_vstart and reservation_size of each region are filled in, but not
+ * the reservation itself. A region may have an empty reservation if its pages are all in the
+ * reservations of its neighbours.
+ *
+ * @param elf the elf file to parse.
+ * @param regions Array for list of regions, in ascending order. Assumed to be the correct
+                  size as reported by a call to sel4utils_elf_num_regions
+ *
+ * @return 0 on success.
+ */
+int
+sel4utils_elf_plan_regions(elf_t *elf, sel4utils_elf_region_t *regions);
+
 /**
  * Parses an elf file and returns the number of loadable regions. The result of this
  * is used to calculate the number of regions to pass to sel4utils_elf_reserve and
@@ -73,6 +73,102 @@ void *sel4utils_dup_and_map(vka_t *vka, vspace_t *vspace, seL4_CPtr page, size_t
  */
 void sel4utils_unmap_dup(vka_t *vka, vspace_t *vspace, void *mapping, size_t size_bits);
 
+/* Duplicate a number of page caps and map them contiguously into a vspace with a single
+ * call, so that a buffer spanning them can be accessed at once
+ *
+ * @param vka Allocator for resources
+ * @param vspace vspace to map into
+ * @param pages cptrs to duplicate and map, in the order they are to be mapped
+ * @param num_pages number of pages
+ * @param size_bits size of the pages to map
+ *
+ * @return virtual address of mapping, NULL on error
+ */
+void *sel4utils_dup_and_map_pages(vka_t *vka, vspace_t *vspace, seL4_CPtr pages[], size_t num_pages,
+                                  size_t size_bits);
+
+/* Unmap duplicated page caps and free any resources. Is the opposite
+ * of sel4utils_dup_and_map_pages
+ *
+ * @param vka Allocator used to allocated resources
+ * @param vspace vspace that frames were mapped into
+ * @param mapping virtual address of mapping to remove
+ * @param num_pages number of pages
+ * @param size_bits size of the pages to unmap
+ *
+ * @return none
+ */
+void sel4utils_unmap_dup_pages(vka_t *vka, vspace_t *vspace, void *mapping, size_t num_pages, size_t size_bits);
+
+/* A window of virtual addresses reserved in a vspace for mapping other frames into, so that a
+ * frame can be looked at without allocating a cslot and finding free virtual memory each time.
+ * Each entry of the window has its own cslot and 4K of the reservation. Unmapping a frame from
+ * the window leaves it mapped until its entry is needed for another frame, least recently used
+ * first, so mapping the same frame again costs no system calls. */
+typedef struct sel4utils_map_window_entry {
+    seL4_CPtr slot;
+    /* frame cap whose copy is in slot and mapped, or seL4_CapNull */
+    seL4_CPtr page;
+    /* number of mappings of the entry that have not been unmapped */
+    size_t users;
+    uint64_t last_used;
+} sel4utils_map_window_entry_t;
+
+typedef struct sel4utils_map_window {
+    vka_t *vka;
+    vspace_t *vspace;
+    reservation_t reservation;
+    void *vaddr;
+    sel4utils_map_window_entry_t *entries;
+    size_t num_entries;
+    uint64_t clock;
+} sel4utils_map_window_t;
+
+/* Reserve a window in a vspace and allocate a cslot for each of its entries
+ *
+ * @param window window to initialise
+ * @param vka Allocator for resources, must be able to make paths to the frames mapped
+ * @param vspace vspace to reserve the window in
+ * @param entries storage for the entries, must remain valid while the window exists
+ * @param num_entries number of 4K pages in the window
+ *
+ * @return 0 on success
+ */
+int sel4utils_map_window_init(sel4utils_map_window_t *window, vka_t *vka, vspace_t *vspace,
+                              sel4utils_map_window_entry_t *entries, size_t num_entries);
+
+/* Map a 4K frame into a window, reusing its mapping if it is still there
+ *
+ * The cap is recognised by its cptr, so sel4utils_map_window_flush must be called before a cap
+ * that has been mapped is deleted, or its cslot is reused for another frame.
+ *
+ * @param window window to map into
+ * @param page cptr of the frame to map
+ *
+ * @return virtual address of mapping, NULL if every entry is in use or on error
+ */
+void *sel4utils_map_window_map(sel4utils_map_window_t *window, seL4_CPtr page);
+
+/* Finish with a mapping made by sel4utils_map_window_map. The frame stays mapped until its
+ * entry is reused or the window is flushed
+ *
+ * @param window window the frame was mapped into
+ * @param mapping virtual address returned by sel4utils_map_window_map
+ */
+void sel4utils_map_window_unmap(sel4utils_map_window_t *window, void *mapping);
+
+/* Unmap every frame left mapped in a window and delete their copies. No mappings may be in use
+ *
+ * @param window window to flush
+ */
+void sel4utils_map_window_flush(sel4utils_map_window_t *window);
+
+/* Flush a window and free its cslots and reservation
+ *
+ * @param window window to destroy
+ */
+void sel4utils_map_window_destroy(sel4utils_map_window_t *window);
+
 #if defined(CONFIG_IOMMU) || defined(CONFIG_ARM_SMMU)
 int sel4utils_map_iospace_page(vka_t *vka, seL4_CPtr iospace, seL4_CPtr frame, seL4_Word vaddr,
                                seL4_CapRights_t rights, int cacheable, seL4_Word size_bits,
@@ -57,6 +57,10 @@ typedef struct {
      * you want to implement */
     int num_elf_regions;
     sel4utils_elf_region_t *elf_regions;
+    /* regions mapped with copies of caps to frames the process does not own, which are released
+     * with sel4utils_elf_release_shared when the process is destroyed */
+    int num_shared_regions;
+    sel4utils_elf_region_t *shared_regions;
     bool own_vspace;
     bool own_cspace;
     bool own_ep;
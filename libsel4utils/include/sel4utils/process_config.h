@@ -26,6 +26,9 @@ typedef struct {
     const char *image_name;
     /* Do you want the elf image preloaded? */
     bool do_elf_load;
+    /* if so, should read only segments be mapped straight from the frames of the image instead
+     * of being copied? See sel4utils_elf_load_record_regions_shared */
+    bool share_elf;
 
     /* otherwise what is the entry point and sysinfo? */
     void *entry_point;
@@ -94,6 +97,12 @@ static inline sel4utils_process_config_t process_config_elf(sel4utils_process_co
     return config;
 }
 
+static inline sel4utils_process_config_t process_config_share_elf(sel4utils_process_config_t config, bool share)
+{
+    config.share_elf = share;
+    return config;
+}
+
 static inline sel4utils_process_config_t process_config_noelf(sel4utils_process_config_t config, void *entry_point,
                                                               uintptr_t sysinfo)
 {
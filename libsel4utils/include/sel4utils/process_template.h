@@ -0,0 +1,85 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+#pragma once
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+
+#include <sel4utils/elf.h>
+#include <sel4utils/process.h>
+#include <sel4utils/process_config.h>
+
+/* A process template holds everything about an elf image that is the same for every process
+ * started from it, so that the same image can be started many times without parsing and loading
+ * the elf file each time.
+ *
+ * The contents of each region are loaded once into frames mapped into the spawner vspace. The
+ * frames of read only regions are mapped straight into every process started from the template,
+ * and writable regions are copied into new frames with one copy per window of pages. */
+typedef struct sel4utils_process_template {
+    void *entry_point;
+    uintptr_t sysinfo;
+    int num_elf_phdrs;
+    Elf_Phdr *elf_phdrs;
+    /* regions of the image as laid out by sel4utils_elf_plan_regions. No reservations are held */
+    int num_elf_regions;
+    sel4utils_elf_region_t *elf_regions;
+    /* for each region, the contents of its planned reservation in the spawner vspace */
+    void **images;
+    vspace_t *spawner_vspace;
+} sel4utils_process_template_t;
+
+/**
+ * Parse and load an elf image from the cpio archive into a template.
+ *
+ * @param process_template uninitialised template.
+ * @param spawner_vspace   vspace of the caller. The contents of the image are loaded into new
+ *                         pages in this vspace, which must be able to find their frame caps.
+ * @param image_name       name of the elf image to load from the cpio archive.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sel4utils_process_template_create(sel4utils_process_template_t *process_template, vspace_t *spawner_vspace,
+                                      const char *image_name);
+
+/**
+ * Configure a process from a template, as sel4utils_configure_process_custom would for the image
+ * the template was created from.
+ *
+ * The regions of the image are reserved before the thread is configured, and are populated
+ * in place: read only regions by mapping copies of the template's frame caps, and writable
+ * regions by copying the template's contents into new frames. sel4utils_destroy_process deletes
+ * the copies but leaves the frames to the template, which must not be destroyed while any
+ * process started from it exists.
+ *
+ * @param process_template template created by sel4utils_process_template_create.
+ * @param process          uninitialised process struct.
+ * @param vka              allocator to use to allocate objects. Must be able to make paths to
+ *                         the frame caps of the spawner vspace.
+ * @param config           process config. It must create a vspace, and any elf image it names
+ *                         is ignored.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sel4utils_process_template_configure(sel4utils_process_template_t *process_template,
+                                         sel4utils_process_t *process, vka_t *vka,
+                                         sel4utils_process_config_t config);
+
+/**
+ * Free the frames and memory held by a template.
+ *
+ * @param process_template template to destroy.
+ */
+void sel4utils_process_template_destroy(sel4utils_process_template_t *process_template);
@@ -60,6 +60,26 @@ typedef struct sel4utils_checkpoint {
 
 typedef void (*sel4utils_thread_entry_fn)(void *arg0, void *arg1, void *ipc_buf);
 
+/* Taken by a paging fault handler around resolving each fault, to serialise it with every other
+ * user of the allocator and vspaces the handler modifies */
+typedef struct sel4utils_paging_lock {
+    void (*lock)(void *cookie);
+    void (*unlock)(void *cookie);
+    void *cookie;
+} sel4utils_paging_lock_t;
+
+typedef struct sel4utils_paging_fault_handler {
+    sel4utils_thread_t thread;
+    /* vspace the handler runs in */
+    vspace_t *vspace;
+    /* vspace that faults are resolved against */
+    vspace_t *paged_vspace;
+    seL4_CPtr fault_endpoint;
+    char *name;
+    /* lock.lock is NULL if the handler does not need to take a lock */
+    sel4utils_paging_lock_t lock;
+} sel4utils_paging_fault_handler_t;
+
 /**
  * Configure a thread, allocating any resources required. The thread will start at priority 0.
  *
@@ -203,6 +223,42 @@ void sel4utils_free_checkpoint(sel4utils_checkpoint_t *checkpoint);
 int sel4utils_start_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vspace,
                                   seL4_CPtr cspace, seL4_Word data, char *name, sel4utils_thread_t *res);
 
+/**
+ * Start a fault handling thread that backs lazy reservations on demand and copies pages shared
+ * copy-on-write when they are written to. Faults on a lazy reservation of paged_vspace (see
+ * sel4utils_set_lazy_reservation) or on its copy-on-write pages (see
+ * sel4utils_share_mem_at_vaddr_cow) are resolved with sel4utils_vspace_handle_fault and the
+ * faulting thread is resumed. Any other fault is printed
+ * as by sel4utils_start_fault_handler, and the faulting thread is left blocked.
+ *
+ * The handler runs concurrently with the thread that started it. Resolving a fault modifies
+ * paged_vspace, allocates frames and book keeping from the vka of paged_vspace, and for
+ * copy-on-write pages makes temporary mappings in vspace. None of these are thread safe, so
+ * either
+ *  - pass a lock, which the handler holds whilst resolving each fault and which everything else
+ *    must hold whilst using paged_vspace, vspace or the vka of paged_vspace, or
+ *  - pass NULL, in which case paged_vspace must have been given a vka that is dedicated to it,
+ *    and nothing else may use paged_vspace, or vspace whilst copy-on-write pages are shared.
+ * Typically the faulting threads belong to a process whose vspace is managed by the process
+ * running the handler.
+ *
+ * @param fault_endpoint the fault_endpoint to wait on
+ * @param vka allocator
+ * @param vspace vspace to run the handler in (this library must be mapped into that vspace).
+ * @param cspace the cspace that the fault_endpoint is in
+ * @param data the cspace_data for that cspace (with correct guard)
+ * @param name the name of the thread to print if it faults
+ * @param paged_vspace the vspace of the threads whose faults are sent to fault_endpoint
+ * @param lock lock to hold whilst resolving a fault, or NULL if paged_vspace has a dedicated vka
+ *             (see above). It is copied, but its cookie must stay valid whilst the handler runs.
+ * @param res the handler data structure to populate, must stay valid whilst the handler runs
+ *
+ * @return 0 on success.
+ */
+int sel4utils_start_paging_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vspace,
+                                         seL4_CPtr cspace, seL4_Word data, char *name, vspace_t *paged_vspace,
+                                         sel4utils_paging_lock_t *lock, sel4utils_paging_fault_handler_t *res);
+
 /**
  * Pretty print a fault message.
  *
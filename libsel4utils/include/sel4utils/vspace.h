@@ -36,7 +36,9 @@
 #include <vspace/vspace.h>
 #include <vka/vka.h>
 #include <sel4utils/util.h>
+#include <sel4utils/mapping.h>
 #include <sel4utils/arch/vspace.h>
+#include <sel4utils/vspace_log.h>
 
 /* These definitions are only here so that you can take the size of them.
  * TOUCHING THESE DATA STRUCTURES IN ANY WAY WILL BREAK THE WORLD
@@ -53,6 +55,7 @@ typedef struct vspace_mid_level {
 
 typedef struct vspace_bottom_level {
     seL4_CPtr cap[VSPACE_LEVEL_SIZE];
+    /* not present in the bottom levels of compact vspaces, see sel4utils_set_compact_book_keeping */
     uintptr_t cookie[VSPACE_LEVEL_SIZE];
 } vspace_bottom_level_t;
 
@@ -66,11 +69,71 @@ struct sel4utils_res {
     int cacheable;
     int malloced;
     bool rights_deferred;
-    struct sel4utils_res *next;
+    /* pages are allocated and mapped when first touched, see sel4utils_set_lazy_reservation */
+    bool lazy;
+    /* number of pages after a faulting page to map along with it, for lazy reservations */
+    size_t read_ahead;
+    /* reservations of a vspace form an AVL tree ordered by start address */
+    struct sel4utils_res *left;
+    struct sel4utils_res *right;
+    int height;
 };
 
 typedef struct sel4utils_res sel4utils_res_t;
 
+/* A maximal run of free (neither mapped nor reserved) virtual memory */
+struct sel4utils_free_extent {
+    uintptr_t start;
+    uintptr_t end;
+    /* size of the largest extent in the subtree rooted at this node */
+    uintptr_t max_size;
+    struct sel4utils_free_extent *left;
+    struct sel4utils_free_extent *right;
+    int height;
+};
+
+/* Index of the free extents of a vspace, kept as an AVL tree ordered by address and
+ * augmented with the largest extent size of each subtree so that a hole of a given size
+ * and alignment can be found without walking the shadow page table */
+typedef struct sel4utils_free_index {
+    struct sel4utils_free_extent *root;
+    /* nodes not in the tree, linked through their right pointer */
+    struct sel4utils_free_extent *spare;
+    size_t num_spare;
+    /* pages that nodes have been carved from, linked through their first word */
+    void *chunks;
+    size_t num_chunks;
+    /* incremented on every change to the free virtual memory of the vspace */
+    uint64_t generation;
+    /* the tree does not reflect the shadow page table and must be rebuilt before use */
+    bool stale;
+    bool rebuilding;
+} sel4utils_free_index_t;
+
+/* A frame shared copy-on-write between vspaces. The vspaces only map it read only, each through
+ * its own copy of the cap. The record keeps another copy, along with the cookie the frame was
+ * allocated with, and frees the frame when the last vspace drops its reference */
+typedef struct sel4utils_cow_frame {
+    size_t refs;
+    seL4_CPtr cap;
+    uintptr_t cookie;
+    /* allocator that cap and cookie belong to */
+    vka_t *vka;
+    size_t size_bits;
+} sel4utils_cow_frame_t;
+
+/* A range of a vspace that was shared copy-on-write. Pages that have since been written to
+ * or unmapped are no longer copy-on-write and have a NULL frame */
+typedef struct sel4utils_cow_range {
+    uintptr_t start;
+    size_t num_pages;
+    size_t size_bits;
+    sel4utils_cow_frame_t **frames;
+    /* number of frames that are not NULL, the range is freed when this reaches 0 */
+    size_t live;
+    struct sel4utils_cow_range *next;
+} sel4utils_cow_range_t;
+
 typedef struct sel4utils_alloc_data {
     seL4_CPtr vspace_root;
     vka_t *vka;
@@ -79,8 +142,25 @@ typedef struct sel4utils_alloc_data {
     uintptr_t last_allocated;
     vspace_t *bootstrap;
     sel4utils_map_page_fn map_page;
-    sel4utils_res_t *reservation_head;
+    sel4utils_res_t *reservation_root;
     bool is_empty;
+    /* back base page requests with larger pages where possible */
+    bool promote_pages;
+    sel4utils_free_index_t free_index;
+    sel4utils_cow_range_t *cow_ranges;
+    /* window in the vspace handling faults that copy-on-write pages are copied through, made on
+     * first use. Its vspace is NULL until then */
+    sel4utils_map_window_t cow_window;
+    sel4utils_map_window_entry_t cow_window_entries[2];
+    /* bottom levels only hold caps, and cookies are kept in a separate sparse table */
+    bool compact;
+    vspace_mid_level_t *cookie_top_level;
+    /* last bottom level found by get_bottom_level and the base address it covers */
+    uintptr_t lookup_base;
+    vspace_bottom_level_t *lookup_level;
+#ifdef CONFIG_SEL4UTILS_VSPACE_LOG
+    sel4utils_vspace_log_t *log;
+#endif
 } sel4utils_alloc_data_t;
 
 static inline sel4utils_res_t *reservation_to_res(reservation_t res)
@@ -219,6 +299,7 @@ int sel4utils_bootstrap_vspace(vspace_t *vspace, sel4utils_alloc_data_t *data,
 /**
  * Initialise a vspace allocator for the current address space (this is intended
  * for use by the root task). Take details of existing frames from bootinfo.
+ * The caps to the frames of the image are recorded, so that vspace_get_cap finds them.
  *
  * @param vspace                  uninitialised vspace struct to populate.
  * @param data                    uninitialised vspace data struct to populate.
@@ -327,6 +408,103 @@ int sel4utils_reserve_range_at_no_alloc(vspace_t *vspace, sel4utils_res_t *reser
 int sel4utils_move_resize_reservation(vspace_t *vspace, reservation_t reservation, void *vaddr,
                                       size_t bytes);
 
+/**
+ * Enable or disable page size promotion. When enabled, requests to create new base (4K) pages
+ * through vspace_new_pages and vspace_new_pages_at_vaddr are satisfied with the largest naturally
+ * aligned page sizes that fit in the range, falling back to smaller pages at the edges of the range
+ * and wherever a larger page cannot be allocated or mapped. vspace_new_pages will also align the
+ * range it picks for the largest page size that fits in it.
+ *
+ * Pages created this way can be unmapped with any size_bits up to their actual size, but only
+ * as a whole: unmapping part of a promoted page fails.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param promote true to enable promotion, false to disable it.
+ */
+void sel4utils_set_page_promotion(vspace_t *vspace, bool promote);
+
+/**
+ * Switch a vspace to a compact layout for its book keeping. Normally every base page in a region
+ * that has been partially reserved or mapped costs two words of book keeping, one for its cap
+ * and one for its cookie. In the compact layout only the cap is kept alongside the page, and
+ * cookies are kept in a separate table that only has entries for regions where a non-zero cookie
+ * has been stored. This halves the book keeping for mappings of frames the vspace did not
+ * allocate itself (vspace_map_pages, shared memory, device memory), at the cost of an extra
+ * lookup for each cookie. Vspaces that mostly allocate their own frames with vspace_new_pages
+ * use about the same memory either way.
+ *
+ * The layout must be chosen straight after the vspace is created, before anything is reserved
+ * or mapped in it.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @return 0 on success, -1 if the vspace already has book keeping for any mappings.
+ */
+int sel4utils_set_compact_book_keeping(vspace_t *vspace);
+
+/**
+ * Make a reservation lazily backed. Instead of being mapped up front with vspace_new_pages_at_vaddr,
+ * its pages are allocated and mapped by sel4utils_vspace_handle_fault the first time they are
+ * touched. Faults on the vspace need to be delivered to a handler that calls it, such as
+ * sel4utils_start_paging_fault_handler.
+ *
+ * Backing a page allocates from the vka of the vspace. If faults are handled by another thread,
+ * that vka must either be dedicated to the vspace or be shared under a lock that the handler
+ * also holds (see sel4utils_start_paging_fault_handler).
+ *
+ * Pages that have been backed belong to the vspace: they may be unmapped (after which touching
+ * them backs them again), and any still mapped are unmapped and freed when the reservation is
+ * freed.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param reservation the reservation to make lazy. Must not have deferred rights.
+ * @param read_ahead number of following pages in the reservation to back along with each
+ *                   faulting page, stopping at the first one that is already backed.
+ * @return 0 on success.
+ */
+int sel4utils_set_lazy_reservation(vspace_t *vspace, reservation_t reservation, size_t read_ahead);
+
+/**
+ * Share memory from one vspace to another copy-on-write. As for vspace_share_mem_at_vaddr, but
+ * instead of both vspaces mapping the same frames writable, the frames are mapped read only into
+ * both and whichever vspace first writes to a page faults and is given its own copy of it. The
+ * last vspace still sharing a frame takes it over without copying.
+ *
+ * Both vspaces need their faults delivered to sel4utils_vspace_handle_fault, for example by
+ * sel4utils_start_paging_fault_handler, or writes to the shared pages will never complete.
+ *
+ * @param from vspace to share memory from.
+ * @param to vspace to share memory to.
+ * @param start address of the memory to share in from. This must be mapped, in pages of
+ *              exactly size_bits, and lie within a single reservation of from.
+ * @param num_pages number of pages to share.
+ * @param size_bits size of the pages.
+ * @param vaddr address to map the memory at in to.
+ * @param reservation reservation in to covering vaddr. Its rights are used for the pages once
+ *                    they have been copied.
+ * @return 0 on success.
+ */
+int sel4utils_share_mem_at_vaddr_cow(vspace_t *from, vspace_t *to, void *start, int num_pages,
+                                     size_t size_bits, void *vaddr, reservation_t reservation);
+
+/**
+ * Resolve a fault that is due to how the vspace manages its memory. That is either a fault on a
+ * lazily backed reservation, which is resolved by allocating and mapping the page that was
+ * touched along with any read ahead, or a write to a page shared copy-on-write, which is resolved
+ * by giving the vspace its own copy of the page. The vspace is not thread safe, so the caller
+ * must ensure nothing else is using it at the same time.
+ *
+ * Copies of 4K pages are made through a map window that is reserved in current the first time
+ * one is needed and kept until the vspace is torn down, so current must outlive the vspace.
+ *
+ * @param vspace the virtual memory allocator of the faulting thread.
+ * @param current the vspace of the thread calling this function, used for temporary mappings.
+ * @param vaddr the faulting address.
+ * @param write true if the fault was caused by a write.
+ * @return 0 if the fault was resolved and the faulting thread can be resumed, otherwise the
+ *         fault is not one this vspace can resolve.
+ */
+int sel4utils_vspace_handle_fault(vspace_t *vspace, vspace_t *current, uintptr_t vaddr, bool write);
+
 /*
  * Copy the code and data segment (the image effectively) from current vspace
  * into clone vspace. The clone vspace should be initialised.
@@ -338,6 +516,25 @@ int sel4utils_move_resize_reservation(vspace_t *vspace, reservation_t reservatio
  */
 int sel4utils_bootstrap_clone_into_vspace(vspace_t *current, vspace_t *clone, reservation_t reserve);
 
+/*
+ * As for sel4utils_bootstrap_clone_into_vspace, but the pages of the code of the image (up to
+ * _etext) that current has caps to are shared copy-on-write with
+ * sel4utils_share_mem_at_vaddr_cow instead of being copied. This makes them read only in
+ * current as well, so the faults of both vspaces need to be handled as described there. The
+ * rest of the image, which the running process writes to, is always copied, as are any pages
+ * current has no caps to.
+ *
+ * current only has caps to its image if they were recorded when it was bootstrapped, as
+ * sel4utils_bootstrap_vspace_with_bootinfo does with the userImageFrames of the bootinfo. For
+ * a vspace bootstrapped without them this behaves exactly as sel4utils_bootstrap_clone_into_vspace.
+ *
+ * @param current the vspace to copy from.
+ * @param clone the vspace to copy to.
+ * @param reservation the previously established reservation in clone to copy.
+ * @return 0 on success.
+ */
+int sel4utils_bootstrap_clone_into_vspace_cow(vspace_t *current, vspace_t *clone, reservation_t reserve);
+
 /**
  * Get the bounds of _executable_start and _end.
  *
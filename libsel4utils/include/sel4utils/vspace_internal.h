@@ -33,9 +33,71 @@
 #define BYTES_FOR_LEVEL(l) BIT(VSPACE_LEVEL_BITS * (l) + PAGE_BITS_4K)
 #define ALIGN_FOR_LEVEL(l) (~(MASK(VSPACE_LEVEL_BITS * (l) + PAGE_BITS_4K)))
 
+/* Range of virtual memory that find_range hands out from. The first page is never handed
+ * out so that NULL can be used to indicate failure */
+#define FREE_INDEX_START PAGE_SIZE_4K
+#define FREE_INDEX_END KERNEL_RESERVED_START
+
+/* Number of pages a self bootstrapped vspace may use for free index nodes. These come out of
+ * the region that is reserved at bootstrap for book keeping */
+#define FREE_INDEX_BOOTSTRAP_PAGES 16
+
 void *create_level(vspace_t *vspace, size_t size);
 void *bootstrap_create_level(vspace_t *vspace, size_t size);
 
+/* Free extent index, see free_index.c */
+void sel4utils_free_index_init(vspace_t *vspace);
+int sel4utils_free_index_prepare(vspace_t *vspace);
+void sel4utils_free_index_add(vspace_t *vspace, uintptr_t start, uintptr_t end);
+void sel4utils_free_index_remove(vspace_t *vspace, uintptr_t start, uintptr_t end);
+void sel4utils_free_index_invalidate(vspace_t *vspace);
+uintptr_t sel4utils_free_index_find(vspace_t *vspace, uintptr_t hint, size_t bytes, size_t size_bits);
+void sel4utils_free_index_tear_down(vspace_t *vspace);
+/* Probe the shadow page table for a free range instead, for when the index is unavailable */
+uintptr_t sel4utils_find_range_scan(sel4utils_alloc_data_t *data, uintptr_t start, uintptr_t end,
+                                    size_t bytes, size_t align_bits);
+
+/* Copy-on-write sharing, see cow.c */
+int sel4utils_cow_share(vspace_t *from, vspace_t *to, uintptr_t start, size_t num_pages, size_t size_bits,
+                        uintptr_t vaddr, seL4_CapRights_t to_rights, int from_cacheable, int to_cacheable,
+                        size_t *shared);
+bool sel4utils_cow_is_shared(vspace_t *vspace, uintptr_t vaddr);
+int sel4utils_cow_handle_write(vspace_t *vspace, vspace_t *current, uintptr_t vaddr, seL4_CapRights_t rights,
+                               int cacheable);
+void sel4utils_cow_unmapped(vspace_t *vspace, uintptr_t vaddr, bool free);
+void sel4utils_cow_tear_down(vspace_t *vspace);
+
+/* Operation log, see log.c. Wrap an operation in VSPACE_LOG_START and VSPACE_LOG_OP to record
+ * it, these compile to nothing unless CONFIG_SEL4UTILS_VSPACE_LOG is enabled */
+#ifdef CONFIG_SEL4UTILS_VSPACE_LOG
+void sel4utils_vspace_log_begin(vspace_t *vspace, sel4utils_vspace_log_mark_t *mark);
+void sel4utils_vspace_log_end(const sel4utils_vspace_log_mark_t *mark, sel4utils_vspace_log_op_t op,
+                              uintptr_t vaddr, size_t size_bits, size_t count, int result);
+void sel4utils_vspace_log_paging_objects(vspace_t *vspace, size_t num);
+
+#define VSPACE_LOG_START(vspace) \
+    sel4utils_vspace_log_mark_t _log_mark; \
+    sel4utils_vspace_log_begin(vspace, &_log_mark)
+#define VSPACE_LOG_OP(op, vaddr, size_bits, count, result) \
+    sel4utils_vspace_log_end(&_log_mark, SEL4UTILS_VSPACE_LOG_##op, (uintptr_t) (vaddr), size_bits, count, result)
+#define VSPACE_LOG_PAGING_OBJECTS(vspace, num) sel4utils_vspace_log_paging_objects(vspace, num)
+#else
+#define VSPACE_LOG_START(vspace) do { } while(0)
+#define VSPACE_LOG_OP(op, vaddr, size_bits, count, result) do { } while(0)
+#define VSPACE_LOG_PAGING_OBJECTS(vspace, num) do { } while(0)
+#endif /* CONFIG_SEL4UTILS_VSPACE_LOG */
+
+static inline sel4utils_alloc_data_t *get_alloc_data(vspace_t *vspace)
+{
+    return (sel4utils_alloc_data_t *) vspace->data;
+}
+
+/* Size of the bottom levels of a vspace's shadow page table */
+static inline size_t bottom_level_size(sel4utils_alloc_data_t *data)
+{
+    return data->compact ? sizeof(((vspace_bottom_level_t *) NULL)->cap) : sizeof(vspace_bottom_level_t);
+}
+
 static inline void *create_mid_level(vspace_t *vspace, uintptr_t init)
 {
     vspace_mid_level_t *level = create_level(vspace, sizeof(vspace_mid_level_t));
@@ -49,24 +111,65 @@ static inline void *create_mid_level(vspace_t *vspace, uintptr_t init)
 
 static inline void *create_bottom_level(vspace_t *vspace, uintptr_t init)
 {
-    vspace_bottom_level_t *level = create_level(vspace, sizeof(vspace_bottom_level_t));
-    if (level) {
+    /* levels are zeroed when they are created, which leaves every cap EMPTY and every cookie 0 */
+    vspace_bottom_level_t *level = create_level(vspace, bottom_level_size(get_alloc_data(vspace)));
+    if (level && init != EMPTY) {
         for (int i = 0; i < VSPACE_LEVEL_SIZE; i++) {
             level->cap[i] = init;
-            level->cookie[i] = 0;
         }
     }
     return level;
 }
 
-static inline sel4utils_alloc_data_t *get_alloc_data(vspace_t *vspace)
+/* The cookies of a compact vspace are kept in a table with the same shape as the shadow page
+ * table, except that its bottom levels are arrays of cookies. Levels of it are only created
+ * once a non-zero cookie is stored beneath them, and a missing level means its cookies are all
+ * 0. Returns the cookies for the bottom level covering vaddr, or NULL if there are none */
+static inline uintptr_t *get_cookie_level(vspace_t *vspace, uintptr_t vaddr, bool create)
 {
-    return (sel4utils_alloc_data_t *) vspace->data;
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+
+    if (data->cookie_top_level == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        data->cookie_top_level = create_level(vspace, sizeof(vspace_mid_level_t));
+        if (data->cookie_top_level == NULL) {
+            return NULL;
+        }
+    }
+
+    vspace_mid_level_t *level = data->cookie_top_level;
+    for (int i = VSPACE_NUM_LEVELS - 1; i > 0; i--) {
+        uintptr_t *next = &level->table[INDEX_FOR_LEVEL(vaddr, i)];
+        if (*next == EMPTY) {
+            if (!create) {
+                return NULL;
+            }
+            *next = (uintptr_t) create_level(vspace, sizeof(vspace_mid_level_t));
+            if (*next == EMPTY) {
+                return NULL;
+            }
+        }
+        level = (vspace_mid_level_t *) *next;
+    }
+    return level->table;
+}
+
+/* Cookies of the entries in a bottom level, NULL if the vspace is compact and none are stored.
+ * Set create to make space for them in that case */
+static inline uintptr_t *get_cookies(vspace_t *vspace, vspace_bottom_level_t *level, uintptr_t vaddr, bool create)
+{
+    if (!get_alloc_data(vspace)->compact) {
+        return level->cookie;
+    }
+    return get_cookie_level(vspace, vaddr, create);
 }
 
 static int reserve_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level, uintptr_t start, uintptr_t end,
                                   bool preserve_frames)
 {
+    uintptr_t *cookies = get_cookies(vspace, level, start, false);
     while (start < end) {
         int index = INDEX_FOR_LEVEL(start, 0);
         uintptr_t cap = level->cap[index];
@@ -78,7 +181,9 @@ static int reserve_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level
             return -1;
         }
         level->cap[index] = RESERVED;
-        level->cookie[index] = 0;
+        if (cookies) {
+            cookies[index] = 0;
+        }
         start += BYTES_FOR_LEVEL(0);
     }
     return 0;
@@ -144,6 +249,7 @@ static int reserve_entries_mid(vspace_t *vspace, vspace_mid_level_t *level, int
 static int clear_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level, uintptr_t start, uintptr_t end,
                                 bool only_reserved)
 {
+    uintptr_t *cookies = get_cookies(vspace, level, start, false);
     while (start < end) {
         int index = INDEX_FOR_LEVEL(start, 0);
         uintptr_t cap = level->cap[index];
@@ -151,7 +257,9 @@ static int clear_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level,
             return -1;
         }
         level->cap[index] = EMPTY;
-        level->cookie[index] = 0;
+        if (cookies) {
+            cookies[index] = 0;
+        }
         start += BYTES_FOR_LEVEL(0);
     }
     return 0;
@@ -194,6 +302,11 @@ static int clear_entries_mid(vspace_t *vspace, vspace_mid_level_t *level, int le
 static int update_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level, uintptr_t start, uintptr_t end,
                                  seL4_CPtr cap, uintptr_t cookie)
 {
+    uintptr_t *cookies = get_cookies(vspace, level, start, cookie != 0);
+    if (cookies == NULL && cookie != 0) {
+        ZF_LOGE("Failed to allocate book keeping for cookies");
+        return -1;
+    }
     while (start < end) {
         int index = INDEX_FOR_LEVEL(start, 0);
         uintptr_t old_cap = level->cap[index];
@@ -202,7 +315,9 @@ static int update_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level,
             return -1;
         }
         level->cap[index] = cap;
-        level->cookie[index] = cookie;
+        if (cookies) {
+            cookies[index] = cookie;
+        }
         start += BYTES_FOR_LEVEL(0);
     }
     return 0;
@@ -302,13 +417,26 @@ static inline int update_entries(vspace_t *vspace, uintptr_t vaddr, seL4_CPtr ca
     uintptr_t start = vaddr;
     uintptr_t end = vaddr + BIT(size_bits);
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    return update_entries_mid(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, start, end, cap, cookie);
+    int error = update_entries_mid(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, start, end, cap, cookie);
+    if (error) {
+        /* we don't know how much of the range was updated */
+        sel4utils_free_index_invalidate(vspace);
+        return error;
+    }
+    sel4utils_free_index_remove(vspace, start, end);
+    return 0;
 }
 
 static inline int reserve_entries_range(vspace_t *vspace, uintptr_t start, uintptr_t end, bool preserve_frames)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    return reserve_entries_mid(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, start, end, preserve_frames);
+    int error = reserve_entries_mid(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, start, end, preserve_frames);
+    if (error) {
+        sel4utils_free_index_invalidate(vspace);
+        return error;
+    }
+    sel4utils_free_index_remove(vspace, start, end);
+    return 0;
 }
 
 static inline int reserve_entries(vspace_t *vspace, uintptr_t vaddr, size_t size_bits)
@@ -323,8 +451,10 @@ static inline int clear_entries_range(vspace_t *vspace, uintptr_t start, uintptr
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     int error = clear_entries_mid(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, start, end, only_reserved);
     if (error) {
+        sel4utils_free_index_invalidate(vspace);
         return error;
     }
+    sel4utils_free_index_add(vspace, start, end);
 
     if (start < data->last_allocated) {
         data->last_allocated = start;
@@ -333,6 +463,93 @@ static inline int clear_entries_range(vspace_t *vspace, uintptr_t start, uintptr
     return 0;
 }
 
+/* A run of consecutive entries that have been cleared, which is given to the free index as a
+ * whole once an entry that stays in use is reached */
+struct cleared_run {
+    vspace_t *vspace;
+    bool in_run;
+    uintptr_t start;
+};
+
+static inline void cleared_run_visit(struct cleared_run *run, uintptr_t vaddr, bool cleared)
+{
+    if (cleared) {
+        if (!run->in_run) {
+            run->in_run = true;
+            run->start = vaddr;
+        }
+    } else if (run->in_run) {
+        run->in_run = false;
+        sel4utils_free_index_add(run->vspace, run->start, vaddr);
+    }
+}
+
+static void clear_reserved_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level, uintptr_t start,
+                                          uintptr_t end, struct cleared_run *run)
+{
+    uintptr_t *cookies = get_cookies(vspace, level, start, false);
+    while (start < end) {
+        int index = INDEX_FOR_LEVEL(start, 0);
+        uintptr_t cap = level->cap[index];
+        if (cap == RESERVED) {
+            level->cap[index] = EMPTY;
+            if (cookies) {
+                cookies[index] = 0;
+            }
+        }
+        cleared_run_visit(run, start, cap == RESERVED || cap == EMPTY);
+        start += BYTES_FOR_LEVEL(0);
+    }
+}
+
+static void clear_reserved_entries_mid(vspace_t *vspace, vspace_mid_level_t *level, int level_num, uintptr_t start,
+                                       uintptr_t end, struct cleared_run *run)
+{
+    while (start < end) {
+        int index = INDEX_FOR_LEVEL(start, level_num);
+        uintptr_t aligned_start = start & ALIGN_FOR_LEVEL(level_num);
+        uintptr_t next_start = aligned_start + BYTES_FOR_LEVEL(level_num);
+        if (next_start > end) {
+            next_start = end;
+        }
+        uintptr_t next_table = level->table[index];
+        if (next_table == RESERVED) {
+            /* a reservation only reserves whole entries above the bottom level when it covers
+             * them, so one we only partly cover belongs to someone else */
+            bool covered = start == aligned_start && next_start == aligned_start + BYTES_FOR_LEVEL(level_num);
+            if (covered) {
+                level->table[index] = EMPTY;
+            }
+            cleared_run_visit(run, start, covered);
+        } else if (next_table == EMPTY) {
+            cleared_run_visit(run, start, true);
+        } else if (level_num == 1) {
+            clear_reserved_entries_bottom(vspace, (vspace_bottom_level_t *)next_table, start, next_start, run);
+        } else {
+            clear_reserved_entries_mid(vspace, (vspace_mid_level_t *)next_table, level_num - 1, start, next_start, run);
+        }
+        start = next_start;
+    }
+}
+
+/* Clear the reserved entries in [start, end), leaving any frames in the range mapped. The free
+ * index is only told about the ranges that were actually cleared, and is never rebuilt or
+ * grown, so this is safe to call when freeing */
+static inline void clear_reserved_entries_range(vspace_t *vspace, uintptr_t start, uintptr_t end)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    struct cleared_run run = {
+        .vspace = vspace,
+        .in_run = false,
+    };
+    clear_reserved_entries_mid(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, start, end, &run);
+    cleared_run_visit(&run, end, false);
+
+    if (start < data->last_allocated) {
+        data->last_allocated = start;
+    }
+}
+
 static inline int clear_entries(vspace_t *vspace, uintptr_t vaddr, size_t size_bits)
 {
     uintptr_t start = vaddr;
@@ -374,42 +591,103 @@ static inline bool is_reserved(vspace_mid_level_t *top_level, uintptr_t vaddr, s
     return is_reserved_or_empty(top_level, vaddr, size_bits, RESERVED, EMPTY);
 }
 
-static inline seL4_CPtr get_cap(vspace_mid_level_t *top, uintptr_t vaddr)
+/* Bottom level of the shadow page table that covers vaddr, or NULL if there is none. Once
+ * created a bottom level stays in place until the vspace is torn down, with reserving, clearing
+ * and unmapping only changing its entries, so the last one found can be reused without being
+ * invalidated. This makes lookups of consecutive pages a single index */
+static inline vspace_bottom_level_t *get_bottom_level(sel4utils_alloc_data_t *data, uintptr_t vaddr)
 {
-    vspace_mid_level_t *level = top;
-    for (int i = VSPACE_NUM_LEVELS - 1; i > 1; i--) {
-        int index = INDEX_FOR_LEVEL(vaddr, i);
-        uintptr_t next = level->table[index];
+    uintptr_t base = vaddr & ALIGN_FOR_LEVEL(1);
+    if (data->lookup_level != NULL && data->lookup_base == base) {
+        return data->lookup_level;
+    }
+
+    vspace_mid_level_t *level = data->top_level;
+    for (int i = VSPACE_NUM_LEVELS - 1; i > 0; i--) {
+        uintptr_t next = level->table[INDEX_FOR_LEVEL(vaddr, i)];
         if (next == EMPTY || next == RESERVED) {
-            return 0;
+            return NULL;
         }
         level = (vspace_mid_level_t *)next;
     }
-    uintptr_t next = level->table[INDEX_FOR_LEVEL(vaddr, 1)];
-    if (next == EMPTY || next == RESERVED) {
+    data->lookup_base = base;
+    data->lookup_level = (vspace_bottom_level_t *)level;
+    return data->lookup_level;
+}
+
+/* Cap recorded at vaddr, RESERVED if it is only reserved at the bottom level, and 0 if there
+ * is no bottom level for it */
+static inline seL4_CPtr get_cap(sel4utils_alloc_data_t *data, uintptr_t vaddr)
+{
+    vspace_bottom_level_t *bottom = get_bottom_level(data, vaddr);
+    if (bottom == NULL) {
         return 0;
     }
-    vspace_bottom_level_t *bottom = (vspace_bottom_level_t *)next;
     return bottom->cap[INDEX_FOR_LEVEL(vaddr, 0)];
 }
 
-static inline uintptr_t get_cookie(vspace_mid_level_t *top, uintptr_t vaddr)
+static inline uintptr_t get_cookie(vspace_t *vspace, uintptr_t vaddr)
 {
-    vspace_mid_level_t *level = top;
-    for (int i = VSPACE_NUM_LEVELS - 1; i > 1; i--) {
-        int index = INDEX_FOR_LEVEL(vaddr, i);
-        uintptr_t next = level->table[index];
-        if (next == EMPTY || next == RESERVED) {
-            return 0;
+    vspace_bottom_level_t *bottom = get_bottom_level(get_alloc_data(vspace), vaddr);
+    if (bottom == NULL) {
+        return 0;
+    }
+    uintptr_t *cookies = get_cookies(vspace, bottom, vaddr, false);
+    return cookies == NULL ? 0 : cookies[INDEX_FOR_LEVEL(vaddr, 0)];
+}
+
+/* Whether a frame is mapped at vaddr, as opposed to it being empty or only reserved */
+static inline bool is_backed(sel4utils_alloc_data_t *data, uintptr_t vaddr)
+{
+    seL4_CPtr cap = get_cap(data, vaddr);
+    return cap != EMPTY && cap != RESERVED;
+}
+
+/* Size of the frame mapped at vaddr. Frames larger than a base page are recorded by storing
+ * the same cap in the entry of every base page they cover, and as a cap can only be mapped
+ * once the frame must span from the first to the last of these entries */
+static inline size_t get_frame_size_bits(sel4utils_alloc_data_t *data, uintptr_t vaddr)
+{
+    seL4_CPtr cap = get_cap(data, vaddr);
+    size_t size_bits = PAGE_BITS_4K;
+    if (cap == EMPTY || cap == RESERVED) {
+        return size_bits;
+    }
+    for (int i = 1; i < SEL4_NUM_PAGE_SIZES; i++) {
+        uintptr_t base = ALIGN_DOWN(vaddr, BIT(sel4_page_sizes[i]));
+        if (get_cap(data, base) != cap || get_cap(data, base + BIT(sel4_page_sizes[i]) - PAGE_SIZE_4K) != cap) {
+            break;
         }
-        level = (vspace_mid_level_t *)next;
+        size_bits = sel4_page_sizes[i];
     }
-    uintptr_t next = level->table[INDEX_FOR_LEVEL(vaddr, 1)];
-    if (next == EMPTY || next == RESERVED) {
-        return 0;
+    return size_bits;
+}
+
+/* Replace the cap and cookie recorded for the frame mapped at vaddr. For compact vspaces this
+ * can fail if there was no space for a non-zero cookie, in which case nothing is changed */
+static inline int replace_entries(vspace_t *vspace, uintptr_t vaddr, size_t size_bits, seL4_CPtr cap,
+                                  uintptr_t cookie)
+{
+    for (uintptr_t v = vaddr; cookie != 0 && v < vaddr + BIT(size_bits); v += BYTES_FOR_LEVEL(1)) {
+        if (get_alloc_data(vspace)->compact && get_cookie_level(vspace, v, true) == NULL) {
+            ZF_LOGE("Failed to allocate book keeping for cookies");
+            return -1;
+        }
+    }
+    for (uintptr_t v = vaddr; v < vaddr + BIT(size_bits); v += PAGE_SIZE_4K) {
+        vspace_mid_level_t *level = get_alloc_data(vspace)->top_level;
+        for (int i = VSPACE_NUM_LEVELS - 1; i > 1; i--) {
+            level = (vspace_mid_level_t *) level->table[INDEX_FOR_LEVEL(v, i)];
+        }
+        vspace_bottom_level_t *bottom = (vspace_bottom_level_t *) level->table[INDEX_FOR_LEVEL(v, 1)];
+        assert(bottom->cap[INDEX_FOR_LEVEL(v, 0)] != EMPTY && bottom->cap[INDEX_FOR_LEVEL(v, 0)] != RESERVED);
+        bottom->cap[INDEX_FOR_LEVEL(v, 0)] = cap;
+        uintptr_t *cookies = get_cookies(vspace, bottom, v, false);
+        if (cookies) {
+            cookies[INDEX_FOR_LEVEL(v, 0)] = cookie;
+        }
     }
-    vspace_bottom_level_t *bottom = (vspace_bottom_level_t *)next;
-    return bottom->cookie[INDEX_FOR_LEVEL(vaddr, 0)];
+    return 0;
 }
 
 /* Internal interface functions */
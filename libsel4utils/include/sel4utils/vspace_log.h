@@ -0,0 +1,125 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vspace/vspace.h>
+
+/* A log of the operations performed by a sel4utils vspace, for working out where the time
+ * spent setting up an address space goes. Only available if CONFIG_SEL4UTILS_VSPACE_LOG is
+ * enabled.
+ *
+ * Every operation is recorded once it completes, along with the cycles it took and how many
+ * paging structures the kernel mapping path had to create for it. Operations made on the
+ * vspace are broken down into the steps they performed, which are recorded with a greater
+ * depth before the operation that contains them, so a log can be folded into a flame graph.
+ * Cycles are measured with the sel4bench cycle counter, which must be usable from user level.
+ *
+ * Records are written into a buffer provided by the caller which is used as a ring: once it
+ * is full the oldest records are overwritten. Nothing is allocated, so the log can be used
+ * with vspaces that back malloc. */
+
+typedef enum sel4utils_vspace_log_op {
+    SEL4UTILS_VSPACE_LOG_NEW_PAGES,
+    SEL4UTILS_VSPACE_LOG_MAP_PAGES,
+    SEL4UTILS_VSPACE_LOG_UNMAP_PAGES,
+    SEL4UTILS_VSPACE_LOG_RESERVE,
+    SEL4UTILS_VSPACE_LOG_FREE_RESERVATION,
+    SEL4UTILS_VSPACE_LOG_SHARE,
+    SEL4UTILS_VSPACE_LOG_FAULT,
+    SEL4UTILS_VSPACE_LOG_TEAR_DOWN,
+    /* steps of the operations above */
+    SEL4UTILS_VSPACE_LOG_FIND_RANGE,
+    SEL4UTILS_VSPACE_LOG_ALLOC_FRAMES,
+    SEL4UTILS_VSPACE_LOG_MAP_PAGE,
+    SEL4UTILS_VSPACE_LOG_COPY_CAP,
+    SEL4UTILS_VSPACE_LOG_NUM_OPS
+} sel4utils_vspace_log_op_t;
+
+typedef struct sel4utils_vspace_log_record {
+    sel4utils_vspace_log_op_t op;
+    /* number of operations this one was a step of, 0 for calls made on the vspace */
+    uint32_t depth;
+    /* 0 on success, operations that return nothing always succeed */
+    int result;
+    /* start of the range operated on, or 0 if it was not known */
+    uintptr_t vaddr;
+    size_t size_bits;
+    /* number of pages of size_bits operated on */
+    size_t count;
+    /* cycles spent in the operation, including its steps */
+    uint64_t cycles;
+    /* paging structures created while mapping pages, including in its steps */
+    size_t paging_objects;
+} sel4utils_vspace_log_record_t;
+
+typedef struct sel4utils_vspace_log {
+    sel4utils_vspace_log_record_t *records;
+    size_t max_records;
+    /* total number of records written, all but the last max_records have been overwritten */
+    uint64_t written;
+    /* book keeping for operations in progress */
+    uint32_t depth;
+    uint64_t paging_objects;
+} sel4utils_vspace_log_t;
+
+/* Start of an operation in progress, only used by the vspace */
+typedef struct sel4utils_vspace_log_mark {
+    sel4utils_vspace_log_t *log;
+    uint64_t cycles;
+    uint64_t paging_objects;
+} sel4utils_vspace_log_mark_t;
+
+/* Size of each record, and of the header before them, in an exported log */
+#define SEL4UTILS_VSPACE_LOG_EXPORT_HEADER_SIZE 16
+#define SEL4UTILS_VSPACE_LOG_EXPORT_RECORD_SIZE 32
+
+/**
+ * Start logging the operations performed by a vspace, or stop if log is NULL.
+ *
+ * @param vspace the vspace to log.
+ * @param log storage for the state of the log, must remain valid while it is attached.
+ * @param records buffer to write records to.
+ * @param max_records number of records that fit in the buffer, must not be 0.
+ * @return 0 on success, -1 if CONFIG_SEL4UTILS_VSPACE_LOG is not enabled.
+ */
+int sel4utils_vspace_set_log(vspace_t *vspace, sel4utils_vspace_log_t *log,
+                             sel4utils_vspace_log_record_t *records, size_t max_records);
+
+/* Number of records held in a log, oldest first */
+size_t sel4utils_vspace_log_num_records(const sel4utils_vspace_log_t *log);
+/* The ith oldest record held in a log */
+const sel4utils_vspace_log_record_t *sel4utils_vspace_log_get(const sel4utils_vspace_log_t *log, size_t i);
+
+/* Print the records held in a log one per line, oldest first and indented by depth */
+void sel4utils_vspace_log_dump(const sel4utils_vspace_log_t *log);
+
+/**
+ * Export the records held in a log in a compact binary form. All fields are little endian.
+ *
+ * The header is
+ *   u32 magic 0x474c5356 ("VSLG"), u16 version 1, u16 record size, u32 number of records,
+ *   u32 number of records that were overwritten (saturating)
+ * and each record, oldest first, is
+ *   u8 op, u8 depth (saturating), u8 size_bits, u8 reserved, s32 result, u64 vaddr,
+ *   u64 cycles, u32 count (saturating), u32 paging objects (saturating)
+ *
+ * @param log the log to export.
+ * @param buf buffer to export into, or NULL to find the size needed.
+ * @param len size of buf. If the log does not fit, only the newest records that do are exported.
+ * @return number of bytes written to buf, or needed if buf is NULL.
+ */
+size_t sel4utils_vspace_log_export(const sel4utils_vspace_log_t *log, void *buf, size_t len);
@@ -35,19 +35,47 @@ static inline seL4_CapRights_t rights_from_elf(unsigned long permissions)
     return seL4_CapRights_new(false, false, canRead, canWrite);
 }
 
-static int load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
-                        vka_t *loadee_vka, vka_t *loader_vka,
-                        char *src, size_t file_size, int num_regions,
-                        sel4utils_elf_region_t regions[num_regions], int region_index)
+/*
+ * Find the reservation that the loadee frame at vaddr belongs to. Frames at either end of a
+ * region may belong to the reservation of an adjacent region.
+ *
+ * @param remaining bytes of the segment from vaddr, or from the start of the segment if that is
+ *                  later
+ */
+static int frame_reservation(int num_regions, sel4utils_elf_region_t regions[num_regions], int region_index,
+                             void *vaddr, size_t remaining, reservation_t *reservation)
+{
+    sel4utils_elf_region_t region = regions[region_index];
+
+    if (vaddr < region.reservation_vstart) {
+        //  Have to use reservation from adjacent region
+        if ((region_index - 1) < 0) {
+            ZF_LOGE("Invalid regions: bad elf file.");
+            return 1;
+        }
+        *reservation = regions[region_index - 1].reservation;
+    } else if (vaddr + (MIN(remaining, PAGE_SIZE_4K)) >
+               (region.reservation_vstart + region.reservation_size)) {
+        if ((region_index + 1) >= num_regions) {
+            ZF_LOGE("Invalid regions: bad elf file.");
+            return 1;
+        }
+        *reservation = regions[region_index + 1].reservation;
+    } else {
+        *reservation = region.reservation;
+    }
+    return 0;
+}
+
+static int load_segment_by_page(vspace_t *loadee_vspace, vspace_t *loader_vspace,
+                                vka_t *loadee_vka, vka_t *loader_vka,
+                                char *src, size_t file_size, int num_regions,
+                                sel4utils_elf_region_t regions[num_regions], int region_index)
 {
     int error = seL4_NoError;
     sel4utils_elf_region_t region = regions[region_index];
     size_t segment_size = region.size;
     uintptr_t dst = (uintptr_t) region.elf_vstart;
-    if (file_size > segment_size) {
-        ZF_LOGE("Error, file_size %zu > segment_size %zu", file_size, segment_size);
-        return seL4_InvalidArgument;
-    }
 
     /* create a slot to map a page into the loader address space */
     seL4_CPtr loader_slot;
@@ -66,25 +94,10 @@ static int load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
         void *loader_vaddr = 0;
         void *loadee_vaddr = (void *)((seL4_Word)ROUND_DOWN(dst, PAGE_SIZE_4K));
 
-        /* Find the reservation that this frame belongs to.
-         * The reservation may belong to an adjacent region */
+        /* Find the reservation that this frame belongs to */
         reservation_t reservation;
-        if (loadee_vaddr < region.reservation_vstart) {
-            //  Have to use reservation from adjacent region
-            if ((region_index - 1) < 0) {
-                ZF_LOGE("Invalid regions: bad elf file.");
-                return 1;
-            }
-            reservation = regions[region_index - 1].reservation;
-        } else if (loadee_vaddr + (MIN(segment_size - pos, PAGE_SIZE_4K)) >
-                   (region.reservation_vstart + region.reservation_size)) {
-            if ((region_index + 1) >= num_regions) {
-                ZF_LOGE("Invalid regions: bad elf file.");
-                return 1;
-            }
-            reservation = regions[region_index + 1].reservation;
-        } else {
-            reservation = region.reservation;
+        if (frame_reservation(num_regions, regions, region_index, loadee_vaddr, segment_size - pos, &reservation)) {
+            return 1;
         }
 
         /* We need to check if the frame has already been mapped by another region.
@@ -150,6 +163,287 @@ static int load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
     return error;
 }
 
+/* Allocate frames for the pages of a window that are not already backed, perhaps by an adjacent
+ * region, with a single call for each run of pages that share a reservation */
+static int back_window(vspace_t *loadee_vspace, int num_regions, sel4utils_elf_region_t regions[num_regions],
+                       int region_index, uintptr_t window, size_t num_pages)
+{
+    uintptr_t start = (uintptr_t) regions[region_index].elf_vstart;
+    uintptr_t end = start + regions[region_index].size;
+    reservation_t run_reservation = {0};
+    size_t run = 0;
+
+    for (size_t i = 0; i <= num_pages; i++) {
+        uintptr_t vaddr = window + i * PAGE_SIZE_4K;
+        reservation_t reservation = {0};
+        bool unbacked = false;
+
+        if (i < num_pages && vspace_get_cap(loadee_vspace, (void *) vaddr) == seL4_CapNull) {
+            if (frame_reservation(num_regions, regions, region_index, (void *) vaddr, end - MAX(vaddr, start),
+                                  &reservation)) {
+                return 1;
+            }
+            unbacked = true;
+        }
+
+        if (run > 0 && (!unbacked || reservation.res != run_reservation.res)) {
+            int error = vspace_new_pages_at_vaddr(loadee_vspace, (void *)(vaddr - run * PAGE_SIZE_4K), run,
+                                                  seL4_PageBits, run_reservation);
+            if (error != seL4_NoError) {
+                ZF_LOGE("ERROR: failed to allocate frames by loadee vka: %d", error);
+                return error;
+            }
+            run = 0;
+        }
+
+        if (unbacked) {
+            if (run == 0) {
+                run_reservation = reservation;
+            }
+            run++;
+        }
+    }
+    return 0;
+}
+
+/* Copy the file contents of the pages [range_start, range_end) of a segment into the loadee a window
+ * of pages at a time: back the window, map all of its frames into the loader at once, copy the file
+ * contents in with a single memcpy, and unmap them again */
+static int load_range(vspace_t *loadee_vspace, vspace_t *loader_vspace,
+                      vka_t *loadee_vka, vka_t *loader_vka,
+                      char *src, size_t file_size, int num_regions,
+                      sel4utils_elf_region_t regions[num_regions], int region_index,
+                      seL4_CPtr slots[], size_t window_pages, uintptr_t range_start, uintptr_t range_end)
+{
+    uintptr_t start = (uintptr_t) regions[region_index].elf_vstart;
+
+    int error = seL4_NoError;
+    for (uintptr_t window = range_start; window < range_end && error == seL4_NoError;
+         window += window_pages * PAGE_SIZE_4K) {
+        size_t num_pages = MIN(window_pages, (range_end - window) / PAGE_SIZE_4K);
+
+        error = back_window(loadee_vspace, num_regions, regions, region_index, window, num_pages);
+        if (error != seL4_NoError) {
+            break;
+        }
+
+        /* copy the frame caps to map into the loader address space */
+        size_t copied;
+        for (copied = 0; copied < num_pages; copied++) {
+            cspacepath_t loadee_frame_cap, loader_frame_cap;
+            vka_cspace_make_path(loadee_vka, vspace_get_cap(loadee_vspace, (void *)(window + copied * PAGE_SIZE_4K)),
+                                 &loadee_frame_cap);
+            vka_cspace_make_path(loader_vka, slots[copied], &loader_frame_cap);
+            error = vka_cnode_copy(&loader_frame_cap, &loadee_frame_cap, seL4_AllRights);
+            if (error != seL4_NoError) {
+                ZF_LOGE("ERROR: failed to copy frame cap into loader cspace: %d", error);
+                break;
+            }
+        }
+
+        if (error == seL4_NoError) {
+            /* map the whole window into the loader address space */
+            char *loader_vaddr = vspace_map_pages(loader_vspace, slots, NULL, seL4_AllRights, num_pages,
+                                                  seL4_PageBits, 1);
+            if (loader_vaddr == NULL) {
+                ZF_LOGE("failed to map frames into loader vspace.");
+                error = -1;
+            } else {
+                /* finally copy the data */
+                uintptr_t copy_start = MAX(window, start);
+                uintptr_t copy_end = MIN(window + num_pages * PAGE_SIZE_4K, start + file_size);
+                if (copy_start < copy_end) {
+                    memcpy(loader_vaddr + (copy_start - window), src + (copy_start - start), copy_end - copy_start);
+                }
+                /* Note that we don't need to explicitly zero frames as seL4 gives us zero'd frames */
+
+#ifdef CONFIG_ARCH_ARM
+                /* Flush the caches */
+                for (size_t i = 0; i < num_pages; i++) {
+                    seL4_ARM_Page_Unify_Instruction(slots[i], 0, PAGE_SIZE_4K);
+                    seL4_ARM_Page_Unify_Instruction(vspace_get_cap(loadee_vspace, (void *)(window + i * PAGE_SIZE_4K)),
+                                                    0, PAGE_SIZE_4K);
+                }
+#elif CONFIG_ARCH_RISCV
+                /* Ensure that the writes to memory that may be executed become visible */
+                asm volatile("fence.i" ::: "memory");
+#endif
+
+                /* now unmap the window in the loader address space */
+                vspace_unmap_pages(loader_vspace, loader_vaddr, num_pages, seL4_PageBits, VSPACE_PRESERVE);
+            }
+        }
+
+        for (size_t i = 0; i < copied; i++) {
+            cspacepath_t loader_frame_cap;
+            vka_cspace_make_path(loader_vka, slots[i], &loader_frame_cap);
+            vka_cnode_delete(&loader_frame_cap);
+        }
+    }
+
+    return error;
+}
+
+/*
+ * Find the frame of the loader that holds the file contents of the loadee page at vaddr, if the
+ * page can be mapped straight from it. That is only the case for pages that are entirely file
+ * contents of this region, which rules out pages shared with an adjacent region and the partial
+ * pages at either end of the segment, and that the loader has a 4K frame for.
+ *
+ * @return the frame, or seL4_CapNull if the page has to be copied.
+ */
+static seL4_CPtr shareable_frame(vspace_t *loadee_vspace, vspace_t *loader_vspace, char *src, size_t file_size,
+                                 int num_regions, sel4utils_elf_region_t regions[num_regions], int region_index,
+                                 uintptr_t vaddr)
+{
+    sel4utils_elf_region_t region = regions[region_index];
+    uintptr_t start = (uintptr_t) region.elf_vstart;
+
+    if (vaddr < start || vaddr + PAGE_SIZE_4K > start + file_size) {
+        return seL4_CapNull;
+    }
+    reservation_t reservation;
+    if (frame_reservation(num_regions, regions, region_index, (void *) vaddr, start + file_size - vaddr,
+                          &reservation) || reservation.res != region.reservation.res) {
+        return seL4_CapNull;
+    }
+    if (vspace_get_cap(loadee_vspace, (void *) vaddr) != seL4_CapNull) {
+        return seL4_CapNull;
+    }
+
+    void *src_page = src + (vaddr - start);
+    seL4_CPtr frame = vspace_get_cap(loader_vspace, src_page);
+    /* a larger frame is recorded against every 4K page it covers, and cannot be mapped as one */
+    if (frame == seL4_CapNull || vspace_get_cap(loader_vspace, src_page - PAGE_SIZE_4K) == frame ||
+        vspace_get_cap(loader_vspace, src_page + PAGE_SIZE_4K) == frame) {
+        return seL4_CapNull;
+    }
+    return frame;
+}
+
+/* Map a frame of the loader straight into the loadee with the rights of the region. The frame is
+ * mapped without a cookie so the loadee vspace never tries to free it. */
+static int share_page(vspace_t *loadee_vspace, vka_t *loadee_vka, vka_t *loader_vka,
+                      sel4utils_elf_region_t region, seL4_CPtr frame, uintptr_t vaddr)
+{
+    seL4_CPtr slot;
+    int error = vka_cspace_alloc(loadee_vka, &slot);
+    if (error) {
+        ZF_LOGE("Failed to allocate cslot by loadee vka: %d", error);
+        return error;
+    }
+
+    cspacepath_t loadee_frame_cap, loader_frame_cap;
+    vka_cspace_make_path(loadee_vka, slot, &loadee_frame_cap);
+    vka_cspace_make_path(loader_vka, frame, &loader_frame_cap);
+    error = vka_cnode_copy(&loadee_frame_cap, &loader_frame_cap, region.rights);
+    if (error != seL4_NoError) {
+        ZF_LOGE("ERROR: failed to copy frame cap into loadee cspace: %d", error);
+        vka_cspace_free(loadee_vka, slot);
+        return error;
+    }
+
+    error = vspace_map_pages_at_vaddr(loadee_vspace, &slot, NULL, (void *) vaddr, 1, seL4_PageBits,
+                                      region.reservation);
+    if (error != seL4_NoError) {
+        ZF_LOGE("ERROR: failed to map frame into loadee vspace: %d", error);
+        vka_cnode_delete(&loadee_frame_cap);
+        vka_cspace_free(loadee_vka, slot);
+        return error;
+    }
+
+#ifdef CONFIG_ARCH_ARM
+    /* The contents were written through another mapping, make sure they can be executed */
+    seL4_ARM_Page_Unify_Instruction(slot, 0, PAGE_SIZE_4K);
+#endif
+    return 0;
+}
+
+/* Load a segment a window of pages at a time. If share_read_only is set and the segment is read
+ * only, the pages that are entirely file contents are mapped straight from the frames of the loader
+ * that hold the image instead, and only the rest are allocated and copied. */
+static int load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
+                        vka_t *loadee_vka, vka_t *loader_vka,
+                        char *src, size_t file_size, int num_regions,
+                        sel4utils_elf_region_t regions[num_regions], int region_index, bool share_read_only)
+{
+    sel4utils_elf_region_t region = regions[region_index];
+    size_t segment_size = region.size;
+    uintptr_t start = (uintptr_t) region.elf_vstart;
+    uintptr_t end = start + segment_size;
+    if (file_size > segment_size) {
+        ZF_LOGE("Error, file_size %zu > segment_size %zu", file_size, segment_size);
+        return seL4_InvalidArgument;
+    }
+
+    if (CONFIG_SEL4UTILS_ELF_LOAD_WINDOW == 0) {
+        return load_segment_by_page(loadee_vspace, loader_vspace, loadee_vka, loader_vka, src, file_size,
+                                    num_regions, regions, region_index);
+    }
+
+    /* slots to copy the caps of a window of frames into so they can be mapped into the loader */
+    seL4_CPtr slots[CONFIG_SEL4UTILS_ELF_LOAD_WINDOW];
+    uintptr_t first_page = ROUND_DOWN(start, PAGE_SIZE_4K);
+    uintptr_t last_page = ROUND_UP(end, PAGE_SIZE_4K);
+    size_t window_pages = MIN(CONFIG_SEL4UTILS_ELF_LOAD_WINDOW, (last_page - first_page) / PAGE_SIZE_4K);
+    size_t num_slots = 0;
+
+    if (vka_cspace_alloc_range(loader_vka, window_pages, &slots[0]) == 0) {
+        for (num_slots = 1; num_slots < window_pages; num_slots++) {
+            slots[num_slots] = slots[0] + num_slots;
+        }
+    } else {
+        while (num_slots < window_pages && vka_cspace_alloc(loader_vka, &slots[num_slots]) == 0) {
+            num_slots++;
+        }
+    }
+    if (num_slots < window_pages) {
+        /* not enough slots, fall back to loading a page at a time */
+        for (size_t i = 0; i < num_slots; i++) {
+            vka_cspace_free(loader_vka, slots[i]);
+        }
+        return load_segment_by_page(loadee_vspace, loader_vspace, loadee_vka, loader_vka, src, file_size,
+                                    num_regions, regions, region_index);
+    }
+
+    int error = seL4_NoError;
+    /* a page can only be shared if it lines up with a page of the image */
+    if (share_read_only && !seL4_CapRights_get_capAllowWrite(region.rights) &&
+        ((uintptr_t) src % PAGE_SIZE_4K) == (start % PAGE_SIZE_4K)) {
+        /* copy the runs of pages between the ones that can be shared */
+        uintptr_t run_start = first_page;
+        for (uintptr_t vaddr = first_page; vaddr < last_page && error == seL4_NoError; vaddr += PAGE_SIZE_4K) {
+            seL4_CPtr frame = shareable_frame(loadee_vspace, loader_vspace, src, file_size, num_regions, regions,
+                                              region_index, vaddr);
+            if (frame == seL4_CapNull) {
+                continue;
+            }
+            if (run_start < vaddr) {
+                error = load_range(loadee_vspace, loader_vspace, loadee_vka, loader_vka, src, file_size,
+                                   num_regions, regions, region_index, slots, window_pages, run_start, vaddr);
+            }
+            if (error == seL4_NoError) {
+                error = share_page(loadee_vspace, loadee_vka, loader_vka, region, frame, vaddr);
+            }
+            run_start = vaddr + PAGE_SIZE_4K;
+        }
+        if (error == seL4_NoError && run_start < last_page) {
+            error = load_range(loadee_vspace, loader_vspace, loadee_vka, loader_vka, src, file_size,
+                               num_regions, regions, region_index, slots, window_pages, run_start, last_page);
+        }
+    } else {
+        error = load_range(loadee_vspace, loader_vspace, loadee_vka, loader_vka, src, file_size,
+                           num_regions, regions, region_index, slots, window_pages, first_page, last_page);
+    }
+
+    /* clear the cslots */
+    for (size_t i = 0; i < num_slots; i++) {
+        vka_cspace_free(loader_vka, slots[i]);
+    }
+
+    return error;
+}
+
 /**
  * Load an array of regions into a vspace.
  *
@@ -165,12 +459,13 @@ static int load_segment(vspace_t *loadee_vspace, vspace_t *loader_vspace,
  * @param elf_file pointer to elf object
  * @param num_regions total number of segments/regions to load.
  * @param regions region array containing segment info.
+ * @param share_read_only map read only segments straight from the frames of the elf file.
  *
  * @return 0 on success.
  */
 static int load_segments(vspace_t *loadee_vspace, vspace_t *loader_vspace,
                          vka_t *loadee_vka, vka_t *loader_vka, elf_t *elf_file,
-                         int num_regions, sel4utils_elf_region_t regions[num_regions])
+                         int num_regions, sel4utils_elf_region_t regions[num_regions], bool share_read_only)
 {
     for (int i = 0; i < num_regions; i++) {
         int segment_index = regions[i].segment_index;
@@ -181,7 +476,7 @@ static int load_segments(vspace_t *loadee_vspace, vspace_t *loader_vspace,
         size_t file_size = elf_getProgramHeaderFileSize(elf_file, segment_index);
 
         int error = load_segment(loadee_vspace, loader_vspace, loadee_vka, loader_vka,
-                                 source_addr, file_size, num_regions, regions, i);
+                                 source_addr, file_size, num_regions, regions, i, share_read_only);
         if (error) {
             return error;
         }
@@ -406,22 +701,18 @@ static int compare_regions(sel4utils_elf_region_t a, sel4utils_elf_region_t b)
 }
 
 /**
- * Parse an elf file and create reservations in a target vspace for all loadable segments.
+ * Parse an elf file and plan the reservations for all loadable segments.
  *
  * Reads segment layout data out of elf file and stores in elf_region array.
  * Then sorts the array, then plans reservations based on segment layout.
- * Finally creates reservations in vspace.
  *
- * @param loadee vspace to create reservations in.
  * @param elf_file pointer to elf file.
  * @param num_regions number of regions in array as calculated by count_loadable_regions.
  * @param regions region array.
- * @param mapanywhere throw away vspace positioning if set to 1.
  *
  * @return 0 on success.
  */
-static int elf_reserve_regions_in_vspace(vspace_t *loadee, elf_t *elf_file,
-                                         int num_regions, sel4utils_elf_region_t regions[num_regions], int mapanywhere)
+static int plan_regions(elf_t *elf_file, int num_regions, sel4utils_elf_region_t regions[num_regions])
 {
     int error = read_regions(elf_file, num_regions, regions);
     if (error) {
@@ -437,6 +728,29 @@ static int elf_reserve_regions_in_vspace(vspace_t *loadee, elf_t *elf_file,
         ZF_LOGE("Failed to prepare reservations");
         return error;
     }
+    return 0;
+}
+
+/**
+ * Parse an elf file and create reservations in a target vspace for all loadable segments.
+ *
+ * Plans the reservations with plan_regions, then creates them in vspace.
+ *
+ * @param loadee vspace to create reservations in.
+ * @param elf_file pointer to elf file.
+ * @param num_regions number of regions in array as calculated by count_loadable_regions.
+ * @param regions region array.
+ * @param mapanywhere throw away vspace positioning if set to 1.
+ *
+ * @return 0 on success.
+ */
+static int elf_reserve_regions_in_vspace(vspace_t *loadee, elf_t *elf_file,
+                                         int num_regions, sel4utils_elf_region_t regions[num_regions], int mapanywhere)
+{
+    int error = plan_regions(elf_file, num_regions, regions);
+    if (error) {
+        return error;
+    }
     error = create_reservations(loadee, num_regions, regions, mapanywhere);
     if (error) {
         ZF_LOGE("Failed to create reservations");
@@ -474,8 +788,9 @@ void *sel4utils_elf_reserve(vspace_t *loadee, elf_t *elf_file, sel4utils_elf_reg
     return entry_point(elf_file);
 }
 
-void *sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t *loader_vka,
-                                        elf_t *elf_file, sel4utils_elf_region_t *regions, int mapanywhere)
+static void *elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t *loader_vka,
+                                     elf_t *elf_file, sel4utils_elf_region_t *regions, int mapanywhere,
+                                     bool share_read_only)
 {
     /* Calculate number of loadable regions.  Use stack array if one wasn't passed in */
     int num_regions = count_loadable_regions(elf_file);
@@ -494,7 +809,7 @@ void *sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_
     }
 
     /* Load Map reservations and load in elf data */
-    error = load_segments(loadee, loader, loadee_vka, loader_vka, elf_file, num_regions, regions);
+    error = load_segments(loadee, loader, loadee_vka, loader_vka, elf_file, num_regions, regions, share_read_only);
     if (error) {
         ZF_LOGE("Failed to load segments");
         return NULL;
@@ -513,6 +828,39 @@ void *sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_
     return entry_point(elf_file);
 }
 
+int sel4utils_elf_plan_regions(elf_t *elf_file, sel4utils_elf_region_t *regions)
+{
+    return plan_regions(elf_file, count_loadable_regions(elf_file), regions);
+}
+
+void *sel4utils_elf_load_record_regions(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka, vka_t *loader_vka,
+                                        elf_t *elf_file, sel4utils_elf_region_t *regions, int mapanywhere)
+{
+    return elf_load_record_regions(loadee, loader, loadee_vka, loader_vka, elf_file, regions, mapanywhere, false);
+}
+
+void *sel4utils_elf_load_record_regions_shared(vspace_t *loadee, vspace_t *loader, vka_t *loadee_vka,
+                                               vka_t *loader_vka, elf_t *elf_file,
+                                               sel4utils_elf_region_t *regions, int mapanywhere)
+{
+    if (regions == NULL) {
+        ZF_LOGE("Regions are needed to release shared pages");
+        return NULL;
+    }
+    return elf_load_record_regions(loadee, loader, loadee_vka, loader_vka, elf_file, regions, mapanywhere, true);
+}
+
+void sel4utils_elf_release_shared(vspace_t *loadee, int num_regions, sel4utils_elf_region_t *regions)
+{
+    for (int i = 0; i < num_regions; i++) {
+        /* shared frames are mapped without a cookie, so only our caps to them are freed */
+        if (!seL4_CapRights_get_capAllowWrite(regions[i].rights) && regions[i].reservation_size > 0) {
+            vspace_unmap_pages(loadee, regions[i].reservation_vstart, regions[i].reservation_size / PAGE_SIZE_4K,
+                               seL4_PageBits, VSPACE_FREE);
+        }
+    }
+}
+
 uintptr_t sel4utils_elf_get_vsyscall(elf_t *elf_file)
 {
     uintptr_t *addr = (uintptr_t *)sel4utils_elf_get_section(elf_file, "__vsyscall", NULL);
@@ -151,3 +151,190 @@ void sel4utils_unmap_dup(vka_t *vka, vspace_t *vspace, void *mapping, size_t siz
     vka_cnode_delete(&copy_path);
     vka_cspace_free(vka, copy);
 }
+
+void *sel4utils_dup_and_map_pages(vka_t *vka, vspace_t *vspace, seL4_CPtr pages[], size_t num_pages,
+                                  size_t size_bits)
+{
+    seL4_CPtr copies[num_pages];
+    size_t num_slots = 0;
+    size_t num_copied = 0;
+    void *mapping = NULL;
+
+    /* First need to copy the caps */
+    if (vka_cspace_alloc_range(vka, num_pages, &copies[0]) == 0) {
+        for (num_slots = 1; num_slots < num_pages; num_slots++) {
+            copies[num_slots] = copies[0] + num_slots;
+        }
+    } else {
+        while (num_slots < num_pages && vka_cspace_alloc(vka, &copies[num_slots]) == 0) {
+            num_slots++;
+        }
+    }
+    if (num_slots < num_pages) {
+        goto out;
+    }
+    for (; num_copied < num_pages; num_copied++) {
+        cspacepath_t page_path, copy_path;
+        vka_cspace_make_path(vka, pages[num_copied], &page_path);
+        vka_cspace_make_path(vka, copies[num_copied], &copy_path);
+        if (vka_cnode_copy(&copy_path, &page_path, seL4_AllRights) != seL4_NoError) {
+            goto out;
+        }
+    }
+    /* Now map them in */
+    mapping = vspace_map_pages(vspace, copies, NULL, seL4_AllRights, num_pages, size_bits, 1);
+
+out:
+    if (!mapping) {
+        for (size_t i = 0; i < num_slots; i++) {
+            if (i < num_copied) {
+                cspacepath_t copy_path;
+                vka_cspace_make_path(vka, copies[i], &copy_path);
+                vka_cnode_delete(&copy_path);
+            }
+            vka_cspace_free(vka, copies[i]);
+        }
+    }
+    return mapping;
+}
+
+void sel4utils_unmap_dup_pages(vka_t *vka, vspace_t *vspace, void *mapping, size_t num_pages, size_t size_bits)
+{
+    /* Grab copies of the caps */
+    seL4_CPtr copies[num_pages];
+    for (size_t i = 0; i < num_pages; i++) {
+        copies[i] = vspace_get_cap(vspace, mapping + i * BIT(size_bits));
+        assert(copies[i]);
+    }
+    /* now free the mapping */
+    vspace_unmap_pages(vspace, mapping, num_pages, size_bits, VSPACE_PRESERVE);
+    /* delete and free the caps */
+    for (size_t i = 0; i < num_pages; i++) {
+        cspacepath_t copy_path;
+        vka_cspace_make_path(vka, copies[i], &copy_path);
+        vka_cnode_delete(&copy_path);
+        vka_cspace_free(vka, copies[i]);
+    }
+}
+
+int sel4utils_map_window_init(sel4utils_map_window_t *window, vka_t *vka, vspace_t *vspace,
+                              sel4utils_map_window_entry_t *entries, size_t num_entries)
+{
+    *window = (sel4utils_map_window_t) {
+        .vka = vka,
+        .vspace = vspace,
+        .entries = entries,
+        .num_entries = num_entries,
+    };
+
+    window->reservation = vspace_reserve_range(vspace, num_entries * PAGE_SIZE_4K, seL4_AllRights, 1,
+                                               &window->vaddr);
+    if (window->reservation.res == NULL) {
+        ZF_LOGE("Failed to reserve %zu pages for map window", num_entries);
+        return -1;
+    }
+
+    seL4_CPtr first;
+    bool range = vka_cspace_alloc_range(vka, num_entries, &first) == 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        entries[i] = (sel4utils_map_window_entry_t) {
+            .slot = range ? first + i : seL4_CapNull,
+        };
+        if (!range && vka_cspace_alloc(vka, &entries[i].slot) != 0) {
+            ZF_LOGE("Failed to allocate cslot for map window");
+            window->num_entries = i;
+            sel4utils_map_window_destroy(window);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *entry_vaddr(sel4utils_map_window_t *window, size_t i)
+{
+    return window->vaddr + i * PAGE_SIZE_4K;
+}
+
+/* Unmap the frame left mapped in an unused entry and delete its copy */
+static void evict(sel4utils_map_window_t *window, sel4utils_map_window_entry_t *entry)
+{
+    assert(entry->users == 0);
+    vspace_unmap_pages(window->vspace, entry_vaddr(window, entry - window->entries), 1, seL4_PageBits,
+                       VSPACE_PRESERVE);
+    cspacepath_t path;
+    vka_cspace_make_path(window->vka, entry->slot, &path);
+    vka_cnode_delete(&path);
+    entry->page = seL4_CapNull;
+}
+
+void *sel4utils_map_window_map(sel4utils_map_window_t *window, seL4_CPtr page)
+{
+    sel4utils_map_window_entry_t *victim = NULL;
+
+    if (page == seL4_CapNull) {
+        ZF_LOGE("No frame to map");
+        return NULL;
+    }
+    for (size_t i = 0; i < window->num_entries; i++) {
+        sel4utils_map_window_entry_t *entry = &window->entries[i];
+        if (entry->page == page) {
+            /* still mapped */
+            entry->users++;
+            entry->last_used = ++window->clock;
+            return entry_vaddr(window, i);
+        }
+        if (entry->users == 0 && (victim == NULL || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+    if (victim == NULL) {
+        ZF_LOGE("Every entry of the map window is in use");
+        return NULL;
+    }
+    if (victim->page != seL4_CapNull) {
+        evict(window, victim);
+    }
+
+    cspacepath_t page_path, copy_path;
+    vka_cspace_make_path(window->vka, page, &page_path);
+    vka_cspace_make_path(window->vka, victim->slot, &copy_path);
+    if (vka_cnode_copy(&copy_path, &page_path, seL4_AllRights) != seL4_NoError) {
+        return NULL;
+    }
+    void *vaddr = entry_vaddr(window, victim - window->entries);
+    if (vspace_map_pages_at_vaddr(window->vspace, &victim->slot, NULL, vaddr, 1, seL4_PageBits,
+                                  window->reservation) != 0) {
+        vka_cnode_delete(&copy_path);
+        return NULL;
+    }
+    victim->page = page;
+    victim->users = 1;
+    victim->last_used = ++window->clock;
+    return vaddr;
+}
+
+void sel4utils_map_window_unmap(sel4utils_map_window_t *window, void *mapping)
+{
+    size_t i = (mapping - window->vaddr) / PAGE_SIZE_4K;
+    assert(i < window->num_entries);
+    assert(window->entries[i].users > 0);
+    window->entries[i].users--;
+}
+
+void sel4utils_map_window_flush(sel4utils_map_window_t *window)
+{
+    for (size_t i = 0; i < window->num_entries; i++) {
+        if (window->entries[i].page != seL4_CapNull) {
+            evict(window, &window->entries[i]);
+        }
+    }
+}
+
+void sel4utils_map_window_destroy(sel4utils_map_window_t *window)
+{
+    sel4utils_map_window_flush(window);
+    for (size_t i = 0; i < window->num_entries; i++) {
+        vka_cspace_free(window->vka, window->entries[i].slot);
+    }
+    vspace_free_reservation(window->vspace, window->reservation);
+}
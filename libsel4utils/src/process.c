@@ -173,6 +173,9 @@ seL4_CPtr sel4utils_move_cap_to_process(sel4utils_process_t *process, cspacepath
     allocate_next_slot(process);
     return dest.capPtr;
 }
+/* Maximum number of pages of a remote stack mapped at once */
+#define STACK_WRITE_PAGES 16
+
 int sel4utils_stack_write(vspace_t *current_vspace, vspace_t *target_vspace,
                           vka_t *vka, void *buf, size_t len, uintptr_t *initial_stack_pointer)
 {
@@ -181,23 +184,28 @@ int sel4utils_stack_write(vspace_t *current_vspace, vspace_t *target_vspace,
     uintptr_t new_stack_pointer = (*initial_stack_pointer) - len;
     uintptr_t current_dest = new_stack_pointer;
     while (remaining > 0) {
-        /* How many can we write on the current page ? */
-        size_t towrite = MIN(PAGE_SIZE_4K - (current_dest % PAGE_SIZE_4K), remaining);
+        /* How many pages can we write at once ? */
+        uintptr_t page = PAGE_ALIGN_4K(current_dest);
+        size_t num_pages = MIN(STACK_WRITE_PAGES, (ROUND_UP(current_dest + remaining, PAGE_SIZE_4K) - page) / PAGE_SIZE_4K);
+        size_t towrite = MIN(page + num_pages * PAGE_SIZE_4K - current_dest, remaining);
         assert(towrite != 0);
-        /* Get the cap */
-        seL4_CPtr frame = vspace_get_cap(target_vspace, (void *)PAGE_ALIGN_4K(current_dest));
-        if (!frame) {
-            return -1;
+        /* Get the caps */
+        seL4_CPtr frames[num_pages];
+        for (size_t i = 0; i < num_pages; i++) {
+            frames[i] = vspace_get_cap(target_vspace, (void *)(page + i * PAGE_SIZE_4K));
+            if (!frames[i]) {
+                return -1;
+            }
         }
-        /* map it in */
-        void *mapping = sel4utils_dup_and_map(vka, current_vspace, frame, seL4_PageBits);
+        /* map them in */
+        void *mapping = sel4utils_dup_and_map_pages(vka, current_vspace, frames, num_pages, seL4_PageBits);
         if (!mapping) {
             return -1;
         }
         /* Copy the portion */
-        memcpy(mapping + (current_dest % PAGE_SIZE_4K), buf + written, towrite);
+        memcpy(mapping + (current_dest - page), buf + written, towrite);
         /* Unmap */
-        sel4utils_unmap_dup(vka, current_vspace, mapping, seL4_PageBits);
+        sel4utils_unmap_dup_pages(vka, current_vspace, mapping, num_pages, seL4_PageBits);
         remaining -= towrite;
         written += towrite;
         current_dest += towrite;
@@ -206,25 +214,91 @@ int sel4utils_stack_write(vspace_t *current_vspace, vspace_t *target_vspace,
     return 0;
 }
 
-static int sel4utils_stack_write_constant(vspace_t *current_vspace, vspace_t *target_vspace,
-                                          vka_t *vka, long value, uintptr_t *initial_stack_pointer)
+/* The initial stack of a new process, built up in a local buffer so that it can be written to
+ * the process with a single mapping of the pages it covers */
+typedef struct stack_image {
+    char *buf;
+    size_t size;
+    /* stack pointer in the new process that the end of buf is written below */
+    uintptr_t top;
+    /* stack pointer in the new process once everything pushed so far is written */
+    uintptr_t sp;
+    bool overflow;
+} stack_image_t;
+
+static int stack_image_init(stack_image_t *image, uintptr_t top, size_t size)
 {
-    return sel4utils_stack_write(current_vspace, target_vspace, vka, &value, sizeof(value), initial_stack_pointer);
+    *image = (stack_image_t) {
+        .buf = calloc(1, size),
+        .size = size,
+        .top = top,
+        .sp = top
+    };
+    if (image->buf == NULL) {
+        ZF_LOGE("Failed to allocate %zu bytes for initial stack", size);
+        return -1;
+    }
+    return 0;
 }
 
-static int sel4utils_stack_copy_args(vspace_t *current_vspace, vspace_t *target_vspace,
-                                     vka_t *vka, int argc, char *argv[], uintptr_t *dest_argv, uintptr_t *initial_stack_pointer)
+/* Make room for len bytes on the stack, which are left zeroed. Returns where they are in the buffer */
+static void *stack_image_skip(stack_image_t *image, size_t len)
+{
+    if (image->overflow || image->top - image->sp + len > image->size) {
+        image->overflow = true;
+        return NULL;
+    }
+    image->sp -= len;
+    return image->buf + image->size - (image->top - image->sp);
+}
+
+static void stack_image_push(stack_image_t *image, const void *data, size_t len)
+{
+    void *dest = stack_image_skip(image, len);
+    if (dest != NULL) {
+        memcpy(dest, data, len);
+    }
+}
+
+static void stack_image_push_constant(stack_image_t *image, long value)
+{
+    stack_image_push(image, &value, sizeof(value));
+}
+
+static void stack_image_push_args(stack_image_t *image, int argc, char *argv[], uintptr_t *dest_argv)
 {
     for (int i = 0; i < argc; i++) {
-        int error = sel4utils_stack_write(current_vspace, target_vspace, vka, argv[i], strlen(argv[i]) + 1,
-                                          initial_stack_pointer);
-        if (error) {
-            return error;
-        }
-        dest_argv[i] = *initial_stack_pointer;
-        *initial_stack_pointer = ROUND_DOWN(*initial_stack_pointer, 4);
+        stack_image_push(image, argv[i], strlen(argv[i]) + 1);
+        dest_argv[i] = image->sp;
+        stack_image_skip(image, image->sp - ROUND_DOWN(image->sp, 4));
     }
-    return 0;
+}
+
+/* Space needed by stack_image_push_args */
+static size_t stack_args_size(int argc, char *argv[])
+{
+    size_t size = 0;
+    for (int i = 0; i < argc; i++) {
+        size += strlen(argv[i]) + 1 + 3;
+    }
+    return size;
+}
+
+/* Write everything pushed to the stack of the new process, and free the buffer */
+static int stack_image_write(vspace_t *current_vspace, vspace_t *target_vspace, vka_t *vka, stack_image_t *image)
+{
+    int error = -1;
+    if (image->overflow) {
+        ZF_LOGE("Initial stack did not fit in %zu bytes", image->size);
+    } else {
+        size_t len = image->top - image->sp;
+        uintptr_t stack_pointer = image->top;
+        error = sel4utils_stack_write(current_vspace, target_vspace, vka, image->buf + image->size - len, len,
+                                      &stack_pointer);
+        assert(error || stack_pointer == image->sp);
+    }
+    free(image->buf);
+    return error;
 }
 
 int sel4utils_spawn_process(sel4utils_process_t *process, vka_t *vka, vspace_t *vspace, int argc,
@@ -236,16 +310,20 @@ int sel4utils_spawn_process(sel4utils_process_t *process, vka_t *vka, vspace_t *
     /* write all the strings into the stack */
     if (argc > 0) {
         uintptr_t dest_argv[argc];
-        /* Copy over the user arguments */
-        error = sel4utils_stack_copy_args(vspace, &process->vspace, vka, argc, argv, dest_argv, &initial_stack_pointer);
+        stack_image_t image;
+        error = stack_image_init(&image, initial_stack_pointer, stack_args_size(argc, argv) + sizeof(dest_argv));
         if (error) {
             return -1;
         }
+        /* Copy over the user arguments */
+        stack_image_push_args(&image, argc, argv, dest_argv);
         /* Put the new argv array on as well */
-        error = sel4utils_stack_write(vspace, &process->vspace, vka, dest_argv, sizeof(dest_argv), &initial_stack_pointer);
+        stack_image_push(&image, dest_argv, sizeof(dest_argv));
+        error = stack_image_write(vspace, &process->vspace, vka, &image);
         if (error) {
             return -1;
         }
+        initial_stack_pointer = image.sp;
         new_process_argv = initial_stack_pointer;
     }
     /* move the stack pointer down to a place we can write to.
@@ -280,18 +358,28 @@ int sel4utils_spawn_process_v(sel4utils_process_t *process, vka_t *vka, vspace_t
 
     uintptr_t initial_stack_pointer = (uintptr_t) process->thread.stack_top - sizeof(seL4_Word);
 
-    /* Copy the elf headers */
-    uintptr_t at_phdr;
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, process->elf_phdrs,
-                                  process->num_elf_phdrs * sizeof(Elf_Phdr), &initial_stack_pointer);
+    uintptr_t dest_argv[argc];
+    uintptr_t dest_envp[envc];
+    Elf_auxv_t auxv[7];
+
+    /* lay out the whole initial stack locally, then write it in one go */
+    stack_image_t image;
+    error = stack_image_init(&image, initial_stack_pointer,
+                             process->num_elf_phdrs * sizeof(Elf_Phdr) +
+                             stack_args_size(argc, argv) + stack_args_size(envc, envp) +
+                             5 * sizeof(seL4_Word) + sizeof(auxv) + sizeof(dest_argv) + sizeof(dest_envp) +
+                             STACK_CALL_ALIGNMENT);
     if (error) {
         return -1;
     }
-    at_phdr = initial_stack_pointer;
+
+    /* Copy the elf headers */
+    uintptr_t at_phdr;
+    stack_image_push(&image, process->elf_phdrs, process->num_elf_phdrs * sizeof(Elf_Phdr));
+    at_phdr = image.sp;
 
     /* initialize of aux vectors */
     int auxc = 6;
-    Elf_auxv_t auxv[7];
     auxv[0].a_type = AT_PAGESZ;
     auxv[0].a_un.a_val = process->pagesz;
     auxv[1].a_type = AT_PHDR;
@@ -312,21 +400,12 @@ int sel4utils_spawn_process_v(sel4utils_process_t *process, vka_t *vka, vspace_t
 
     seL4_UserContext context = {0};
 
-    uintptr_t dest_argv[argc];
-    uintptr_t dest_envp[envc];
-
     /* write all the strings into the stack */
     /* Copy over the user arguments */
-    error = sel4utils_stack_copy_args(vspace, &process->vspace, vka, argc, argv, dest_argv, &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push_args(&image, argc, argv, dest_argv);
 
     /* copy the environment */
-    error = sel4utils_stack_copy_args(vspace, &process->vspace, vka, envc, envp, dest_envp, &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push_args(&image, envc, envp, dest_envp);
 
     /* we need to make sure the stack is aligned to a double word boundary after we push on everything else
      * below this point. First, work out how much we are going to push */
@@ -334,51 +413,33 @@ int sel4utils_spawn_process_v(sel4utils_process_t *process, vka_t *vka, vspace_t
                      sizeof(auxv[0]) * auxc + /* aux */
                      sizeof(dest_argv) + /* args */
                      sizeof(dest_envp); /* env */
-    uintptr_t hypothetical_stack_pointer = initial_stack_pointer - to_push;
+    uintptr_t hypothetical_stack_pointer = image.sp - to_push;
     uintptr_t rounded_stack_pointer = ALIGN_DOWN(hypothetical_stack_pointer, STACK_CALL_ALIGNMENT);
     ptrdiff_t stack_rounding = hypothetical_stack_pointer - rounded_stack_pointer;
-    initial_stack_pointer -= stack_rounding;
+    stack_image_skip(&image, stack_rounding);
 
     /* construct initial stack frame */
     /* Null terminate aux */
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, 0, &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, 0, &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push_constant(&image, 0);
+    stack_image_push_constant(&image, 0);
     /* write aux */
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, auxv, sizeof(auxv[0]) * auxc, &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push(&image, auxv, sizeof(auxv[0]) * auxc);
     /* Null terminate environment */
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, 0, &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push_constant(&image, 0);
     /* write environment */
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, dest_envp, sizeof(dest_envp), &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push(&image, dest_envp, sizeof(dest_envp));
     /* Null terminate arguments */
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, 0, &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push_constant(&image, 0);
     /* write arguments */
-    error = sel4utils_stack_write(vspace, &process->vspace, vka, dest_argv, sizeof(dest_argv), &initial_stack_pointer);
-    if (error) {
-        return -1;
-    }
+    stack_image_push(&image, dest_argv, sizeof(dest_argv));
     /* Push argument count */
-    error = sel4utils_stack_write_constant(vspace, &process->vspace, vka, argc, &initial_stack_pointer);
+    stack_image_push_constant(&image, argc);
+
+    error = stack_image_write(vspace, &process->vspace, vka, &image);
     if (error) {
         return -1;
     }
+    initial_stack_pointer = image.sp;
 
     ZF_LOGD("Starting process at %p, stack %p\n", process->entry_point, (void *) initial_stack_pointer);
     assert(initial_stack_pointer % (2 * sizeof(seL4_Word)) == 0);
@@ -565,7 +626,17 @@ int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *vka,
         elf_t elf;
         elf_newFile(file, size, &elf);
 
-        if (config.do_elf_load) {
+        if (config.do_elf_load && config.share_elf) {
+            /* the regions are kept so that destroying the process releases the shared frames */
+            process->num_shared_regions = sel4utils_elf_num_regions(&elf);
+            process->shared_regions = calloc(process->num_shared_regions, sizeof(*process->shared_regions));
+            if (!process->shared_regions) {
+                ZF_LOGE("Failed to allocate memory for elf region information");
+                goto error;
+            }
+            process->entry_point = sel4utils_elf_load_record_regions_shared(&process->vspace, spawner_vspace, vka,
+                                                                            vka, &elf, process->shared_regions, 0);
+        } else if (config.do_elf_load) {
             process->entry_point = sel4utils_elf_load(&process->vspace, spawner_vspace, vka, vka, &elf);
         } else {
             process->num_elf_regions = sel4utils_elf_num_regions(&elf);
@@ -672,6 +743,10 @@ error:
         free(process->elf_phdrs);
     }
 
+    if (process->shared_regions) {
+        free(process->shared_regions);
+    }
+
     if (data != NULL) {
         free(data);
     }
@@ -697,6 +772,10 @@ void sel4utils_destroy_process(sel4utils_process_t *process, vka_t *vka)
 
     /* tear down the vspace */
     if (process->own_vspace) {
+        /* tear down only frees frames with cookies, which shared frames do not have */
+        if (process->shared_regions) {
+            sel4utils_elf_release_shared(&process->vspace, process->num_shared_regions, process->shared_regions);
+        }
         vspace_tear_down(&process->vspace, VSPACE_FREE);
         /* free any objects created by the vspace */
         clear_objects(process, vka);
@@ -720,6 +799,10 @@ void sel4utils_destroy_process(sel4utils_process_t *process, vka_t *vka)
     if (process->elf_phdrs) {
         free(process->elf_phdrs);
     }
+
+    if (process->shared_regions) {
+        free(process->shared_regions);
+    }
 }
 
 seL4_CPtr sel4utils_process_init_cap(void *data, seL4_CPtr cap)
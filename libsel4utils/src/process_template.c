@@ -0,0 +1,359 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <elf/elf.h>
+#include <cpio/cpio.h>
+#include <sel4/sel4.h>
+#include <vka/capops.h>
+#include <sel4utils/process_template.h>
+#include <sel4utils/util.h>
+
+/* This library works with our cpio set up in the build system */
+extern char _cpio_archive[];
+extern char _cpio_archive_end[];
+
+/* Number of pages of a region populated at a time */
+#define TEMPLATE_WINDOW 64
+
+static size_t region_pages(const sel4utils_elf_region_t *region)
+{
+    return region->reservation_size / PAGE_SIZE_4K;
+}
+
+/* Copy the file contents of every segment that overlaps the reservation of region i into its image */
+static int fill_image(elf_t *elf_file, int num_regions, sel4utils_elf_region_t regions[num_regions], int i,
+                      char *image)
+{
+    uintptr_t res_start = (uintptr_t) regions[i].reservation_vstart;
+    uintptr_t res_end = res_start + regions[i].reservation_size;
+
+    for (int j = 0; j < num_regions; j++) {
+        int segment_index = regions[j].segment_index;
+        uintptr_t start = (uintptr_t) regions[j].elf_vstart;
+        uintptr_t end = start + elf_getProgramHeaderFileSize(elf_file, segment_index);
+        uintptr_t copy_start = MAX(start, res_start);
+        uintptr_t copy_end = MIN(end, res_end);
+        if (copy_start >= copy_end) {
+            continue;
+        }
+        char *src = elf_getProgramSegment(elf_file, segment_index);
+        if (src == NULL) {
+            ZF_LOGE("Failed to find segment %d in elf file", segment_index);
+            return -1;
+        }
+        memcpy(image + (copy_start - res_start), src + (copy_start - start), copy_end - copy_start);
+    }
+    return 0;
+}
+
+int sel4utils_process_template_create(sel4utils_process_template_t *process_template, vspace_t *spawner_vspace,
+                                      const char *image_name)
+{
+    memset(process_template, 0, sizeof(*process_template));
+    process_template->spawner_vspace = spawner_vspace;
+
+    unsigned long size;
+    unsigned long cpio_len = _cpio_archive_end - _cpio_archive;
+    char *file = cpio_get_file(_cpio_archive, cpio_len, image_name, &size);
+    if (file == NULL) {
+        ZF_LOGE("Failed to find %s in the cpio archive", image_name);
+        return -1;
+    }
+    elf_t elf;
+    if (elf_newFile(file, size, &elf)) {
+        ZF_LOGE("Failed to parse elf file %s", image_name);
+        return -1;
+    }
+
+    process_template->entry_point = (void *)(uintptr_t) elf_getEntryPoint(&elf);
+    process_template->sysinfo = sel4utils_elf_get_vsyscall(&elf);
+
+    process_template->num_elf_phdrs = sel4utils_elf_num_phdrs(&elf);
+    process_template->elf_phdrs = calloc(process_template->num_elf_phdrs, sizeof(Elf_Phdr));
+    if (!process_template->elf_phdrs) {
+        ZF_LOGE("Failed to allocate memory for elf phdr information");
+        goto error;
+    }
+    sel4utils_elf_read_phdrs(&elf, process_template->num_elf_phdrs, process_template->elf_phdrs);
+
+    int num_regions = sel4utils_elf_num_regions(&elf);
+    process_template->num_elf_regions = num_regions;
+    process_template->elf_regions = calloc(num_regions, sizeof(*process_template->elf_regions));
+    process_template->images = calloc(num_regions, sizeof(*process_template->images));
+    if (!process_template->elf_regions || !process_template->images) {
+        ZF_LOGE("Failed to allocate memory for elf region information");
+        goto error;
+    }
+    if (sel4utils_elf_plan_regions(&elf, process_template->elf_regions)) {
+        ZF_LOGE("Failed to plan regions");
+        goto error;
+    }
+
+    for (int i = 0; i < num_regions; i++) {
+        size_t num_pages = region_pages(&process_template->elf_regions[i]);
+        if (num_pages == 0) {
+            continue;
+        }
+        char *image = vspace_new_pages(spawner_vspace, seL4_AllRights, num_pages, seL4_PageBits);
+        if (image == NULL) {
+            ZF_LOGE("Failed to allocate %zu pages for region %d", num_pages, i);
+            goto error;
+        }
+        process_template->images[i] = image;
+        /* Note that we don't need to explicitly zero frames as seL4 gives us zero'd frames */
+        if (fill_image(&elf, num_regions, process_template->elf_regions, i, image)) {
+            goto error;
+        }
+#ifdef CONFIG_ARCH_ARM
+        /* Flush the caches */
+        for (size_t j = 0; j < num_pages; j++) {
+            seL4_ARM_Page_Unify_Instruction(vspace_get_cap(spawner_vspace, image + j * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
+        }
+#endif
+    }
+#ifdef CONFIG_ARCH_RISCV
+    /* Ensure that the writes to memory that may be executed become visible */
+    asm volatile("fence.i" ::: "memory");
+#endif
+
+    return 0;
+
+error:
+    sel4utils_process_template_destroy(process_template);
+    return -1;
+}
+
+void sel4utils_process_template_destroy(sel4utils_process_template_t *process_template)
+{
+    if (process_template->images) {
+        for (int i = 0; i < process_template->num_elf_regions; i++) {
+            if (process_template->images[i] != NULL) {
+                vspace_unmap_pages(process_template->spawner_vspace, process_template->images[i],
+                                   region_pages(&process_template->elf_regions[i]), seL4_PageBits, VSPACE_FREE);
+            }
+        }
+        free(process_template->images);
+        process_template->images = NULL;
+    }
+
+    if (process_template->elf_regions) {
+        free(process_template->elf_regions);
+        process_template->elf_regions = NULL;
+    }
+
+    if (process_template->elf_phdrs) {
+        free(process_template->elf_phdrs);
+        process_template->elf_phdrs = NULL;
+    }
+}
+
+static int alloc_slots(vka_t *vka, size_t num, seL4_CPtr slots[num])
+{
+    if (vka_cspace_alloc_range(vka, num, &slots[0]) == 0) {
+        for (size_t i = 1; i < num; i++) {
+            slots[i] = slots[0] + i;
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        int error = vka_cspace_alloc(vka, &slots[i]);
+        if (error) {
+            ZF_LOGE("Failed to allocate cslot: %d", error);
+            while (i > 0) {
+                i--;
+                vka_cspace_free(vka, slots[i]);
+            }
+            return error;
+        }
+    }
+    return 0;
+}
+
+static void free_slots(vka_t *vka, size_t num, seL4_CPtr slots[num], size_t num_copied)
+{
+    for (size_t i = 0; i < num; i++) {
+        if (i < num_copied) {
+            cspacepath_t path;
+            vka_cspace_make_path(vka, slots[i], &path);
+            vka_cnode_delete(&path);
+        }
+        vka_cspace_free(vka, slots[i]);
+    }
+}
+
+/* Copy the caps of the frames mapped at vaddr in vspace into slots, returning how many were copied */
+static size_t copy_frame_caps(vka_t *vka, vspace_t *vspace, void *vaddr, size_t num, seL4_CPtr slots[num],
+                              seL4_CapRights_t rights)
+{
+    for (size_t i = 0; i < num; i++) {
+        cspacepath_t src, dest;
+        vka_cspace_make_path(vka, vspace_get_cap(vspace, vaddr + i * PAGE_SIZE_4K), &src);
+        vka_cspace_make_path(vka, slots[i], &dest);
+        int error = vka_cnode_copy(&dest, &src, rights);
+        if (error != seL4_NoError) {
+            ZF_LOGE("Failed to copy frame cap: %d", error);
+            return i;
+        }
+    }
+    return num;
+}
+
+/* Populate a window of pages of a region of a process from the template image */
+static int populate_window(sel4utils_process_template_t *process_template, sel4utils_process_t *process,
+                           vka_t *vka, sel4utils_elf_region_t *region, reservation_t reservation, char *image,
+                           size_t offset, size_t num_pages)
+{
+    vspace_t *spawner_vspace = process_template->spawner_vspace;
+    void *vaddr = region->reservation_vstart + offset;
+    seL4_CPtr slots[TEMPLATE_WINDOW];
+
+    int error = alloc_slots(vka, num_pages, slots);
+    if (error) {
+        return error;
+    }
+
+    if (!seL4_CapRights_get_capAllowWrite(region->rights)) {
+        /* map copies of the template's frames without cookies, so that only the copies are
+         * freed when the process is destroyed */
+        size_t copied = copy_frame_caps(vka, spawner_vspace, image + offset, num_pages, slots, region->rights);
+        if (copied < num_pages) {
+            free_slots(vka, num_pages, slots, copied);
+            return -1;
+        }
+        error = vspace_map_pages_at_vaddr(&process->vspace, slots, NULL, vaddr, num_pages, seL4_PageBits,
+                                          reservation);
+        if (error) {
+            ZF_LOGE("Failed to map template frames into process: %d", error);
+            free_slots(vka, num_pages, slots, copied);
+        }
+        return error;
+    }
+
+    /* copy the template's contents into new frames */
+    error = vspace_new_pages_at_vaddr(&process->vspace, vaddr, num_pages, seL4_PageBits, reservation);
+    if (error) {
+        ZF_LOGE("Failed to allocate frames for process: %d", error);
+        free_slots(vka, num_pages, slots, 0);
+        return error;
+    }
+    size_t copied = copy_frame_caps(vka, &process->vspace, vaddr, num_pages, slots, seL4_AllRights);
+    if (copied < num_pages) {
+        free_slots(vka, num_pages, slots, copied);
+        return -1;
+    }
+    char *mapping = vspace_map_pages(spawner_vspace, slots, NULL, seL4_AllRights, num_pages, seL4_PageBits, 1);
+    if (mapping == NULL) {
+        ZF_LOGE("Failed to map process frames into spawner");
+        free_slots(vka, num_pages, slots, copied);
+        return -1;
+    }
+    memcpy(mapping, image + offset, num_pages * PAGE_SIZE_4K);
+#ifdef CONFIG_ARCH_ARM
+    /* Flush the caches */
+    for (size_t i = 0; i < num_pages; i++) {
+        seL4_ARM_Page_Unify_Instruction(slots[i], 0, PAGE_SIZE_4K);
+        seL4_ARM_Page_Unify_Instruction(vspace_get_cap(&process->vspace, vaddr + i * PAGE_SIZE_4K), 0, PAGE_SIZE_4K);
+    }
+#elif CONFIG_ARCH_RISCV
+    /* Ensure that the writes to memory that may be executed become visible */
+    asm volatile("fence.i" ::: "memory");
+#endif
+    vspace_unmap_pages(spawner_vspace, mapping, num_pages, seL4_PageBits, VSPACE_PRESERVE);
+    free_slots(vka, num_pages, slots, copied);
+    return 0;
+}
+
+int sel4utils_process_template_configure(sel4utils_process_template_t *process_template,
+                                         sel4utils_process_t *process, vka_t *vka,
+                                         sel4utils_process_config_t config)
+{
+    if (!config.create_vspace) {
+        ZF_LOGE("A process configured from a template must create its own vspace");
+        return -1;
+    }
+
+    /* reserve the planned layout of the image, along with any reservations asked for, so that
+     * the thread is configured around them */
+    sel4utils_elf_region_t *regions = process_template->elf_regions;
+    int num_regions = process_template->num_elf_regions;
+    sel4utils_elf_region_t *extra_reservations = config.reservations;
+    int num_extra_reservations = config.num_reservations;
+    sel4utils_elf_region_t reservations[num_regions + num_extra_reservations];
+    int num_reservations = 0;
+
+    for (int i = 0; i < num_regions; i++) {
+        if (regions[i].reservation_size == 0) {
+            continue;
+        }
+        reservations[num_reservations] = regions[i];
+        reservations[num_reservations].elf_vstart = regions[i].reservation_vstart;
+        reservations[num_reservations].size = regions[i].reservation_size;
+        num_reservations++;
+    }
+    for (int i = 0; i < num_extra_reservations; i++) {
+        reservations[num_reservations + i] = extra_reservations[i];
+    }
+
+    config = process_config_noelf(config, process_template->entry_point, process_template->sysinfo);
+    config = process_config_create_vspace(config, reservations, num_reservations + num_extra_reservations);
+    int error = sel4utils_configure_process_custom(process, vka, process_template->spawner_vspace, config);
+    if (error) {
+        return error;
+    }
+    for (int i = 0; i < num_extra_reservations; i++) {
+        extra_reservations[i].reservation = reservations[num_reservations + i].reservation;
+    }
+
+    process->num_elf_phdrs = process_template->num_elf_phdrs;
+    process->elf_phdrs = calloc(process->num_elf_phdrs, sizeof(Elf_Phdr));
+    if (!process->elf_phdrs) {
+        ZF_LOGE("Failed to allocate memory for elf phdr information");
+        goto error;
+    }
+    memcpy(process->elf_phdrs, process_template->elf_phdrs, process->num_elf_phdrs * sizeof(Elf_Phdr));
+
+    /* the process releases its copies of the caps to the template's read only frames */
+    process->num_shared_regions = num_regions;
+    process->shared_regions = calloc(num_regions, sizeof(*process->shared_regions));
+    if (!process->shared_regions) {
+        ZF_LOGE("Failed to allocate memory for shared region information");
+        goto error;
+    }
+    memcpy(process->shared_regions, regions, num_regions * sizeof(*regions));
+
+    for (int i = 0, r = 0; i < num_regions; i++) {
+        size_t num_pages = region_pages(&regions[i]);
+        if (num_pages == 0) {
+            continue;
+        }
+        for (size_t page = 0; page < num_pages; page += TEMPLATE_WINDOW) {
+            error = populate_window(process_template, process, vka, &regions[i], reservations[r].reservation,
+                                    process_template->images[i], page * PAGE_SIZE_4K,
+                                    MIN(TEMPLATE_WINDOW, num_pages - page));
+            if (error) {
+                goto error;
+            }
+        }
+        r++;
+    }
+
+    return 0;
+
+error:
+    sel4utils_destroy_process(process, vka);
+    return -1;
+}
@@ -54,6 +54,14 @@ static int delegate_cspace_alloc(void *data, seL4_CPtr *res)
     return vka_cspace_alloc(sdata->delegate, res);
 }
 
+static int delegate_cspace_alloc_range(void *data, size_t num, seL4_CPtr *res)
+{
+    slab_data_t *sdata = data;
+    assert(data != NULL);
+    assert(sdata->delegate != NULL);
+    return vka_cspace_alloc_range(sdata->delegate, num, res);
+}
+
 static void delegate_cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res)
 {
     slab_data_t *sdata = data;
@@ -194,10 +202,13 @@ int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTy
     slab_vka->cspace_alloc = delegate_cspace_alloc;
     slab_vka->cspace_make_path = delegate_cspace_make_path;
     slab_vka->cspace_free = delegate_cspace_free;
+    slab_vka->cspace_alloc_range = delegate_cspace_alloc_range;
     slab_vka->utspace_alloc_at = delegate_utspace_alloc_at;
     slab_vka->utspace_alloc = slab_utspace_alloc;
     slab_vka->utspace_alloc_maybe_device = slab_utspace_alloc_maybe_device;
     slab_vka->utspace_free = slab_utspace_free;
+    /* batches fall back to individual allocations from the slabs */
+    slab_vka->utspace_alloc_batch = NULL;
 
     /* allocate untyped */
     size_t total_size = calculate_total_size(object_freq);
@@ -26,6 +26,7 @@
 #include <sel4utils/api.h>
 #include <sel4utils/mapping.h>
 #include <sel4utils/thread.h>
+#include <sel4utils/vspace.h>
 #include <sel4utils/util.h>
 #include <sel4utils/arch/util.h>
 #include <sel4utils/helpers.h>
@@ -317,6 +318,64 @@ sel4utils_start_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vs
                                   (void *) fault_endpoint, 1);
 }
 
+static int
+paging_fault_handler(sel4utils_paging_fault_handler_t *handler)
+{
+    seL4_CPtr reply = handler->thread.reply.cptr;
+    seL4_MessageInfo_t info = api_recv(handler->fault_endpoint, NULL, reply);
+    while (1) {
+        seL4_Fault_t fault = seL4_getFault(info);
+        if (seL4_Fault_get_seL4_FaultType(fault) == seL4_Fault_VMFault) {
+            /* read everything we need before handling the fault clobbers our message registers */
+            uintptr_t vaddr = seL4_Fault_VMFault_get_Addr(fault);
+            bool write = !sel4utils_is_read_fault();
+            if (handler->lock.lock) {
+                handler->lock.lock(handler->lock.cookie);
+            }
+            int error = sel4utils_vspace_handle_fault(handler->paged_vspace, handler->vspace, vaddr, write);
+            if (handler->lock.unlock) {
+                handler->lock.unlock(handler->lock.cookie);
+            }
+            if (error == 0) {
+                /* an empty reply resumes the faulting thread */
+                info = api_reply_recv(handler->fault_endpoint, seL4_MessageInfo_new(0, 0, 0, 0), NULL, reply);
+                continue;
+            }
+        }
+        sel4utils_print_fault_message(info, handler->name);
+        info = api_recv(handler->fault_endpoint, NULL, reply);
+    }
+    return 0;
+}
+
+int
+sel4utils_start_paging_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vspace,
+                                     seL4_CPtr cspace, seL4_Word cap_data, char *name, vspace_t *paged_vspace,
+                                     sel4utils_paging_lock_t *lock, sel4utils_paging_fault_handler_t *res)
+{
+    if (lock != NULL && (lock->lock == NULL || lock->unlock == NULL)) {
+        ZF_LOGE("Paging fault handler lock needs both lock and unlock");
+        return -1;
+    }
+
+    res->vspace = vspace;
+    res->paged_vspace = paged_vspace;
+    res->fault_endpoint = fault_endpoint;
+    res->name = name;
+    res->lock = lock == NULL ? (sel4utils_paging_lock_t) {0} : *lock;
+
+    int error = sel4utils_configure_thread(vka, vspace, vspace, 0, cspace,
+                                           cap_data, &res->thread);
+
+    if (error) {
+        ZF_LOGE("Failed to configure fault handling thread\n");
+        return -1;
+    }
+
+    return sel4utils_start_thread(&res->thread, (sel4utils_thread_entry_fn)paging_fault_handler, res,
+                                  NULL, 1);
+}
+
 int
 sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint_t *checkpoint, bool suspend)
 {
@@ -36,7 +36,10 @@
  * our tables */
 #define MID_LEVEL_STRUCTURES_SIZE (NUM_MID_LEVEL_STRUCTURES * sizeof(vspace_mid_level_t))
 #define BOTTOM_LEVEL_STRUCTURES_SIZE (NUM_BOTTOM_LEVEL_STRUCTURES * sizeof(vspace_bottom_level_t))
-#define VSPACE_RESERVE_SIZE (MID_LEVEL_STRUCTURES_SIZE + BOTTOM_LEVEL_STRUCTURES_SIZE + sizeof(vspace_mid_level_t))
+/* We also need room for the pages the free index takes its nodes from */
+#define FREE_INDEX_STRUCTURES_SIZE (FREE_INDEX_BOOTSTRAP_PAGES * PAGE_SIZE_4K)
+#define VSPACE_RESERVE_SIZE (MID_LEVEL_STRUCTURES_SIZE + BOTTOM_LEVEL_STRUCTURES_SIZE + sizeof(vspace_mid_level_t) \
+                             + FREE_INDEX_STRUCTURES_SIZE)
 #define VSPACE_RESERVE_START (KERNEL_RESERVED_START - VSPACE_RESERVE_SIZE)
 
 static int common_init(vspace_t *vspace, vka_t *vka, seL4_CPtr vspace_root,
@@ -45,8 +48,18 @@ static int common_init(vspace_t *vspace, vka_t *vka, seL4_CPtr vspace_root,
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     data->vka = vka;
     data->last_allocated = 0x10000000;
-    data->reservation_head = NULL;
+    data->reservation_root = NULL;
     data->is_empty = false;
+    data->promote_pages = false;
+    data->cow_ranges = NULL;
+    data->cow_window.vspace = NULL;
+    data->compact = false;
+    data->cookie_top_level = NULL;
+    data->lookup_level = NULL;
+#ifdef CONFIG_SEL4UTILS_VSPACE_LOG
+    data->log = NULL;
+#endif
+    sel4utils_free_index_init(vspace);
 
     data->vspace_root = vspace_root;
     vspace->allocated_object = allocated_object_fn;
@@ -395,6 +408,31 @@ int sel4utils_bootstrap_vspace(vspace_t *vspace, sel4utils_alloc_data_t *data,
     return 0;
 }
 
+/* Record the caps to the frames the kernel mapped the image with, which it hands over in order
+ * from the first page of the image, so that they can be found with vspace_get_cap */
+static int record_initial_task_frames(vspace_t *vspace, seL4_SlotRegion frames)
+{
+    uintptr_t va_start, va_end;
+    sel4utils_get_image_region(&va_start, &va_end);
+    va_start = ROUND_DOWN(va_start, PAGE_SIZE_4K);
+
+    size_t num_frames = frames.end - frames.start;
+    if (num_frames != (va_end - va_start) / PAGE_SIZE_4K) {
+        ZF_LOGW("%zu image frames do not cover the image at %p-%p, not recording them", num_frames,
+                (void *) va_start, (void *) va_end);
+        return 0;
+    }
+
+    for (size_t i = 0; i < num_frames; i++) {
+        /* no cookie, as the frames were never allocated by us */
+        if (update_entries(vspace, va_start + i * PAGE_SIZE_4K, frames.start + i, seL4_PageBits, 0)) {
+            ZF_LOGE("Failed to record image frame %zu", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int sel4utils_bootstrap_vspace_with_bootinfo(vspace_t *vspace, sel4utils_alloc_data_t *data,
                                              seL4_CPtr vspace_root,
                                              vka_t *vka, seL4_BootInfo *info, vspace_allocated_object_fn allocated_object_fn,
@@ -412,11 +450,28 @@ int sel4utils_bootstrap_vspace_with_bootinfo(vspace_t *vspace, sel4utils_alloc_d
     }
     existing_frames[i + 2] = NULL;
 
-    return sel4utils_bootstrap_vspace(vspace, data, vspace_root, vka, allocated_object_fn,
-                                      allocated_object_cookie, existing_frames);
+    if (sel4utils_bootstrap_vspace(vspace, data, vspace_root, vka, allocated_object_fn,
+                                   allocated_object_cookie, existing_frames)) {
+        return -1;
+    }
+
+    return record_initial_task_frames(vspace, info->userImageFrames);
 }
 
-int sel4utils_bootstrap_clone_into_vspace(vspace_t *current, vspace_t *clone, reservation_t image)
+/* Number of pages from vaddr, up to end, that can be shared copy-on-write from current. That
+ * needs current to have caps to them, and they must not be part of larger pages */
+static size_t shareable_pages(vspace_t *current, uintptr_t vaddr, uintptr_t end)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(current);
+    size_t num = 0;
+    while (vaddr < end && is_backed(data, vaddr) && get_frame_size_bits(data, vaddr) == seL4_PageBits) {
+        num++;
+        vaddr += PAGE_SIZE_4K;
+    }
+    return num;
+}
+
+static int clone_into_vspace(vspace_t *current, vspace_t *clone, reservation_t image, bool cow)
 {
     sel4utils_res_t *res = reservation_to_res(image);
     seL4_CPtr slot;
@@ -429,7 +484,26 @@ int sel4utils_bootstrap_clone_into_vspace(vspace_t *current, vspace_t *clone, re
     cspacepath_t dest;
     vka_cspace_make_path(get_alloc_data(current)->vka, slot, &dest);
 
+    /* Only the code of the running image is never written to. Everything after it, such as
+     * the data, the bss and the malloc and allocator state in them, is written to by this
+     * function itself, so making any of it read only would fault part way through the clone. */
+    extern char _etext[];
+    uintptr_t cow_end = MIN(ROUND_DOWN((uintptr_t) _etext, PAGE_SIZE_4K), res->end);
+
     for (uintptr_t page = res->start; page < res->end - 1; page += PAGE_SIZE_4K) {
+        size_t num = cow && page < cow_end ? shareable_pages(current, page, cow_end) : 0;
+        if (num > 0) {
+            error = sel4utils_share_mem_at_vaddr_cow(current, clone, (void *) page, num, seL4_PageBits,
+                                                     (void *) page, image);
+            if (error == 0) {
+                page += (num - 1) * PAGE_SIZE_4K;
+                continue;
+            }
+            /* copying still works, so do that for the rest of the image */
+            ZF_LOGW("Failed to share image copy-on-write at %"PRIuPTR", copying it instead", page);
+            cow = false;
+        }
+
         /* we don't know if the current vspace has caps to its mappings -
          * it probably doesn't.
          *
@@ -476,3 +550,13 @@ int sel4utils_bootstrap_clone_into_vspace(vspace_t *current, vspace_t *clone, re
     vka_cspace_free(get_alloc_data(current)->vka, slot);
     return 0;
 }
+
+int sel4utils_bootstrap_clone_into_vspace(vspace_t *current, vspace_t *clone, reservation_t image)
+{
+    return clone_into_vspace(current, clone, image, false);
+}
+
+int sel4utils_bootstrap_clone_into_vspace_cow(vspace_t *current, vspace_t *clone, reservation_t image)
+{
+    return clone_into_vspace(current, clone, image, true);
+}
@@ -0,0 +1,475 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Copy-on-write sharing of frames between vspaces.
+ *
+ * A shared frame is described by a sel4utils_cow_frame_t, which counts the vspaces mapping it.
+ * Each vspace maps the frame read only through a cap of its own, with a cookie of 0 in the
+ * shadow page table so that nothing but the record ever frees the frame. The pages of a vspace
+ * that are copy-on-write are found through its list of sel4utils_cow_range_t, one for every
+ * range it has shared. There are few of these, so a list is enough.
+ *
+ * Unlike the shadow page table none of this is used by malloc, so it is allocated with malloc. */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4utils/vspace.h>
+#include <sel4utils/mapping.h>
+#include <sel4utils/vspace_internal.h>
+#include <vka/capops.h>
+
+#include <utils/util.h>
+
+static seL4_CapRights_t read_only(void)
+{
+    return seL4_CapRights_new(false, false, true, false);
+}
+
+/* Find the frame a copy-on-write page of a vspace is shared through, along with the range that
+ * records it */
+static sel4utils_cow_frame_t **find_frame(sel4utils_alloc_data_t *data, uintptr_t vaddr,
+                                          sel4utils_cow_range_t **range)
+{
+    for (sel4utils_cow_range_t *r = data->cow_ranges; r != NULL; r = r->next) {
+        if (vaddr < r->start || vaddr - r->start >= r->num_pages * BIT(r->size_bits)) {
+            continue;
+        }
+        size_t index = (vaddr - r->start) >> r->size_bits;
+        /* ranges may overlap where the earlier one has since let go of the page */
+        if (r->frames[index] != NULL) {
+            *range = r;
+            return &r->frames[index];
+        }
+    }
+    return NULL;
+}
+
+static sel4utils_cow_range_t *new_range(sel4utils_alloc_data_t *data, uintptr_t start, size_t num_pages,
+                                        size_t size_bits)
+{
+    sel4utils_cow_range_t *range = malloc(sizeof(*range));
+    if (range == NULL) {
+        return NULL;
+    }
+    range->frames = calloc(num_pages, sizeof(*range->frames));
+    if (range->frames == NULL) {
+        free(range);
+        return NULL;
+    }
+    range->start = start;
+    range->num_pages = num_pages;
+    range->size_bits = size_bits;
+    range->live = 0;
+    range->next = data->cow_ranges;
+    data->cow_ranges = range;
+    return range;
+}
+
+static void free_range_if_unused(sel4utils_alloc_data_t *data, sel4utils_cow_range_t *range)
+{
+    if (range->live > 0) {
+        return;
+    }
+    sel4utils_cow_range_t **prev = &data->cow_ranges;
+    while (*prev != range) {
+        prev = &(*prev)->next;
+    }
+    *prev = range->next;
+    free(range->frames);
+    free(range);
+}
+
+/* Stop treating a page as copy-on-write */
+static void release_entry(sel4utils_alloc_data_t *data, sel4utils_cow_range_t *range,
+                          sel4utils_cow_frame_t **entry)
+{
+    *entry = NULL;
+    range->live--;
+    free_range_if_unused(data, range);
+}
+
+static void delete_cap(vka_t *vka, seL4_CPtr cap)
+{
+    cspacepath_t path;
+    vka_cspace_make_path(vka, cap, &path);
+    vka_cnode_delete(&path);
+    vka_cspace_free(vka, cap);
+}
+
+static void put_frame(sel4utils_cow_frame_t *frame)
+{
+    assert(frame->refs > 0);
+    frame->refs--;
+    if (frame->refs > 0) {
+        return;
+    }
+    delete_cap(frame->vka, frame->cap);
+    if (frame->cookie != 0) {
+        vka_utspace_free(frame->vka, kobject_get_type(KOBJECT_FRAME, frame->size_bits), frame->size_bits,
+                         frame->cookie);
+    }
+    free(frame);
+}
+
+/* Turn a page of vspace that is mapped normally into a copy-on-write one. The vspace keeps
+ * mapping the frame with the cap it already has, but read only, and the record takes over
+ * freeing the frame */
+static int make_cow(vspace_t *vspace, uintptr_t vaddr, size_t size_bits, int cacheable,
+                    sel4utils_cow_frame_t **result)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    seL4_CPtr cap = get_cap(data, vaddr);
+    cspacepath_t src, dest;
+
+    if (!is_backed(data, vaddr) || get_frame_size_bits(data, vaddr) != size_bits) {
+        ZF_LOGE("No %zu bit page mapped at %p to share", size_bits, (void *) vaddr);
+        return -1;
+    }
+
+    sel4utils_cow_frame_t *frame = malloc(sizeof(*frame));
+    if (frame == NULL) {
+        ZF_LOGE("Failed to allocate copy-on-write frame");
+        return -1;
+    }
+
+    int error = vka_cspace_alloc_path(data->vka, &dest);
+    if (error) {
+        ZF_LOGE("Failed to allocate slot for copy-on-write frame");
+        free(frame);
+        return error;
+    }
+
+    vka_cspace_make_path(data->vka, cap, &src);
+    error = vka_cnode_copy(&dest, &src, seL4_AllRights);
+    if (error) {
+        ZF_LOGE("Failed to copy cap, error %d", error);
+        vka_cspace_free(data->vka, dest.capPtr);
+        free(frame);
+        return error;
+    }
+
+    /* mapping a frame again at the address it is mapped at changes its rights */
+    error = data->map_page(vspace, cap, (void *) vaddr, read_only(), cacheable, size_bits);
+    if (error) {
+        ZF_LOGE("Failed to make page at %p read only", (void *) vaddr);
+        delete_cap(data->vka, dest.capPtr);
+        free(frame);
+        return error;
+    }
+
+    *frame = (sel4utils_cow_frame_t) {
+        .refs = 1,
+        .cap = dest.capPtr,
+        .cookie = get_cookie(vspace, vaddr),
+        .vka = data->vka,
+        .size_bits = size_bits,
+    };
+    replace_entries(vspace, vaddr, size_bits, cap, 0);
+
+    *result = frame;
+    return 0;
+}
+
+/* Map a frame read only into a vspace with a new copy of its cap */
+static int map_frame(vspace_t *vspace, sel4utils_cow_frame_t *frame, uintptr_t vaddr, seL4_CapRights_t rights,
+                     int cacheable)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    cspacepath_t src, dest;
+
+    int error = vka_cspace_alloc_path(data->vka, &dest);
+    if (error) {
+        ZF_LOGE("Failed to allocate slot in to cspace, error: %d", error);
+        return error;
+    }
+
+    /* the cap gets the full rights of the reservation, so the last vspace sharing the frame
+     * can make it writable */
+    vka_cspace_make_path(frame->vka, frame->cap, &src);
+    error = vka_cnode_copy(&dest, &src, rights);
+    if (error) {
+        ZF_LOGE("Failed to copy cap, error %d", error);
+        vka_cspace_free(data->vka, dest.capPtr);
+        return error;
+    }
+
+    error = data->map_page(vspace, dest.capPtr, (void *) vaddr, read_only(), cacheable, frame->size_bits);
+    if (error) {
+        ZF_LOGE("Failed to map page into target vspace at vaddr %p", (void *) vaddr);
+        delete_cap(data->vka, dest.capPtr);
+        return error;
+    }
+
+    error = update_entries(vspace, vaddr, dest.capPtr, frame->size_bits, 0);
+    if (error) {
+        seL4_ARCH_Page_Unmap(dest.capPtr);
+        delete_cap(data->vka, dest.capPtr);
+        return error;
+    }
+
+    frame->refs++;
+    return 0;
+}
+
+int sel4utils_cow_share(vspace_t *from, vspace_t *to, uintptr_t start, size_t num_pages, size_t size_bits,
+                        uintptr_t vaddr, seL4_CapRights_t to_rights, int from_cacheable, int to_cacheable,
+                        size_t *shared)
+{
+    sel4utils_alloc_data_t *from_data = get_alloc_data(from);
+    sel4utils_alloc_data_t *to_data = get_alloc_data(to);
+    sel4utils_cow_range_t *from_range = NULL;
+    int error = 0;
+    size_t i;
+
+    *shared = 0;
+
+    sel4utils_cow_range_t *to_range = new_range(to_data, vaddr, num_pages, size_bits);
+    if (to_range == NULL) {
+        ZF_LOGE("Failed to allocate copy-on-write range");
+        return -1;
+    }
+
+    for (i = 0; i < num_pages; i++) {
+        uintptr_t from_vaddr = start + i * BIT(size_bits);
+        uintptr_t to_vaddr = vaddr + i * BIT(size_bits);
+        sel4utils_cow_range_t *range;
+        sel4utils_cow_frame_t *frame;
+
+        sel4utils_cow_frame_t **entry = find_frame(from_data, from_vaddr, &range);
+        if (entry != NULL) {
+            /* already copy-on-write, from an earlier share */
+            frame = *entry;
+        } else {
+            if (from_range == NULL) {
+                from_range = new_range(from_data, start, num_pages, size_bits);
+                if (from_range == NULL) {
+                    ZF_LOGE("Failed to allocate copy-on-write range");
+                    error = -1;
+                    break;
+                }
+            }
+            error = make_cow(from, from_vaddr, size_bits, from_cacheable, &frame);
+            if (error) {
+                break;
+            }
+            from_range->frames[i] = frame;
+            from_range->live++;
+        }
+
+        error = map_frame(to, frame, to_vaddr, to_rights, to_cacheable);
+        if (error) {
+            break;
+        }
+        to_range->frames[i] = frame;
+        to_range->live++;
+    }
+
+    /* pages made copy-on-write in from stay that way if we failed, which does no harm */
+    if (from_range != NULL) {
+        free_range_if_unused(from_data, from_range);
+    }
+    free_range_if_unused(to_data, to_range);
+
+    *shared = i;
+    return error;
+}
+
+bool sel4utils_cow_is_shared(vspace_t *vspace, uintptr_t vaddr)
+{
+    sel4utils_cow_range_t *range;
+    return find_frame(get_alloc_data(vspace), vaddr, &range) != NULL;
+}
+
+/* The window that 4K pages are copied through, reserved in current on first use */
+static sel4utils_map_window_t *copy_window(sel4utils_alloc_data_t *data, vspace_t *current)
+{
+    if (data->cow_window.vspace == current) {
+        return &data->cow_window;
+    }
+    if (data->cow_window.vspace != NULL) {
+        /* faults are now being handled from another vspace */
+        sel4utils_map_window_destroy(&data->cow_window);
+    }
+    if (sel4utils_map_window_init(&data->cow_window, data->vka, current, data->cow_window_entries,
+                                  ARRAY_SIZE(data->cow_window_entries)) != 0) {
+        data->cow_window.vspace = NULL;
+        return NULL;
+    }
+    return &data->cow_window;
+}
+
+/* Copy the contents of one frame into another by mapping both into current */
+static int copy_frame(sel4utils_alloc_data_t *data, vspace_t *current, seL4_CPtr dest_cap, seL4_CPtr src_cap,
+                      size_t size_bits)
+{
+    sel4utils_map_window_t *window = size_bits == seL4_PageBits ? copy_window(data, current) : NULL;
+    void *dest, *src;
+
+    if (window != NULL) {
+        dest = sel4utils_map_window_map(window, dest_cap);
+        src = sel4utils_map_window_map(window, src_cap);
+    } else {
+        /* the window only holds 4K frames */
+        dest = sel4utils_dup_and_map(data->vka, current, dest_cap, size_bits);
+        src = sel4utils_dup_and_map(data->vka, current, src_cap, size_bits);
+    }
+    if (dest != NULL && src != NULL) {
+        memcpy(dest, src, BIT(size_bits));
+    }
+
+    if (window != NULL) {
+        if (dest != NULL) {
+            sel4utils_map_window_unmap(window, dest);
+        }
+        if (src != NULL) {
+            sel4utils_map_window_unmap(window, src);
+        }
+        /* either cap may be deleted once we return, so nothing can be left mapped by cptr */
+        sel4utils_map_window_flush(window);
+    } else {
+        if (dest != NULL) {
+            sel4utils_unmap_dup(data->vka, current, dest, size_bits);
+        }
+        if (src != NULL) {
+            sel4utils_unmap_dup(data->vka, current, src, size_bits);
+        }
+    }
+    return dest == NULL || src == NULL ? -1 : 0;
+}
+
+int sel4utils_cow_handle_write(vspace_t *vspace, vspace_t *current, uintptr_t vaddr, seL4_CapRights_t rights,
+                               int cacheable)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    sel4utils_cow_range_t *range;
+    sel4utils_cow_frame_t **entry = find_frame(data, vaddr, &range);
+    assert(entry != NULL);
+
+    sel4utils_cow_frame_t *frame = *entry;
+    size_t size_bits = frame->size_bits;
+    uintptr_t page = ALIGN_DOWN(vaddr, BIT(size_bits));
+    seL4_CPtr cap = get_cap(data, page);
+
+    if (frame->refs == 1 && frame->vka == data->vka) {
+        /* nobody else maps the frame any more, so take it over rather than copying it */
+        int error = replace_entries(vspace, page, size_bits, cap, frame->cookie);
+        if (error) {
+            return error;
+        }
+        error = data->map_page(vspace, cap, (void *) page, rights, cacheable, size_bits);
+        if (error) {
+            ZF_LOGE("Failed to make page at %p writable", (void *) page);
+            replace_entries(vspace, page, size_bits, cap, 0);
+            return error;
+        }
+        delete_cap(frame->vka, frame->cap);
+        free(frame);
+        release_entry(data, range, entry);
+        return 0;
+    }
+
+    vka_object_t copy;
+    int error = vka_alloc_frame(data->vka, size_bits, &copy);
+    if (error) {
+        ZF_LOGE("Failed to allocate frame to copy page at %p into", (void *) page);
+        return error;
+    }
+
+    if (copy_frame(data, current, copy.cptr, cap, size_bits) != 0) {
+        ZF_LOGE("Failed to map frames to copy page at %p", (void *) page);
+        vka_free_object(data->vka, &copy);
+        return -1;
+    }
+
+    /* swap the shared frame for the copy */
+    error = replace_entries(vspace, page, size_bits, copy.cptr, copy.ut);
+    if (error) {
+        vka_free_object(data->vka, &copy);
+        return error;
+    }
+    seL4_ARCH_Page_Unmap(cap);
+    error = data->map_page(vspace, copy.cptr, (void *) page, rights, cacheable, size_bits);
+    if (error) {
+        ZF_LOGE("Failed to map copy of page at %p", (void *) page);
+        /* leave things as they were */
+        data->map_page(vspace, cap, (void *) page, read_only(), cacheable, size_bits);
+        replace_entries(vspace, page, size_bits, cap, 0);
+        vka_free_object(data->vka, &copy);
+        return error;
+    }
+#ifdef CONFIG_ARCH_ARM
+    seL4_ARM_Page_Unify_Instruction(copy.cptr, 0, BIT(size_bits));
+#endif /* CONFIG_ARCH_ARM */
+
+    delete_cap(data->vka, cap);
+    release_entry(data, range, entry);
+    put_frame(frame);
+    return 0;
+}
+
+void sel4utils_cow_unmapped(vspace_t *vspace, uintptr_t vaddr, bool free)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    sel4utils_cow_range_t *range;
+    sel4utils_cow_frame_t **entry = find_frame(data, vaddr, &range);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    sel4utils_cow_frame_t *frame = *entry;
+    release_entry(data, range, entry);
+    /* if the caller is keeping our cap to the frame then our reference goes with it */
+    if (free) {
+        put_frame(frame);
+    }
+}
+
+void sel4utils_cow_tear_down(vspace_t *vspace)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+
+    if (data->cow_window.vspace != NULL) {
+        sel4utils_map_window_destroy(&data->cow_window);
+        data->cow_window.vspace = NULL;
+    }
+
+    /* unmapping a page lets go of it, and the range goes once it has no pages left */
+    while (data->cow_ranges != NULL) {
+        sel4utils_cow_range_t *range = data->cow_ranges;
+        for (size_t i = 0; i < range->num_pages; i++) {
+            if (range->frames[i] == NULL) {
+                continue;
+            }
+            bool last = range->live == 1;
+            /* range is freed along with its last page, after which it must not be looked at */
+            sel4utils_cow_range_t *next = range->next;
+            void *vaddr = (void *)(range->start + i * BIT(range->size_bits));
+            sel4utils_unmap_pages(vspace, vaddr, 1, range->size_bits, VSPACE_FREE);
+            /* the unmap is refused if the page is now part of a larger frame, and then the
+             * page is still recorded, as is the range if it was the last one */
+            if (last ? data->cow_ranges != next : range->frames[i] != NULL) {
+                ZF_LOGE("Failed to unmap copy-on-write page at %p, leaking the rest", vaddr);
+                return;
+            }
+            if (last) {
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,494 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+/* Index of the free virtual memory in a vspace, used by find_range.
+ *
+ * The shadow page table remains the authority on what is free. The index is kept in step
+ * with it by the range functions in vspace_internal.h and is only ever a cache: if it cannot
+ * be updated (for example because it has run out of nodes) it is marked stale and rebuilt
+ * from the shadow page table the next time it is prepared.
+ *
+ * Nodes cannot come from malloc, as malloc may itself be backed by this vspace and call back
+ * into it. Instead they are carved out of pages obtained the same way as the shadow page
+ * table levels, and are only ever taken from the spare list in the middle of an operation.
+ * The spare list is refilled by sel4utils_free_index_prepare, which is called at the start
+ * of operations when the index is consistent and it is safe to allocate. Operations that only
+ * free memory, such as unmapping and freeing reservations, do not prepare the index: they add
+ * the ranges they free, and if that runs out of spare nodes the index is rebuilt later. */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sel4utils/vspace.h>
+#include <sel4utils/vspace_internal.h>
+
+#include <utils/util.h>
+
+/* Number of spare nodes to have available before starting an operation. A single update
+ * needs at most one new node, as any other nodes it needs are ones it removed first */
+#define FREE_INDEX_MIN_SPARE 4
+
+#define NODES_PER_CHUNK ((PAGE_SIZE_4K - sizeof(void *)) / sizeof(struct sel4utils_free_extent))
+
+static inline sel4utils_free_index_t *get_free_index(vspace_t *vspace)
+{
+    return &get_alloc_data(vspace)->free_index;
+}
+
+static inline int _tree_height(struct sel4utils_free_extent *node)
+{
+    return node ? node->height : 0;
+}
+
+static inline uintptr_t _tree_max_size(struct sel4utils_free_extent *node)
+{
+    return node ? node->max_size : 0;
+}
+
+static inline void _tree_update(struct sel4utils_free_extent *node)
+{
+    node->height = MAX(_tree_height(node->left), _tree_height(node->right)) + 1;
+    node->max_size = MAX(node->end - node->start, MAX(_tree_max_size(node->left), _tree_max_size(node->right)));
+}
+
+static struct sel4utils_free_extent *_tree_rotate_right(struct sel4utils_free_extent *node)
+{
+    struct sel4utils_free_extent *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    _tree_update(node);
+    _tree_update(left);
+    return left;
+}
+
+static struct sel4utils_free_extent *_tree_rotate_left(struct sel4utils_free_extent *node)
+{
+    struct sel4utils_free_extent *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    _tree_update(node);
+    _tree_update(right);
+    return right;
+}
+
+/* Restores the AVL invariant for a subtree whose children are already balanced */
+static struct sel4utils_free_extent *_tree_balance(struct sel4utils_free_extent *node)
+{
+    _tree_update(node);
+    int balance = _tree_height(node->left) - _tree_height(node->right);
+    if (balance > 1) {
+        if (_tree_height(node->left->left) < _tree_height(node->left->right)) {
+            node->left = _tree_rotate_left(node->left);
+        }
+        return _tree_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (_tree_height(node->right->right) < _tree_height(node->right->left)) {
+            node->right = _tree_rotate_right(node->right);
+        }
+        return _tree_rotate_left(node);
+    }
+    return node;
+}
+
+static struct sel4utils_free_extent *_tree_insert(struct sel4utils_free_extent *root,
+                                                  struct sel4utils_free_extent *node)
+{
+    if (!root) {
+        node->left = node->right = NULL;
+        _tree_update(node);
+        return node;
+    }
+    /* extents never overlap, so no two nodes can have the same start */
+    assert(node->start != root->start);
+    if (node->start < root->start) {
+        root->left = _tree_insert(root->left, node);
+    } else {
+        root->right = _tree_insert(root->right, node);
+    }
+    return _tree_balance(root);
+}
+
+static struct sel4utils_free_extent *_tree_remove_min(struct sel4utils_free_extent *root,
+                                                      struct sel4utils_free_extent **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = _tree_remove_min(root->left, min);
+    return _tree_balance(root);
+}
+
+static struct sel4utils_free_extent *_tree_remove(struct sel4utils_free_extent *root,
+                                                  struct sel4utils_free_extent *node)
+{
+    struct sel4utils_free_extent *min;
+    /* node must be in the tree */
+    assert(root);
+    if (node->start < root->start) {
+        root->left = _tree_remove(root->left, node);
+        return _tree_balance(root);
+    }
+    if (node->start > root->start) {
+        root->right = _tree_remove(root->right, node);
+        return _tree_balance(root);
+    }
+    assert(root == node);
+    if (!node->right) {
+        return node->left;
+    }
+    node->right = _tree_remove_min(node->right, &min);
+    min->left = node->left;
+    min->right = node->right;
+    return _tree_balance(min);
+}
+
+/* Find any extent that overlaps [start, end), or is adjacent to it if adjacent is set */
+static struct sel4utils_free_extent *_tree_find_overlap(struct sel4utils_free_extent *root, uintptr_t start,
+                                                        uintptr_t end, bool adjacent)
+{
+    while (root) {
+        if (adjacent ? root->end < start : root->end <= start) {
+            root = root->right;
+        } else if (adjacent ? root->start > end : root->start >= end) {
+            root = root->left;
+        } else {
+            return root;
+        }
+    }
+    return NULL;
+}
+
+/* Find the lowest extent that has room for an aligned range of bytes at or above hint.
+ * Subtrees without an extent of at least bytes are skipped entirely */
+static struct sel4utils_free_extent *_tree_find_fit(struct sel4utils_free_extent *root, uintptr_t hint,
+                                                    size_t bytes, size_t size_bits, uintptr_t *result)
+{
+    if (!root || root->max_size < bytes) {
+        return NULL;
+    }
+    if (root->end > hint) {
+        /* everything to the left ends before root starts */
+        if (root->start > hint) {
+            struct sel4utils_free_extent *found = _tree_find_fit(root->left, hint, bytes, size_bits, result);
+            if (found) {
+                return found;
+            }
+        }
+        uintptr_t start = ALIGN_UP(MAX(root->start, hint), SIZE_BITS_TO_BYTES(size_bits));
+        if (start < root->end && root->end - start >= bytes) {
+            *result = start;
+            return root;
+        }
+    }
+    return _tree_find_fit(root->right, hint, bytes, size_bits, result);
+}
+
+static void _put_spare(sel4utils_free_index_t *index, struct sel4utils_free_extent *node)
+{
+    node->right = index->spare;
+    index->spare = node;
+    index->num_spare++;
+}
+
+static struct sel4utils_free_extent *_get_spare(sel4utils_free_index_t *index)
+{
+    struct sel4utils_free_extent *node = index->spare;
+    if (node) {
+        index->spare = node->right;
+        index->num_spare--;
+    }
+    return node;
+}
+
+static void _release_tree(sel4utils_free_index_t *index, struct sel4utils_free_extent *node)
+{
+    if (node) {
+        _release_tree(index, node->left);
+        _release_tree(index, node->right);
+        _put_spare(index, node);
+    }
+}
+
+static int _add_chunk(vspace_t *vspace)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    sel4utils_free_index_t *index = &data->free_index;
+
+    /* a self bootstrapped vspace takes pages from its book keeping region, which only
+     * has room for a limited number of them */
+    if (data->bootstrap == NULL && index->num_chunks == FREE_INDEX_BOOTSTRAP_PAGES) {
+        return -1;
+    }
+    void *chunk = create_level(vspace, PAGE_SIZE_4K);
+    if (chunk == NULL) {
+        return -1;
+    }
+    *(void **)chunk = index->chunks;
+    index->chunks = chunk;
+    index->num_chunks++;
+
+    struct sel4utils_free_extent *nodes = (struct sel4utils_free_extent *)((uintptr_t)chunk + sizeof(void *));
+    for (int i = 0; i < NODES_PER_CHUNK; i++) {
+        _put_spare(index, &nodes[i]);
+    }
+    return 0;
+}
+
+/* Insert [start, end), which must not overlap or be adjacent to any extent in the tree */
+static int _insert_extent(sel4utils_free_index_t *index, uintptr_t start, uintptr_t end)
+{
+    struct sel4utils_free_extent *node = _get_spare(index);
+    if (node == NULL) {
+        return -1;
+    }
+    node->start = start;
+    node->end = end;
+    index->root = _tree_insert(index->root, node);
+    return 0;
+}
+
+struct rebuild_state {
+    vspace_t *vspace;
+    bool in_run;
+    uintptr_t run_start;
+    int error;
+};
+
+static void _rebuild_visit(struct rebuild_state *state, uintptr_t vaddr, bool free)
+{
+    sel4utils_free_index_t *index = get_free_index(state->vspace);
+    if (free) {
+        if (!state->in_run) {
+            state->in_run = true;
+            state->run_start = vaddr;
+        }
+        return;
+    }
+    if (state->in_run) {
+        state->in_run = false;
+        uintptr_t start = MAX(state->run_start, FREE_INDEX_START);
+        if (start < vaddr && !state->error) {
+            if (index->num_spare == 0) {
+                state->error = _add_chunk(state->vspace);
+            }
+            if (!state->error) {
+                state->error = _insert_extent(index, start, vaddr);
+            }
+        }
+    }
+}
+
+static void _rebuild_bottom(struct rebuild_state *state, vspace_bottom_level_t *level, uintptr_t base)
+{
+    for (int i = 0; i < VSPACE_LEVEL_SIZE; i++) {
+        uintptr_t vaddr = base + i * BYTES_FOR_LEVEL(0);
+        if (vaddr >= FREE_INDEX_END) {
+            return;
+        }
+        _rebuild_visit(state, vaddr, level->cap[i] == EMPTY);
+    }
+}
+
+static void _rebuild_mid(struct rebuild_state *state, vspace_mid_level_t *level, int level_num, uintptr_t base)
+{
+    for (int i = 0; i < VSPACE_LEVEL_SIZE; i++) {
+        uintptr_t vaddr = base + i * BYTES_FOR_LEVEL(level_num);
+        uintptr_t next_table = level->table[i];
+        if (vaddr >= FREE_INDEX_END) {
+            return;
+        }
+        if (next_table == EMPTY || next_table == RESERVED) {
+            _rebuild_visit(state, vaddr, next_table == EMPTY);
+        } else if (level_num == 1) {
+            _rebuild_bottom(state, (vspace_bottom_level_t *)next_table, vaddr);
+        } else {
+            _rebuild_mid(state, (vspace_mid_level_t *)next_table, level_num - 1, vaddr);
+        }
+    }
+}
+
+/* Recreate the tree from the shadow page table */
+static int _rebuild(vspace_t *vspace)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    sel4utils_free_index_t *index = &data->free_index;
+
+    _release_tree(index, index->root);
+    index->root = NULL;
+
+    /* Growing the index may allocate, which may come back into this vspace. Such nested
+     * operations must not use the index, and any change they make could be missed by
+     * the walk, so check none happened */
+    uint64_t generation = index->generation;
+    struct rebuild_state state = {
+        .vspace = vspace,
+        .in_run = false,
+        .error = 0,
+    };
+    index->rebuilding = true;
+    _rebuild_mid(&state, data->top_level, VSPACE_NUM_LEVELS - 1, 0);
+    /* close the final run */
+    _rebuild_visit(&state, FREE_INDEX_END, false);
+    index->rebuilding = false;
+
+    if (state.error || generation != index->generation) {
+        return -1;
+    }
+    index->stale = false;
+    return 0;
+}
+
+/* Start with an empty, stale, index that will be built on first use */
+void sel4utils_free_index_init(vspace_t *vspace)
+{
+    sel4utils_free_index_t *index = get_free_index(vspace);
+    *index = (sel4utils_free_index_t) {
+        .root = NULL,
+        .spare = NULL,
+        .num_spare = 0,
+        .chunks = NULL,
+        .num_chunks = 0,
+        .generation = 0,
+        /* built from the shadow page table on first use */
+        .stale = true,
+        .rebuilding = false,
+    };
+}
+
+/* Make the index usable and top up its spare nodes. Must only be called when no update to
+ * the shadow page table is in progress. Returns 0 if the index can be used by find */
+int sel4utils_free_index_prepare(vspace_t *vspace)
+{
+    sel4utils_free_index_t *index = get_free_index(vspace);
+
+    if (index->rebuilding) {
+        return -1;
+    }
+    if (index->stale && _rebuild(vspace) != 0) {
+        return -1;
+    }
+    while (index->num_spare < FREE_INDEX_MIN_SPARE) {
+        if (_add_chunk(vspace) != 0) {
+            /* not fatal, an update that runs out of nodes will just mark the index stale */
+            break;
+        }
+    }
+    return index->stale ? -1 : 0;
+}
+
+/* Called when the shadow page table has changed in some unknown way */
+void sel4utils_free_index_invalidate(vspace_t *vspace)
+{
+    sel4utils_free_index_t *index = get_free_index(vspace);
+    index->generation++;
+    index->stale = true;
+}
+
+/* [start, end) is now free */
+void sel4utils_free_index_add(vspace_t *vspace, uintptr_t start, uintptr_t end)
+{
+    sel4utils_free_index_t *index = get_free_index(vspace);
+    struct sel4utils_free_extent *node;
+
+    index->generation++;
+    if (index->stale) {
+        return;
+    }
+    start = MAX(start, FREE_INDEX_START);
+    end = MIN(end, FREE_INDEX_END);
+    if (start >= end) {
+        return;
+    }
+    /* merge with any extents that this touches */
+    while ((node = _tree_find_overlap(index->root, start, end, true)) != NULL) {
+        start = MIN(start, node->start);
+        end = MAX(end, node->end);
+        index->root = _tree_remove(index->root, node);
+        _put_spare(index, node);
+    }
+    if (_insert_extent(index, start, end) != 0) {
+        index->stale = true;
+    }
+}
+
+/* [start, end) is no longer free. Parts of it need not have been free before */
+void sel4utils_free_index_remove(vspace_t *vspace, uintptr_t start, uintptr_t end)
+{
+    sel4utils_free_index_t *index = get_free_index(vspace);
+    struct sel4utils_free_extent *node;
+    uintptr_t low_start = 0, low_end = 0;
+    uintptr_t high_start = 0, high_end = 0;
+
+    index->generation++;
+    if (index->stale) {
+        return;
+    }
+    start = MAX(start, FREE_INDEX_START);
+    end = MIN(end, FREE_INDEX_END);
+    if (start >= end) {
+        return;
+    }
+    /* remove every extent that overlaps, remembering the parts that stick out either side */
+    while ((node = _tree_find_overlap(index->root, start, end, false)) != NULL) {
+        if (node->start < start) {
+            low_start = node->start;
+            low_end = start;
+        }
+        if (node->end > end) {
+            high_start = end;
+            high_end = node->end;
+        }
+        index->root = _tree_remove(index->root, node);
+        _put_spare(index, node);
+    }
+    if ((low_start != low_end && _insert_extent(index, low_start, low_end) != 0) ||
+        (high_start != high_end && _insert_extent(index, high_start, high_end) != 0)) {
+        index->stale = true;
+    }
+}
+
+/* Find the lowest free range of bytes, aligned to size_bits, at or above hint. Wraps around
+ * to search below hint if there is nothing above it. Returns 0 if there is no such range */
+uintptr_t sel4utils_free_index_find(vspace_t *vspace, uintptr_t hint, size_t bytes, size_t size_bits)
+{
+    sel4utils_free_index_t *index = get_free_index(vspace);
+    uintptr_t result = 0;
+
+    assert(!index->stale);
+    if (_tree_find_fit(index->root, hint, bytes, size_bits, &result) == NULL && hint > FREE_INDEX_START) {
+        /* wrap around and look below the hint */
+        _tree_find_fit(index->root, FREE_INDEX_START, bytes, size_bits, &result);
+    }
+    return result;
+}
+
+/* Release the pages used for nodes back to the bootstrapper */
+void sel4utils_free_index_tear_down(vspace_t *vspace)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    sel4utils_free_index_t *index = &data->free_index;
+
+    /* only vspaces with a bootstrapper can be torn down */
+    assert(data->bootstrap != NULL);
+    while (index->chunks != NULL) {
+        void *chunk = index->chunks;
+        index->chunks = *(void **)chunk;
+        vspace_unmap_pages(data->bootstrap, chunk, 1, PAGE_BITS_4K, VSPACE_FREE);
+    }
+    sel4utils_free_index_init(vspace);
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+#include <stdio.h>
+#include <string.h>
+#include <sel4utils/vspace.h>
+#include <sel4utils/vspace_internal.h>
+#include <sel4utils/vspace_log.h>
+#ifdef CONFIG_SEL4UTILS_VSPACE_LOG
+#include <sel4bench/sel4bench.h>
+#endif
+
+#define EXPORT_MAGIC 0x474c5356
+#define EXPORT_VERSION 1
+
+static const char *op_names[SEL4UTILS_VSPACE_LOG_NUM_OPS] = {
+    [SEL4UTILS_VSPACE_LOG_NEW_PAGES] = "new_pages",
+    [SEL4UTILS_VSPACE_LOG_MAP_PAGES] = "map_pages",
+    [SEL4UTILS_VSPACE_LOG_UNMAP_PAGES] = "unmap_pages",
+    [SEL4UTILS_VSPACE_LOG_RESERVE] = "reserve",
+    [SEL4UTILS_VSPACE_LOG_FREE_RESERVATION] = "free_reservation",
+    [SEL4UTILS_VSPACE_LOG_SHARE] = "share",
+    [SEL4UTILS_VSPACE_LOG_FAULT] = "fault",
+    [SEL4UTILS_VSPACE_LOG_TEAR_DOWN] = "tear_down",
+    [SEL4UTILS_VSPACE_LOG_FIND_RANGE] = "find_range",
+    [SEL4UTILS_VSPACE_LOG_ALLOC_FRAMES] = "alloc_frames",
+    [SEL4UTILS_VSPACE_LOG_MAP_PAGE] = "map_page",
+    [SEL4UTILS_VSPACE_LOG_COPY_CAP] = "copy_cap",
+};
+
+#ifdef CONFIG_SEL4UTILS_VSPACE_LOG
+
+void sel4utils_vspace_log_begin(vspace_t *vspace, sel4utils_vspace_log_mark_t *mark)
+{
+    sel4utils_vspace_log_t *log = get_alloc_data(vspace)->log;
+    mark->log = log;
+    if (log == NULL) {
+        return;
+    }
+    log->depth++;
+    mark->paging_objects = log->paging_objects;
+    mark->cycles = sel4bench_get_cycle_count();
+}
+
+void sel4utils_vspace_log_end(const sel4utils_vspace_log_mark_t *mark, sel4utils_vspace_log_op_t op,
+                              uintptr_t vaddr, size_t size_bits, size_t count, int result)
+{
+    sel4utils_vspace_log_t *log = mark->log;
+    if (log == NULL) {
+        return;
+    }
+    uint64_t cycles = sel4bench_get_cycle_count() - mark->cycles;
+    log->depth--;
+    log->records[log->written % log->max_records] = (sel4utils_vspace_log_record_t) {
+        .op = op,
+        .depth = log->depth,
+        .result = result,
+        .vaddr = vaddr,
+        .size_bits = size_bits,
+        .count = count,
+        .cycles = cycles,
+        .paging_objects = log->paging_objects - mark->paging_objects,
+    };
+    log->written++;
+}
+
+void sel4utils_vspace_log_paging_objects(vspace_t *vspace, size_t num)
+{
+    sel4utils_vspace_log_t *log = get_alloc_data(vspace)->log;
+    if (log != NULL) {
+        log->paging_objects += num;
+    }
+}
+
+int sel4utils_vspace_set_log(vspace_t *vspace, sel4utils_vspace_log_t *log,
+                             sel4utils_vspace_log_record_t *records, size_t max_records)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+
+    if (log != NULL) {
+        if (records == NULL || max_records == 0) {
+            ZF_LOGE("Need somewhere to write records");
+            return -1;
+        }
+        *log = (sel4utils_vspace_log_t) {
+            .records = records,
+            .max_records = max_records,
+        };
+    }
+    data->log = log;
+    return 0;
+}
+
+#else
+
+int sel4utils_vspace_set_log(vspace_t *vspace, sel4utils_vspace_log_t *log,
+                             sel4utils_vspace_log_record_t *records, size_t max_records)
+{
+    ZF_LOGE("CONFIG_SEL4UTILS_VSPACE_LOG is not enabled");
+    return -1;
+}
+
+#endif /* CONFIG_SEL4UTILS_VSPACE_LOG */
+
+size_t sel4utils_vspace_log_num_records(const sel4utils_vspace_log_t *log)
+{
+    return log->written < log->max_records ? log->written : log->max_records;
+}
+
+const sel4utils_vspace_log_record_t *sel4utils_vspace_log_get(const sel4utils_vspace_log_t *log, size_t i)
+{
+    uint64_t oldest = log->written - sel4utils_vspace_log_num_records(log);
+    return &log->records[(oldest + i) % log->max_records];
+}
+
+void sel4utils_vspace_log_dump(const sel4utils_vspace_log_t *log)
+{
+    size_t num = sel4utils_vspace_log_num_records(log);
+
+    printf("vspace log: %zu records, %llu overwritten\n", num, (unsigned long long)(log->written - num));
+    for (size_t i = 0; i < num; i++) {
+        const sel4utils_vspace_log_record_t *r = sel4utils_vspace_log_get(log, i);
+        printf("%*s%s vaddr %p size_bits %zu count %zu cycles %llu paging_objects %zu result %d\n",
+               (int) r->depth * 2, "", op_names[r->op], (void *) r->vaddr, r->size_bits, r->count,
+               (unsigned long long) r->cycles, r->paging_objects, r->result);
+    }
+}
+
+static uint8_t *put(uint8_t *p, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        p[i] = value >> (i * 8);
+    }
+    return p + bytes;
+}
+
+static uint64_t saturate(uint64_t value, size_t bytes)
+{
+    uint64_t max = bytes == 8 ? UINT64_MAX : (1ull << (bytes * 8)) - 1;
+    return value > max ? max : value;
+}
+
+size_t sel4utils_vspace_log_export(const sel4utils_vspace_log_t *log, void *buf, size_t len)
+{
+    size_t num = sel4utils_vspace_log_num_records(log);
+
+    if (buf == NULL) {
+        return SEL4UTILS_VSPACE_LOG_EXPORT_HEADER_SIZE + num * SEL4UTILS_VSPACE_LOG_EXPORT_RECORD_SIZE;
+    }
+    if (len < SEL4UTILS_VSPACE_LOG_EXPORT_HEADER_SIZE) {
+        return 0;
+    }
+
+    size_t fit = (len - SEL4UTILS_VSPACE_LOG_EXPORT_HEADER_SIZE) / SEL4UTILS_VSPACE_LOG_EXPORT_RECORD_SIZE;
+    size_t skip = num > fit ? num - fit : 0;
+
+    uint8_t *p = buf;
+    p = put(p, EXPORT_MAGIC, 4);
+    p = put(p, EXPORT_VERSION, 2);
+    p = put(p, SEL4UTILS_VSPACE_LOG_EXPORT_RECORD_SIZE, 2);
+    p = put(p, num - skip, 4);
+    p = put(p, saturate(log->written - (num - skip), 4), 4);
+
+    for (size_t i = skip; i < num; i++) {
+        const sel4utils_vspace_log_record_t *r = sel4utils_vspace_log_get(log, i);
+        p = put(p, r->op, 1);
+        p = put(p, saturate(r->depth, 1), 1);
+        p = put(p, r->size_bits, 1);
+        p = put(p, 0, 1);
+        p = put(p, (uint32_t) r->result, 4);
+        p = put(p, r->vaddr, 8);
+        p = put(p, r->cycles, 8);
+        p = put(p, saturate(r->count, 4), 4);
+        p = put(p, saturate(r->paging_objects, 4), 4);
+    }
+
+    return p - (uint8_t *) buf;
+}
@@ -62,66 +62,125 @@ static int check_reservation(vspace_mid_level_t *top_level, sel4utils_res_t *res
            is_reserved_range(top_level, start, end);
 }
 
-static void insert_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+static inline int reservation_height(sel4utils_res_t *node)
 {
+    return node ? node->height : 0;
+}
 
-    assert(data != NULL);
-    assert(reservation != NULL);
+static inline void reservation_update_height(sel4utils_res_t *node)
+{
+    node->height = MAX(reservation_height(node->left), reservation_height(node->right)) + 1;
+}
 
-    reservation->next = NULL;
+/* Reservations are ordered by start address. Empty reservations can share a start address
+ * with another reservation, so ties are broken by the address of the reservation itself */
+static inline bool reservation_before(sel4utils_res_t *a, sel4utils_res_t *b)
+{
+    return a->start < b->start || (a->start == b->start && (uintptr_t) a < (uintptr_t) b);
+}
 
-    /* insert at head */
-    if (data->reservation_head == NULL || reservation->start > data->reservation_head->start) {
-        reservation->next = data->reservation_head;
-        data->reservation_head = reservation;
-        return;
-    }
+static sel4utils_res_t *reservation_rotate_right(sel4utils_res_t *node)
+{
+    sel4utils_res_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    reservation_update_height(node);
+    reservation_update_height(left);
+    return left;
+}
 
-    /* insert elsewhere */
-    sel4utils_res_t *prev = data->reservation_head;
-    sel4utils_res_t *current = prev->next;
+static sel4utils_res_t *reservation_rotate_left(sel4utils_res_t *node)
+{
+    sel4utils_res_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    reservation_update_height(node);
+    reservation_update_height(right);
+    return right;
+}
 
-    while (current != NULL) {
-        /* insert in the middle */
-        if (reservation->start > current->start) {
-            reservation->next = current;
-            prev->next = reservation;
-            return;
+/* Restores the AVL invariant for a subtree whose children are already balanced */
+static sel4utils_res_t *reservation_balance(sel4utils_res_t *node)
+{
+    reservation_update_height(node);
+    int balance = reservation_height(node->left) - reservation_height(node->right);
+    if (balance > 1) {
+        if (reservation_height(node->left->left) < reservation_height(node->left->right)) {
+            node->left = reservation_rotate_left(node->left);
+        }
+        return reservation_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (reservation_height(node->right->right) < reservation_height(node->right->left)) {
+            node->right = reservation_rotate_right(node->right);
         }
-        prev = current;
-        current = current->next;
+        return reservation_rotate_left(node);
     }
+    return node;
+}
 
-    /* insert at the end */
-    prev->next = reservation;
+static sel4utils_res_t *reservation_tree_insert(sel4utils_res_t *root, sel4utils_res_t *reservation)
+{
+    if (root == NULL) {
+        reservation->left = reservation->right = NULL;
+        reservation->height = 1;
+        return reservation;
+    }
+    if (reservation_before(reservation, root)) {
+        root->left = reservation_tree_insert(root->left, reservation);
+    } else {
+        root->right = reservation_tree_insert(root->right, reservation);
+    }
+    return reservation_balance(root);
 }
 
-static void remove_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+static sel4utils_res_t *reservation_tree_remove_min(sel4utils_res_t *root, sel4utils_res_t **min)
 {
-    /* remove head */
-    if (reservation == data->reservation_head) {
-        data->reservation_head = data->reservation_head->next;
-        reservation->next = NULL;
-        return;
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
     }
+    root->left = reservation_tree_remove_min(root->left, min);
+    return reservation_balance(root);
+}
 
-    sel4utils_res_t *prev = data->reservation_head;
-    sel4utils_res_t *current = prev->next;
+static sel4utils_res_t *reservation_tree_remove(sel4utils_res_t *root, sel4utils_res_t *reservation)
+{
+    sel4utils_res_t *min;
 
-    while (current != NULL) {
-        /* remove middle */
-        if (current == reservation) {
-            prev->next = reservation->next;
-            reservation->next = NULL;
-            return;
+    if (root == NULL) {
+        ZF_LOGE("Reservation %p not found", reservation);
+        return NULL;
+    }
+    if (reservation != root) {
+        if (reservation_before(reservation, root)) {
+            root->left = reservation_tree_remove(root->left, reservation);
+        } else {
+            root->right = reservation_tree_remove(root->right, reservation);
         }
-        prev = current;
-        current = current->next;
+        return reservation_balance(root);
     }
+    if (root->right == NULL) {
+        return root->left;
+    }
+    root->right = reservation_tree_remove_min(root->right, &min);
+    min->left = root->left;
+    min->right = root->right;
+    return reservation_balance(min);
+}
 
-    /* remove tail */
-    prev->next = NULL;
-    reservation->next = NULL;
+static void insert_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+{
+    assert(data != NULL);
+    assert(reservation != NULL);
+
+    data->reservation_root = reservation_tree_insert(data->reservation_root, reservation);
+}
+
+static void remove_reservation(sel4utils_alloc_data_t *data, sel4utils_res_t *reservation)
+{
+    data->reservation_root = reservation_tree_remove(data->reservation_root, reservation);
+    reservation->left = reservation->right = NULL;
 }
 
 static void perform_reservation(vspace_t *vspace, sel4utils_res_t *reservation, uintptr_t vaddr, size_t bytes,
@@ -135,8 +194,13 @@ static void perform_reservation(vspace_t *vspace, sel4utils_res_t *reservation,
 
     reservation->rights = rights;
     reservation->cacheable = cacheable;
+    reservation->lazy = false;
+    reservation->read_ahead = 0;
 
+    VSPACE_LOG_START(vspace);
     error = reserve_entries_range(vspace, reservation->start, reservation->end, true);
+    VSPACE_LOG_OP(RESERVE, reservation->start, seL4_PageBits,
+                  (reservation->end - reservation->start) / PAGE_SIZE_4K, error);
 
     /* only support to reserve things that we've checked that we can */
     assert(error == seL4_NoError);
@@ -163,6 +227,7 @@ int sel4utils_map_page_pd(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_Cap
     for (int i = 0; i < num; i++) {
         vspace_maybe_call_allocated_object(vspace, objects[i]);
     }
+    VSPACE_LOG_PAGING_OBJECTS(vspace, num);
 
     return seL4_NoError;
 }
@@ -185,16 +250,19 @@ int sel4utils_map_page_ept(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_Ca
 
     if (pagetable.cptr != 0) {
         vspace_maybe_call_allocated_object(vspace, pagetable);
+        VSPACE_LOG_PAGING_OBJECTS(vspace, 1);
         pagetable.cptr = 0;
     }
 
     if (pagedir.cptr != 0) {
         vspace_maybe_call_allocated_object(vspace, pagedir);
+        VSPACE_LOG_PAGING_OBJECTS(vspace, 1);
         pagedir.cptr = 0;
     }
 
     if (pdpt.cptr != 0) {
         vspace_maybe_call_allocated_object(vspace, pdpt);
+        VSPACE_LOG_PAGING_OBJECTS(vspace, 1);
         pdpt.cptr = 0;
     }
 
@@ -221,6 +289,7 @@ int sel4utils_map_page_iommu(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_
     for (int i = 0; i < num_pts; i++) {
         vspace_maybe_call_allocated_object(vspace, pts[i]);
     }
+    VSPACE_LOG_PAGING_OBJECTS(vspace, num_pts);
 
     return seL4_NoError;
 }
@@ -230,61 +299,99 @@ static int map_page(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_CapRights
                     int cacheable, size_t size_bits)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    return data->map_page(vspace, cap, vaddr, rights, cacheable, size_bits);
+    VSPACE_LOG_START(vspace);
+    int error = data->map_page(vspace, cap, vaddr, rights, cacheable, size_bits);
+    VSPACE_LOG_OP(MAP_PAGE, vaddr, size_bits, 1, error);
+    return error;
 }
 
 static sel4utils_res_t *find_reserve(sel4utils_alloc_data_t *data, uintptr_t vaddr)
 {
+    sel4utils_res_t *current = data->reservation_root;
 
-    sel4utils_res_t *current = data->reservation_head;
-
+    /* reservations do not overlap, so only the last one starting at or below vaddr
+     * can contain it */
     while (current != NULL) {
-        if (vaddr >= current->start && vaddr < current->end) {
+        if (vaddr < current->start) {
+            current = current->left;
+        } else if (vaddr < current->end) {
             return current;
+        } else {
+            current = current->right;
         }
-
-        current = current->next;
     }
 
     return NULL;
 }
 
-static void *find_range(sel4utils_alloc_data_t *data, size_t num_pages, size_t size_bits)
+/* Look for bytes of contiguous free memory, aligned to align_bits, in [start, end) by probing
+ * the shadow page table. Only used when the free index is unavailable */
+uintptr_t sel4utils_find_range_scan(sel4utils_alloc_data_t *data, uintptr_t start, uintptr_t end,
+                                    size_t bytes, size_t align_bits)
 {
-    /* look for a contiguous range that is free.
-     * We use first-fit with the optimisation that we store
-     * a pointer to the last thing we freed/allocated */
-    size_t contiguous = 0;
-    uintptr_t start = ALIGN_UP(data->last_allocated, SIZE_BITS_TO_BYTES(size_bits));
-    uintptr_t current = start;
+    uintptr_t current;
 
-    assert(IS_ALIGNED(start, size_bits));
-    while (contiguous < num_pages) {
+    start = ALIGN_UP(start, BIT(align_bits));
+    current = start;
 
-        bool available = is_available(data->top_level, current, size_bits);
-        current += SIZE_BITS_TO_BYTES(size_bits);
+    while (current - start < bytes) {
+        if (current >= end) {
+            return 0;
+        }
 
-        if (available) {
-            /* keep going! */
-            contiguous++;
-        } else {
+        bool available = is_available(data->top_level, current, PAGE_BITS_4K);
+        current += PAGE_SIZE_4K;
+
+        if (!available) {
             /* reset start and try again */
-            start = current;
-            contiguous = 0;
+            start = ALIGN_UP(current, BIT(align_bits));
+            current = start;
         }
+    }
 
-        if (current >= KERNEL_RESERVED_START) {
-            ZF_LOGE("Out of virtual memory");
-            return NULL;
+    return start;
+}
+
+static void *find_range_aligned(vspace_t *vspace, size_t bytes, size_t align_bits)
+{
+    /* look for a contiguous range that is free.
+     * We use first-fit starting from the last thing we freed/allocated,
+     * wrapping around to the bottom of the address space if that fails */
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    uintptr_t hint = MAX(data->last_allocated, FREE_INDEX_START);
+    uintptr_t start;
+
+    VSPACE_LOG_START(vspace);
+    if (sel4utils_free_index_prepare(vspace) == 0) {
+        start = sel4utils_free_index_find(vspace, hint, bytes, align_bits);
+        /* claim the range straight away, so that anything we allocate whilst mapping
+         * into it cannot be handed the same range */
+        if (start != 0) {
+            sel4utils_free_index_remove(vspace, start, start + bytes);
         }
+    } else {
+        start = sel4utils_find_range_scan(data, hint, FREE_INDEX_END, bytes, align_bits);
+        if (start == 0) {
+            start = sel4utils_find_range_scan(data, FREE_INDEX_START, FREE_INDEX_END, bytes, align_bits);
+        }
+    }
+    VSPACE_LOG_OP(FIND_RANGE, start, align_bits, bytes >> align_bits, start == 0 ? -1 : 0);
 
+    if (start == 0) {
+        ZF_LOGE("Out of virtual memory");
+        return NULL;
     }
 
-    data->last_allocated = current;
+    data->last_allocated = start + bytes;
 
     return (void *) start;
 }
 
+static void *find_range(vspace_t *vspace, size_t num_pages, size_t size_bits)
+{
+    return find_range_aligned(vspace, num_pages * SIZE_BITS_TO_BYTES(size_bits), size_bits);
+}
+
 static int map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[],
                               void *vaddr, size_t num_pages,
                               size_t size_bits, seL4_CapRights_t rights, int cacheable)
@@ -303,37 +410,168 @@ static int map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cook
     return error;
 }
 
+/* Page size to use at vaddr when promotion is enabled. This is the largest page size that is
+ * naturally aligned at vaddr and fits before end, but no smaller than size_bits */
+static size_t promoted_size_bits(uintptr_t vaddr, uintptr_t end, size_t size_bits)
+{
+    size_t frame_bits = size_bits;
+    for (int i = 0; i < SEL4_NUM_PAGE_SIZES; i++) {
+        size_t bits = sel4_page_sizes[i];
+        if (bits > size_bits && IS_ALIGNED(vaddr, bits) && end - vaddr >= BIT(bits)) {
+            frame_bits = bits;
+        }
+    }
+    return frame_bits;
+}
+
+/* The next page size down from frame_bits */
+static size_t smaller_size_bits(size_t frame_bits)
+{
+    for (int i = SEL4_NUM_PAGE_SIZES - 1; i > 0; i--) {
+        if (sel4_page_sizes[i] == frame_bits) {
+            return sel4_page_sizes[i - 1];
+        }
+    }
+    return frame_bits;
+}
+
+static int new_page_at_vaddr(vspace_t *vspace, uintptr_t vaddr, size_t size_bits, seL4_CapRights_t rights,
+                             int cacheable, bool can_use_dev)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    vka_object_t object;
+
+    VSPACE_LOG_START(vspace);
+    int error = vka_alloc_frame_maybe_device(data->vka, size_bits, can_use_dev, &object);
+    VSPACE_LOG_OP(ALLOC_FRAMES, vaddr, size_bits, 1, error);
+    if (error) {
+        return seL4_NotEnoughMemory;
+    }
+
+    error = map_page(vspace, object.cptr, (void *) vaddr, rights, cacheable, size_bits);
+    if (error != seL4_NoError) {
+        vka_free_object(data->vka, &object);
+        return error;
+    }
+
+    return update_entries(vspace, vaddr, object.cptr, size_bits, object.ut);
+}
+
+/* Largest number of frames new_pages_batch allocates at once. Bounded by the stack needed for
+ * their cookies, as this runs underneath malloc and so cannot allocate */
+#define NEW_PAGES_BATCH 64
+
+/* Allocate num frames into a contiguous range of slots with as few retypes as the allocator can
+ * manage, and map them in sequence from vaddr. Paging structures are created when the first
+ * frame that needs them is mapped. The number of frames that were mapped is returned in mapped,
+ * any that could not be are freed again */
+static int new_pages_batch(vspace_t *vspace, uintptr_t vaddr, size_t num, size_t size_bits,
+                           seL4_CapRights_t rights, int cacheable, bool can_use_dev, size_t *mapped)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    seL4_Word type = kobject_get_type(KOBJECT_FRAME, size_bits);
+    seL4_Word cookies[NEW_PAGES_BATCH];
+    seL4_CPtr first;
+    cspacepath_t path;
+    size_t i;
+
+    assert(num <= NEW_PAGES_BATCH);
+    *mapped = 0;
+
+    VSPACE_LOG_START(vspace);
+    int error = vka_cspace_alloc_range(data->vka, num, &first);
+    if (error) {
+        VSPACE_LOG_OP(ALLOC_FRAMES, vaddr, size_bits, num, error);
+        return error;
+    }
+    vka_cspace_make_path(data->vka, first, &path);
+
+    error = vka_utspace_alloc_batch(data->vka, &path, type, size_bits, num, can_use_dev, cookies);
+    VSPACE_LOG_OP(ALLOC_FRAMES, vaddr, size_bits, num, error);
+    if (error) {
+        for (i = 0; i < num; i++) {
+            vka_cspace_free(data->vka, cspacepath_offset(&path, i).capPtr);
+        }
+        return error;
+    }
+
+    for (i = 0; i < num; i++) {
+        seL4_CPtr cap = cspacepath_offset(&path, i).capPtr;
+        uintptr_t v = vaddr + i * BIT(size_bits);
+
+        error = map_page(vspace, cap, (void *) v, rights, cacheable, size_bits);
+        if (error != seL4_NoError) {
+            break;
+        }
+        error = update_entries(vspace, v, cap, size_bits, cookies[i]);
+        if (error != seL4_NoError) {
+            /* not recorded, so nobody else would know to unmap it */
+            seL4_ARCH_Page_Unmap(cap);
+            break;
+        }
+    }
+    *mapped = i;
+
+    /* release the frames we did not get to */
+    for (; i < num; i++) {
+        cspacepath_t slot = cspacepath_offset(&path, i);
+        vka_cnode_delete(&slot);
+        vka_cspace_free(data->vka, slot.capPtr);
+        vka_utspace_free(data->vka, type, size_bits, cookies[i]);
+    }
+
+    return error;
+}
+
 static int new_pages_at_vaddr(vspace_t *vspace, void *vaddr, size_t num_pages, size_t size_bits,
                               seL4_CapRights_t rights, int cacheable, bool can_use_dev)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    int i;
     int error = seL4_NoError;
-    void *start_vaddr = vaddr;
-
-    for (i = 0; i < num_pages; i++) {
-        vka_object_t object;
-        if (vka_alloc_frame_maybe_device(data->vka, size_bits, can_use_dev, &object) != 0) {
-            /* abort! */
-            ZF_LOGE("Failed to allocate page number: %d out of %zu", i, num_pages);
-            error = seL4_NotEnoughMemory;
-            break;
+    uintptr_t start = (uintptr_t) vaddr;
+    uintptr_t end = start + num_pages * BIT(size_bits);
+    uintptr_t v = start;
+    bool promote = data->promote_pages && size_bits == seL4_PageBits;
+    /* promoted ranges are mostly large pages already, so batching buys little there */
+    bool batch = !promote && num_pages > 1;
+
+    while (v < end) {
+        if (batch) {
+            size_t mapped;
+            size_t num = MIN((end - v) / BIT(size_bits), NEW_PAGES_BATCH);
+            error = new_pages_batch(vspace, v, num, size_bits, rights, cacheable, can_use_dev, &mapped);
+            v += mapped * BIT(size_bits);
+            if (error == seL4_NoError) {
+                continue;
+            }
+            /* either the allocator cannot do batches right now or something went wrong
+             * part way, go one frame at a time for the rest so we find out which */
+            batch = false;
         }
 
-        error = map_page(vspace, object.cptr, vaddr, rights, cacheable, size_bits);
+        size_t frame_bits = size_bits;
+        if (promote) {
+            frame_bits = promoted_size_bits(v, end, size_bits);
+        }
 
-        if (error == seL4_NoError) {
-            error = update_entries(vspace, (uintptr_t) vaddr, object.cptr, size_bits, object.ut);
-            vaddr = (void *)((uintptr_t) vaddr + (BIT(size_bits)));
-        } else {
-            vka_free_object(data->vka, &object);
+        error = new_page_at_vaddr(vspace, v, frame_bits, rights, cacheable, can_use_dev);
+        /* A promoted page may fail because there is no untyped large enough, or because a
+         * paging structure is already in the way. Try again with smaller pages */
+        while (error != seL4_NoError && frame_bits > size_bits) {
+            frame_bits = smaller_size_bits(frame_bits);
+            error = new_page_at_vaddr(vspace, v, frame_bits, rights, cacheable, can_use_dev);
+        }
+        if (error != seL4_NoError) {
+            /* abort! */
+            ZF_LOGE("Failed to allocate page number: %zu out of %zu", (size_t)((v - start) / BIT(size_bits)), num_pages);
             break;
         }
+        v += BIT(frame_bits);
     }
 
-    if (i < num_pages) {
+    if (v < end) {
         /* we failed, clean up successfully allocated pages */
-        sel4utils_unmap_pages(vspace, start_vaddr, i, size_bits, data->vka);
+        sel4utils_unmap_pages(vspace, vaddr, (v - start) / BIT(size_bits), size_bits, data->vka);
     }
 
     return error;
@@ -347,6 +585,8 @@ int sel4utils_map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uintptr_t c
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     sel4utils_res_t *res = reservation_to_res(reservation);
 
+    sel4utils_free_index_prepare(vspace);
+
     if (!sel4_valid_size_bits(size_bits)) {
         ZF_LOGE("Invalid size_bits %zu", size_bits);
         return -1;
@@ -362,8 +602,11 @@ int sel4utils_map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uintptr_t c
         return -1;
     }
 
-    return map_pages_at_vaddr(vspace, caps, cookies, vaddr, num_pages, size_bits,
-                              res->rights, res->cacheable);
+    VSPACE_LOG_START(vspace);
+    int error = map_pages_at_vaddr(vspace, caps, cookies, vaddr, num_pages, size_bits,
+                                   res->rights, res->cacheable);
+    VSPACE_LOG_OP(MAP_PAGES, vaddr, size_bits, num_pages, error);
+    return error;
 }
 
 int sel4utils_deferred_rights_map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[], void *vaddr,
@@ -373,6 +616,8 @@ int sel4utils_deferred_rights_map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr cap
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     sel4utils_res_t *res = reservation_to_res(reservation);
 
+    sel4utils_free_index_prepare(vspace);
+
     if (!sel4_valid_size_bits(size_bits)) {
         ZF_LOGE("Invalid size_bits %zu", size_bits);
         return -1;
@@ -388,13 +633,16 @@ int sel4utils_deferred_rights_map_pages_at_vaddr(vspace_t *vspace, seL4_CPtr cap
         return -1;
     }
 
-    return map_pages_at_vaddr(vspace, caps, cookies, vaddr, num_pages, size_bits,
-                              rights, res->cacheable);
+    VSPACE_LOG_START(vspace);
+    int error = map_pages_at_vaddr(vspace, caps, cookies, vaddr, num_pages, size_bits,
+                                   rights, res->cacheable);
+    VSPACE_LOG_OP(MAP_PAGES, vaddr, size_bits, num_pages, error);
+    return error;
 }
 
-void *sel4utils_map_pages(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[],
-                          seL4_CapRights_t rights, size_t num_pages, size_t size_bits,
-                          int cacheable)
+static void *map_pages(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[],
+                       seL4_CapRights_t rights, size_t num_pages, size_t size_bits,
+                       int cacheable)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     int error;
@@ -402,7 +650,7 @@ void *sel4utils_map_pages(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[
 
     assert(num_pages > 0);
 
-    ret_vaddr = find_range(data, num_pages, size_bits);
+    ret_vaddr = find_range(vspace, num_pages, size_bits);
     if (ret_vaddr == NULL) {
         return NULL;
     }
@@ -411,9 +659,18 @@ void *sel4utils_map_pages(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[
                                ret_vaddr, num_pages, size_bits,
                                rights, cacheable);
     if (error != 0) {
-        if (clear_entries(vspace, (uintptr_t)ret_vaddr, size_bits) != 0) {
-            ZF_LOGE("FATAL: Failed to clear VMM metadata for vmem @0x%p, %lu pages.",
-                    ret_vaddr, BIT(size_bits));
+        /* undo any pages that did get mapped, leaving the caps to the caller */
+        for (size_t i = 0; i < num_pages; i++) {
+            void *vaddr = (void *)((uintptr_t) ret_vaddr + i * BIT(size_bits));
+            if (get_cap(data, (uintptr_t) vaddr) != 0) {
+                sel4utils_unmap_pages(vspace, vaddr, 1, size_bits, VSPACE_PRESERVE);
+            }
+        }
+        /* and give back the rest of the range */
+        if (clear_entries_range(vspace, (uintptr_t)ret_vaddr,
+                                (uintptr_t)ret_vaddr + num_pages * BIT(size_bits), false) != 0) {
+            ZF_LOGE("FATAL: Failed to clear VMM metadata for vmem @0x%p, %zu pages.",
+                    ret_vaddr, num_pages);
             /* This is probably cause for a panic, but continue anyway. */
         }
         return NULL;
@@ -421,11 +678,19 @@ void *sel4utils_map_pages(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[
     return ret_vaddr;
 }
 
-seL4_CPtr sel4utils_get_cap(vspace_t *vspace, void *vaddr)
+void *sel4utils_map_pages(vspace_t *vspace, seL4_CPtr caps[], uintptr_t cookies[],
+                          seL4_CapRights_t rights, size_t num_pages, size_t size_bits,
+                          int cacheable)
 {
-    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    seL4_CPtr cap = get_cap(data->top_level, (uintptr_t) vaddr);
+    VSPACE_LOG_START(vspace);
+    void *vaddr = map_pages(vspace, caps, cookies, rights, num_pages, size_bits, cacheable);
+    VSPACE_LOG_OP(MAP_PAGES, vaddr, size_bits, num_pages, vaddr == NULL ? -1 : 0);
+    return vaddr;
+}
 
+seL4_CPtr sel4utils_get_cap(vspace_t *vspace, void *vaddr)
+{
+    seL4_CPtr cap = get_cap(get_alloc_data(vspace), (uintptr_t) vaddr);
     if (cap == RESERVED) {
         cap = 0;
     }
@@ -434,58 +699,160 @@ seL4_CPtr sel4utils_get_cap(vspace_t *vspace, void *vaddr)
 
 uintptr_t sel4utils_get_cookie(vspace_t *vspace, void *vaddr)
 {
-    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    return get_cookie(data->top_level, (uintptr_t) vaddr);
+    return get_cookie(vspace, (uintptr_t) vaddr);
 }
 
-void sel4utils_unmap_pages(vspace_t *vspace, void *vaddr, size_t num_pages, size_t size_bits, vka_t *vka)
+/* A run of consecutive shadow page table entries that all hold the same frame */
+struct frame_run {
+    /* allocator to free the frame with, or NULL to only unmap it */
+    vka_t *vka;
+    /* whether the entries have been cleared, rather than reserved or left alone */
+    bool cleared;
+    seL4_CPtr cap;
+    uintptr_t cookie;
+    uintptr_t vaddr;
+    size_t pages;
+};
+
+/* Unmap, and if we have an allocator free, the frame the run describes, and start a new run */
+static void release_frame(vspace_t *vspace, struct frame_run *run)
 {
-    uintptr_t v = (uintptr_t) vaddr;
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    sel4utils_res_t *reserve = find_reserve(data, v);
 
-    if (!sel4_valid_size_bits(size_bits)) {
-        ZF_LOGE("Invalid size_bits %zu", size_bits);
+    if (run->pages == 0) {
         return;
     }
 
-    if (vka == VSPACE_FREE) {
-        vka = data->vka;
+    /* frames are recorded in every base page entry they cover */
+    size_t frame_bits = seL4_PageBits + CTZL(run->pages);
+    assert(run->pages == BIT(frame_bits - seL4_PageBits));
+
+    if (data->cow_ranges != NULL) {
+        sel4utils_cow_unmapped(vspace, run->vaddr, run->vka != NULL);
     }
 
-    for (int i = 0; i < num_pages; i++) {
-        seL4_CPtr cap = get_cap(data->top_level, v);
+    if (run->vka) {
+        /* deleting a cap to a frame also removes its mapping, so there is nothing to unmap */
+        cspacepath_t path;
+        vka_cspace_make_path(run->vka, run->cap, &path);
+        vka_cnode_delete(&path);
+        vka_cspace_free(run->vka, run->cap);
+        if (run->cookie) {
+            vka_utspace_free(run->vka, kobject_get_type(KOBJECT_FRAME, frame_bits), frame_bits, run->cookie);
+        }
+    } else {
+        int error = seL4_ARCH_Page_Unmap(run->cap);
+        if (error != seL4_NoError) {
+            ZF_LOGE("Failed to unmap page at vaddr %p", (void *) run->vaddr);
+        }
+    }
 
-        /* unmap */
-        if (cap != 0) {
-            int error = seL4_ARCH_Page_Unmap(cap);
-            if (error != seL4_NoError) {
-                ZF_LOGE("Failed to unmap page at vaddr %p", vaddr);
-            }
+    if (run->cleared) {
+        sel4utils_free_index_add(vspace, run->vaddr, run->vaddr + BIT(frame_bits));
+        if (run->vaddr < data->last_allocated) {
+            data->last_allocated = run->vaddr;
         }
+    }
+
+    run->pages = 0;
+}
 
-        if (vka) {
-            cspacepath_t path;
-            vka_cspace_make_path(vka, cap, &path);
-            vka_cnode_delete(&path);
-            vka_cspace_free(vka, cap);
-            if (sel4utils_get_cookie(vspace, vaddr)) {
-                vka_utspace_free(vka, kobject_get_type(KOBJECT_FRAME, size_bits),
-                                 size_bits, sel4utils_get_cookie(vspace, vaddr));
+/* Add the entry for the base page at vaddr to the run, releasing the frame before it first if
+ * this is a different one */
+static void extend_run(vspace_t *vspace, struct frame_run *run, uintptr_t vaddr, seL4_CPtr cap, uintptr_t cookie)
+{
+    if (run->pages > 0 && run->cap == cap) {
+        run->pages++;
+        return;
+    }
+    release_frame(vspace, run);
+    run->cap = cap;
+    run->cookie = cookie;
+    run->vaddr = vaddr;
+    run->pages = 1;
+}
+
+static void unmap_entries_bottom(vspace_t *vspace, vspace_bottom_level_t *level, uintptr_t start, uintptr_t end,
+                                 struct frame_run *run, uintptr_t reset)
+{
+    uintptr_t *cookies = get_cookies(vspace, level, start, false);
+    while (start < end) {
+        int index = INDEX_FOR_LEVEL(start, 0);
+        seL4_CPtr cap = level->cap[index];
+        if (cap == EMPTY || cap == RESERVED) {
+            release_frame(vspace, run);
+        } else {
+            extend_run(vspace, run, start, cap, cookies == NULL ? 0 : cookies[index]);
+            level->cap[index] = reset;
+            if (cookies) {
+                cookies[index] = 0;
             }
         }
+        start += BYTES_FOR_LEVEL(0);
+    }
+}
 
-        if (reserve == NULL) {
-            clear_entries(vspace, v, size_bits);
+/* Walk the shadow page table once for the whole range, releasing each frame as we reach its
+ * end and setting its entries to reset */
+static void unmap_entries_mid(vspace_t *vspace, vspace_mid_level_t *level, int level_num, uintptr_t start,
+                              uintptr_t end, struct frame_run *run, uintptr_t reset)
+{
+    while (start < end) {
+        int index = INDEX_FOR_LEVEL(start, level_num);
+        uintptr_t next_start = (start & ALIGN_FOR_LEVEL(level_num)) + BYTES_FOR_LEVEL(level_num);
+        if (next_start > end) {
+            next_start = end;
+        }
+        uintptr_t next_table = level->table[index];
+        if (next_table == EMPTY || next_table == RESERVED) {
+            /* nothing is mapped anywhere under this entry */
+            release_frame(vspace, run);
+        } else if (level_num == 1) {
+            unmap_entries_bottom(vspace, (vspace_bottom_level_t *) next_table, start, next_start, run, reset);
         } else {
-            reserve_entries(vspace, v, size_bits);
+            unmap_entries_mid(vspace, (vspace_mid_level_t *) next_table, level_num - 1, start, next_start, run, reset);
         }
-        assert(get_cap(data->top_level, v) != cap);
-        assert(get_cookie(data->top_level, v) == 0);
+        start = next_start;
+    }
+}
+
+/* Whether vaddr is in the middle of a frame rather than at its start */
+static bool within_frame(sel4utils_alloc_data_t *data, uintptr_t vaddr)
+{
+    return vaddr >= PAGE_SIZE_4K && is_backed(data, vaddr) && get_cap(data, vaddr - PAGE_SIZE_4K) == get_cap(data, vaddr);
+}
+
+void sel4utils_unmap_pages(vspace_t *vspace, void *vaddr, size_t num_pages, size_t size_bits, vka_t *vka)
+{
+    uintptr_t start = (uintptr_t) vaddr;
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    sel4utils_res_t *reserve = find_reserve(data, start);
 
-        v += (BIT(size_bits));
-        vaddr = (void *) v;
+    if (!sel4_valid_size_bits(size_bits)) {
+        ZF_LOGE("Invalid size_bits %zu", size_bits);
+        return;
+    }
+
+    if (vka == VSPACE_FREE) {
+        vka = data->vka;
+    }
+
+    uintptr_t end = start + num_pages * BIT(size_bits);
+    /* the frames here may be larger than size_bits if they were promoted */
+    if (within_frame(data, start) || within_frame(data, end)) {
+        ZF_LOGE("Cannot unmap part of a page in range %p-%p", vaddr, (void *) end);
+        return;
     }
+
+    VSPACE_LOG_START(vspace);
+    struct frame_run run = {
+        .vka = vka,
+        .cleared = reserve == NULL,
+    };
+    unmap_entries_mid(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, start, end, &run,
+                      reserve == NULL ? EMPTY : RESERVED);
+    release_frame(vspace, &run);
+    VSPACE_LOG_OP(UNMAP_PAGES, vaddr, size_bits, num_pages, 0);
 }
 
 int sel4utils_new_pages_at_vaddr(vspace_t *vspace, void *vaddr, size_t num_pages,
@@ -494,16 +861,20 @@ int sel4utils_new_pages_at_vaddr(vspace_t *vspace, void *vaddr, size_t num_pages
     struct sel4utils_alloc_data *data = get_alloc_data(vspace);
     sel4utils_res_t *res = reservation_to_res(reservation);
 
+    sel4utils_free_index_prepare(vspace);
+
     if (!check_reservation(data->top_level, res, (uintptr_t) vaddr, (uintptr_t)vaddr + num_pages * BIT(size_bits))) {
         ZF_LOGE("Range for vaddr %p with %"PRIuPTR" 4k pages not reserved!", vaddr, num_pages);
         return -1;
     }
 
-    return new_pages_at_vaddr(vspace, vaddr, num_pages, size_bits, res->rights, res->cacheable, can_use_dev);
+    VSPACE_LOG_START(vspace);
+    int error = new_pages_at_vaddr(vspace, vaddr, num_pages, size_bits, res->rights, res->cacheable, can_use_dev);
+    VSPACE_LOG_OP(NEW_PAGES, vaddr, size_bits, num_pages, error);
+    return error;
 }
 
-void *sel4utils_new_pages(vspace_t *vspace, seL4_CapRights_t rights,
-                          size_t num_pages, size_t size_bits)
+static void *new_pages(vspace_t *vspace, seL4_CapRights_t rights, size_t num_pages, size_t size_bits)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     int error;
@@ -511,7 +882,13 @@ void *sel4utils_new_pages(vspace_t *vspace, seL4_CapRights_t rights,
 
     assert(num_pages > 0);
 
-    ret_vaddr = find_range(data, num_pages, size_bits);
+    if (data->promote_pages && size_bits == seL4_PageBits) {
+        /* align the range for the largest page that could be used in it */
+        size_t bytes = num_pages * BIT(size_bits);
+        ret_vaddr = find_range_aligned(vspace, bytes, promoted_size_bits(0, bytes, size_bits));
+    } else {
+        ret_vaddr = find_range(vspace, num_pages, size_bits);
+    }
     if (ret_vaddr == NULL) {
         return NULL;
     }
@@ -527,9 +904,10 @@ void *sel4utils_new_pages(vspace_t *vspace, seL4_CapRights_t rights,
     error = new_pages_at_vaddr(vspace, ret_vaddr, num_pages, size_bits, rights,
                                (int)true, false);
     if (error != 0) {
-        if (clear_entries(vspace, (uintptr_t)ret_vaddr, size_bits) != 0) {
-            ZF_LOGE("FATAL: Failed to clear VMM metadata for vmem @0x%p, %lu pages.",
-                    ret_vaddr, BIT(size_bits));
+        if (clear_entries_range(vspace, (uintptr_t)ret_vaddr,
+                                (uintptr_t)ret_vaddr + num_pages * BIT(size_bits), false) != 0) {
+            ZF_LOGE("FATAL: Failed to clear VMM metadata for vmem @0x%p, %zu pages.",
+                    ret_vaddr, num_pages);
             /* This is probably cause for a panic, but continue anyway. */
         }
         return NULL;
@@ -538,11 +916,20 @@ void *sel4utils_new_pages(vspace_t *vspace, seL4_CapRights_t rights,
     return ret_vaddr;
 }
 
+void *sel4utils_new_pages(vspace_t *vspace, seL4_CapRights_t rights,
+                          size_t num_pages, size_t size_bits)
+{
+    VSPACE_LOG_START(vspace);
+    void *vaddr = new_pages(vspace, rights, num_pages, size_bits);
+    VSPACE_LOG_OP(NEW_PAGES, vaddr, size_bits, num_pages, vaddr == NULL ? -1 : 0);
+    return vaddr;
+}
+
 int sel4utils_reserve_range_no_alloc_aligned(vspace_t *vspace, sel4utils_res_t *reservation,
                                              size_t size, size_t size_bits, seL4_CapRights_t rights, int cacheable, void **result)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    void *vaddr = find_range(data, BYTES_TO_SIZE_BITS_PAGES(size, size_bits), size_bits);
+    void *vaddr = find_range(vspace, BYTES_TO_SIZE_BITS_PAGES(size, size_bits), size_bits);
 
     if (vaddr == NULL) {
         return -1;
@@ -597,6 +984,8 @@ int sel4utils_reserve_range_at_no_alloc(vspace_t *vspace, sel4utils_res_t *reser
                                         size_t size, seL4_CapRights_t rights, int cacheable)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+
+    sel4utils_free_index_prepare(vspace);
     if (!is_available_range(data->top_level, (uintptr_t) vaddr, (uintptr_t)vaddr + size)) {
         ZF_LOGE("Range not available at %p, size %p", vaddr, (void *)size);
         return -1;
@@ -644,8 +1033,18 @@ void sel4utils_free_reservation(vspace_t *vspace, reservation_t reservation)
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     sel4utils_res_t *res = reservation.res;
 
-    clear_entries_range(vspace, res->start, res->end, true);
+    VSPACE_LOG_START(vspace);
+    if (res->lazy) {
+        /* we backed these pages, so we are the ones that have to free them. Parts of the
+         * reservation never touched are skipped by the walk without being visited page by page */
+        sel4utils_unmap_pages(vspace, (void *) res->start, (res->end - res->start) / PAGE_SIZE_4K, seL4_PageBits,
+                              VSPACE_FREE);
+    }
+
+    /* any frames still mapped in the range stay mapped, and only what is cleared becomes free */
+    clear_reserved_entries_range(vspace, res->start, res->end);
     remove_reservation(data, res);
+    VSPACE_LOG_OP(FREE_RESERVATION, res->start, seL4_PageBits, (res->end - res->start) / PAGE_SIZE_4K, 0);
     if (res->malloced) {
         free(reservation.res);
     }
@@ -670,6 +1069,8 @@ int sel4utils_move_resize_reservation(vspace_t *vspace, reservation_t reservatio
     uintptr_t new_end = ROUND_UP(((uintptr_t)(vaddr)) + bytes, PAGE_SIZE_4K);
     uintptr_t v = 0;
 
+    sel4utils_free_index_prepare(vspace);
+
     /* Sanity checks that newly asked reservation space is available. */
     if (new_start < res->start) {
         if (!is_available_range(data->top_level, new_start, res->start)) {
@@ -696,7 +1097,7 @@ int sel4utils_move_resize_reservation(vspace_t *vspace, reservation_t reservatio
     for (v = res->start; v < res->end; v += PAGE_SIZE_4K) {
         if (v < new_start || v >= new_end) {
             /* Clear any regions that aren't reserved by the new region any more. */
-            if (get_cap(data->top_level, v) == RESERVED) {
+            if (get_cap(data, v) == RESERVED) {
                 clear_entries_range(vspace, v, v + PAGE_SIZE_4K, true);
             }
         } else {
@@ -704,90 +1105,172 @@ int sel4utils_move_resize_reservation(vspace_t *vspace, reservation_t reservatio
         }
     }
 
+    /* The reservation must be taken out of the tree whilst its start address changes, and
+     * then re-inserted to keep the tree sorted by start address. */
     bool need_reinsert = false;
     if (res->start != new_start) {
         need_reinsert = true;
+        remove_reservation(data, res);
     }
 
     res->start = new_start;
     res->end = new_end;
 
-    /* We may need to re-insert the reservation into the list to keep it sorted by start address. */
     if (need_reinsert) {
-        remove_reservation(data, res);
         insert_reservation(data, res);
     }
 
     return 0;
 }
 
+void sel4utils_set_page_promotion(vspace_t *vspace, bool promote)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    data->promote_pages = promote;
+}
+
+int sel4utils_set_compact_book_keeping(vspace_t *vspace)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+
+    /* the layout of bottom levels can only change while there are none */
+    for (int i = 0; i < VSPACE_LEVEL_SIZE; i++) {
+        if (data->top_level->table[i] != EMPTY && data->top_level->table[i] != RESERVED) {
+            ZF_LOGE("Book keeping layout must be chosen before anything is reserved or mapped");
+            return -1;
+        }
+    }
+
+    data->compact = true;
+    return 0;
+}
+
+int sel4utils_set_lazy_reservation(vspace_t *vspace, reservation_t reservation, size_t read_ahead)
+{
+    sel4utils_res_t *res = reservation.res;
+
+    if (res == NULL) {
+        ZF_LOGE("Invalid reservation");
+        return -1;
+    }
+
+    if (res->rights_deferred) {
+        ZF_LOGE("Lazy reservations need to know their rights up front");
+        return -1;
+    }
+
+    res->lazy = true;
+    res->read_ahead = read_ahead;
+    return 0;
+}
+
+static int handle_fault(vspace_t *vspace, vspace_t *current, uintptr_t vaddr, bool write)
+{
+    sel4utils_alloc_data_t *data = get_alloc_data(vspace);
+    sel4utils_res_t *res = find_reserve(data, vaddr);
+
+    if (res == NULL) {
+        return -1;
+    }
+
+    if (write && !seL4_CapRights_get_capAllowWrite(res->rights)) {
+        return -1;
+    }
+
+    if (write && data->cow_ranges != NULL && sel4utils_cow_is_shared(vspace, vaddr)) {
+        return sel4utils_cow_handle_write(vspace, current, vaddr, res->rights, res->cacheable);
+    }
+
+    if (!res->lazy) {
+        return -1;
+    }
+
+    uintptr_t page = ROUND_DOWN(vaddr, PAGE_SIZE_4K);
+    if (is_backed(data, page)) {
+        /* backing the page did not stop it faulting */
+        return -1;
+    }
+
+    sel4utils_free_index_prepare(vspace);
+
+    size_t num = 1;
+    while (num <= res->read_ahead && page + num * PAGE_SIZE_4K < res->end &&
+           !is_backed(data, page + num * PAGE_SIZE_4K)) {
+        num++;
+    }
+
+    int error = new_pages_at_vaddr(vspace, (void *) page, num, seL4_PageBits, res->rights, res->cacheable, false);
+    if (error && num > 1) {
+        /* read ahead is only an optimisation, the faulting page is what we need */
+        error = new_pages_at_vaddr(vspace, (void *) page, 1, seL4_PageBits, res->rights, res->cacheable, false);
+    }
+
+    return error;
+}
+
+int sel4utils_vspace_handle_fault(vspace_t *vspace, vspace_t *current, uintptr_t vaddr, bool write)
+{
+    VSPACE_LOG_START(vspace);
+    int error = handle_fault(vspace, current, vaddr, write);
+    VSPACE_LOG_OP(FAULT, vaddr, seL4_PageBits, 1, error);
+    return error;
+}
+
 seL4_CPtr sel4utils_get_root(vspace_t *vspace)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
     return data->vspace_root;
 }
 
-static void free_page(vspace_t *vspace, vka_t *vka, uintptr_t vaddr)
+/* Release the frames we allocated under a level of the shadow page table, and the levels
+ * below it, in a single walk */
+static void tear_down_level(vspace_t *vspace, vspace_mid_level_t *level, int level_num, uintptr_t vaddr,
+                            struct frame_run *run)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    vspace_mid_level_t *level = data->top_level;
-    /* see if we should free the thing here or not */
-    uintptr_t cookie = get_cookie(level, vaddr);
-    int num_4k_entries = 1;
-    if (cookie != 0) {
-        /* walk along and see just how big this page is */
-        uintptr_t test_vaddr = vaddr + PAGE_SIZE_4K;
-        while (get_cookie(level, test_vaddr) == cookie) {
-            test_vaddr += PAGE_SIZE_4K;
-            num_4k_entries++;
+
+    for (int i = 0; i < VSPACE_LEVEL_SIZE; i++) {
+        uintptr_t next_table = level->table[i];
+        uintptr_t next_vaddr = vaddr + i * BYTES_FOR_LEVEL(level_num);
+        size_t size;
+
+        if (next_table == EMPTY || next_table == RESERVED) {
+            release_frame(vspace, run);
+            continue;
+        }
+
+        if (level_num == 1) {
+            vspace_bottom_level_t *bottom = (vspace_bottom_level_t *) next_table;
+            uintptr_t *cookies = get_cookies(vspace, bottom, next_vaddr, false);
+            for (int j = 0; j < VSPACE_LEVEL_SIZE; j++) {
+                /* only the frames we allocated are ours to free */
+                if (cookies == NULL || cookies[j] == 0) {
+                    release_frame(vspace, run);
+                } else {
+                    extend_run(vspace, run, next_vaddr + j * BYTES_FOR_LEVEL(0), bottom->cap[j], cookies[j]);
+                }
+            }
+            size = bottom_level_size(data);
+        } else {
+            tear_down_level(vspace, (vspace_mid_level_t *) next_table, level_num - 1, next_vaddr, run);
+            size = sizeof(vspace_mid_level_t);
         }
-        sel4utils_unmap_pages(vspace, (void *)vaddr, 1, PAGE_BITS_4K * num_4k_entries, vka);
+
+        /* the run keeps its own copy of anything it needs from the level */
+        vspace_unmap_pages(data->bootstrap, (void *) next_table, size / PAGE_SIZE_4K, PAGE_BITS_4K, VSPACE_FREE);
     }
 }
 
-static void free_pages_at_level(vspace_t *vspace, vka_t *vka, int table_level, uintptr_t vaddr)
+static void free_cookie_levels(vspace_t *vspace, vspace_mid_level_t *level, int level_num)
 {
     sel4utils_alloc_data_t *data = get_alloc_data(vspace);
-    vspace_mid_level_t *level = data->top_level;
-    /* walk down to the level that we want */
-    for (int i = VSPACE_NUM_LEVELS - 1; i > table_level && i > 1; i--) {
-        int index = INDEX_FOR_LEVEL(vaddr, i);
-        switch (level->table[index]) {
-        case RESERVED:
-        case EMPTY:
-            return;
-        }
-        level = (vspace_mid_level_t *)level->table[index];
-    }
-    if (table_level == 0) {
-        int index = INDEX_FOR_LEVEL(vaddr, 1);
-        switch (level->table[index]) {
-        case RESERVED:
-        case EMPTY:
-            return;
-        }
-        vspace_bottom_level_t *bottom = (vspace_bottom_level_t *)level->table[index];
-        index = INDEX_FOR_LEVEL(vaddr, 0);
-        if (bottom->cap[index] != EMPTY && bottom->cap[index] != RESERVED) {
-            free_page(vspace, vka, vaddr);
+
+    for (int i = 0; level_num > 0 && i < VSPACE_LEVEL_SIZE; i++) {
+        if (level->table[i] != EMPTY) {
+            free_cookie_levels(vspace, (vspace_mid_level_t *) level->table[i], level_num - 1);
         }
-    } else {
-        int index = INDEX_FOR_LEVEL(vaddr, table_level);
-        switch (level->table[index]) {
-        case RESERVED:
-        case EMPTY:
-            return;
-        }
-        /* recurse to the sub level */
-        for (int j = 0; j < VSPACE_LEVEL_SIZE; j++) {
-            free_pages_at_level(vspace, vka,
-                                table_level - 1,
-                                vaddr + j * BYTES_FOR_LEVEL(table_level - 1));
-        }
-        vspace_unmap_pages(data->bootstrap, (void *)level->table[index],
-                           (table_level == 1 ? sizeof(vspace_bottom_level_t) : sizeof(vspace_mid_level_t)) / PAGE_SIZE_4K, PAGE_BITS_4K,
-                           VSPACE_FREE);
     }
+    vspace_unmap_pages(data->bootstrap, level, sizeof(vspace_mid_level_t) / PAGE_SIZE_4K, PAGE_BITS_4K, VSPACE_FREE);
 }
 
 void sel4utils_tear_down(vspace_t *vspace, vka_t *vka)
@@ -804,20 +1287,44 @@ void sel4utils_tear_down(vspace_t *vspace, vka_t *vka)
         vka = data->vka;
     }
 
+    VSPACE_LOG_START(vspace);
+
+    /* pages shared copy-on-write have no cookie, so would not be found below */
+    sel4utils_cow_tear_down(vspace);
+
     /* free all the reservations */
-    while (data->reservation_head != NULL) {
-        reservation_t res = { .res = data->reservation_head };
+    while (data->reservation_root != NULL) {
+        reservation_t res = { .res = data->reservation_root };
         sel4utils_free_reservation(vspace, res);
     }
 
     /* walk each level and find any pages / large pages */
     if (data->top_level) {
-        for (int i = 0; i < BIT(VSPACE_LEVEL_BITS); i++) {
-            free_pages_at_level(vspace, vka, VSPACE_NUM_LEVELS - 1, BYTES_FOR_LEVEL(VSPACE_NUM_LEVELS - 1) * i);
-        }
+        struct frame_run run = {
+            .vka = vka,
+        };
+        tear_down_level(vspace, data->top_level, VSPACE_NUM_LEVELS - 1, 0, &run);
+        release_frame(vspace, &run);
         vspace_unmap_pages(data->bootstrap, data->top_level, sizeof(vspace_mid_level_t) / PAGE_SIZE_4K, PAGE_BITS_4K,
                            VSPACE_FREE);
     }
+
+    if (data->cookie_top_level) {
+        free_cookie_levels(vspace, data->cookie_top_level, VSPACE_NUM_LEVELS - 1);
+    }
+    data->lookup_level = NULL;
+
+    sel4utils_free_index_tear_down(vspace);
+    VSPACE_LOG_OP(TEAR_DOWN, 0, 0, 0, 0);
+}
+
+static int copy_cap(vspace_t *to, cspacepath_t *dest, cspacepath_t *src, seL4_CapRights_t rights, uintptr_t vaddr,
+                    size_t size_bits)
+{
+    VSPACE_LOG_START(to);
+    int error = vka_cnode_copy(dest, src, rights);
+    VSPACE_LOG_OP(COPY_CAP, vaddr, size_bits, 1, error);
+    return error;
 }
 
 int sel4utils_share_mem_at_vaddr(vspace_t *from, vspace_t *to, void *start, int num_pages,
@@ -830,11 +1337,14 @@ int sel4utils_share_mem_at_vaddr(vspace_t *from, vspace_t *to, void *start, int
     int page;
     sel4utils_res_t *res = reservation_to_res(reservation);
 
+    sel4utils_free_index_prepare(to);
+
     if (!sel4_valid_size_bits(size_bits)) {
         ZF_LOGE("Invalid size bits %zu", size_bits);
         return -1;
     }
 
+    VSPACE_LOG_START(to);
     /* go through, page by page, and duplicate the page cap into the to cspace and
      * map it into the to vspace */
     size_t size_bytes = 1 << size_bits;
@@ -843,7 +1353,7 @@ int sel4utils_share_mem_at_vaddr(vspace_t *from, vspace_t *to, void *start, int
         uintptr_t to_vaddr = (uintptr_t) vaddr + (uintptr_t) page * size_bytes;
 
         /* get the frame cap to be copied */
-        seL4_CPtr cap = get_cap(from_data->top_level, from_vaddr);
+        seL4_CPtr cap = get_cap(from_data, from_vaddr);
         if (cap == seL4_CapNull) {
             ZF_LOGE("Cap not present in from vspace to copy, vaddr %"PRIuPTR, from_vaddr);
             error = -1;
@@ -861,7 +1371,7 @@ int sel4utils_share_mem_at_vaddr(vspace_t *from, vspace_t *to, void *start, int
         }
 
         /* copy the frame cap into the to cspace */
-        error = vka_cnode_copy(&to_path, &from_path, res->rights);
+        error = copy_cap(to, &to_path, &from_path, res->rights, to_vaddr, size_bits);
         if (error) {
             ZF_LOGE("Failed to copy cap, error %d\n", error);
             break;
@@ -881,6 +1391,41 @@ int sel4utils_share_mem_at_vaddr(vspace_t *from, vspace_t *to, void *start, int
         /* we didn't finish, undo any pages we did map */
         vspace_unmap_pages(to, vaddr, page, size_bits, VSPACE_FREE);
     }
+    VSPACE_LOG_OP(SHARE, vaddr, size_bits, num_pages, error);
+
+    return error;
+}
+
+int sel4utils_share_mem_at_vaddr_cow(vspace_t *from, vspace_t *to, void *start, int num_pages,
+                                     size_t size_bits, void *vaddr, reservation_t reservation)
+{
+    sel4utils_res_t *res = reservation_to_res(reservation);
+    sel4utils_res_t *from_res = find_reserve(get_alloc_data(from), (uintptr_t) start);
+    size_t shared;
+
+    sel4utils_free_index_prepare(to);
+
+    if (!sel4_valid_size_bits(size_bits)) {
+        ZF_LOGE("Invalid size bits %zu", size_bits);
+        return -1;
+    }
+
+    /* the reservations are where we find the rights to give pages once they are copied */
+    if (from_res == NULL || (uintptr_t) start + num_pages * BIT(size_bits) > from_res->end) {
+        ZF_LOGE("Memory to share copy-on-write must be within a single reservation");
+        return -1;
+    }
+    if (res->rights_deferred || from_res->rights_deferred) {
+        ZF_LOGE("Memory shared copy-on-write needs to know its rights up front");
+        return -1;
+    }
+
+    int error = sel4utils_cow_share(from, to, (uintptr_t) start, num_pages, size_bits, (uintptr_t) vaddr,
+                                    res->rights, from_res->cacheable, res->cacheable, &shared);
+    if (error) {
+        /* we didn't finish, undo any pages we did map */
+        vspace_unmap_pages(to, vaddr, shared, size_bits, VSPACE_FREE);
+    }
 
     return error;
 }
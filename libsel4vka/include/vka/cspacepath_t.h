@@ -99,6 +99,18 @@ cspacepath_swap(cspacepath_t *a, cspacepath_t *b)
     *b = tmp;
 }
 
+/* Construct the path to the slot 'index' slots after 'base' in the same CNode. Used
+ * when 'base' describes the first slot of a contiguous range of slots */
+static inline cspacepath_t
+cspacepath_offset(const cspacepath_t *base, seL4_Word index)
+{
+    cspacepath_t path = *base;
+    path.capPtr += index;
+    path.offset += index;
+    path.window = 1;
+    return path;
+}
+
 /// --------------------------- Debug --------------------------------
 inline static void cspacepath_t_print(const cspacepath_t* src)
 {
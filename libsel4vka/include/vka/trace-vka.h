@@ -0,0 +1,104 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vka/vka.h>
+
+/* A shim allocator that records every call made through it, along with its arguments
+ * and result, before passing it on to a subordinate allocator. The resulting trace
+ * describes an application's allocation behaviour and can be replayed against other
+ * allocators or allocator configurations to compare them.
+ *
+ * Records are written into a buffer provided by the caller. When the buffer fills the
+ * optional flush callback is invoked to drain it (for example by printing it with
+ * vka_trace_print), otherwise further records are counted as dropped.
+ *
+ * The book keeping memory of an allocator can be recorded into the same trace with
+ * vka_trace_add, which is how allocman's mspace_trace_make_interface works. Traces printed
+ * with vka_trace_print can be replayed on the host by libsel4allocman/tools/replay. */
+
+typedef enum vka_trace_op {
+    VKA_TRACE_CSPACE_ALLOC,
+    VKA_TRACE_CSPACE_FREE,
+    VKA_TRACE_UTSPACE_ALLOC,
+    VKA_TRACE_UTSPACE_ALLOC_AT,
+    /* One record is written for each object in a batch, all sharing the same count */
+    VKA_TRACE_UTSPACE_ALLOC_BATCH,
+    VKA_TRACE_UTSPACE_FREE,
+    /* Book keeping memory, see mspace_trace_make_interface in allocman */
+    VKA_TRACE_MSPACE_ALLOC,
+    VKA_TRACE_MSPACE_FREE,
+} vka_trace_op_t;
+
+typedef struct vka_trace_record {
+    vka_trace_op_t op;
+    /* return value of the underlying allocator, 0 for operations that return nothing */
+    int result;
+    /* object type and size_bits as passed to the vka, utspace operations only */
+    seL4_Word type;
+    seL4_Word size_bits;
+    /* slot that was allocated, freed, or that an object was allocated into */
+    seL4_CPtr slot;
+    /* cookie of the object that was allocated or freed, or the address of the memory for
+     * mspace operations */
+    seL4_Word cookie;
+    /* requested physical address for VKA_TRACE_UTSPACE_ALLOC_AT */
+    uintptr_t paddr;
+    /* number of objects in the batch for VKA_TRACE_UTSPACE_ALLOC_BATCH */
+    size_t count;
+    bool can_use_dev;
+    /* size of the memory for mspace operations */
+    size_t bytes;
+} vka_trace_record_t;
+
+typedef struct vka_trace {
+    /* allocator that performs the actual allocations */
+    vka_t *underlying;
+    vka_trace_record_t *records;
+    size_t max_records;
+    size_t num_records;
+    /* records that were lost because the buffer was full and could not be flushed */
+    size_t dropped;
+    /* (Optional) called with the contents of the buffer when it is full */
+    void (*flush)(void *cookie, const vka_trace_record_t *records, size_t num);
+    void *flush_cookie;
+} vka_trace_t;
+
+/*
+ * vka - A structure to populate with this allocator's implementation functions.
+ * trace - Storage for the state of the trace, must remain valid whilst vka is in use.
+ * tracee - A subordinate allocator that will do the actual work.
+ * records - Buffer to write records to.
+ * max_records - Number of records that fit in the buffer.
+ * flush - (Optional) function to drain the buffer when it becomes full.
+ * flush_cookie - Passed to flush.
+ */
+void vka_init_tracevka(vka_t *vka, vka_trace_t *trace, vka_t *tracee, vka_trace_record_t *records,
+                       size_t max_records,
+                       void (*flush)(void *cookie, const vka_trace_record_t *records, size_t num),
+                       void *flush_cookie);
+
+/* Add a record to a trace, for allocators that are traced without going through a vka */
+void vka_trace_add(vka_trace_t *trace, vka_trace_record_t record);
+
+/* Hand any buffered records to the flush function and empty the buffer */
+void vka_trace_flush(vka_trace_t *trace);
+
+/* Print records one per line, in a format suitable for capturing and replaying later:
+ *   op result type size_bits slot cookie paddr count can_use_dev bytes
+ * with every field printed as hex. Matches the signature of the flush callback, cookie
+ * is ignored */
+void vka_trace_print(void *cookie, const vka_trace_record_t *records, size_t num);
@@ -90,6 +90,34 @@ typedef int (*vka_utspace_alloc_at_fn)(void *data, const cspacepath_t *dest, seL
 typedef int (*vka_utspace_alloc_maybe_device_fn)(void *data, const cspacepath_t *dest, seL4_Word type,
                                                  seL4_Word size_bits, bool can_use_dev, seL4_Word *res);
 
+/**
+ * Allocate a number of objects of the same type and size from untyped memory, with
+ * as few retypes as possible
+ *
+ * @param data cookie for the underlying allocator
+ * @param dest path to the first of num contiguous empty cslots in the same cnode
+ * @param type the seL4 object type to allocate (as passed to Untyped_Retype)
+ * @param size_bits the size of each object to allocate (as passed to Untyped_Retype)
+ * @param num number of objects to allocate
+ * @param can_use_dev whether the allocator can use device untyped instead of regular untyped
+ * @param res array of num locations to store the cookie representing each allocation. Each
+ *            object is freed individually with its own cookie
+ * @return 0 on success
+ */
+typedef int (*vka_utspace_alloc_batch_fn)(void *data, const cspacepath_t *dest, seL4_Word type,
+                                          seL4_Word size_bits, size_t num, bool can_use_dev, seL4_Word *res);
+
+/**
+ * Allocate a number of contiguous cslots in the same cnode
+ *
+ * @param data cookie for the underlying allocator
+ * @param num number of slots to allocate
+ * @param res pointer to a cptr to store the first allocated slot. The remaining slots follow
+ *            it, see cspacepath_offset. Each slot is freed individually with cspace_free
+ * @return 0 on success
+ */
+typedef int (*vka_cspace_alloc_range_fn)(void *data, size_t num, seL4_CPtr *res);
+
 /**
  * Free a portion of an allocated untyped. Is the responsibility of the caller to
  * have already deleted the object (by deleting all capabilities) first
@@ -122,6 +150,10 @@ typedef uintptr_t (*vka_utspace_paddr_fn)(void *data, seL4_Word target, seL4_Wor
  *
  * Alternatively, you can think of this as a abstract class in an
  * OO hierarchy, of which has several implementations.
+ *
+ * The operations after utspace_paddr are optional, and the wrappers for them fall back or fail
+ * when they are NULL. Code that fills in a vka_t field by field, rather than with an
+ * initialiser, must set any of them it does not implement to NULL.
  */
 
 typedef struct vka {
@@ -134,6 +166,8 @@ typedef struct vka {
     vka_cspace_free_fn cspace_free;
     vka_utspace_free_fn utspace_free;
     vka_utspace_paddr_fn utspace_paddr;
+    vka_utspace_alloc_batch_fn utspace_alloc_batch;
+    vka_cspace_alloc_range_fn cspace_alloc_range;
 } vka_t;
 
 static inline int vka_cspace_alloc(vka_t *vka, seL4_CPtr *res)
@@ -156,6 +190,28 @@ static inline int vka_cspace_alloc(vka_t *vka, seL4_CPtr *res)
     return vka->cspace_alloc(vka->data, res);
 }
 
+/* Unlike vka_utspace_alloc_batch there is no general way to fall back when the allocator
+ * cannot hand out ranges, so callers must be prepared for this to fail and fall back to
+ * allocating slots individually themselves */
+static inline int vka_cspace_alloc_range(vka_t *vka, size_t num, seL4_CPtr *res)
+{
+    if (!vka) {
+        ZF_LOGE("vka is NULL");
+        return -1;
+    }
+
+    if (!res) {
+        ZF_LOGE("res is NULL");
+        return -1;
+    }
+
+    if (!vka->cspace_alloc_range) {
+        return -1;
+    }
+
+    return vka->cspace_alloc_range(vka->data, num, res);
+}
+
 static inline void vka_cspace_make_path(vka_t *vka, seL4_CPtr slot, cspacepath_t *res)
 {
 
@@ -272,6 +328,43 @@ static inline int vka_utspace_alloc_at(vka_t *vka, const cspacepath_t *dest, seL
     return vka->utspace_alloc_at(vka->data, dest, type, size_bits, paddr, cookie);
 }
 
+static inline int vka_utspace_alloc_batch(vka_t *vka, const cspacepath_t *dest, seL4_Word type,
+                                          seL4_Word size_bits, size_t num, bool can_use_dev, seL4_Word *res)
+{
+    if (!vka) {
+        ZF_LOGE("vka is NULL");
+        return -1;
+    }
+
+    if (!res) {
+        ZF_LOGE("res is NULL");
+        return -1;
+    }
+
+    if (vka->utspace_alloc_batch) {
+        return vka->utspace_alloc_batch(vka->data, dest, type, size_bits, num, can_use_dev, res);
+    }
+
+    /* fall back to allocating one object at a time */
+    for (size_t i = 0; i < num; i++) {
+        cspacepath_t slot = cspacepath_offset(dest, i);
+        int error = vka_utspace_alloc_maybe_device(vka, &slot, type, size_bits, can_use_dev, &res[i]);
+        if (error) {
+            /* release everything we have allocated so far */
+            while (i > 0) {
+                i--;
+                slot = cspacepath_offset(dest, i);
+                seL4_CNode_Delete(slot.root, slot.capPtr, slot.capDepth);
+                if (vka->utspace_free) {
+                    vka->utspace_free(vka->data, type, size_bits, res[i]);
+                }
+            }
+            return error;
+        }
+    }
+    return 0;
+}
+
 static inline void vka_utspace_free(vka_t *vka, seL4_Word type, seL4_Word size_bits, seL4_Word target)
 {
     if (!vka) {
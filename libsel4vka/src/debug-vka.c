@@ -124,6 +124,21 @@ static int cspace_alloc(void *data, seL4_CPtr *res)
     return result;
 }
 
+static int cspace_alloc_range(void *data, size_t num, seL4_CPtr *res)
+{
+    assert(data != NULL);
+
+    state_t *s = (state_t *)data;
+    vka_t *v = s->underlying;
+    int result = vka_cspace_alloc_range(v, num, res);
+    if (result == 0 && res != NULL) {
+        for (size_t i = 0; i < num; i++) {
+            track_slot(s, *res + i);
+        }
+    }
+    return result;
+}
+
 /* Stop tracking a slot that is now dead. */
 static void untrack_slot(state_t *state, seL4_CPtr slot)
 {
@@ -261,6 +276,23 @@ static int utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type
     return result;
 }
 
+static int utspace_alloc_batch(void *data, const cspacepath_t *dest, seL4_Word type,
+                               seL4_Word size_bits, size_t num, bool can_use_dev, seL4_Word *res)
+{
+    assert(data != NULL);
+
+    state_t *s = (state_t *)data;
+
+    vka_t *v = s->underlying;
+    int result = vka_utspace_alloc_batch(v, dest, type, size_bits, num, can_use_dev, res);
+    if (result == 0 && res != NULL) {
+        for (size_t i = 0; i < num; i++) {
+            track_obj(s, type, size_bits, res[i]);
+        }
+    }
+    return result;
+}
+
 /* Stop tracking an object that is now dead. */
 static void untrack_obj(state_t *state, seL4_Word type, seL4_Word size_bits,
                         seL4_Word cookie)
@@ -335,6 +367,8 @@ int vka_init_debugvka(vka_t *vka, vka_t *tracee)
     vka->utspace_alloc_at = utspace_alloc_at;
     vka->cspace_free = cspace_free;
     vka->utspace_free = utspace_free;
+    vka->utspace_alloc_batch = utspace_alloc_batch;
+    vka->cspace_alloc_range = cspace_alloc_range;
 
     return 0;
 
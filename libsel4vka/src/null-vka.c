@@ -49,6 +49,17 @@ static int utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type
     return -1;
 }
 
+static int utspace_alloc_batch(void *data, const cspacepath_t *dest, seL4_Word type,
+                               seL4_Word size_bits, size_t num, bool can_use_dev, seL4_Word *res)
+{
+    return -1;
+}
+
+static int cspace_alloc_range(void *data, size_t num, seL4_CPtr *res)
+{
+    return -1;
+}
+
 static void utspace_free(void *data, seL4_Word type, seL4_Word size_bits,
                          seL4_Word target)
 {
@@ -71,6 +82,8 @@ void vka_init_nullvka(vka_t *vka)
         .utspace_alloc_at = utspace_alloc_at,
         .cspace_free = cspace_free,
         .utspace_free = utspace_free,
-        .utspace_paddr = utspace_paddr
+        .utspace_paddr = utspace_paddr,
+        .utspace_alloc_batch = utspace_alloc_batch,
+        .cspace_alloc_range = cspace_alloc_range
     };
 }
@@ -0,0 +1,242 @@
+/*
+ * Copyright 2017, Data61
+ * Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+ * ABN 41 687 119 230.
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(DATA61_BSD)
+ */
+
+#include <assert.h>
+#include <autoconf.h>
+#include <sel4/sel4.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vka/cspacepath_t.h>
+#include <vka/vka.h>
+#include <vka/trace-vka.h>
+
+void vka_trace_add(vka_trace_t *trace, vka_trace_record_t r)
+{
+    assert(trace != NULL);
+
+    if (trace->num_records == trace->max_records) {
+        vka_trace_flush(trace);
+    }
+    if (trace->num_records == trace->max_records) {
+        trace->dropped++;
+        return;
+    }
+    trace->records[trace->num_records] = r;
+    trace->num_records++;
+}
+
+static int cspace_alloc(void *data, seL4_CPtr *res)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    vka_t *v = t->underlying;
+    int result = v->cspace_alloc(v->data, res);
+    vka_trace_add(t, (vka_trace_record_t) {
+        .op = VKA_TRACE_CSPACE_ALLOC,
+        .result = result,
+        .slot = result == 0 ? *res : 0
+    });
+    return result;
+}
+
+/* Recorded as an allocation of each slot in the range */
+static int cspace_alloc_range(void *data, size_t num, seL4_CPtr *res)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    int result = vka_cspace_alloc_range(t->underlying, num, res);
+    if (result != 0) {
+        vka_trace_add(t, (vka_trace_record_t) {
+            .op = VKA_TRACE_CSPACE_ALLOC,
+            .result = result
+        });
+        return result;
+    }
+    for (size_t i = 0; i < num; i++) {
+        vka_trace_add(t, (vka_trace_record_t) {
+            .op = VKA_TRACE_CSPACE_ALLOC,
+            .slot = *res + i
+        });
+    }
+    return result;
+}
+
+static void cspace_free(void *data, seL4_CPtr slot)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    vka_t *v = t->underlying;
+    vka_trace_add(t, (vka_trace_record_t) {
+        .op = VKA_TRACE_CSPACE_FREE,
+        .slot = slot
+    });
+    v->cspace_free(v->data, slot);
+}
+
+/* Not recorded as it has no effect on allocator state */
+static void cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    vka_t *v = t->underlying;
+    v->cspace_make_path(v->data, slot, res);
+}
+
+static int utspace_alloc_maybe_device(void *data, const cspacepath_t *dest, seL4_Word type,
+                                      seL4_Word size_bits, bool can_use_dev, seL4_Word *res)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    vka_t *v = t->underlying;
+    int result = vka_utspace_alloc_maybe_device(v, dest, type, size_bits, can_use_dev, res);
+    vka_trace_add(t, (vka_trace_record_t) {
+        .op = VKA_TRACE_UTSPACE_ALLOC,
+        .result = result,
+        .type = type,
+        .size_bits = size_bits,
+        .slot = dest->capPtr,
+        .cookie = result == 0 ? *res : 0,
+        .can_use_dev = can_use_dev
+    });
+    return result;
+}
+
+static int utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type,
+                         seL4_Word size_bits, seL4_Word *res)
+{
+    return utspace_alloc_maybe_device(data, dest, type, size_bits, false, res);
+}
+
+static int utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type,
+                            seL4_Word size_bits, uintptr_t paddr, seL4_Word *cookie)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    vka_t *v = t->underlying;
+    int result = vka_utspace_alloc_at(v, dest, type, size_bits, paddr, cookie);
+    vka_trace_add(t, (vka_trace_record_t) {
+        .op = VKA_TRACE_UTSPACE_ALLOC_AT,
+        .result = result,
+        .type = type,
+        .size_bits = size_bits,
+        .slot = dest->capPtr,
+        .cookie = result == 0 ? *cookie : 0,
+        .paddr = paddr
+    });
+    return result;
+}
+
+static int utspace_alloc_batch(void *data, const cspacepath_t *dest, seL4_Word type,
+                               seL4_Word size_bits, size_t num, bool can_use_dev, seL4_Word *res)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    vka_t *v = t->underlying;
+    int result = vka_utspace_alloc_batch(v, dest, type, size_bits, num, can_use_dev, res);
+    for (size_t i = 0; i < num; i++) {
+        vka_trace_add(t, (vka_trace_record_t) {
+            .op = VKA_TRACE_UTSPACE_ALLOC_BATCH,
+            .result = result,
+            .type = type,
+            .size_bits = size_bits,
+            .slot = dest->capPtr + i,
+            .cookie = result == 0 ? res[i] : 0,
+            .count = num,
+            .can_use_dev = can_use_dev
+        });
+    }
+    return result;
+}
+
+static void utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    vka_t *v = t->underlying;
+    vka_trace_add(t, (vka_trace_record_t) {
+        .op = VKA_TRACE_UTSPACE_FREE,
+        .type = type,
+        .size_bits = size_bits,
+        .cookie = target
+    });
+    v->utspace_free(v->data, type, size_bits, target);
+}
+
+/* Not recorded as it has no effect on allocator state */
+static uintptr_t utspace_paddr(void *data, seL4_Word target, seL4_Word type, seL4_Word size_bits)
+{
+    assert(data != NULL);
+
+    vka_trace_t *t = (vka_trace_t *)data;
+    return vka_utspace_paddr(t->underlying, target, type, size_bits);
+}
+
+void vka_init_tracevka(vka_t *vka, vka_trace_t *trace, vka_t *tracee, vka_trace_record_t *records,
+                       size_t max_records,
+                       void (*flush)(void *cookie, const vka_trace_record_t *records, size_t num),
+                       void *flush_cookie)
+{
+    assert(vka != NULL);
+    assert(trace != NULL);
+    assert(tracee != NULL);
+
+    *trace = (vka_trace_t) {
+        .underlying = tracee,
+        .records = records,
+        .max_records = max_records,
+        .num_records = 0,
+        .dropped = 0,
+        .flush = flush,
+        .flush_cookie = flush_cookie
+    };
+
+    vka->data = (void *)trace;
+    vka->cspace_alloc = cspace_alloc;
+    vka->cspace_make_path = cspace_make_path;
+    vka->utspace_alloc = utspace_alloc;
+    vka->utspace_alloc_maybe_device = utspace_alloc_maybe_device;
+    vka->utspace_alloc_at = utspace_alloc_at;
+    vka->cspace_free = cspace_free;
+    vka->utspace_free = utspace_free;
+    vka->utspace_paddr = utspace_paddr;
+    vka->utspace_alloc_batch = utspace_alloc_batch;
+    vka->cspace_alloc_range = cspace_alloc_range;
+}
+
+void vka_trace_flush(vka_trace_t *trace)
+{
+    assert(trace != NULL);
+
+    if (trace->flush != NULL && trace->num_records > 0) {
+        trace->flush(trace->flush_cookie, trace->records, trace->num_records);
+        trace->num_records = 0;
+    }
+}
+
+void vka_trace_print(void *cookie, const vka_trace_record_t *records, size_t num)
+{
+    for (size_t i = 0; i < num; i++) {
+        const vka_trace_record_t *r = &records[i];
+        printf("vka_trace %x %x %lx %lx %lx %lx %lx %zx %x %zx\n", (unsigned int)r->op, (unsigned int)r->result,
+               (long)r->type, (long)r->size_bits, (long)r->slot, (long)r->cookie, (long)r->paddr, r->count,
+               (unsigned int)r->can_use_dev, r->bytes);
+    }
+}